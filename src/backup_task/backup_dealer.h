@@ -12,8 +12,8 @@ class BackUpDealer : public RequestDealer {
   typedef RequestDealer super;
 
 public:
-  explicit BackUpDealer(const char *request_json_str)
-      : super(request_json_str) {}
+  explicit BackUpDealer(Json::Value &request)
+      : super(request) {}
 
   virtual ~BackUpDealer() {}
   bool virtual Deal() override;
@@ -46,6 +46,23 @@ extern std::string node_mgr_tmp_data_path;
 extern std::string prometheus_path;
 extern int64_t prometheus_port_start;
 extern std::string local_ip;
+extern int64_t transfer_bandwidth_limit;
+extern int64_t transfer_window_size;
+extern int64_t bulk_read_threshold;
+extern int64_t bulk_stream_window;
+extern int64_t socket_buffer_size;
+extern bool job_cgroup_enabled;
+extern std::string job_cgroup_root;
+extern std::string job_cgroup_backup;
+extern std::string job_cgroup_restore;
+extern std::string job_cgroup_rebuild;
+extern std::string job_cgroup_command;
+extern int64_t finished_job_retention;
+extern int64_t finished_job_ttl;
+extern std::string job_journal_path;
+extern int64_t job_executor_threads;
+extern int64_t job_executor_express_threads;
+extern std::string job_type_concurrency;
 
 Configs *Configs::get_instance()
 {
@@ -242,6 +259,69 @@ void Configs::define_configs()
                     57010, "prometheus_port_start");
   define_str_config("local_ip", local_ip,
                     "127.0.0.1", "node_mgr ip");
+  define_int_config("transfer_bandwidth_limit", transfer_bandwidth_limit, 0,
+                    LLONG_MAX, 0,
+                    "Bytes per second all file transfers of the host share, "
+                    "0 means no host wide limit.");
+  define_int_config("transfer_window_size", transfer_window_size, 65536,
+                    LLONG_MAX, 16 * 1024 * 1024,
+                    "Bytes one transfer may have queued on its socket.");
+  define_int_config("bulk_read_threshold", bulk_read_threshold, 0, LLONG_MAX,
+                    1024LL * 1024 * 1024,
+                    "Files of at least this many bytes are read bypassing the "
+                    "page cache unless the request picks a send_mode, 0 "
+                    "disables it.");
+  define_int_config("bulk_stream_window", bulk_stream_window, 65536,
+                    LLONG_MAX, 16 * 1024 * 1024,
+                    "Bytes a bulk stream may have sent but not yet consumed "
+                    "by the receiver.");
+  define_int_config("socket_buffer_size", socket_buffer_size, 0, INT_MAX, 0,
+                    "Send and receive buffer size of the brpc sockets, 0 "
+                    "keeps the system default.");
+  define_bool_config("job_cgroup_enabled", job_cgroup_enabled, true,
+                     "Run backup, restore, rebuild and command jobs in "
+                     "cgroups of their own.");
+  define_str_config("job_cgroup_root", job_cgroup_root,
+                    "/sys/fs/cgroup/kunlun_node_mgr_jobs",
+                    "cgroup v2 directory the cgroups of the jobs are created "
+                    "in.");
+  define_str_config("job_cgroup_backup", job_cgroup_backup,
+                    "cpu.weight=50;io.weight=50",
+                    "cgroup limits of backup jobs, ';' separated "
+                    "file=value pairs, ',' stands for a space in a value.");
+  define_str_config("job_cgroup_restore", job_cgroup_restore,
+                    "cpu.weight=50;io.weight=50",
+                    "cgroup limits of restore jobs.");
+  define_str_config("job_cgroup_rebuild", job_cgroup_rebuild,
+                    "cpu.weight=50;io.weight=50",
+                    "cgroup limits of rebuild node jobs.");
+  define_str_config("job_cgroup_command", job_cgroup_command, "cpu.weight=100",
+                    "cgroup limits of execute_command jobs.");
+  define_int_config("finished_job_retention", finished_job_retention, 1,
+                    LLONG_MAX, 1000,
+                    "Number of finished jobs whose status and result are kept "
+                    "for get_job_status and get_job_result.");
+  define_int_config("finished_job_ttl", finished_job_ttl, 1, LLONG_MAX, 86400,
+                    "Seconds a finished job is kept, a request repeating it "
+                    "meanwhile gets its response instead of running again.");
+  define_str_config("job_journal_path", job_journal_path,
+                    "../data/job_journal",
+                    "LevelDB directory the jobs are journaled in, so that "
+                    "they survive a restart of node_mgr.");
+  define_int_config("job_executor_threads", job_executor_threads, 1, 1024, 32,
+                    "Threads the blocking work of the jobs and the shell "
+                    "commands runs on.");
+  define_int_config("job_executor_express_threads",
+                    job_executor_express_threads, 1, 64, 4,
+                    "Threads besides job_executor_threads running only the "
+                    "short read-only requests, get_paths_space and "
+                    "check_port_idle, so they never wait behind the jobs.");
+  define_str_config("job_type_concurrency", job_type_concurrency,
+                    "backup_shard=2;backup_compute=2;restore_mysql=2;"
+                    "restore_postgres=2;rebuild_node=1",
+                    "Jobs of a type running at most at once, ';' separated "
+                    "job_type=count pairs, types not listed are bounded by "
+                    "job_executor_threads only.");
 
   /*
           There is no practical way we can prevent multiple cluster_mgr
@@ -39,8 +39,8 @@ class NodeExporterInstallDealer : public RequestDealer {
   typedef RequestDealer super;
 
 public:
-  explicit NodeExporterInstallDealer(const char *request_json_str)
-      : super(request_json_str), exporter_port_("") {}
+  explicit NodeExporterInstallDealer(Json::Value &request)
+      : super(request), exporter_port_("") {}
 
   virtual ~NodeExporterInstallDealer() {}
   bool virtual Deal() override;
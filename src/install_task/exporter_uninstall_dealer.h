@@ -39,8 +39,8 @@ class NodeExporterUninstallDealer : public RequestDealer {
     typedef RequestDealer super;
 
 public:
-  explicit NodeExporterUninstallDealer(const char *request_json_str)
-      : super(request_json_str), exporter_port_("") {}
+  explicit NodeExporterUninstallDealer(Json::Value &request)
+      : super(request), exporter_port_("") {}
 
   virtual ~NodeExporterUninstallDealer() {}
   bool virtual Deal() override;
@@ -12,8 +12,8 @@ class MySQLUninstallDealer : public RequestDealer {
   typedef RequestDealer super;
 
 public:
-  explicit MySQLUninstallDealer(const char *request_json_str)
-      : super(request_json_str), install_prefix_(""), data_prefix_(""),
+  explicit MySQLUninstallDealer(Json::Value &request)
+      : super(request), install_prefix_(""), data_prefix_(""),
         log_prefix_(""), wal_prefix_(""), exporter_port_("") {}
 
   virtual ~MySQLUninstallDealer() {}
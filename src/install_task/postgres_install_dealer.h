@@ -12,8 +12,8 @@ class PostgresInstallDealer : public RequestDealer {
   typedef RequestDealer super;
 
 public:
-  explicit PostgresInstallDealer(const char *request_json_str)
-      : super(request_json_str), install_prefix_(""), data_prefix_(""),
+  explicit PostgresInstallDealer(Json::Value &request)
+      : super(request), install_prefix_(""), data_prefix_(""),
       exporter_port_("") {}
 
   virtual ~PostgresInstallDealer() {}
@@ -14,8 +14,8 @@ class PostgresUninstallDealer : public RequestDealer {
   typedef RequestDealer super;
 
 public:
-  explicit PostgresUninstallDealer(const char *request_json_str)
-      : super(request_json_str), install_prefix_(""), data_prefix_(""),
+  explicit PostgresUninstallDealer(Json::Value &request)
+      : super(request), install_prefix_(""), data_prefix_(""),
       exporter_port_("") {}
 
   virtual ~PostgresUninstallDealer() {}
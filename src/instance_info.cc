@@ -11,6 +11,7 @@
 #include "zettalib/op_log.h"
 #include "zettalib/tool_func.h"
 #include "install_task/exporter_install_dealer.h"
+#include "util_func/child_process.h"
 #include "sys.h"
 #include "json/json.h"
 #include <arpa/inet.h>
@@ -910,26 +911,28 @@ bool Instance_info::get_pgsql_alive_tcp(const std::string &ip, int port,
   return true;
 }
 
-bool Instance_info::CreatePsLog() {
-  std::string ps_cmd = "ps -eo pid,ppid,command > ./.ps_log";
-  BiodirectPopen bi_open(ps_cmd.c_str());
-  bool ret = bi_open.Launch("r");
-  if(!ret || bi_open.get_chiled_status() != 0) {
-    FILE *stderr_fp = bi_open.getReadStdErrFp();
-    if(stderr_fp == nullptr){
-      KLOG_ERROR("Biooppen launch failed: {}",bi_open.getErr());
-      return false;
-    }
-        
-    char buffer[8192];
-    if (fgets(buffer, 8192, stderr_fp) != nullptr) {
-      KLOG_ERROR("Biopopen execute failed and stderr: {}", buffer);
-    }
+// Run cmd to completion, a failure is logged with the first line of its
+// stderr
+static bool RunCheckedCmd(const std::string &cmd) {
+  kunlun::ChildProcess child(cmd);
+  if (!child.Launch() || !child.Wait()) {
+    KLOG_ERROR("Launch {} failed: {}", cmd, child.getErr());
+    return false;
+  }
+  if (child.exit_code() != 0) {
+    const std::string &err = child.stderr_str();
+    KLOG_ERROR("{} execute failed and stderr: {}", cmd,
+               err.substr(0, err.find('\n')));
     return false;
   }
   return true;
 }
 
+bool Instance_info::CreatePsLog() {
+  std::string ps_cmd = "ps -eo pid,ppid,command > ./.ps_log";
+  return RunCheckedCmd(ps_cmd);
+}
+
 bool KProcStat::Parse(const char * buf) {
     std::vector<std::string> vec = StringTokenize(buf , " ");
     if (vec.size () < 3) {
@@ -1100,21 +1103,7 @@ void Instance_info::start_exporter(exporter_stat* es) {
   }
 
   KLOG_INFO("Will execute cmd: {}", cmd);
-  BiodirectPopen bi_open(cmd.c_str());
-  bool ret = bi_open.Launch("r");
-  if(!ret || bi_open.get_chiled_status() != 0) {
-    FILE *stderr_fp = bi_open.getReadStdErrFp();
-    if(stderr_fp == nullptr){
-      KLOG_ERROR("Biooppen launch failed: {}",bi_open.getErr());
-      return;
-    }
-        
-    char buffer[8192];
-    if (fgets(buffer, 8192, stderr_fp) != nullptr) {
-      KLOG_ERROR("Biopopen execute failed and stderr: {}", buffer);
-    }
-    return;
-  }
+  RunCheckedCmd(cmd);
 }
 
 void Instance_info::stop_exporter(exporter_stat *es) {
@@ -1124,21 +1113,7 @@ void Instance_info::stop_exporter(exporter_stat *es) {
 
   std::string cmd = string_sprintf("kill -9 %d", pid);
   KLOG_INFO("Will kill {} cmd: {}", es->GetBinName(), cmd);
-  BiodirectPopen bi_open(cmd.c_str());
-  bool ret = bi_open.Launch("r");
-  if(!ret || bi_open.get_chiled_status() != 0) {
-    FILE *stderr_fp = bi_open.getReadStdErrFp();
-    if(stderr_fp == nullptr){
-      KLOG_ERROR("Biooppen launch failed: {}",bi_open.getErr());
-      return;
-    }
-        
-    char buffer[8192];
-    if (fgets(buffer, 8192, stderr_fp) != nullptr) {
-      KLOG_ERROR("Biopopen execute failed and stderr: {}", buffer);
-    }
-    return;
-  }
+  RunCheckedCmd(cmd);
 }
 
 void Instance_info::add_node_exporter(const std::string& exporter_port) {
@@ -1297,21 +1272,20 @@ void Instance_info::keepalive_instance() {
 
 bool Instance_info::get_path_used(std::string &path, uint64_t &used) {
   bool ret = false;
-  FILE *pfd = NULL;
 
   char *p;
   char buf[256];
   std::string str_cmd;
+  std::string output;
 
   str_cmd = "du --max-depth=0 " + path;
   KLOG_INFO("get_path_used str_cmd : {}", str_cmd);
 
-  pfd = popen(str_cmd.c_str(), "r");
-  if (!pfd)
+  if (kunlun::RunCommand(str_cmd, &output, nullptr, false) < 0)
     goto end;
 
-  if (fgets(buf, 256, pfd) == NULL)
-    goto end;
+  // first line
+  snprintf(buf, sizeof(buf), "%s", output.c_str());
 
   p = strchr(buf, 0x09); // asii ht
   if (p == NULL)
@@ -1322,34 +1296,29 @@ bool Instance_info::get_path_used(std::string &path, uint64_t &used) {
   ret = true;
 
 end:
-  if (pfd != NULL)
-    pclose(pfd);
-
   return ret;
 }
 
 bool Instance_info::get_path_free(std::string &path, uint64_t &free) {
   bool ret = false;
-  FILE *pfd = NULL;
 
   char *p, *q;
   char buf[256];
   std::string str_cmd;
+  std::string output;
+  size_t eol;
 
   str_cmd = "df " + path;
   KLOG_INFO("get_path_free str_cmd: {}", str_cmd);
 
-  pfd = popen(str_cmd.c_str(), "r");
-  if (!pfd)
-    goto end;
-
-  // first line
-  if (fgets(buf, 256, pfd) == NULL)
+  if (kunlun::RunCommand(str_cmd, &output, nullptr, false) < 0)
     goto end;
 
-  // second line
-  if (fgets(buf, 256, pfd) == NULL)
+  // second line, the first one is the header
+  eol = output.find('\n');
+  if (eol == std::string::npos)
     goto end;
+  snprintf(buf, sizeof(buf), "%s", output.c_str() + eol + 1);
 
   // first space
   p = strchr(buf, 0x20);
@@ -1385,9 +1354,6 @@ bool Instance_info::get_path_free(std::string &path, uint64_t &free) {
   ret = true;
 
 end:
-  if (pfd != NULL)
-    pclose(pfd);
-
   return ret;
 }
 
@@ -1426,16 +1392,13 @@ bool Instance_info::get_vec_path(std::vector<std::string> &vec_path,
   return (vec_path.size() > 0);
 }
 
-bool Instance_info::get_path_space(Json::Value &para, std::string &result) {
+bool Instance_info::get_path_space(
+    std::vector<std::string> &vec_paths,
+    std::vector<std::vector<Tpye_Path_Used_Free>> &vec_vec_path_used_free,
+    std::string &result) {
   bool ret = true;
   uint64_t u_used, u_free;
   std::string path_used;
-  std::vector<std::string> vec_paths;
-
-  vec_paths.emplace_back(para["path0"].asString());
-  vec_paths.emplace_back(para["path1"].asString());
-  vec_paths.emplace_back(para["path2"].asString());
-  vec_paths.emplace_back(para["path3"].asString());
 
   std::vector<std::string> vec_sub_path;
   vec_sub_path.emplace_back("/instance_data/data_dir_path");
@@ -1443,15 +1406,9 @@ bool Instance_info::get_path_space(Json::Value &para, std::string &result) {
   vec_sub_path.emplace_back("/instance_data/innodb_log_dir_path");
   vec_sub_path.emplace_back("/instance_data/comp_datadir");
 
-  std::vector<std::string> vec_path_index;
-  vec_path_index.emplace_back("path0");
-  vec_path_index.emplace_back("path1");
-  vec_path_index.emplace_back("path2");
-  vec_path_index.emplace_back("path3");
-
   vec_vec_path_used_free.clear();
 
-  for (int i = 0; i < 4; i++) {
+  for (size_t i = 0; i < vec_sub_path.size() && i < vec_paths.size(); i++) {
     std::vector<std::string> vec_path;
     if (!get_vec_path(vec_path, vec_paths[i])) {
       if (result.length() > 0)
@@ -1485,40 +1442,53 @@ bool Instance_info::get_path_space(Json::Value &para, std::string &result) {
     vec_vec_path_used_free.emplace_back(vec_path_used_free);
   }
 
+  return ret;
+}
+
+bool Instance_info::get_path_space(Json::Value &para, std::string &result) {
+  std::vector<std::string> vec_paths;
+  vec_paths.emplace_back(para["path0"].asString());
+  vec_paths.emplace_back(para["path1"].asString());
+  vec_paths.emplace_back(para["path2"].asString());
+  vec_paths.emplace_back(para["path3"].asString());
+
+  std::vector<std::string> vec_path_index;
+  vec_path_index.emplace_back("path0");
+  vec_path_index.emplace_back("path1");
+  vec_path_index.emplace_back("path2");
+  vec_path_index.emplace_back("path3");
+
+  std::vector<std::vector<Tpye_Path_Used_Free>> vec_vec_path_used_free;
+  if (!get_path_space(vec_paths, vec_vec_path_used_free, result))
+    return false;
+
   // json for return
   Json::Value root;
 
-  if (ret) {
-    for (int i = 0; i < 4; i++) {
-      Json::Value list;
-      for (auto &path_used_free : vec_vec_path_used_free[i]) {
-        Json::Value para_json_array;
-        para_json_array["path"] = std::get<0>(path_used_free);
-        para_json_array["used"] = std::get<1>(path_used_free);
-        para_json_array["free"] = std::get<2>(path_used_free);
-        list.append(para_json_array);
-      }
-      root[vec_path_index[i]] = list;
+  for (int i = 0; i < 4; i++) {
+    Json::Value list;
+    for (auto &path_used_free : vec_vec_path_used_free[i]) {
+      Json::Value para_json_array;
+      para_json_array["path"] = std::get<0>(path_used_free);
+      para_json_array["used"] = std::get<1>(path_used_free);
+      para_json_array["free"] = std::get<2>(path_used_free);
+      list.append(para_json_array);
     }
-
-    Json::FastWriter writer;
-    writer.omitEndingLineFeed();
-    result = writer.write(root);
+    root[vec_path_index[i]] = list;
   }
 
-  return ret;
+  Json::FastWriter writer;
+  writer.omitEndingLineFeed();
+  result = writer.write(root);
+
+  return true;
 }
 
-bool Instance_info::check_port_idle(Json::Value &para, std::string &result){
+bool Instance_info::check_port_idle(int &port, int step){
   bool ret = true;
-  int port, step;
-	FILE* pfd = NULL;
-	char buf[256];
 	std::string str_cmd;
 	std::string str_port;
-
-  port = para["port"].asInt();
-  step = para["step"].asInt();
+	std::string output;
 
   while(1){
     ret = true;
@@ -1527,22 +1497,25 @@ bool Instance_info::check_port_idle(Json::Value &para, std::string &result){
       str_cmd = "netstat -anp | grep " + str_port;
       KLOG_INFO("check_port_idle str_cmd: {}",str_cmd);
 
-      pfd = popen(str_cmd.c_str(), "r");
-      if(!pfd){
+      // grep exits 1 when nothing matched
+      if(kunlun::RunCommand(str_cmd, &output, nullptr, false) < 0){
         ret = false;
         break;
       }
 
-      while(fgets(buf, 256, pfd)) {
-        KLOG_INFO("check_port_idle {}", buf);
-        if(strstr(buf, str_port.c_str())) {
+      size_t begin = 0;
+      while(begin < output.size()) {
+        size_t end = output.find('\n', begin);
+        if(end == std::string::npos)
+          end = output.size();
+        std::string line = output.substr(begin, end - begin);
+        begin = end + 1;
+        KLOG_INFO("check_port_idle {}", line);
+        if(line.find(str_port) != std::string::npos) {
           ret = false;
           break;
         }
       }
-        
-      pclose(pfd);
-      pfd = NULL;
 
       if(!ret)
         break;
@@ -1554,15 +1527,20 @@ bool Instance_info::check_port_idle(Json::Value &para, std::string &result){
     port += step;
   }
 
-  if(ret){
-    // json for return
-    Json::Value root;
-    root["port"] = port;
-  
-    Json::FastWriter writer;
-    writer.omitEndingLineFeed();
-    result = writer.write(root);
-  }
-
   return ret;
 }
+
+bool Instance_info::check_port_idle(Json::Value &para, std::string &result){
+  int port = para["port"].asInt();
+  if(!check_port_idle(port, para["step"].asInt()))
+    return false;
+
+  // json for return
+  Json::Value root;
+  root["port"] = port;
+
+  Json::FastWriter writer;
+  writer.omitEndingLineFeed();
+  result = writer.write(root);
+  return true;
+}
@@ -164,8 +164,6 @@ public:
   std::mutex postgres_mux_;
   std::vector<exporter_stat*> postgres_exporters_;
 
-  std::vector<std::vector<Tpye_Path_Used_Free>> vec_vec_path_used_free;
-
 private:
   static Instance_info *m_inst;
   Instance_info();
@@ -218,7 +216,15 @@ public:
   bool get_path_free(std::string &path, uint64_t &free);
   void trimString(std::string &str);
   bool get_vec_path(std::vector<std::string> &vec_path, std::string &paths);
+  // space of the paths path0..path3 of a request, the ones failed listed
+  // in result
+  bool get_path_space(
+      std::vector<std::string> &vec_paths,
+      std::vector<std::vector<Tpye_Path_Used_Free>> &vec_vec_path_used_free,
+      std::string &result);
   bool get_path_space(Json::Value &para, std::string &result);
+  // moves port by step till step ports from it are all idle
+  bool check_port_idle(int &port, int step);
   bool check_port_idle(Json::Value &para, std::string &result);
   std::string get_mysql_unix_sock(const std::string& user, const std::string& passwd, 
             const std::string& port);
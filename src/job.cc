@@ -47,22 +47,32 @@ Job::Job() {}
 Job::~Job() {}
 
 bool Job::job_system_cmd(std::string &cmd) {
-  kunlun::BiodirectPopen *popen_p = new kunlun::BiodirectPopen(cmd.c_str());
-  FILE *stderr_fp;
-
-  if (!popen_p->Launch("rw")) {
-    goto end;
-  }
-  stderr_fp = popen_p->getReadStdErrFp();
-  char buf[256];
-  if (fgets(buf, 256, stderr_fp) != nullptr) {
-    KLOG_ERROR("Biopopen stderr: {}", buf);
-    goto end;
+  kunlun::ChildProcess child(cmd);
+  child.set_line_sink([](const std::string &line, bool is_stderr) {
+    if (is_stderr)
+      KLOG_ERROR("stderr: {}", line);
+  });
+  if (!child.Launch() || !child.Wait()) {
+    KLOG_ERROR("{}", child.getErr());
+    return false;
   }
 
-end:
-  if (popen_p != nullptr)
-    delete popen_p;
+  return true;
+}
+
+// Run cmd logging its output as it comes, the last line of its stdout is
+// kept in last_line with its newline
+bool Job::job_run_cmd(std::string &cmd, std::string *last_line) {
+  kunlun::ChildProcess child(cmd);
+  child.set_line_sink([last_line](const std::string &line, bool is_stderr) {
+    KLOG_INFO("{}", line);
+    if (last_line != nullptr && !is_stderr)
+      *last_line = line + "\n";
+  });
+  if (!child.Launch() || !child.Wait()) {
+    KLOG_ERROR("{}", child.getErr());
+    return false;
+  }
 
   return true;
 }
@@ -136,8 +146,6 @@ bool Job::job_create_program_path() {
 
 bool Job::job_control_storage(int port, int control) {
   bool ret = false;
-  FILE *pfd;
-  char buf[256];
 
   std::string cmd, instance_path;
 
@@ -152,16 +160,10 @@ bool Job::job_control_storage(int port, int control) {
     cmd += "./stopmysql.sh " + std::to_string(port);
     KLOG_INFO("job_control_storage cmd {}", cmd);
 
-    pfd = popen(cmd.c_str(), "r");
-    if (!pfd) {
+    if (!job_run_cmd(cmd)) {
       KLOG_ERROR( "stop error {}", cmd);
       goto end;
     }
-    while (fgets(buf, 256, pfd) != NULL) {
-      // if(strcasestr(buf, "error") != NULL)
-      KLOG_INFO( "{}", buf);
-    }
-    pclose(pfd);
     return true;
   } else if (control == 2) {
     // start
@@ -170,16 +172,10 @@ bool Job::job_control_storage(int port, int control) {
     cmd += "./startmysql.sh " + std::to_string(port);
     KLOG_INFO( "job_control_storage cmd {}", cmd);
 
-    pfd = popen(cmd.c_str(), "r");
-    if (!pfd) {
+    if (!job_run_cmd(cmd)) {
       KLOG_ERROR( "start error {}", cmd);
       goto end;
     }
-    while (fgets(buf, 256, pfd) != NULL) {
-      // if(strcasestr(buf, "error") != NULL)
-      KLOG_INFO( "{}", buf);
-    }
-    pclose(pfd);
     return true;
   } else if (control == 3) {
     // stop
@@ -188,16 +184,10 @@ bool Job::job_control_storage(int port, int control) {
     cmd += "./stopmysql.sh " + std::to_string(port);
     KLOG_INFO("job_control_storage cmd {}", cmd);
 
-    pfd = popen(cmd.c_str(), "r");
-    if (!pfd) {
+    if (!job_run_cmd(cmd)) {
       KLOG_ERROR( "stop error {}", cmd);
       goto end;
     }
-    while (fgets(buf, 256, pfd) != NULL) {
-      // if(strcasestr(buf, "error") != NULL)
-      KLOG_INFO( "{}", buf);
-    }
-    pclose(pfd);
 
     sleep(1);
 
@@ -207,16 +197,10 @@ bool Job::job_control_storage(int port, int control) {
     cmd += "./startmysql.sh " + std::to_string(port);
     KLOG_INFO( "job_control_storage cmd {}", cmd);
 
-    pfd = popen(cmd.c_str(), "r");
-    if (!pfd) {
+    if (!job_run_cmd(cmd)) {
       KLOG_ERROR( "start error {}", cmd);
       goto end;
     }
-    while (fgets(buf, 256, pfd) != NULL) {
-      // if(strcasestr(buf, "error") != NULL)
-      KLOG_INFO( "{}", buf);
-    }
-    pclose(pfd);
     return true;
   }
 
@@ -226,8 +210,6 @@ end:
 
 bool Job::job_control_computer(std::string &ip, int port, int control) {
   bool ret = false;
-  FILE *pfd;
-  char buf[256];
 
   int nodes;
   std::string cmd, pathdir, instance_path, jsonfile_path, jsonfile_buf;
@@ -282,16 +264,10 @@ bool Job::job_control_computer(std::string &ip, int port, int control) {
     cmd += "./pg_ctl -D " + pathdir + " stop";
     KLOG_INFO( "stop_computer cmd {}", cmd);
 
-    pfd = popen(cmd.c_str(), "r");
-    if (!pfd) {
+    if (!job_run_cmd(cmd)) {
       KLOG_ERROR("stop error {}", cmd);
       goto end;
     }
-    while (fgets(buf, 256, pfd) != NULL) {
-      // if(strcasestr(buf, "error") != NULL)
-      KLOG_INFO( "{}", buf);
-    }
-    pclose(pfd);
     return true;
   } else if (control == 2) {
     // start
@@ -299,12 +275,10 @@ bool Job::job_control_computer(std::string &ip, int port, int control) {
           "/scripts; python2 start_pg.py --port=" + std::to_string(port);
     KLOG_INFO( "start pgsql cmd : {}", cmd);
 
-    pfd = popen(cmd.c_str(), "r");
-    if (!pfd) {
+    if (!job_run_cmd(cmd)) {
       KLOG_ERROR("start error {}", cmd);
       goto end;
     }
-    pclose(pfd);
     return true;
   } else if (control == 3) {
     // stop computer cmd
@@ -312,16 +286,10 @@ bool Job::job_control_computer(std::string &ip, int port, int control) {
     cmd += "./pg_ctl -D " + pathdir + " stop";
     KLOG_INFO("stop_computer cmd {}", cmd);
 
-    pfd = popen(cmd.c_str(), "r");
-    if (!pfd) {
+    if (!job_run_cmd(cmd)) {
       KLOG_ERROR( "stop error {}", cmd);
       goto end;
     }
-    while (fgets(buf, 256, pfd) != NULL) {
-      // if(strcasestr(buf, "error") != NULL)
-      KLOG_INFO( "{}", buf);
-    }
-    pclose(pfd);
 
     sleep(1);
 
@@ -330,12 +298,10 @@ bool Job::job_control_computer(std::string &ip, int port, int control) {
           "/scripts; python2 start_pg.py --port=" + std::to_string(port);
     KLOG_INFO("start pgsql cmd : {}", cmd);
 
-    pfd = popen(cmd.c_str(), "r");
-    if (!pfd) {
+    if (!job_run_cmd(cmd)) {
       KLOG_ERROR("start error {}", cmd);
       goto end;
     }
-    pclose(pfd);
 
     return true;
   }
@@ -374,10 +340,8 @@ bool Job::job_computer_add_lib(std::set<std::string> &set_lib) {
 
 bool Job::job_node_exporter(Json::Value &para, std::string &job_info) {
 
-  FILE* pfd;
-	char buf[256];
-
-	std::string cmd, process_id;
+	const char *buf;
+	std::string cmd, process_id, output;
 
   job_info = "node exporter start";
   KLOG_INFO( "{}", job_info);
@@ -387,13 +351,13 @@ bool Job::job_node_exporter(Json::Value &para, std::string &job_info) {
 	cmd = "netstat -tnpl | grep tcp6 | grep " + std::to_string(prometheus_port_start+1);
 	KLOG_INFO( "start_node_exporter cmd {}", cmd);
 
-	pfd = popen(cmd.c_str(), "r");
-	if(!pfd) {
+	if (kunlun::RunCommand(cmd, &output, nullptr, false) < 0) {
 		KLOG_ERROR("get error {}", cmd);
 		goto end;
 	}
-	if(fgets(buf, 256, pfd)!=NULL) {
-		char *p, *q;
+	buf = output.c_str();
+	{
+		const char *p, *q;
 		p = strstr(buf, "LISTEN");
 		if(p != NULL) {
 			p = strchr(p, 0x20);
@@ -408,21 +372,18 @@ bool Job::job_node_exporter(Json::Value &para, std::string &job_info) {
 			}
 		}
 	}
-	pclose(pfd);
 
 	/////////////////////////////////////////////////////////
 	// start prometheus
 	if(process_id.length() == 0) {
 		cmd = "cd " + prometheus_path + "/node_exporter;";
-		cmd += "./node_exporter --web.listen-address=:" + std::to_string(prometheus_port_start+1) + " &";
+		cmd += "./node_exporter --web.listen-address=:" + std::to_string(prometheus_port_start+1) + " >/dev/null 2>&1 &";
 		KLOG_INFO( "job_restart_prometheus cmd {}", cmd);
 
-		pfd = popen(cmd.c_str(), "r");
-		if(!pfd) {
+		if (!job_run_cmd(cmd)) {
 			KLOG_ERROR("start error {}", cmd);
 			goto end;
 		}
-		pclose(pfd);
 	}
 
   job_info = "node exporter successfully";
@@ -494,10 +455,6 @@ end:
 
 bool Job::job_install_storage(Json::Value &para, std::string &job_info) {
 
-  kunlun::BiodirectPopen *popen_p = nullptr;
-  FILE *stderr_fp;
-  char buffer[8192];
-
   int retry = 9;
   int install_id, dbcfg=0;
   int port;
@@ -615,17 +572,10 @@ bool Job::job_install_storage(Json::Value &para, std::string &job_info) {
 
   KLOG_INFO("job_install_storage cmd {}", cmd);
 
-  popen_p = new kunlun::BiodirectPopen(cmd.c_str());
-  if (!popen_p->Launch("rw")) {
-    job_info = "BiodirectPopen error";
+  if (!job_run_cmd(cmd)) {
+    job_info = "launch install cmd error";
     goto end;
   }
-  stderr_fp = popen_p->getReadStdErrFp();
-  while (fgets(buffer, 8192, stderr_fp) != nullptr) {
-    KLOG_INFO("Biopopen: {}", buffer);
-  }
-  delete popen_p;
-  popen_p = nullptr;
 
   /////////////////////////////////////////////////////////////
   // check instance succeed by connect to instance
@@ -649,8 +599,6 @@ bool Job::job_install_storage(Json::Value &para, std::string &job_info) {
   return true;
 
 end:
-  if(popen_p != nullptr)
-    delete popen_p;
 
   KLOG_INFO( "{}", job_info);
   return false;
@@ -658,10 +606,6 @@ end:
 
 bool Job::job_install_computer(Json::Value &para, std::string &job_info) {
  
-  kunlun::BiodirectPopen *popen_p = nullptr;
-  FILE *stderr_fp;
-  char buffer[8192];
-
   int retry = 9;
   int install_id;
   int port;
@@ -742,17 +686,10 @@ bool Job::job_install_computer(Json::Value &para, std::string &job_info) {
          std::to_string(install_id);
   KLOG_INFO("job_install_computer cmd {}", cmd);
 
-  popen_p = new kunlun::BiodirectPopen(cmd.c_str());
-  if (!popen_p->Launch("rw")) {
-    job_info = "BiodirectPopen error";
+  if (!job_run_cmd(cmd)) {
+    job_info = "launch install cmd error";
     goto end;
   }
-  stderr_fp = popen_p->getReadStdErrFp();
-  while (fgets(buffer, 8192, stderr_fp) != nullptr) {
-    KLOG_INFO( "Biopopen: {}", buffer);
-  }
-  delete popen_p;
-  popen_p = nullptr;
 
   /////////////////////////////////////////////////////////////
   // check instance succeed by connect to instance
@@ -774,16 +711,12 @@ bool Job::job_install_computer(Json::Value &para, std::string &job_info) {
   return true;
 
 end:
-  if(popen_p != nullptr)
-    delete popen_p;
   KLOG_ERROR( "{}", job_info);
   return false;
 }
 
 bool Job::job_delete_storage(Json::Value &para, std::string &job_info) {
 
-  FILE *pfd;
-  char buf[256];
 
   int nodes;
   int port;
@@ -810,16 +743,10 @@ bool Job::job_delete_storage(Json::Value &para, std::string &job_info) {
   cmd += "./stopmysql.sh " + std::to_string(port);
   KLOG_INFO( "job_delete_storage cmd {}", cmd);
 
-  pfd = popen(cmd.c_str(), "r");
-  if (!pfd) {
+  if (!job_run_cmd(cmd)) {
     job_info = "stop error " + cmd;
     goto end;
   }
-  while (fgets(buf, 256, pfd) != NULL) {
-    // if(strcasestr(buf, "error") != NULL)
-    KLOG_INFO("{}", buf);
-  }
-  pclose(pfd);
 
   /////////////////////////////////////////////////////////////
   // read json file from path/dba_tools
@@ -905,8 +832,6 @@ end:
 
 bool Job::job_delete_computer(Json::Value &para, std::string &job_info) {
 
-  FILE *pfd;
-  char buf[256];
 
   int nodes;
   int port;
@@ -967,16 +892,10 @@ bool Job::job_delete_computer(Json::Value &para, std::string &job_info) {
     cmd += "./pg_ctl -D " + pathdir + " stop";
     KLOG_INFO( "job_delete_computer cmd {}", cmd);
 
-    pfd = popen(cmd.c_str(), "r");
-    if (!pfd) {
+    if (!job_run_cmd(cmd)) {
       job_info = "stop error " + cmd;
       goto end;
     }
-    while (fgets(buf, 256, pfd) != NULL) {
-      // if(strcasestr(buf, "error") != NULL)
-      KLOG_INFO("{}", buf);
-    }
-    pclose(pfd);
     KLOG_INFO("stop computer end");
 
     // rm file in pathdir
@@ -1013,10 +932,9 @@ end:
 
 bool Job::job_backup_compute(Json::Value &para, std::string &job_info) {
 
-  FILE *pfd;
-  char buf[512];
+  std::string last_line;
 
-  char *p = nullptr;
+  const char *p = nullptr;
   std::string cmd, backup_storage;
   int port;
   std::string ip;
@@ -1038,28 +956,22 @@ bool Job::job_backup_compute(Json::Value &para, std::string &job_info) {
   cmd += " -logdir=" + log_dir; 
   KLOG_INFO("job_backup_compute cmd {}", cmd);
 
-  pfd = popen(cmd.c_str(), "r");
-  if (!pfd) {
+  if (!job_run_cmd(cmd, &last_line)) {
     job_info = "backup error " + cmd;
     goto end;
   }
-  while (fgets(buf, 512, pfd) != NULL) {
-    // if(strcasestr(buf, "error") != NULL)
-    KLOG_INFO( "{}", buf);
-  }
-  pclose(pfd);
 
   ////////////////////////////////////////////////////////
   // check error, must be contain cluster_name & shard_name, and the tail like
   // ".tgz\n\0"
-  p = strstr(buf, ".tgz");
+  p = strstr(last_line.c_str(), ".tgz");
   if (p == NULL || *(p + 4) != '\n' || *(p + 5) != '\0') {
-    KLOG_ERROR("backup compute error: {}", buf);
+    KLOG_ERROR("backup compute error: {}", last_line);
     job_info = "backup compute cmd return error";
     goto end;
   }
  
-    job_info = buf;
+    job_info = last_line;
 
   ////////////////////////////////////////////////////////
   // rm backup path
@@ -1085,8 +997,7 @@ end:
 
 bool Job::job_backup_shard(Json::Value &para, std::string &job_info) {
 
-  FILE *pfd;
-  char buf[512];
+  std::string last_line;
 
   std::string cmd, cluster_name, shard_name, shard_id, backup_storage;
   int port;
@@ -1113,34 +1024,28 @@ bool Job::job_backup_shard(Json::Value &para, std::string &job_info) {
   cmd += " -logdir=" + log_dir; 
   KLOG_INFO("job_backup_shard cmd {}", cmd);
 
-  pfd = popen(cmd.c_str(), "r");
-  if (!pfd) {
+  if (!job_run_cmd(cmd, &last_line)) {
     job_info = "backup error " + cmd;
     goto end;
   }
-  while (fgets(buf, 512, pfd) != NULL) {
-    // if(strcasestr(buf, "error") != NULL)
-    KLOG_INFO( "{}", buf);
-  }
-  pclose(pfd);
 
   ////////////////////////////////////////////////////////
   // check error, must be contain cluster_name & shard_name, and the tail like
   // ".tgz\n\0"
-  if (strstr(buf, cluster_name.c_str()) == NULL ||
-      strstr(buf, shard_name.c_str()) == NULL) {
-    KLOG_ERROR("backup error: {}", buf);
+  if (strstr(last_line.c_str(), cluster_name.c_str()) == NULL ||
+      strstr(last_line.c_str(), shard_name.c_str()) == NULL) {
+    KLOG_ERROR("backup error: {}", last_line);
     job_info = "backup cmd return error";
     goto end;
   } else {
-    char *p = strstr(buf, ".tgz");
+    const char *p = strstr(last_line.c_str(), ".tgz");
     if (p == NULL || *(p + 4) != '\n' || *(p + 5) != '\0') {
-      KLOG_ERROR("backup error: {}", buf);
+      KLOG_ERROR("backup error: {}", last_line);
       job_info = "backup cmd return error";
       goto end;
     }
 
-    job_info = buf;
+    job_info = last_line;
   }
 
   ////////////////////////////////////////////////////////
@@ -1167,8 +1072,7 @@ end:
 
 bool Job::job_restore_storage(Json::Value &para, std::string &job_info) {
 
-  FILE *pfd;
-  char buf[512];
+  std::string last_line;
 
   std::string cmd, cluster_name, shard_name, timestamp, backup_storage;
   std::string ip, user, pwd;
@@ -1196,21 +1100,15 @@ bool Job::job_restore_storage(Json::Value &para, std::string &job_info) {
          "' -HdfsNameNodeService=" + backup_storage;
   KLOG_INFO("job_restore_storage cmd {}", cmd);
 
-  pfd = popen(cmd.c_str(), "r");
-  if (!pfd) {
+  if (!job_run_cmd(cmd, &last_line)) {
     job_info = "restore error " + cmd;
     goto end;
   }
-  while (fgets(buf, 512, pfd) != NULL) {
-    // if(strcasestr(buf, "error") != NULL)
-    KLOG_INFO( "{}", buf);
-  }
-  pclose(pfd);
 
   ////////////////////////////////////////////////////////
   // check error
-  if (strstr(buf, "restore MySQL instance successfully") == NULL) {
-    KLOG_ERROR( "restore storage error: {}", buf);
+  if (strstr(last_line.c_str(), "restore MySQL instance successfully") == NULL) {
+    KLOG_ERROR( "restore storage error: {}", last_line);
     job_info = "restore cmd return error";
     goto end;
   }
@@ -1255,8 +1153,7 @@ end:
 
 bool Job::job_restore_computer(Json::Value &para, std::string &job_info) {
 
-  FILE *pfd;
-  char buf[512];
+  std::string last_line;
 
   std::string cmd, strtmp, cluster_name, meta_str, shard_map;
   std::string ip;
@@ -1280,21 +1177,15 @@ bool Job::job_restore_computer(Json::Value &para, std::string &job_info) {
          " -metaclusterconnstr=" + meta_str + " -shard_map=\"" + shard_map + "\"";
   KLOG_INFO( "job_restore_computer cmd {}", cmd);
 
-  pfd = popen(cmd.c_str(), "r");
-  if (!pfd) {
+  if (!job_run_cmd(cmd, &last_line)) {
     job_info = "restore error " + cmd;
     goto end;
   }
-  while (fgets(buf, 512, pfd) != NULL) {
-    // if(strcasestr(buf, "error") != NULL)
-    KLOG_INFO( "{}", buf);
-  }
-  pclose(pfd);
 
   ////////////////////////////////////////////////////////
   // check error
-  if (strstr(buf, "restore Compute successfully") == NULL) {
-    KLOG_ERROR("restore computer error: {}", buf);
+  if (strstr(last_line.c_str(), "restore Compute successfully") == NULL) {
+    KLOG_ERROR("restore computer error: {}", last_line);
     job_info = "restore cmd return error";
     goto end;
   }
@@ -11,9 +11,9 @@
 #include "sys_config.h"
 #include "json/json.h"
 #include <errno.h>
-#include "zettalib/biodirectpopen.h"
 #include "zettalib/errorcup.h"
 #include "util_func/meta_info.h"
+#include "util_func/child_process.h"
 
 #include <algorithm>
 #include <list>
@@ -39,6 +39,7 @@ public:
   }
 
   bool job_system_cmd(std::string &cmd);
+  bool job_run_cmd(std::string &cmd, std::string *last_line = nullptr);
   bool job_save_file(std::string &path, const char *buf);
   bool job_read_file(std::string &path, std::string &str);
   bool job_create_program_path();
@@ -0,0 +1,304 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#include "path_index.h"
+#include "zettalib/op_log.h"
+#include "zettalib/tool_func.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <thread>
+
+// entries cached before the index starts over
+#define PATH_INDEX_MAX_ENTRIES 65536
+#define PATH_INDEX_WATCH_MASK                                                  \
+  (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY |          \
+   IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF)
+
+extern std::string node_mgr_util_path;
+extern std::string node_mgr_tmp_data_path;
+
+PathIndex *PathIndex::m_inst = nullptr;
+
+PathIndex::PathIndex() : inotify_fd_(-1), generation_(0) {}
+
+static std::string ParentDir(const std::string &path) {
+  size_t pos = path.rfind('/');
+  if (pos == std::string::npos || pos == 0) {
+    return "/";
+  }
+  return path.substr(0, pos);
+}
+
+bool PathIndex::Init() {
+  root_path(kUtilRoot);
+  root_path(kTmpDataRoot);
+
+  int fd = inotify_init1(IN_CLOEXEC);
+  if (fd < 0) {
+    KLOG_ERROR("inotify_init1() failed: {}, path lookups are not cached",
+               strerror(errno));
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> guard(mtx_);
+    inotify_fd_ = fd;
+  }
+  std::thread watcher(&PathIndex::watchLoop, this);
+  watcher.detach();
+  KLOG_INFO("Path index watching {} and {}", roots_[kUtilRoot],
+            roots_[kTmpDataRoot]);
+  return true;
+}
+
+std::string PathIndex::root_path(Root root) {
+  std::lock_guard<std::mutex> guard(mtx_);
+  if (!roots_[root].empty()) {
+    return roots_[root];
+  }
+  if (root == kUtilRoot) {
+    roots_[root] = kunlun::ConvertToAbsolutePath(node_mgr_util_path.c_str());
+    if (roots_[root].empty()) {
+      KLOG_ERROR("kunlun::ConvertToAbsolutePath {} faild: {}",
+                 node_mgr_util_path, strerror(errno));
+    }
+  } else {
+    roots_[root] =
+        kunlun::ConvertToAbsolutePath(node_mgr_tmp_data_path.c_str());
+    if (roots_[root].empty()) {
+      KLOG_ERROR("kunlun::ConvertToAbsolutePath {} faild: {}. set to current dir",
+                 node_mgr_tmp_data_path, strerror(errno));
+      roots_[root] = kunlun::ConvertToAbsolutePath("./");
+    }
+  }
+  return roots_[root];
+}
+
+PathEntry PathIndex::Lookup(Root root, const std::string &name) {
+  PathEntry entry;
+  entry.abs_path = root_path(root);
+  entry.exists = false;
+  memset(&entry.st, 0, sizeof(entry.st));
+  if (entry.abs_path.empty()) {
+    return entry;
+  }
+  entry.abs_path += "/" + name;
+
+  uint64_t generation = 0;
+  {
+    std::lock_guard<std::mutex> guard(mtx_);
+    auto iter = entries_.find(entry.abs_path);
+    if (iter != entries_.end()) {
+      return iter->second;
+    }
+    generation = generation_;
+  }
+
+  entry.exists = stat(entry.abs_path.c_str(), &entry.st) == 0;
+
+  std::lock_guard<std::mutex> guard(mtx_);
+  // an event arrived since the stat, it may describe a newer state
+  if (generation != generation_ || inotify_fd_ < 0) {
+    return entry;
+  }
+  // without watches up to its directory the entry would never be invalidated
+  if (!watchPath(roots_[root], name)) {
+    return entry;
+  }
+  if (entries_.size() >= PATH_INDEX_MAX_ENTRIES) {
+    entries_.clear();
+  }
+  entries_[entry.abs_path] = entry;
+  return entry;
+}
+
+std::shared_ptr<SharedFile> PathIndex::OpenShared(const std::string &abs_path) {
+  uint64_t generation = 0;
+  {
+    std::lock_guard<std::mutex> guard(mtx_);
+    auto iter = shared_files_.find(abs_path);
+    if (iter != shared_files_.end()) {
+      std::shared_ptr<SharedFile> file = iter->second.lock();
+      if (file) {
+        return file;
+      }
+      shared_files_.erase(iter);
+    }
+    generation = generation_;
+  }
+
+  int fd = open(abs_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return nullptr;
+  }
+  std::shared_ptr<SharedFile> file = std::make_shared<SharedFile>(fd);
+
+  std::lock_guard<std::mutex> guard(mtx_);
+  if (generation != generation_ || inotify_fd_ < 0 || !underWatch(abs_path)) {
+    return file;
+  }
+  // another reader may have opened it meanwhile, keep the first one
+  std::weak_ptr<SharedFile> &slot = shared_files_[abs_path];
+  std::shared_ptr<SharedFile> existing = slot.lock();
+  if (existing) {
+    return existing;
+  }
+  slot = file;
+  if (shared_files_.size() >= PATH_INDEX_MAX_ENTRIES) {
+    for (auto iter = shared_files_.begin(); iter != shared_files_.end();) {
+      if (iter->second.expired()) {
+        iter = shared_files_.erase(iter);
+      } else {
+        ++iter;
+      }
+    }
+  }
+  return file;
+}
+
+// Watch every directory from `root` down to the one holding `name`, a
+// rename anywhere on the way changes what `name` resolves to.
+// mtx_ must be held
+bool PathIndex::watchPath(const std::string &root, const std::string &name) {
+  std::string dir = root;
+  if (!watchDir(dir)) {
+    return false;
+  }
+  size_t start = 0;
+  for (;;) {
+    size_t slash = name.find('/', start);
+    std::string component = name.substr(start, slash - start);
+    // only plain names are cached, anything else is stat()ed every time
+    if (component.empty() || component == "." || component == "..") {
+      return false;
+    }
+    if (slash == std::string::npos) {
+      return true;
+    }
+    dir += "/" + component;
+    if (!watchDir(dir)) {
+      return false;
+    }
+    start = slash + 1;
+  }
+}
+
+// True if the directory holding `abs_path` is watched, so the file is
+// dropped once it is replaced. mtx_ must be held
+bool PathIndex::underWatch(const std::string &abs_path) {
+  return watched_dirs_.find(ParentDir(abs_path)) != watched_dirs_.end();
+}
+
+// mtx_ must be held
+bool PathIndex::watchDir(const std::string &dir) {
+  if (watched_dirs_.find(dir) != watched_dirs_.end()) {
+    return true;
+  }
+  int wd = inotify_add_watch(inotify_fd_, dir.c_str(),
+                             PATH_INDEX_WATCH_MASK | IN_ONLYDIR);
+  if (wd < 0) {
+    // a missing directory is normal, the name just does not exist
+    if (errno != ENOENT && errno != ENOTDIR) {
+      KLOG_ERROR("inotify_add_watch() {} failed: {}", dir, strerror(errno));
+    }
+    return false;
+  }
+  // the same inode watched under another name, keep the newer name
+  auto iter = watches_.find(wd);
+  if (iter != watches_.end()) {
+    watched_dirs_.erase(iter->second);
+  }
+  watches_[wd] = dir;
+  watched_dirs_[dir] = wd;
+  return true;
+}
+
+// mtx_ must be held
+void PathIndex::invalidate(const std::string &path, bool subtree) {
+  generation_++;
+  entries_.erase(path);
+  shared_files_.erase(path);
+  if (!subtree) {
+    return;
+  }
+  std::string prefix = path + "/";
+  for (auto iter = entries_.begin(); iter != entries_.end();) {
+    if (iter->first.compare(0, prefix.size(), prefix) == 0) {
+      iter = entries_.erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+  for (auto iter = shared_files_.begin(); iter != shared_files_.end();) {
+    if (iter->first.compare(0, prefix.size(), prefix) == 0) {
+      iter = shared_files_.erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+}
+
+// mtx_ must be held
+void PathIndex::invalidateAll() {
+  generation_++;
+  entries_.clear();
+  shared_files_.clear();
+}
+
+void PathIndex::watchLoop() {
+  alignas(struct inotify_event) char buff[64 * 1024];
+  for (;;) {
+    ssize_t len = read(inotify_fd_, buff, sizeof(buff));
+    if (len < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      KLOG_ERROR("Read inotify events failed: {}, path lookups are not cached",
+                 strerror(errno));
+      std::lock_guard<std::mutex> guard(mtx_);
+      close(inotify_fd_);
+      inotify_fd_ = -1;
+      invalidateAll();
+      return;
+    }
+
+    std::lock_guard<std::mutex> guard(mtx_);
+    for (char *ptr = buff; ptr < buff + len;) {
+      const struct inotify_event *event =
+          reinterpret_cast<const struct inotify_event *>(ptr);
+      ptr += sizeof(struct inotify_event) + event->len;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        KLOG_INFO("Path index missed inotify events, start over");
+        invalidateAll();
+        continue;
+      }
+      auto iter = watches_.find(event->wd);
+      if (iter == watches_.end()) {
+        continue;
+      }
+      std::string dir = iter->second;
+      if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+        // the watch no longer describes `dir`, drop it with what it covered
+        invalidate(dir, true);
+        if (!(event->mask & IN_IGNORED)) {
+          inotify_rm_watch(inotify_fd_, event->wd);
+        }
+        auto dir_iter = watched_dirs_.find(dir);
+        if (dir_iter != watched_dirs_.end() && dir_iter->second == event->wd) {
+          watched_dirs_.erase(dir_iter);
+        }
+        watches_.erase(iter);
+        continue;
+      }
+      if (event->len > 0) {
+        invalidate(dir + "/" + event->name, true);
+      }
+    }
+  }
+}
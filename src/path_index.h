@@ -0,0 +1,88 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#ifndef _NODE_MGR_PATH_INDEX_H_
+#define _NODE_MGR_PATH_INDEX_H_
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+
+// A read-only fd shared by every concurrent reader of the same file
+class SharedFile {
+public:
+  explicit SharedFile(int fd) : fd_(fd) {}
+  ~SharedFile() { close(fd_); }
+  int fd() const { return fd_; }
+
+private:
+  // forbid copy
+  SharedFile(const SharedFile &rht) = delete;
+  SharedFile &operator=(const SharedFile &rht) = delete;
+
+  int fd_;
+};
+
+struct PathEntry {
+  std::string abs_path;
+  bool exists;
+  struct stat st;
+};
+
+/*
+  In-memory index of names under node_mgr_util_path and
+  node_mgr_tmp_data_path. A lookup stats the name once, after that it is
+  answered from memory until inotify reports a change in the directory
+  holding it. Lookups keep working, uncached, if inotify is unavailable.
+*/
+class PathIndex {
+private:
+  static PathIndex *m_inst;
+  PathIndex();
+
+public:
+  static PathIndex *get_instance() {
+    if (!m_inst)
+      m_inst = new PathIndex();
+    return m_inst;
+  }
+
+  enum Root { kUtilRoot = 0, kTmpDataRoot, kRootMax };
+
+  // Resolve the roots and start watching, config must be loaded
+  bool Init();
+  // Absolute path of the root, empty if it can not be resolved
+  std::string root_path(Root root);
+  // `name` is relative to the root
+  PathEntry Lookup(Root root, const std::string &name);
+  // nullptr with errno set if the file can not be opened
+  std::shared_ptr<SharedFile> OpenShared(const std::string &abs_path);
+
+private:
+  void watchLoop();
+  bool watchPath(const std::string &root, const std::string &name);
+  bool underWatch(const std::string &abs_path);
+  bool watchDir(const std::string &dir);
+  void invalidate(const std::string &path, bool subtree);
+  void invalidateAll();
+
+  std::mutex mtx_;
+  std::string roots_[kRootMax];
+  int inotify_fd_;
+  // bumped by every invalidation, a lookup racing with one is not cached
+  uint64_t generation_;
+  std::unordered_map<std::string, PathEntry> entries_;
+  // watch descriptor -> directory
+  std::unordered_map<int, std::string> watches_;
+  std::unordered_map<std::string, int> watched_dirs_;
+  std::unordered_map<std::string, std::weak_ptr<SharedFile>> shared_files_;
+};
+
+#endif /*_NODE_MGR_PATH_INDEX_H_*/
@@ -10,8 +10,11 @@
 #include "zettalib/tool_func.h"
 #include "zettalib/op_mysql.h"
 #include "instance_info.h"
+#include "traffic_governor.h"
 #include "util_func/error_code.h"
 #include "util_func/meta_info.h"
+#include "util_func/child_process.h"
+#include "util_func/job_control.h"
 #include "json/json.h"
 #include <stdio.h>
 #include <string>
@@ -22,49 +25,87 @@
 namespace kunlun
 {
 
+// A step an earlier run of the job finished before node_mgr restarted
+static bool StepFinished(const char *step, std::string *payload = nullptr) {
+    JobControl *job = JobControl::current();
+    return job != nullptr && job->StepFinished(step, payload);
+}
+
+static void FinishStep(const char *step, const std::string &payload = "") {
+    JobControl *job = JobControl::current();
+    if (job != nullptr)
+        job->FinishStep(step, payload);
+}
+
 bool CRbNode::Run() {
     bool ret = true;
     KLOG_INFO("start rebuild host {} node job_id {}", rb_host_, job_id_);
     KLOG_INFO("rb host step: check params");
-    if(!PrepareParams()) {
-        ret = false;
-        UpdateStatRecord();
-        return ret;
+    // the mysqld of the rebuilt node is down once its data was cleared,
+    // a resumed job takes the params found before
+    std::string params;
+    if(StepFinished("check_param", &params)) {
+        LoadParams(params);
+    } else {
+        if(!PrepareParams()) {
+            ret = false;
+            UpdateStatRecord();
+            return ret;
+        }
+        FinishStep("check_param", SaveParams());
     }
     KLOG_INFO("rb host step: xtraback data");
     UpdateStatRecord();
-    if(!XtrabackData()) {
-        ret = false;
-        UpdateStatRecord();
-        return ret;
+    if(!StepFinished("xtracback_data")) {
+        if(!XtrabackData()) {
+            ret = false;
+            UpdateStatRecord();
+            return ret;
+        }
+        FinishStep("xtracback_data");
     }
     KLOG_INFO("rb host step: check xtraback data");
     UpdateStatRecord();
-    if(!CheckXtrabackData()) {
-        ret = false;
-        UpdateStatRecord();
-        return ret;
+    if(!StepFinished("checksum_data")) {
+        if(!CheckXtrabackData()) {
+            ret = false;
+            UpdateStatRecord();
+            return ret;
+        }
+        FinishStep("checksum_data");
     }
     KLOG_INFO("rb host step: backup old data");
     UpdateStatRecord();
-    if(!BackupOldData()) {
-        ret = false;
-        UpdateStatRecord();
-        return ret;
+    if(!StepFinished("backup_old_data")) {
+        if(!BackupOldData()) {
+            ret = false;
+            UpdateStatRecord();
+            return ret;
+        }
+        FinishStep("backup_old_data");
     }
     KLOG_INFO("rb host step: clear old data");
     UpdateStatRecord();
-    if(!ClearOldData()) {
-        ret = false;
-        UpdateStatRecord();
-        return ret;
+    if(!StepFinished("clear_old_data")) {
+        if(!ClearOldData()) {
+            ret = false;
+            UpdateStatRecord();
+            return ret;
+        }
+        FinishStep("clear_old_data");
     }
     KLOG_INFO("rb host step: recover data");
     UpdateStatRecord();
-    if(!RecoverXtrabackData()) {
-        ret = false;
-        UpdateStatRecord();
-        return ret;
+    // the gtid position is read from the xtrabackup files the step removes
+    if(StepFinished("recover_data", &gtid_purged_)) {
+        KLOG_INFO("rb host data recovered before, gtid_purged {}", gtid_purged_);
+    } else {
+        if(!RecoverXtrabackData()) {
+            ret = false;
+            UpdateStatRecord();
+            return ret;
+        }
+        FinishStep("recover_data", gtid_purged_);
     }
     KLOG_INFO("rb host step: rebuild sync");
     UpdateStatRecord();
@@ -79,6 +120,48 @@ bool CRbNode::Run() {
     return ret;
 }   
 
+std::string CRbNode::SaveParams() {
+    Json::Value doc;
+    doc["nodemgr_tcp_port"] = nodemgr_tcp_port_;
+    doc["nodemgr_bin_path"] = nodemgr_bin_path_;
+    doc["pull_etcfile"] = pull_etcfile_;
+    doc["pull_unixsock"] = pull_unixsock_;
+    doc["rb_unixsock"] = rb_unixsock_;
+    doc["xtrabackup_tmp"] = xtrabackup_tmp_;
+    doc["backup_tmp"] = backup_tmp_;
+    doc["rb_datadir"] = rb_datadir_;
+    doc["rb_logdir"] = rb_logdir_;
+    doc["rb_wallogdir"] = rb_wallogdir_;
+    doc["rb_etcfile"] = rb_etcfile_;
+    doc["tmp_etcfile"] = tmp_etcfile_;
+    doc["tool_dir"] = tool_dir_;
+
+    Json::FastWriter writer;
+    writer.omitEndingLineFeed();
+    return writer.write(doc);
+}
+
+void CRbNode::LoadParams(const std::string& params) {
+    Json::Value doc;
+    Json::Reader reader;
+    reader.parse(params, doc);
+    step_ = "check_param";
+    nodemgr_tcp_port_ = doc["nodemgr_tcp_port"].asString();
+    nodemgr_bin_path_ = doc["nodemgr_bin_path"].asString();
+    pull_etcfile_ = doc["pull_etcfile"].asString();
+    pull_unixsock_ = doc["pull_unixsock"].asString();
+    rb_unixsock_ = doc["rb_unixsock"].asString();
+    xtrabackup_tmp_ = doc["xtrabackup_tmp"].asString();
+    backup_tmp_ = doc["backup_tmp"].asString();
+    rb_datadir_ = doc["rb_datadir"].asString();
+    rb_logdir_ = doc["rb_logdir"].asString();
+    rb_wallogdir_ = doc["rb_wallogdir"].asString();
+    rb_etcfile_ = doc["rb_etcfile"].asString();
+    tmp_etcfile_ = doc["tmp_etcfile"].asString();
+    tool_dir_ = doc["tool_dir"].asString();
+    KLOG_INFO("rb host params found before: {}", params);
+}
+
 bool CRbNode::PrepareParams() {
     step_ = "check_param";
     std::string hostaddr = pull_host_.substr(0, pull_host_.rfind("_"));
@@ -165,9 +248,17 @@ bool CRbNode::XtrabackData() {
     ClearTempData(xtrabackup_tmp_);
     std::string hostaddr = pull_host_.substr(0, pull_host_.rfind("_"));
     std::string kl_host = hostaddr+":"+nodemgr_tcp_port_;
+
+    // the stream counts against the host bandwidth while it runs, pv gets
+    // the share of the governor if that is below the requested limit
+    TrafficLease lease(1, pvlimit_, "rebuild_node_" + job_id_);
+    int pv_rate = pvlimit_;
+    if (lease.rate() > 0 && (pv_rate <= 0 || lease.rate() < pv_rate)) {
+        pv_rate = lease.rate();
+    }
     std::string xtra_cmd = string_sprintf("./util/kl_tool --host=%s --command=\"cd %s; ./util/xtrabackup --defaults-file=%s --user=agent --socket=%s -pagent_pwd --kill-long-queries-timeout=20 --stream=xbstream --parallel=4 --compress-threads=4 --backup --no-backup-locks=1 | ./util/lz4 -B4 | ./util/pv --rate-limit=%d\" | ./util/lz4 -d | ./util/xbstream -x -C %s > ../log/rebuild_node_tool_%s.log 2>&1",
             kl_host.c_str(), nodemgr_bin_path_.c_str(), pull_etcfile_.c_str(), pull_unixsock_.c_str(),
-            pvlimit_, xtrabackup_tmp_.c_str(), job_id_.c_str());
+            pv_rate, xtrabackup_tmp_.c_str(), job_id_.c_str());
     KLOG_INFO("xtraback cmd: {}", xtra_cmd);
     if(ExecuteCmd(xtra_cmd.c_str())) {
         error_code_ = RB_XTRACBACK_DATA_FROM_PULL_HOST_ERR;
@@ -218,10 +309,10 @@ bool CRbNode::ClearOldData() {
         return false;
     }
     std::string back_cnf_cmd = string_sprintf("cp %s %s", rb_etcfile_.c_str(), (rb_datadir_+"/"+rb_port).c_str());
-    system(back_cnf_cmd.c_str());
+    RunCommand(back_cnf_cmd);
     std::string back_auto_cmd = string_sprintf("cp %s %s", (rb_datadir_+"/"+rb_port+"/data/mysqld-auto.cnf").c_str(),
                             (rb_datadir_+"/"+rb_port).c_str());
-    system(back_auto_cmd.c_str());
+    RunCommand(back_auto_cmd);
 
     std::string rm_path = rb_datadir_+"/"+rb_port+"/data";
     ClearTempData(rm_path);
@@ -254,10 +345,10 @@ bool CRbNode::RecoverXtrabackData() {
     ClearTempData(xtrabackup_tmp_);
     std::string back_cnf_cmd = string_sprintf("mv %s %s", tmp_etcfile_.c_str(),
                             (rb_datadir_+"/"+rb_port+"/data/").c_str());
-    system(back_cnf_cmd.c_str());
+    RunCommand(back_cnf_cmd);
     std::string back_auto_cmd = string_sprintf("mv %s %s", (rb_datadir_+"/"+rb_port+"/mysqld-auto.cnf").c_str(),
                             (rb_datadir_+"/"+rb_port+"/data/").c_str());
-    system(back_auto_cmd.c_str());
+    RunCommand(back_auto_cmd);
     return true;
 }
 
@@ -357,35 +448,9 @@ void CRbNode::UpdateStatRecord() {
 }
 
 int CRbNode::ExecuteCmd(const char* buff) {
-    int rc = 0;
-    pid_t kl_pid = fork();
-    if(kl_pid < 0) {
-        KLOG_ERROR("fork process for execute command failed, {}.{}", errno, strerror(errno));
-        return 1;
-    }
-
-    if(kl_pid == 0) {
-        const char *argvs[4];
-        argvs[0] = "sh";
-        argvs[1] = "-c";
-        argvs[2] = buff;
-        argvs[3] = nullptr;
-
-        /*execv*/
-        execv("/bin/sh", (char *const *)(argvs));
-    } 
-        
-    char errinfo[1024] = {0};
-    while(true) {
-        if(!CheckPidStatus(kl_pid, rc, errinfo)) 
-            sleep(1);
-        else
-            break;
-    }
-    
+    int rc = RunCommand(buff);
     if(rc) {
-        //error_info_ = string_sprintf("%s", errinfo);
-        KLOG_ERROR("execute cmd failed {}", errinfo);
+        KLOG_ERROR("execute cmd {} failed, return {}", buff, rc);
     }
     return rc;
 }
@@ -393,7 +458,7 @@ int CRbNode::ExecuteCmd(const char* buff) {
 void CRbNode::ClearTempData(const std::string& path) {
     std::string buff = "rm -rf "+path+"/*";
     KLOG_INFO(" clear dir: {} data", buff);
-    system(buff.c_str());
+    RunCommand(buff);
 }
 
 std::string CRbNode::GetMysqlGlobalVariables(const std::string& host, const std::string& key_name) {
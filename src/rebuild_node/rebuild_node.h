@@ -33,6 +33,9 @@ private:
     bool RecoverXtrabackData();
     bool RebuildSync();
     void UpdateStatRecord();
+    // what PrepareParams found, kept with the job's steps
+    std::string SaveParams();
+    void LoadParams(const std::string& params);
 
     int ExecuteCmd(const char* buff);
     void ClearTempData(const std::string& path);
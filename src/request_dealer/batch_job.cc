@@ -0,0 +1,240 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#include "batch_job.h"
+#include "request_dealer.h"
+#include "zettalib/op_log.h"
+#include <map>
+
+BatchJob::~BatchJob() {
+  // dealers of jobs never submitted
+  for (auto &node : nodes_) {
+    delete node.dealer;
+  }
+}
+
+bool BatchJob::Prepare(const Json::Value &request,
+                       const JobTable::DealerMaker &make_dealer) {
+  request_id_ = request["cluster_mgr_request_id"].asString();
+  task_spec_info_ = request["task_spec_info"].asString();
+  const Json::Value &jobs = request["paras"]["jobs"];
+  if (!jobs.isArray() || jobs.size() == 0) {
+    setErr("'jobs' must be a non-empty array");
+    return false;
+  }
+
+  std::map<std::string, size_t> index;
+  nodes_.resize(jobs.size());
+  for (Json::Value::ArrayIndex i = 0; i < jobs.size(); i++) {
+    std::string name = jobs[i]["name"].asString();
+    if (name.empty() || index.count(name)) {
+      setErr("job %u of the batch has no name or a duplicate one", i);
+      return false;
+    }
+    nodes_[i].name = name;
+    index[name] = i;
+  }
+
+  // Kahn's algorithm, a job left with unmet dependencies is on a cycle
+  std::vector<size_t> unmet(nodes_.size(), 0);
+  std::vector<std::vector<size_t>> dependents(nodes_.size());
+  for (Json::Value::ArrayIndex i = 0; i < jobs.size(); i++) {
+    const Json::Value &depends_on = jobs[i]["depends_on"];
+    for (Json::Value::ArrayIndex j = 0; j < depends_on.size(); j++) {
+      auto it = index.find(depends_on[j].asString());
+      if (it == index.end()) {
+        setErr("job %s depends on unknown job %s", nodes_[i].name.c_str(),
+               depends_on[j].asString().c_str());
+        return false;
+      }
+      nodes_[i].depends_on.push_back(it->second);
+      dependents[it->second].push_back(i);
+      unmet[i]++;
+    }
+  }
+  std::vector<size_t> ready;
+  for (size_t i = 0; i < nodes_.size(); i++) {
+    if (unmet[i] == 0) {
+      ready.push_back(i);
+    }
+  }
+  size_t ordered = 0;
+  while (!ready.empty()) {
+    size_t i = ready.back();
+    ready.pop_back();
+    ordered++;
+    for (size_t next : dependents[i]) {
+      if (--unmet[next] == 0) {
+        ready.push_back(next);
+      }
+    }
+  }
+  if (ordered != nodes_.size()) {
+    setErr("dependencies of the batch jobs form a cycle");
+    return false;
+  }
+
+  for (Json::Value::ArrayIndex i = 0; i < jobs.size(); i++) {
+    Json::Value job_request = jobs[i]["request"];
+    if (!job_request.isObject()) {
+      setErr("job %s has no request", nodes_[i].name.c_str());
+      return false;
+    }
+    if (!job_request.isMember("cluster_mgr_request_id")) {
+      job_request["cluster_mgr_request_id"] =
+          request_id_ + "/" + nodes_[i].name;
+    }
+    std::string job_type = job_request["job_type"].asString();
+    nodes_[i].dealer = make_dealer(job_request);
+    if (nodes_[i].dealer == nullptr) {
+      setErr("request of job %s is not valid", nodes_[i].name.c_str());
+      return false;
+    }
+    kunlun::ClusterRequestTypes type = nodes_[i].dealer->request_type();
+    if (type == kunlun::kBatchJobsType || JobTable::IsQueryType(type)) {
+      setErr("job %s of type %s can not be batched", nodes_[i].name.c_str(),
+             job_type.c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+void BatchJob::Start(const FinishCallback &on_finish) {
+  on_finish_ = on_finish;
+  KLOG_INFO("batch {} of {} jobs started", request_id_, nodes_.size());
+  advance();
+}
+
+bool BatchJob::settled(const BatchNode &node) const {
+  if (node.state == kNodeSkipped) {
+    return true;
+  }
+  // the id is stored after Submit returned, the result may come first
+  return node.state == kNodeSubmitted && node.has_result &&
+         !node.job_id.empty();
+}
+
+void BatchJob::advance() {
+  std::vector<size_t> ready;
+  std::string batch_response;
+  {
+    std::lock_guard<std::mutex> guard(mux_);
+    if (finished_) {
+      return;
+    }
+    // skipping a job may make its own dependents skip, repeat till stable
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (size_t i = 0; i < nodes_.size(); i++) {
+        BatchNode &node = nodes_[i];
+        if (node.state != kNodePending) {
+          continue;
+        }
+        bool met = true;
+        bool doomed = false;
+        for (size_t dep : node.depends_on) {
+          const BatchNode &parent = nodes_[dep];
+          if (parent.state == kNodeSkipped ||
+              (settled(parent) && !parent.success)) {
+            doomed = true;
+          } else if (!settled(parent)) {
+            met = false;
+          }
+        }
+        if (doomed) {
+          KLOG_INFO("batch {} skips job {}, a job it depends on failed",
+                    request_id_, node.name);
+          node.state = kNodeSkipped;
+          changed = true;
+        } else if (met) {
+          node.state = kNodeSubmitted;
+          ready.push_back(i);
+        }
+      }
+    }
+
+    bool all_settled = ready.empty();
+    for (const auto &node : nodes_) {
+      all_settled = all_settled && settled(node);
+    }
+    if (all_settled) {
+      finished_ = true;
+      batch_response = response();
+    }
+  }
+
+  if (!batch_response.empty()) {
+    KLOG_INFO("batch {} finished", request_id_);
+    if (on_finish_) {
+      on_finish_(batch_response);
+    }
+    return;
+  }
+
+  std::shared_ptr<BatchJob> self = shared_from_this();
+  for (size_t i : ready) {
+    RequestDealer *dealer = nodes_[i].dealer;
+    nodes_[i].dealer = nullptr;
+    std::string job_id = JobTable::get_instance()->Submit(
+        dealer, [self, i](const std::string &response) {
+          self->onJobFinish(i, response);
+        });
+    {
+      std::lock_guard<std::mutex> guard(mux_);
+      nodes_[i].job_id = job_id;
+    }
+    advance();
+  }
+}
+
+void BatchJob::onJobFinish(size_t index, const std::string &response) {
+  Json::Reader reader;
+  Json::Value root;
+  bool success = reader.parse(response, root) &&
+                 root["status"].asString() == "success";
+  {
+    std::lock_guard<std::mutex> guard(mux_);
+    nodes_[index].has_result = true;
+    nodes_[index].success = success;
+    nodes_[index].response = response;
+  }
+  advance();
+}
+
+std::string BatchJob::response() {
+  Json::Value root;
+  root["cluster_mgr_request_id"] = request_id_;
+  root["task_spec_info"] = task_spec_info_;
+  bool success = true;
+  Json::Value jobs;
+  for (const auto &node : nodes_) {
+    Json::Value job;
+    job["job_id"] = node.job_id;
+    if (node.state == kNodeSkipped) {
+      job["status"] = "skipped";
+    } else {
+      job["status"] = node.success ? "success" : "failed";
+      Json::Reader reader;
+      Json::Value response;
+      if (reader.parse(node.response, response)) {
+        job["response"] = response;
+      } else {
+        job["response"] = node.response;
+      }
+    }
+    success = success && node.state != kNodeSkipped && node.success;
+    jobs[node.name] = job;
+  }
+  root["status"] = success ? "success" : "failed";
+  root["info"]["jobs"] = jobs;
+
+  Json::FastWriter writer;
+  writer.omitEndingLineFeed();
+  return writer.write(root);
+}
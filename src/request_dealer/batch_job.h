@@ -0,0 +1,87 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#ifndef _NODE_MGR_BATCH_JOB_H_
+#define _NODE_MGR_BATCH_JOB_H_
+
+#include "job_table.h"
+#include "json/json.h"
+#include "zettalib/errorcup.h"
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class RequestDealer;
+
+/*
+  A batch_jobs request carries the requests of several jobs, each with a
+  name and the names of the jobs it must wait for:
+
+  {"cluster_mgr_request_id":"10","job_type":"batch_jobs","paras":{"jobs":[
+    {"name":"mysql_6001","request":{"job_type":"install_mysql",...}},
+    {"name":"mysql_6002","request":{"job_type":"install_mysql",...}},
+    {"name":"exporter","request":{...},"depends_on":["mysql_6001",
+                                                    "mysql_6002"]}]}}
+
+  Every job is submitted to the JobTable as soon as the jobs it depends on
+  succeeded, so independent ones run side by side. A job depending on one
+  that failed is skipped. A job without a cluster_mgr_request_id of its own
+  gets "<batch request id>/<name>", a repeated batch is then deduplicated
+  job by job. The response lists, per job name, its job id, status and
+  response, and comes when the last job ended. No thread waits for the
+  jobs meanwhile, the batch moves on from their finish callbacks.
+*/
+class BatchJob : public kunlun::ErrorCup,
+                 public std::enable_shared_from_this<BatchJob> {
+public:
+  typedef JobTable::FinishCallback FinishCallback;
+
+  BatchJob() : finished_(false) {}
+  virtual ~BatchJob();
+
+  // Checks the jobs and their dependencies form a DAG and builds their
+  // dealers
+  bool Prepare(const Json::Value &request,
+               const JobTable::DealerMaker &make_dealer);
+  // on_finish gets the response of the whole batch
+  void Start(const FinishCallback &on_finish);
+
+private:
+  enum NodeState { kNodePending, kNodeSubmitted, kNodeSkipped };
+
+  struct BatchNode {
+    std::string name;
+    std::vector<size_t> depends_on;
+    RequestDealer *dealer = nullptr;
+    NodeState state = kNodePending;
+    std::string job_id;
+    bool has_result = false;
+    bool success = false;
+    std::string response;
+  };
+
+  // Submits the jobs whose dependencies are all met, skips the ones that
+  // can not run anymore and finishes the batch once every job ended
+  void advance();
+  void onJobFinish(size_t index, const std::string &response);
+  bool settled(const BatchNode &node) const;
+  std::string response();
+
+  // forbid copy
+  BatchJob(const BatchJob &rht) = delete;
+  BatchJob &operator=(const BatchJob &rht) = delete;
+
+  std::string request_id_;
+  std::string task_spec_info_;
+  FinishCallback on_finish_;
+  std::mutex mux_;
+  std::vector<BatchNode> nodes_;
+  bool finished_;
+};
+
+#endif /*_NODE_MGR_BATCH_JOB_H_*/
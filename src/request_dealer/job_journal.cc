@@ -0,0 +1,135 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#include "job_journal.h"
+#include "leveldb/db.h"
+#include "leveldb/write_batch.h"
+#include "zettalib/op_log.h"
+#include <memory>
+
+std::string job_journal_path;
+
+#define JOB_KEY_PREFIX "job/"
+
+JobJournal *JobJournal::m_inst = NULL;
+
+JobJournal::JobJournal()
+    : db_(nullptr), queued_seq_(0), synced_seq_(0), committing_(false) {}
+
+bool JobJournal::Open(const std::string &path) {
+  leveldb::Options options;
+  options.create_if_missing = true;
+  // a torn record of a crash is reported rather than replayed
+  options.paranoid_checks = true;
+  leveldb::DB *db = nullptr;
+  leveldb::Status status = leveldb::DB::Open(options, path, &db);
+  if (!status.ok()) {
+    setErr("open job journal %s failed: %s", path.c_str(),
+           status.ToString().c_str());
+    return false;
+  }
+  db_ = db;
+  KLOG_INFO("job journal {} opened", path);
+  return true;
+}
+
+void JobJournal::Put(const std::string &job_id, const Json::Value &record) {
+  if (db_ == nullptr) {
+    return;
+  }
+  Json::FastWriter writer;
+  writer.omitEndingLineFeed();
+  PendingWrite write;
+  write.key = JOB_KEY_PREFIX + job_id;
+  write.value = writer.write(record);
+
+  std::unique_lock<std::mutex> lock(mux_);
+  pending_.push_back(std::move(write));
+  uint64_t seq = ++queued_seq_;
+  while (synced_seq_ < seq) {
+    if (committing_) {
+      cond_.wait(lock);
+      continue;
+    }
+    commitGroup(lock);
+  }
+  // erases queued while the group was written have nobody waiting for them
+  if (!committing_ && !pending_.empty()) {
+    commitGroup(lock);
+  }
+}
+
+void JobJournal::Erase(const std::string &job_id) {
+  if (db_ == nullptr) {
+    return;
+  }
+  PendingWrite write;
+  write.key = JOB_KEY_PREFIX + job_id;
+  std::unique_lock<std::mutex> lock(mux_);
+  pending_.push_back(std::move(write));
+  ++queued_seq_;
+  // a running commit leaves it to its leader
+  if (!committing_) {
+    commitGroup(lock);
+  }
+}
+
+void JobJournal::commitGroup(std::unique_lock<std::mutex> &lock) {
+  // lead the group: take every write queued so far
+  committing_ = true;
+  std::vector<PendingWrite> group;
+  group.swap(pending_);
+  uint64_t group_seq = queued_seq_;
+  lock.unlock();
+
+  leveldb::WriteBatch batch;
+  bool has_put = false;
+  for (const auto &it : group) {
+    if (it.value.empty()) {
+      batch.Delete(it.key);
+    } else {
+      batch.Put(it.key, it.value);
+      has_put = true;
+    }
+  }
+  // a delete lost with the page cache only brings an expired record back
+  leveldb::WriteOptions options;
+  options.sync = has_put;
+  leveldb::Status status = db_->Write(options, &batch);
+  if (!status.ok()) {
+    KLOG_ERROR("job journal write of {} records failed: {}", group.size(),
+               status.ToString());
+  }
+
+  lock.lock();
+  synced_seq_ = group_seq;
+  committing_ = false;
+  cond_.notify_all();
+}
+
+void JobJournal::Load(std::vector<Json::Value> &records) {
+  if (db_ == nullptr) {
+    return;
+  }
+  leveldb::ReadOptions options;
+  options.verify_checksums = true;
+  std::unique_ptr<leveldb::Iterator> it(db_->NewIterator(options));
+  for (it->Seek(JOB_KEY_PREFIX);
+       it->Valid() && it->key().starts_with(JOB_KEY_PREFIX); it->Next()) {
+    Json::Reader reader;
+    Json::Value record;
+    if (!reader.parse(it->value().ToString(), record)) {
+      KLOG_ERROR("job journal record {} is corrupted, skip it",
+                 it->key().ToString());
+      continue;
+    }
+    records.push_back(record);
+  }
+  if (!it->status().ok()) {
+    KLOG_ERROR("read job journal failed: {}", it->status().ToString());
+  }
+}
@@ -0,0 +1,81 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#ifndef _NODE_MGR_JOB_JOURNAL_H_
+#define _NODE_MGR_JOB_JOURNAL_H_
+
+#include "json/json.h"
+#include "zettalib/errorcup.h"
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace leveldb {
+class DB;
+}
+
+/*
+  LevelDB journal in `job_journal_path` holding one record per job of the
+  JobTable that changes the node: its request, state, the steps it
+  finished, the process groups it runs and its response.
+
+  Writes are group committed: a writer queues its record and the first
+  one in finds no commit running syncs everything queued so far in one
+  batch while the others wait for it, so the jobs do not pay one fsync
+  each however many run at once.
+*/
+class JobJournal : public kunlun::ErrorCup {
+private:
+  static JobJournal *m_inst;
+  JobJournal();
+
+public:
+  static JobJournal *get_instance() {
+    if (!m_inst)
+      m_inst = new JobJournal();
+    return m_inst;
+  }
+
+  bool Open(const std::string &path);
+  bool opened() const { return db_ != nullptr; }
+
+  // Returns once the record is on disk
+  void Put(const std::string &job_id, const Json::Value &record);
+  // Written at once unless a commit is running, whose leader writes it
+  // then. Not synced on its own: only a crash of the host may bring the
+  // record back, and the job expires again
+  void Erase(const std::string &job_id);
+  // Every record in the journal, for recovery at startup
+  void Load(std::vector<Json::Value> &records);
+
+private:
+  struct PendingWrite {
+    std::string key;
+    // erased when empty
+    std::string value;
+  };
+
+  // Write everything queued in one batch, `lock` holds mux_
+  void commitGroup(std::unique_lock<std::mutex> &lock);
+
+  // forbid copy
+  JobJournal(const JobJournal &rht) = delete;
+  JobJournal &operator=(const JobJournal &rht) = delete;
+
+  leveldb::DB *db_;
+  std::mutex mux_;
+  std::condition_variable cond_;
+  std::vector<PendingWrite> pending_;
+  // seq of the last write queued and of the last one synced
+  uint64_t queued_seq_;
+  uint64_t synced_seq_;
+  bool committing_;
+};
+
+#endif /*_NODE_MGR_JOB_JOURNAL_H_*/
@@ -0,0 +1,582 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#include "job_table.h"
+#include "butil/time.h"
+#include "job_journal.h"
+#include "request_dealer.h"
+#include "util_func/job_executor.h"
+#include "zettalib/op_log.h"
+#include "zettalib/tool_func.h"
+#include <algorithm>
+#include <fstream>
+#include <signal.h>
+#include <sstream>
+
+int64_t finished_job_retention;
+int64_t finished_job_ttl;
+extern std::string job_journal_path;
+
+// a job that keeps node_mgr from staying up is not run forever
+#define JOB_MAX_RESTARTS 3
+
+JobTable *JobTable::m_inst = NULL;
+
+static const char *JobStateName(JobState state) {
+  switch (state) {
+  case kJobQueued:
+    return "queued";
+  case kJobRunning:
+    return "running";
+  case kJobDone:
+    return "done";
+  case kJobFailed:
+    return "failed";
+  case kJobCancelled:
+    return "cancelled";
+  }
+  return "unknown";
+}
+
+static bool IsFinished(JobState state) {
+  return state == kJobDone || state == kJobFailed || state == kJobCancelled;
+}
+
+static JobState JobStateOf(const std::string &name) {
+  for (JobState state :
+       {kJobQueued, kJobRunning, kJobDone, kJobFailed, kJobCancelled}) {
+    if (name == JobStateName(state)) {
+      return state;
+    }
+  }
+  return kJobFailed;
+}
+
+// Start time of the process in clock ticks after boot, tells a process
+// apart from a later one reusing its pid. Empty if there is no such process
+static std::string ProcessStartTime(pid_t pid) {
+  std::ifstream in("/proc/" + std::to_string(pid) + "/stat");
+  std::string stat;
+  if (!std::getline(in, stat)) {
+    return "";
+  }
+  // the command in parentheses may hold spaces, fields count from its end
+  size_t end = stat.rfind(')');
+  if (end == std::string::npos) {
+    return "";
+  }
+  std::stringstream fields(stat.substr(end + 1));
+  std::string field;
+  // starttime is field 22, the state after the command is field 3
+  for (int i = 3; i <= 22 && fields >> field; i++) {
+  }
+  return field;
+}
+
+struct JobRun {
+  std::shared_ptr<JobEntry> job;
+  RequestDealer *dealer;
+};
+
+JobTable::JobTable() : seq_(0) {
+  id_prefix_ = std::to_string(butil::gettimeofday_ms() / 1000);
+}
+
+bool JobTable::IsQueryType(kunlun::ClusterRequestTypes type) {
+  return type == kunlun::kGetJobStatusType ||
+         type == kunlun::kGetJobResultType || type == kunlun::kCancelJobType ||
+         type == kunlun::kListJobsType || type == kunlun::kPingPongType;
+}
+
+bool JobTable::IsExpressType(kunlun::ClusterRequestTypes type) {
+  return type == kunlun::kGetPathsSpaceType ||
+         type == kunlun::kCheckPortIdleType;
+}
+
+bool JobTable::IsIdempotentType(kunlun::ClusterRequestTypes type) {
+  switch (type) {
+  case kunlun::kExecuteCommandType:
+  case kunlun::kInstallMySQLType:
+  case kunlun::kUninstallMySQLType:
+  case kunlun::kInstallPostgresType:
+  case kunlun::kUninstallPostgresType:
+  case kunlun::kInstallStorageType:
+  case kunlun::kInstallComputerType:
+  case kunlun::kDeleteStorageType:
+  case kunlun::kDeleteComputerType:
+  case kunlun::kBackupShardType:
+  case kunlun::kBackupComputeType:
+  case kunlun::kRestoreMySQLType:
+  case kunlun::kRestorePostGresType:
+  case kunlun::kControlInstanceType:
+  case kunlun::kUpdateInstanceType:
+  case kunlun::kInstallNodeExporterType:
+  case kunlun::kUninstallNodeExporterType:
+  case kunlun::kRebuildNodeType:
+  case kunlun::kKillMysqlType:
+    return true;
+  default:
+    // answers that reflect the current state of the node are never reused
+    return false;
+  }
+}
+
+bool JobTable::IsResumableType(kunlun::ClusterRequestTypes type) {
+  switch (type) {
+  case kunlun::kBackupShardType:
+  case kunlun::kBackupComputeType:
+  case kunlun::kRestoreMySQLType:
+  case kunlun::kRestorePostGresType:
+  case kunlun::kRebuildNodeType:
+    return true;
+  default:
+    return false;
+  }
+}
+
+std::string JobTable::Submit(RequestDealer *dealer,
+                             const FinishCallback &on_finish,
+                             bool *duplicate) {
+  const Json::Value &request = dealer->request_json();
+  std::string request_id = request["cluster_mgr_request_id"].asString();
+  std::string job_type = request["job_type"].asString();
+  std::string request_key;
+  if (!request_id.empty() && IsIdempotentType(dealer->request_type())) {
+    request_key = job_type + "/" + request_id;
+  }
+  if (duplicate) {
+    *duplicate = false;
+  }
+
+  std::shared_ptr<JobEntry> job;
+  bool repeated = false;
+  bool finished = false;
+  std::string result;
+  {
+    std::lock_guard<std::mutex> guard(mux_);
+    expire();
+    auto it = request_key.empty() ? by_request_.end()
+                                  : by_request_.find(request_key);
+    if (it != by_request_.end() && jobs_.count(it->second)) {
+      std::shared_ptr<JobEntry> &earlier = jobs_[it->second];
+      if (earlier->state != kJobFailed && earlier->state != kJobCancelled &&
+          !earlier->control.cancelled()) {
+        job = earlier;
+        repeated = true;
+        finished = IsFinished(job->state);
+        if (finished) {
+          result = job->result;
+        } else if (on_finish) {
+          job->waiters.push_back(on_finish);
+        }
+      }
+    }
+    if (!repeated) {
+      job.reset(new JobEntry);
+      job->id = kunlun::string_sprintf("%s-%lu", id_prefix_.c_str(), ++seq_);
+      job->request_id = request_id;
+      job->job_type = job_type;
+      job->request_key = request_key;
+      job->submit_ms = butil::gettimeofday_ms();
+      job->journaled = IsIdempotentType(dealer->request_type()) &&
+                       JobJournal::get_instance()->opened();
+      if (job->journaled) {
+        Json::FastWriter writer;
+        writer.omitEndingLineFeed();
+        job->request = writer.write(request);
+      }
+      if (on_finish) {
+        job->waiters.push_back(on_finish);
+      }
+      jobs_[job->id] = job;
+      if (!request_key.empty()) {
+        by_request_[request_key] = job->id;
+      }
+    }
+  }
+
+  if (repeated) {
+    KLOG_INFO("request {} of job_type {} repeats job {}, {}", request_id,
+              job_type, job->id,
+              finished ? "reuse its response" : "wait for it");
+    delete dealer;
+    if (duplicate) {
+      *duplicate = true;
+    }
+    if (finished && on_finish) {
+      on_finish(result);
+    }
+    return job->id;
+  }
+  KLOG_INFO("job {} accepted for request {}, job_type {}", job->id,
+            job->request_id, job->job_type);
+  journal(job->id);
+  startJob(job, dealer);
+  return job->id;
+}
+
+void JobTable::startJob(const std::shared_ptr<JobEntry> &job,
+                        RequestDealer *dealer) {
+  if (job->journaled) {
+    // the entry owns the control, the id keeps the callback from owning it
+    std::string job_id = job->id;
+    job->control.set_on_change([this, job_id] { journal(job_id); });
+  }
+  JobRun *run = new JobRun;
+  run->job = job;
+  run->dealer = dealer;
+  if (IsExpressType(dealer->request_type())) {
+    kunlun::JobExecutor::get_instance()->SubmitExpress(job->job_type,
+                                                       [run] { runJob(run); });
+    return;
+  }
+  kunlun::JobExecutor::get_instance()->Submit(job->job_type,
+                                              [run] { runJob(run); });
+}
+
+void *JobTable::runJob(void *arg) {
+  std::unique_ptr<JobRun> run(static_cast<JobRun *>(arg));
+  JobEntry *job = run->job.get();
+  JobTable *table = get_instance();
+
+  bool cancelled = false;
+  {
+    std::lock_guard<std::mutex> guard(table->mux_);
+    cancelled = job->state == kJobCancelled;
+    if (!cancelled) {
+      job->state = kJobRunning;
+      job->start_ms = butil::gettimeofday_ms();
+    }
+  }
+  table->journal(job->id);
+
+  bool success = false;
+  if (cancelled) {
+    run->dealer->MarkAborted("job cancelled before it started");
+  } else {
+    kunlun::JobControl::Scope scope(&job->control);
+    run->dealer->Run();
+    success = run->dealer->deal_success();
+  }
+  std::string response = run->dealer->FetchResponse();
+  delete run->dealer;
+
+  std::vector<FinishCallback> waiters =
+      table->finish(run->job, success, response);
+  // the response is on disk before anybody gets it
+  table->journal(job->id);
+  for (const auto &waiter : waiters) {
+    waiter(response);
+  }
+  return nullptr;
+}
+
+std::vector<JobTable::FinishCallback>
+JobTable::finish(const std::shared_ptr<JobEntry> &job, bool success,
+                 const std::string &response) {
+  std::lock_guard<std::mutex> guard(mux_);
+  if (job->control.cancelled()) {
+    job->state = kJobCancelled;
+  } else {
+    job->state = success ? kJobDone : kJobFailed;
+  }
+  job->end_ms = butil::gettimeofday_ms();
+  job->result = response;
+  KLOG_INFO("job {} {} after {} ms", job->id, JobStateName(job->state),
+            job->end_ms - job->submit_ms);
+
+  finished_.push_back(job->id);
+  expire();
+  std::vector<FinishCallback> waiters;
+  waiters.swap(job->waiters);
+  return waiters;
+}
+
+void JobTable::expire() {
+  int64_t now = butil::gettimeofday_ms();
+  while (!finished_.empty()) {
+    auto it = jobs_.find(finished_.front());
+    if (it != jobs_.end() &&
+        (int64_t)finished_.size() <= finished_job_retention &&
+        it->second->end_ms + finished_job_ttl * 1000 > now) {
+      break;
+    }
+    if (it != jobs_.end()) {
+      auto req = by_request_.find(it->second->request_key);
+      // the key may point at a newer run of the request by now
+      if (req != by_request_.end() && req->second == it->first) {
+        by_request_.erase(req);
+      }
+      if (it->second->journaled) {
+        JobJournal::get_instance()->Erase(it->first);
+      }
+      jobs_.erase(it);
+    }
+    finished_.pop_front();
+  }
+}
+
+void JobTable::toJson(const JobEntry &job, Json::Value &status) {
+  status["job_id"] = job.id;
+  status["cluster_mgr_request_id"] = job.request_id;
+  status["job_type"] = job.job_type;
+  status["state"] = JobStateName(job.state);
+  status["submit_ms"] = (Json::Int64)job.submit_ms;
+  status["start_ms"] = (Json::Int64)job.start_ms;
+  status["end_ms"] = (Json::Int64)job.end_ms;
+}
+
+bool JobTable::GetStatus(const std::string &job_id, Json::Value &info) {
+  std::lock_guard<std::mutex> guard(mux_);
+  auto it = jobs_.find(job_id);
+  if (it == jobs_.end()) {
+    info = "job " + job_id + " not found";
+    return false;
+  }
+  toJson(*it->second, info);
+  return true;
+}
+
+bool JobTable::GetResult(const std::string &job_id, Json::Value &info) {
+  std::lock_guard<std::mutex> guard(mux_);
+  auto it = jobs_.find(job_id);
+  if (it == jobs_.end()) {
+    info = "job " + job_id + " not found";
+    return false;
+  }
+  const JobEntry &job = *it->second;
+  if (!IsFinished(job.state)) {
+    info = "job " + job_id + " is " + JobStateName(job.state);
+    return false;
+  }
+  toJson(job, info);
+  Json::Reader reader;
+  Json::Value result;
+  if (reader.parse(job.result, result)) {
+    info["result"] = result;
+  } else {
+    info["result"] = job.result;
+  }
+  return true;
+}
+
+bool JobTable::Cancel(const std::string &job_id, Json::Value &info) {
+  std::shared_ptr<JobEntry> job;
+  bool queued = false;
+  {
+    std::lock_guard<std::mutex> guard(mux_);
+    auto it = jobs_.find(job_id);
+    if (it == jobs_.end()) {
+      info = "job " + job_id + " not found";
+      return false;
+    }
+    job = it->second;
+    if (IsFinished(job->state)) {
+      info = "job " + job_id + " is " + JobStateName(job->state) + " already";
+      return false;
+    }
+    // a queued job is not started at all
+    if (job->state == kJobQueued) {
+      job->state = kJobCancelled;
+      queued = true;
+    }
+  }
+  KLOG_INFO("cancel job {}", job_id);
+  // on disk before the answer, a restart must not resume it
+  if (queued) {
+    journal(job_id);
+  }
+  job->control.Cancel();
+  GetStatus(job_id, info);
+  return true;
+}
+
+void JobTable::ListJobs(const Json::Value &job_ids, bool with_finished,
+                        Json::Value &info) {
+  info = Json::Value(Json::arrayValue);
+  std::lock_guard<std::mutex> guard(mux_);
+  expire();
+  if (job_ids.isArray() && job_ids.size() > 0) {
+    for (Json::Value::ArrayIndex i = 0; i < job_ids.size(); i++) {
+      std::string job_id = job_ids[i].asString();
+      Json::Value status;
+      auto it = jobs_.find(job_id);
+      if (it == jobs_.end()) {
+        status["job_id"] = job_id;
+        status["state"] = "unknown";
+      } else {
+        toJson(*it->second, status);
+      }
+      info.append(status);
+    }
+    return;
+  }
+  for (const auto &it : jobs_) {
+    if (!with_finished && IsFinished(it.second->state)) {
+      continue;
+    }
+    Json::Value status;
+    toJson(*it.second, status);
+    info.append(status);
+  }
+}
+
+void JobTable::journal(const std::string &job_id) {
+  Json::Value record;
+  {
+    std::lock_guard<std::mutex> guard(mux_);
+    auto it = jobs_.find(job_id);
+    if (it == jobs_.end() || !it->second->journaled) {
+      return;
+    }
+    JobEntry &job = *it->second;
+    record["job_id"] = job.id;
+    record["request"] = job.request;
+    record["state"] = JobStateName(job.state);
+    record["submit_ms"] = (Json::Int64)job.submit_ms;
+    record["start_ms"] = (Json::Int64)job.start_ms;
+    record["end_ms"] = (Json::Int64)job.end_ms;
+    record["restarts"] = (Json::Int64)job.restarts;
+    record["result"] = job.result;
+    record["steps"] = Json::Value(Json::objectValue);
+    for (const auto &step : job.control.steps()) {
+      record["steps"][step.first] = step.second;
+    }
+    record["children"] = Json::Value(Json::arrayValue);
+    for (pid_t pgid : job.control.children()) {
+      Json::Value child;
+      child["pgid"] = (Json::Int64)pgid;
+      child["start_time"] = ProcessStartTime(pgid);
+      record["children"].append(child);
+    }
+  }
+  JobJournal::get_instance()->Put(job_id, record);
+}
+
+// The process groups an interrupted job left, node_mgr's restart orphaned
+// them and the job is run again or failed anyway
+static void KillLeftovers(const std::string &job_id,
+                          const Json::Value &children) {
+  for (Json::Value::ArrayIndex i = 0; i < children.size(); i++) {
+    pid_t pgid = (pid_t)children[i]["pgid"].asInt64();
+    std::string start_time = children[i]["start_time"].asString();
+    if (pgid <= 0 || start_time.empty() ||
+        ProcessStartTime(pgid) != start_time) {
+      continue;
+    }
+    KLOG_INFO("kill process group {} left by job {}", pgid, job_id);
+    kill(-pgid, SIGKILL);
+  }
+}
+
+void JobTable::Recover(const DealerMaker &make_dealer) {
+  JobJournal *journal = JobJournal::get_instance();
+  if (!journal->Open(job_journal_path)) {
+    KLOG_ERROR("{}, jobs are not journaled", journal->getErr());
+    return;
+  }
+  std::vector<Json::Value> records;
+  journal->Load(records);
+
+  std::vector<std::pair<std::shared_ptr<JobEntry>, RequestDealer *>> resumed;
+  std::vector<std::shared_ptr<JobEntry>> finished;
+  std::vector<std::string> interrupted;
+  int64_t now = butil::gettimeofday_ms();
+  for (const auto &record : records) {
+    std::string job_id = record["job_id"].asString();
+    Json::Reader reader;
+    Json::Value parsed;
+    RequestDealer *dealer = nullptr;
+    if (reader.parse(record["request"].asString(), parsed, false)) {
+      dealer = make_dealer(parsed);
+    }
+    if (dealer == nullptr) {
+      KLOG_ERROR("request of journaled job {} is not valid, drop it", job_id);
+      journal->Erase(job_id);
+      continue;
+    }
+    std::shared_ptr<JobEntry> job(new JobEntry);
+    const Json::Value &request = dealer->request_json();
+    job->id = job_id;
+    job->request_id = request["cluster_mgr_request_id"].asString();
+    job->job_type = request["job_type"].asString();
+    if (!job->request_id.empty()) {
+      job->request_key = job->job_type + "/" + job->request_id;
+    }
+    job->journaled = true;
+    job->request = record["request"].asString();
+    job->state = JobStateOf(record["state"].asString());
+    job->submit_ms = record["submit_ms"].asInt64();
+    job->start_ms = record["start_ms"].asInt64();
+    job->end_ms = record["end_ms"].asInt64();
+    job->restarts = record["restarts"].asInt64();
+    job->result = record["result"].asString();
+    std::map<std::string, std::string> steps;
+    for (const auto &step : record["steps"].getMemberNames()) {
+      steps[step] = record["steps"][step].asString();
+    }
+    job->control.RestoreSteps(steps);
+
+    if (!IsFinished(job->state)) {
+      KillLeftovers(job_id, record["children"]);
+      interrupted.push_back(job_id);
+      if (IsResumableType(dealer->request_type()) &&
+          job->restarts < JOB_MAX_RESTARTS) {
+        KLOG_INFO("resume job {} of job_type {}, {} steps finished before",
+                  job_id, job->job_type, steps.size());
+        job->state = kJobQueued;
+        job->restarts++;
+        resumed.push_back(std::make_pair(job, dealer));
+        dealer = nullptr;
+      } else {
+        KLOG_INFO("job {} of job_type {} was interrupted by a restart",
+                  job_id, job->job_type);
+        dealer->MarkAborted("job interrupted by a restart of node_mgr");
+        job->result = dealer->FetchResponse();
+        job->state = kJobFailed;
+        job->end_ms = now;
+      }
+    }
+    delete dealer;
+    if (IsFinished(job->state)) {
+      finished.push_back(job);
+    }
+
+    std::lock_guard<std::mutex> guard(mux_);
+    jobs_[job_id] = job;
+    if (job->request_key.empty()) {
+      continue;
+    }
+    // the key stays with the latest job submitted with the request
+    auto req = by_request_.find(job->request_key);
+    if (req == by_request_.end() ||
+        jobs_[req->second]->submit_ms <= job->submit_ms) {
+      by_request_[job->request_key] = job_id;
+    }
+  }
+
+  std::sort(finished.begin(), finished.end(),
+            [](const std::shared_ptr<JobEntry> &a,
+               const std::shared_ptr<JobEntry> &b) {
+              return a->end_ms < b->end_ms;
+            });
+  {
+    std::lock_guard<std::mutex> guard(mux_);
+    for (const auto &job : finished) {
+      finished_.push_back(job->id);
+    }
+    expire();
+  }
+  for (const auto &job_id : interrupted) {
+    this->journal(job_id);
+  }
+  for (const auto &it : resumed) {
+    startJob(it.first, it.second);
+  }
+  KLOG_INFO("recovered {} jobs from the journal, {} resumed", records.size(),
+            resumed.size());
+}
@@ -0,0 +1,146 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#ifndef _NODE_MGR_JOB_TABLE_H_
+#define _NODE_MGR_JOB_TABLE_H_
+
+#include "json/json.h"
+#include "util_func/job_control.h"
+#include "util_func/requestValueDefine.h"
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class RequestDealer;
+
+enum JobState { kJobQueued, kJobRunning, kJobDone, kJobFailed, kJobCancelled };
+
+typedef std::function<void(const std::string &response)> JobFinishCallback;
+
+struct JobEntry {
+  std::string id;
+  std::string request_id;
+  std::string job_type;
+  // key in the request index, empty if the job type is not idempotent
+  std::string request_key;
+  // kept in the JobJournal, with the request it was submitted with
+  bool journaled = false;
+  std::string request;
+  // times node_mgr restarted while it ran
+  int64_t restarts = 0;
+  JobState state = kJobQueued;
+  // unix time in ms, 0 till it happens
+  int64_t submit_ms = 0;
+  int64_t start_ms = 0;
+  int64_t end_ms = 0;
+  // response of the job once it finished
+  std::string result;
+  kunlun::JobControl control;
+  // callers waiting for the response, the submitter and its duplicates
+  std::vector<JobFinishCallback> waiters;
+};
+
+/*
+  Every job Emit accepts is dealt through the JobTable. A synchronous Emit
+  gets the response when the job finishes, an asynchronous one ("async":
+  true in the request) only the job id, and cluster_mgr polls the job with
+  the get_job_status, get_job_result and list_jobs job types or stops it
+  with cancel_job. Finished jobs are kept for their result, the oldest are
+  dropped once there are more than `finished_job_retention` or they ended
+  `finished_job_ttl` seconds ago.
+
+  The jobs of those types are journaled too. When node_mgr starts, Recover
+  loads the finished ones back with their responses. A restore, rebuild or
+  backup that was queued or running is run again, its left over child
+  processes killed first, and skips the steps it finished before. The
+  other interrupted jobs are marked failed.
+
+  cluster_mgr resubmits a job it timed out on with the same
+  cluster_mgr_request_id. For the job types that change the node such a
+  duplicate is not dealt again: it attaches to the job still queued or
+  running, or gets the response of the one that succeeded. A job that
+  failed or was cancelled is run anew.
+*/
+class JobTable {
+private:
+  static JobTable *m_inst;
+  JobTable();
+
+public:
+  static JobTable *get_instance() {
+    if (!m_inst)
+      m_inst = new JobTable();
+    return m_inst;
+  }
+
+  typedef JobFinishCallback FinishCallback;
+  // builds the dealer of a request, taking it over, nullptr if it is not
+  // valid
+  typedef std::function<RequestDealer *(Json::Value &request)> DealerMaker;
+
+  // Opens the JobJournal and takes over the jobs in it, before the
+  // server accepts requests
+  void Recover(const DealerMaker &make_dealer);
+
+  // Takes over dealer and deals it on the JobExecutor, on_finish, if any,
+  // gets the response. Returns the job id, of the earlier job with
+  // *duplicate set if the request repeats one
+  std::string Submit(RequestDealer *dealer, const FinishCallback &on_finish,
+                     bool *duplicate = nullptr);
+
+  // On failure these leave the reason in info
+  bool GetStatus(const std::string &job_id, Json::Value &info);
+  // the status plus the response of a finished job
+  bool GetResult(const std::string &job_id, Json::Value &info);
+  bool Cancel(const std::string &job_id, Json::Value &info);
+  // Status of the listed jobs, of all queued and running ones if
+  // job_ids is empty, finished ones too when with_finished
+  void ListJobs(const Json::Value &job_ids, bool with_finished,
+                Json::Value &info);
+
+  // The job types answered on the spot rather than dealt as jobs: the ones
+  // served from the table and ping_pong
+  static bool IsQueryType(kunlun::ClusterRequestTypes type);
+  // The short read-only job types run in the express lane of the
+  // JobExecutor, never queued behind the long jobs
+  static bool IsExpressType(kunlun::ClusterRequestTypes type);
+  // The job types a repeated cluster_mgr_request_id is not dealt again for
+  static bool IsIdempotentType(kunlun::ClusterRequestTypes type);
+  // The job types run again when node_mgr restarted while they ran
+  static bool IsResumableType(kunlun::ClusterRequestTypes type);
+
+private:
+  static void *runJob(void *arg);
+  void startJob(const std::shared_ptr<JobEntry> &job, RequestDealer *dealer);
+  // Writes the job's record to the JobJournal. Called without mux_ held
+  void journal(const std::string &job_id);
+  // Returns the waiters to hand the response to
+  std::vector<FinishCallback> finish(const std::shared_ptr<JobEntry> &job,
+                                     bool success,
+                                     const std::string &response);
+  void toJson(const JobEntry &job, Json::Value &status);
+  // Drops the finished jobs over the retention. Called with mux_ held
+  void expire();
+
+  std::mutex mux_;
+  // ids stay unique across restarts
+  std::string id_prefix_;
+  uint64_t seq_;
+  std::map<std::string, std::shared_ptr<JobEntry>> jobs_;
+  // ids of the finished jobs, oldest first
+  std::deque<std::string> finished_;
+  // "<job_type>/<cluster_mgr_request_id>" to the id of the latest job of
+  // an idempotent type submitted with it
+  std::map<std::string, std::string> by_request_;
+};
+
+#endif /*_NODE_MGR_JOB_TABLE_H_*/
@@ -2,14 +2,18 @@
 //#include "log.h"
 #include "zettalib/op_log.h"
 #include "string.h"
-#include "zettalib/biodirectpopen.h"
 #include "zettalib/tool_func.h"
 #include "instance_info.h"
 #include "job.h"
 #include <algorithm>
+#include <atomic>
 #include <vector>
 #include "rebuild_node/rebuild_node.h"
+#include "path_index.h"
+#include "traffic_governor.h"
+#include "job_table.h"
 #include "util_func/meta_info.h"
+#include "util_func/child_process.h"
 
 #ifndef NDEBUG
 #include "node_debug/node_debug.h"
@@ -18,12 +22,11 @@
 std::string node_mgr_util_path;
 std::string node_mgr_tmp_data_path;
 extern std::string local_ip;
+extern bool job_cgroup_enabled;
 
 bool RequestDealer::ParseRequest() {
-  Json::Reader reader;
-  bool ret = reader.parse(request_json_str_, json_root_);
-  if (!ret) {
-    setErr("%s", reader.getFormattedErrorMessages().c_str());
+  if (!json_root_.isObject()) {
+    setErr("request is not a json object");
     return false;
   }
   if (!protocalValid()) {
@@ -78,6 +81,17 @@ bool RequestDealer::Deal() {
     ret = KillMysqlByPort();
     break;
 
+  case kunlun::kSetTransferLimitType:
+    ret = setTransferLimit();
+    break;
+
+  case kunlun::kGetJobStatusType:
+  case kunlun::kGetJobResultType:
+  case kunlun::kCancelJobType:
+  case kunlun::kListJobsType:
+    ret = queryJobTable();
+    break;
+
 #ifndef NDEBUG
   case kunlun::kNodeDebugType:
     ret = kunlun::nodeDebug(json_root_["paras"]);
@@ -93,6 +107,71 @@ bool RequestDealer::Deal() {
   return ret;
 }
 
+bool RequestDealer::Run() {
+  const char *job_class = kunlun::JobCgroup::JobClassOf(request_type_);
+  if (job_class == nullptr || !job_cgroup_enabled) {
+    return Deal();
+  }
+
+  Json::Value overrides = json_root_["paras"]["cgroup"];
+  if (!overrides.isNull() && !overrides.isObject()) {
+    setErr("'cgroup' must be an object of cgroup files and their values");
+    deal_success_ = false;
+    return false;
+  }
+  static std::atomic<uint64_t> cgroup_seq(0);
+  std::string request_id = json_root_["cluster_mgr_request_id"].asString();
+  for (auto &c : request_id) {
+    if (!isalnum(c) && c != '-')
+      c = '_';
+  }
+  std::string name = kunlun::string_sprintf("%s_%s_%lu", job_class,
+                                            request_id.c_str(), cgroup_seq++);
+  cgroup_.reset(new kunlun::JobCgroup(name, job_class));
+  if (!cgroup_->Create(overrides)) {
+    // limits asked for by the request are not silently dropped
+    if (!overrides.isNull()) {
+      setErr("%s", cgroup_->getErr());
+      deal_success_ = false;
+      cgroup_.reset();
+      return false;
+    }
+    KLOG_ERROR("{}, the job runs without cgroup limits", cgroup_->getErr());
+    cgroup_.reset();
+    return Deal();
+  }
+
+  bool ret;
+  {
+    kunlun::JobCgroup::Scope scope(cgroup_.get());
+    ret = Deal();
+  }
+  cgroup_->GetUsage(resource_usage_);
+  Json::FastWriter writer;
+  writer.omitEndingLineFeed();
+  KLOG_INFO("job {} resource usage: {}", name, writer.write(resource_usage_));
+  cgroup_.reset();
+  return ret;
+}
+
+void RequestDealer::MarkAborted(const std::string &reason) {
+  deal_success_ = false;
+  deal_info_ = reason;
+}
+
+// true, 1 or "true" in the request
+static bool IsFlagSet(const Json::Value &flag) {
+  if (flag.isBool())
+    return flag.asBool();
+  if (flag.isIntegral())
+    return flag.asInt64() != 0;
+  if (flag.isString())
+    return flag.asString() == "true" || flag.asString() == "1";
+  return false;
+}
+
+bool RequestDealer::IsAsync() { return IsFlagSet(json_root_["async"]); }
+
 bool RequestDealer::protocalValid() {
   bool ret = false;
 
@@ -142,16 +221,27 @@ std::string RequestDealer::FetchResponse() {
   root["task_spec_info"] = json_root_["task_spec_info"].asString();
   root["status"] = getStatusStr();
 
-  Json::Value info_json;
-  Json::Reader reader;
-  bool ret = reader.parse(getInfo().c_str(), info_json);
-  if (ret) {
-    root["info"] = info_json;
+  if (!deal_info_json_.isNull()) {
+    root["info"] = deal_info_json_;
   } else {
-    root["info"] = kunlun::TrimResponseInfo(getInfo());
+    std::string info = getInfo();
+    // plain text, the common case, can not be a json value
+    size_t first = info.find_first_not_of(" \t\r\n");
+    Json::Value info_json;
+    Json::Reader reader;
+    if (first != std::string::npos &&
+        strchr("{[\"-0123456789tfn", info[first]) != nullptr &&
+        reader.parse(info, info_json)) {
+      root["info"] = info_json;
+    } else {
+      root["info"] = kunlun::TrimResponseInfo(info);
+    }
   }
 
   AppendExtraToResponse(root);
+  if (!resource_usage_.isNull()) {
+    root["resource_usage"] = resource_usage_;
+  }
   Json::FastWriter writer;
   writer.omitEndingLineFeed();
   return writer.write(root);
@@ -177,28 +267,24 @@ bool RequestDealer::executeCommand() {
     return false;
   }
   KLOG_INFO("Will execute : {}", execute_command_);
-  popen_p_ = new kunlun::BiodirectPopen(execute_command_.c_str());
-  ret = popen_p_->Launch("r");
-
-  if (!ret || popen_p_->get_chiled_status() != 0) {
-    FILE *stderr_fp = popen_p_->getReadStdErrFp();
-    if(stderr_fp == nullptr){
-      setErr("%s",popen_p_->getErr());
-      KLOG_ERROR("Biooppen launch failed: {}",popen_p_->getErr());
-      deal_info_ = popen_p_->getErr();
-      deal_success_ = false;
-      return false;
-    }
-    char buffer[8192];
-    if (fgets(buffer, 8192, stderr_fp) != nullptr) {
-      KLOG_ERROR("Biopopen excute failed and stderr: {}", buffer);
-      deal_info_ = buffer;
-      deal_info_ = kunlun::TrimResponseInfo(deal_info_);
-    }
-    setErr("child return code: %d, popen_err: %s, command stderr: %s",
-           popen_p_->get_chiled_status(), popen_p_->getErr(), buffer);
-    KLOG_ERROR("child return code: {}, popen_err: {}, command stderr: {}, command: {}",
-           popen_p_->get_chiled_status(), popen_p_->getErr(), buffer, execute_command_);
+  kunlun::ChildProcess child(execute_command_);
+  ret = child.Launch() && child.Wait();
+  if (!ret) {
+    setErr("%s", child.getErr());
+    KLOG_ERROR("Launch command failed: {}", child.getErr());
+    deal_info_ = child.getErr();
+    deal_success_ = false;
+    return false;
+  }
+  if (child.exit_code() != 0) {
+    std::string first_line = child.stderr_str().substr(
+        0, child.stderr_str().find('\n'));
+    KLOG_ERROR("Command execute failed and stderr: {}", first_line);
+    deal_info_ = kunlun::TrimResponseInfo(first_line);
+    setErr("child return code: %d, command stderr: %s", child.exit_code(),
+           first_line.c_str());
+    KLOG_ERROR("child return code: {}, command stderr: {}, command: {}",
+               child.exit_code(), first_line, execute_command_);
     deal_success_ = false;
     return false;
   }
@@ -223,38 +309,17 @@ bool RequestDealer::constructCommand() {
   execute_command_ = para_str;
 
   // find the util which has the same name with command_name
-  bool found_command_local = true;
-  std::vector<std::string> utils;
-  std::string util_abs_path =
-      kunlun::ConvertToAbsolutePath(node_mgr_util_path.c_str());
+  PathIndex *index = PathIndex::get_instance();
+  std::string util_abs_path = index->root_path(PathIndex::kUtilRoot);
   std::string util_abs_tmp_data_path =
-      kunlun::ConvertToAbsolutePath(node_mgr_tmp_data_path.c_str());
+      index->root_path(PathIndex::kTmpDataRoot);
   if (util_abs_path.empty()) {
-    KLOG_ERROR("kunlun::ConvertToAbsolutePath {} faild: {}", node_mgr_util_path,
-               strerror(errno));
-    setErr("kunlun::ConvertToAbsolutePath %s faild: %s", node_mgr_util_path.c_str(),
-               strerror(errno));
+    setErr("kunlun::ConvertToAbsolutePath %s faild", node_mgr_util_path.c_str());
     return false;
   }
-  if (util_abs_tmp_data_path.empty()) {
-    KLOG_ERROR("kunlun::ConvertToAbsolutePath {} faild: {}. set to current dir",
-               node_mgr_tmp_data_path, strerror(errno));
-    util_abs_tmp_data_path = kunlun::ConvertToAbsolutePath("./");
-  }
 
-  int ret = kunlun::GetFileListFromPath(util_abs_path.c_str(), utils);
-  if (ret != 0) {
-    setErr("%s", strerror(ret));
-    return false;
-    // TODO: how to handle the errinfo
-  }
-  if (utils.size() == 0) {
-    found_command_local = false;
-  }
-  auto iter = find(utils.begin(), utils.end(), command_name);
-  if (iter == utils.end()) {
-    found_command_local = false;
-  } else {
+  if (!command_name.empty() && command_name.find('/') == std::string::npos &&
+      index->Lookup(PathIndex::kUtilRoot, command_name).exists) {
     execute_command_ = util_abs_path + "/" + execute_command_;
   }
 
@@ -263,11 +328,7 @@ bool RequestDealer::constructCommand() {
 
   return true;
 }
-RequestDealer::~RequestDealer() {
-  if (popen_p_) {
-    delete popen_p_;
-  }
-}
+RequestDealer::~RequestDealer() {}
 
 bool RequestDealer::getPathsSpace() {
   Json::Value para_json = json_root_["paras"];
@@ -414,9 +475,7 @@ bool RequestDealer::KillMysqlByPort() {
   std::string cmd = kunlun::string_sprintf("./util/safe_killmysql %s %s", port.c_str(), datadir.c_str());
   
   KLOG_INFO("Will execute : {}", cmd);
-  kunlun::BiodirectPopen bi_open(cmd.c_str());
-  ret = bi_open.Launch("r");
-  if(!ret || bi_open.get_chiled_status() != 0) {
+  if(kunlun::RunCommand(cmd) != 0) {
     KLOG_ERROR("safe_killmysql failed");
     deal_success_ = false;
     return false;
@@ -424,3 +483,57 @@ bool RequestDealer::KillMysqlByPort() {
   deal_success_ = true;
   return true;
 }
+
+bool RequestDealer::queryJobTable() {
+  Json::Value para_json = json_root_["paras"];
+  std::string job_id = para_json["job_id"].asString();
+  JobTable *table = JobTable::get_instance();
+  Json::Value info;
+  switch (request_type_) {
+  case kunlun::kGetJobStatusType:
+    deal_success_ = table->GetStatus(job_id, info);
+    break;
+  case kunlun::kGetJobResultType:
+    deal_success_ = table->GetResult(job_id, info);
+    break;
+  case kunlun::kCancelJobType:
+    deal_success_ = table->Cancel(job_id, info);
+    break;
+  default:
+    table->ListJobs(para_json["job_ids"],
+                    IsFlagSet(para_json["with_finished"]), info);
+    deal_success_ = true;
+    break;
+  }
+
+  if (info.isString()) {
+    deal_info_ = info.asString();
+    return deal_success_;
+  }
+  deal_info_json_.swap(info);
+  return deal_success_;
+}
+
+bool RequestDealer::setTransferLimit() {
+  Json::Value para_json = json_root_["paras"];
+  if (!para_json.isMember("bandwidth_limit")) {
+    setErr("'bandwidth_limit' field missing");
+    deal_success_ = false;
+    return false;
+  }
+  int64_t limit = ::atoll(para_json["bandwidth_limit"].asString().c_str());
+  if (limit < 0) {
+    setErr("'bandwidth_limit' must not be negative");
+    deal_success_ = false;
+    return false;
+  }
+  TrafficGovernor::get_instance()->set_bandwidth_limit(limit);
+
+  Json::Value status;
+  TrafficGovernor::get_instance()->get_status(status);
+  Json::FastWriter writer;
+  writer.omitEndingLineFeed();
+  deal_info_ = writer.write(status);
+  deal_success_ = true;
+  return true;
+}
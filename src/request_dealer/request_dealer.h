@@ -8,21 +8,32 @@
 #ifndef _NODE_MANAGER_REQUEST_DEALER_H_
 #define _NODE_MANAGER_REQUEST_DEALER_H_
 
-#include "zettalib/biodirectpopen.h"
 #include "zettalib/errorcup.h"
 #include "util_func/meta_info.h"
+#include "util_func/job_cgroup.h"
 #include "json/json.h"
+#include <memory>
 #include <string>
 
 class RequestDealer : public kunlun::ErrorCup {
 public:
-  explicit RequestDealer(const char *request_json_cstr)
-      : request_json_str_(request_json_cstr), popen_p_(nullptr),
-        deal_success_(false) {}
+  // Takes over the parsed request, request is left null
+  explicit RequestDealer(Json::Value &request) : deal_success_(false) {
+    json_root_.swap(request);
+  }
   virtual ~RequestDealer();
 
+  // Checks the request carries what every job needs
   bool virtual ParseRequest();
   bool virtual Deal();
+  // Deal() with the processes of the job in the cgroup of its job class
+  bool Run();
+  // The job ends with reason instead of being dealt
+  void MarkAborted(const std::string &reason);
+  bool IsAsync();
+  bool deal_success() const { return deal_success_; }
+  kunlun::ClusterRequestTypes request_type() const { return request_type_; }
+  const Json::Value &request_json() const { return json_root_; }
   std::string virtual FetchResponse();
   void virtual AppendExtraToResponse(Json::Value &);
 
@@ -52,6 +63,8 @@ protected:
   bool rebuildNode();
 
   bool KillMysqlByPort();
+  bool setTransferLimit();
+  bool queryJobTable();
 
 private:
   // forbid copy
@@ -59,13 +72,16 @@ private:
   RequestDealer &operator=(const RequestDealer &rht) = delete;
 
 protected:
-  std::string request_json_str_;
   Json::Value json_root_;
   std::string execute_command_;
-  kunlun::BiodirectPopen *popen_p_;
   bool deal_success_;
   std::string deal_info_;
+  // info of the response as a document, takes precedence over deal_info_
+  Json::Value deal_info_json_;
   kunlun::ClusterRequestTypes request_type_;
+  std::unique_ptr<kunlun::JobCgroup> cgroup_;
+  // what the job's processes used, reported with the response
+  Json::Value resource_usage_;
 };
 
 #endif /*_NODE_MANAGER_REQUEST_DEALER_H_*/
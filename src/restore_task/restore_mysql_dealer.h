@@ -12,8 +12,8 @@ class MySQLRestoreDealer : public RequestDealer {
   typedef RequestDealer super;
 
 public:
-  explicit MySQLRestoreDealer(const char *request_json_str)
-      : super(request_json_str) {}
+  explicit MySQLRestoreDealer(Json::Value &request)
+      : super(request) {}
 
   virtual ~MySQLRestoreDealer() {}
   bool virtual Deal() override;
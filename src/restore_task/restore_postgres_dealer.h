@@ -12,8 +12,8 @@ class PostGresRestoreDealer : public RequestDealer {
   typedef RequestDealer super;
 
 public:
-  explicit PostGresRestoreDealer(const char *request_json_str)
-      : super(request_json_str) {}
+  explicit PostGresRestoreDealer(Json::Value &request)
+      : super(request) {}
 
   virtual ~PostGresRestoreDealer() {}
   bool virtual Deal() override;
@@ -0,0 +1,73 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#include "body_sender.h"
+
+extern int64_t transfer_window_size;
+
+namespace kunlun {
+
+BodySender::BodySender(butil::intrusive_ptr<brpc::ProgressiveAttachment> pa,
+                       int64_t weight, int64_t bytes_per_second,
+                       FileCompressType compress, bool checksum,
+                       const std::string &name)
+    : name_(name), lease_(weight, bytes_per_second, name),
+      writer_(pa, transfer_window_size, name), compress_(compress),
+      checksum_enabled_(checksum) {}
+
+bool BodySender::Start() {
+  if (compress_ == kFileCompressNone) {
+    return true;
+  }
+  // with compression traffic_limit applies to the compressed bytes
+  compressor_.reset(new ChunkCompressor(&writer_, &lease_));
+  if (!compressor_->Start()) {
+    setErr("Start compressing %s failed: %s", name_.c_str(),
+           compressor_->getErr());
+    return false;
+  }
+  return true;
+}
+
+bool BodySender::Send(butil::IOBuf *payload) {
+  if (checksum_enabled_) {
+    checksum_.Update(*payload);
+  }
+  if (compressor_) {
+    if (!compressor_->Push(payload)) {
+      setErr("%s", compressor_->getErr());
+      return false;
+    }
+    return true;
+  }
+  lease_.Acquire(payload->size());
+  bool ret = writer_.Write(*payload);
+  payload->clear();
+  if (!ret) {
+    setErr("Peer is gone");
+    return false;
+  }
+  return true;
+}
+
+bool BodySender::Finish() {
+  if (compressor_ && !compressor_->Finish()) {
+    setErr("%s", compressor_->getErr());
+    return false;
+  }
+  // a body cut short goes without trailer, the receiver reports it
+  if (checksum_enabled_) {
+    std::string trailer = checksum_.Trailer();
+    if (!writer_.Write(trailer.data(), trailer.size())) {
+      setErr("Peer is gone");
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace kunlun
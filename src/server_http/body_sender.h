@@ -0,0 +1,70 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#ifndef _NODE_MGR_BODY_SENDER_H_
+#define _NODE_MGR_BODY_SENDER_H_
+
+#include "chunk_compressor.h"
+#include "flow_control.h"
+#include "stream_checksum.h"
+#include "traffic_governor.h"
+#include "zettalib/errorcup.h"
+#include <memory>
+#include <string>
+
+namespace kunlun {
+
+/*
+  The way of a FileService body to the socket: the payload is checksummed,
+  optionally compressed, paced by the traffic lease and written through
+  the flow controlled writer. Finish() ends the compressed stream and
+  appends the checksum trailer.
+*/
+class BodySender : public ErrorCup {
+public:
+  BodySender(butil::intrusive_ptr<brpc::ProgressiveAttachment> pa,
+             int64_t weight, int64_t bytes_per_second,
+             FileCompressType compress, bool checksum,
+             const std::string &name);
+  virtual ~BodySender() {}
+
+  bool Start();
+  // Current share of the bandwidth in bytes per second, 0 means unlimited
+  int64_t rate() { return lease_.rate(); }
+  // Whether the payload is read in user space, checksummed or compressed
+  bool reads_payload() const {
+    return checksum_enabled_ || compress_ != kFileCompressNone;
+  }
+  const std::shared_ptr<TransferWindow> &window() const {
+    return writer_.window();
+  }
+  // Wait till the payload produced so far drained below the window,
+  // `slack` as in FlowControlledWriter::WaitForRoom()
+  void WaitForRoom(int64_t slack = 0) { writer_.WaitForRoom(slack); }
+  // Send a piece of payload, taking the content of `payload`
+  bool Send(butil::IOBuf *payload);
+  // The payload is complete, end the body
+  bool Finish();
+
+private:
+  // forbid copy
+  BodySender(const BodySender &rht) = delete;
+  BodySender &operator=(const BodySender &rht) = delete;
+
+  std::string name_;
+  TrafficLease lease_;
+  FlowControlledWriter writer_;
+  FileCompressType compress_;
+  bool checksum_enabled_;
+  StreamChecksum checksum_;
+  // after lease_ and writer_, it is stopped before them
+  std::unique_ptr<ChunkCompressor> compressor_;
+};
+
+} // namespace kunlun
+
+#endif /*_NODE_MGR_BODY_SENDER_H_*/
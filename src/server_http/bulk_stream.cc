@@ -0,0 +1,123 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#include "bulk_stream.h"
+#include "butil/errno.h"
+#include "butil/time.h"
+#include "file_chunk.h"
+#include "path_index.h"
+#include "stream_checksum.h"
+#include "traffic_governor.h"
+#include "zettalib/op_log.h"
+#include <memory>
+
+extern int64_t bulk_read_threshold;
+
+namespace kunlun {
+
+void *BulkStreamSender::Start(void *task) {
+  std::unique_ptr<BulkStreamTask> owned(static_cast<BulkStreamTask *>(task));
+  BulkStreamSender sender(*owned);
+  sender.Run();
+  return nullptr;
+}
+
+bool BulkStreamSender::Run() {
+  bool ok = send();
+  if (!ok) {
+    KLOG_ERROR("Stream {} of {} failed: {}", task_.stream, task_.path, getErr());
+    butil::IOBuf message;
+    message.push_back(BULK_MSG_ERROR);
+    message.append(getErr());
+    // the peer may be gone already, nothing more to do about it
+    brpc::StreamWrite(task_.stream, message);
+  }
+  brpc::StreamClose(task_.stream);
+  return ok;
+}
+
+// StreamWrite() refuses a message while the window is full, wait for the
+// receiver to consume some
+bool BulkStreamSender::write(butil::IOBuf *message) {
+  for (;;) {
+    int ret = brpc::StreamWrite(task_.stream, *message);
+    if (ret == 0) {
+      message->clear();
+      return true;
+    }
+    if (ret != EAGAIN) {
+      setErr("StreamWrite() failed: %s", berror(ret));
+      return false;
+    }
+    timespec due = butil::seconds_from_now(BULK_STREAM_STALL_TIMEOUT);
+    ret = brpc::StreamWait(task_.stream, &due);
+    if (ret != 0) {
+      setErr("Receiver did not take data for %d seconds: %s",
+             BULK_STREAM_STALL_TIMEOUT, berror(ret));
+      return false;
+    }
+  }
+}
+
+bool BulkStreamSender::send() {
+  // every bulk block is checksummed
+  FileSendMode mode =
+      ResolveFileSendMode((FileSendMode)task_.send_mode, task_.file_size,
+                          bulk_read_threshold, true);
+  FileChunkReader reader(mode);
+  std::shared_ptr<SharedFile> file;
+  if (mode != kFileSendDirect) {
+    file = PathIndex::get_instance()->OpenShared(task_.path);
+  }
+  if (!(file ? reader.Open(file) : reader.Open(task_.path))) {
+    setErr("%s", reader.getErr());
+    return false;
+  }
+
+  TrafficLease lease(task_.weight, task_.bytes_per_second, task_.path);
+  StreamChecksum checksum;
+  off_t offset = task_.offset;
+  int64_t remaining = task_.length;
+  while (remaining != 0) {
+    size_t want = reader.chunk_size();
+    if (remaining > 0 && (int64_t)want > remaining) {
+      want = remaining;
+    }
+    butil::IOBuf message;
+    message.push_back(BULK_MSG_DATA);
+    butil::IOBuf chunk;
+    ssize_t ret = reader.ReadChunk(offset, want, &chunk);
+    if (ret < 0) {
+      setErr("%s", reader.getErr());
+      return false;
+    } else if (ret == 0) {
+      break;
+    }
+    checksum.Update(chunk);
+    lease.Acquire(ret);
+    message.append(chunk);
+    if (!write(&message)) {
+      return false;
+    }
+    offset += ret;
+    if (remaining > 0) {
+      remaining -= ret;
+    }
+  }
+  if (remaining > 0) {
+    setErr("%s shrank while being sent, stopped at offset %ld",
+           task_.path.c_str(), (int64_t)offset);
+    return false;
+  }
+
+  butil::IOBuf end;
+  end.push_back(BULK_MSG_END);
+  end.append(checksum.Trailer());
+  return write(&end);
+}
+
+} // namespace kunlun
@@ -0,0 +1,70 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#ifndef _NODE_MGR_BULK_STREAM_H_
+#define _NODE_MGR_BULK_STREAM_H_
+
+#include "brpc/stream.h"
+#include "butil/iobuf.h"
+#include "zettalib/errorcup.h"
+#include <cstdint>
+#include <string>
+
+// Response header of FileService telling the client the file can also be
+// fetched over streams, its value is the version
+#define BULK_STREAM_HEADER "X-Bulk-Stream"
+#define BULK_STREAM_V1 "v1"
+// First byte of every stream message: file data, the end carrying the
+// checksum trailer of the data, or a failure carrying its reason
+#define BULK_MSG_DATA 'D'
+#define BULK_MSG_END 'E'
+#define BULK_MSG_ERROR 'X'
+// Seconds the sender waits for the receiver to free its window
+#define BULK_STREAM_STALL_TIMEOUT 300
+
+namespace kunlun {
+
+struct BulkStreamTask {
+  brpc::StreamId stream;
+  std::string path;
+  int64_t offset;
+  // -1 means till EOF
+  int64_t length;
+  int64_t weight;
+  int64_t bytes_per_second;
+  int send_mode;
+  int64_t file_size;
+};
+
+/*
+  Sends a byte range of a file over a brpc::Stream accepted by FileService.
+  The stream's max_buf_size is the window: at most that many bytes are
+  unconsumed by the receiver at any time, so neither a slow peer nor a long
+  RTT makes the sender buffer more. A transfer split over several streams
+  runs one sender per stream.
+*/
+class BulkStreamSender : public ErrorCup {
+public:
+  explicit BulkStreamSender(const BulkStreamTask &task) : task_(task) {}
+  virtual ~BulkStreamSender() {}
+
+  // Send the range then close the stream, a failure is reported on the
+  // stream before it is closed
+  bool Run();
+  // bthread entry, takes a new'ed BulkStreamTask
+  static void *Start(void *task);
+
+private:
+  bool write(butil::IOBuf *message);
+  bool send();
+
+  BulkStreamTask task_;
+};
+
+} // namespace kunlun
+
+#endif /*_NODE_MGR_BULK_STREAM_H_*/
@@ -0,0 +1,197 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#include "chunk_compressor.h"
+#include "zettalib/op_log.h"
+#include <mutex>
+#include <string.h>
+
+// chunks read ahead of the compressor
+#define COMPRESS_QUEUE_DEPTH 2
+// size of the compressed blocks handed to the socket
+#define COMPRESS_BLOCK_SIZE (256 * 1024)
+// fast enough to keep up with a 10GbE link on one core
+#define COMPRESS_LEVEL Z_BEST_SPEED
+// zlib writes a gzip header and trailer for windowBits above 15
+#define GZIP_WINDOW_BITS (MAX_WBITS + 16)
+
+namespace kunlun {
+
+FileCompressType GetFileCompressTypeByStr(const char *type_str) {
+  if (type_str == nullptr || *type_str == '\0' ||
+      strcasecmp(type_str, "none") == 0) {
+    return kFileCompressNone;
+  }
+  if (strcasecmp(type_str, "gzip") == 0) {
+    return kFileCompressGzip;
+  }
+  return kFileCompressTypeMax;
+}
+
+ChunkCompressor::ChunkCompressor(FlowControlledWriter *writer,
+                                 TrafficLease *lease)
+    : writer_(writer), lease_(lease), zs_inited_(false), out_block_(nullptr),
+      out_used_(0), closed_(false), failed_(false), tid_(0), started_(false) {
+  memset(&zs_, 0, sizeof(zs_));
+}
+
+ChunkCompressor::~ChunkCompressor() {
+  if (started_) {
+    Finish();
+  }
+  if (out_block_ != nullptr) {
+    TrackedBlock::Free(out_block_);
+  }
+  if (zs_inited_) {
+    deflateEnd(&zs_);
+  }
+}
+
+bool ChunkCompressor::Start() {
+  if (deflateInit2(&zs_, COMPRESS_LEVEL, Z_DEFLATED, GZIP_WINDOW_BITS, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    setErr("DeflateInit2() failed: %s", zs_.msg ? zs_.msg : "");
+    return false;
+  }
+  zs_inited_ = true;
+  if (bthread_start_background(&tid_, nullptr, Run, this) != 0) {
+    setErr("Start compress bthread failed");
+    return false;
+  }
+  started_ = true;
+  return true;
+}
+
+bool ChunkCompressor::Push(butil::IOBuf *chunk) {
+  std::unique_lock<bthread::Mutex> lock(mutex_);
+  while (queue_.size() >= COMPRESS_QUEUE_DEPTH && !failed_) {
+    cond_.wait(lock);
+  }
+  if (failed_) {
+    return false;
+  }
+  queue_.emplace_back();
+  queue_.back().swap(*chunk);
+  cond_.notify_all();
+  return true;
+}
+
+bool ChunkCompressor::Finish() {
+  if (!started_) {
+    return false;
+  }
+  {
+    std::lock_guard<bthread::Mutex> guard(mutex_);
+    closed_ = true;
+    cond_.notify_all();
+  }
+  bthread_join(tid_, nullptr);
+  started_ = false;
+  return !failed_;
+}
+
+void *ChunkCompressor::Run(void *arg) {
+  static_cast<ChunkCompressor *>(arg)->run();
+  return nullptr;
+}
+
+void ChunkCompressor::run() {
+  bool ok = true;
+  for (;;) {
+    butil::IOBuf chunk;
+    {
+      std::unique_lock<bthread::Mutex> lock(mutex_);
+      while (queue_.empty() && !closed_) {
+        cond_.wait(lock);
+      }
+      if (queue_.empty()) {
+        break;
+      }
+      chunk.swap(queue_.front());
+      queue_.pop_front();
+      cond_.notify_all();
+    }
+    if (!deflateChunk(chunk)) {
+      ok = false;
+      break;
+    }
+  }
+  if (ok) {
+    ok = deflateData(nullptr, 0, Z_FINISH) && emitBlock();
+  }
+  if (!ok) {
+    std::lock_guard<bthread::Mutex> guard(mutex_);
+    KLOG_ERROR("Compress stream failed: {}", getErr());
+    failed_ = true;
+    queue_.clear();
+    cond_.notify_all();
+  }
+}
+
+bool ChunkCompressor::deflateChunk(const butil::IOBuf &chunk) {
+  // deflate straight out of the IOBuf blocks, mmap'd ones included
+  for (size_t i = 0; i < chunk.backing_block_num(); i++) {
+    butil::StringPiece block = chunk.backing_block(i);
+    if (!deflateData(block.data(), block.size(), Z_NO_FLUSH)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ChunkCompressor::deflateData(const char *data, size_t length,
+                                  int flush) {
+  zs_.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+  zs_.avail_in = length;
+  for (;;) {
+    if (out_block_ == nullptr) {
+      out_block_ = TrackedBlock::Allocate(COMPRESS_BLOCK_SIZE, writer_->window());
+      if (out_block_ == nullptr) {
+        setErr("Allocate compress block failed");
+        return false;
+      }
+      out_used_ = 0;
+    }
+    zs_.next_out = reinterpret_cast<Bytef *>(out_block_ + out_used_);
+    zs_.avail_out = COMPRESS_BLOCK_SIZE - out_used_;
+    int ret = deflate(&zs_, flush);
+    if (ret == Z_STREAM_ERROR) {
+      setErr("Deflate() failed: %s", zs_.msg ? zs_.msg : "");
+      return false;
+    }
+    out_used_ = COMPRESS_BLOCK_SIZE - zs_.avail_out;
+    if (out_used_ == COMPRESS_BLOCK_SIZE && !emitBlock()) {
+      return false;
+    }
+    if (flush == Z_FINISH ? ret == Z_STREAM_END
+                          : (zs_.avail_in == 0 && zs_.avail_out != 0)) {
+      return true;
+    }
+  }
+}
+
+bool ChunkCompressor::emitBlock() {
+  if (out_block_ == nullptr || out_used_ == 0) {
+    return true;
+  }
+  lease_->Acquire(out_used_);
+  butil::IOBuf buf;
+  int ret = TrackedBlock::Append(out_block_, out_used_, &buf);
+  out_block_ = nullptr;
+  out_used_ = 0;
+  if (ret != 0) {
+    setErr("Append compress block to IOBuf failed");
+    return false;
+  }
+  if (!writer_->Write(buf)) {
+    setErr("Peer is gone");
+    return false;
+  }
+  return true;
+}
+
+} // namespace kunlun
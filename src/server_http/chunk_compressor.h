@@ -0,0 +1,83 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#ifndef _NODE_MGR_CHUNK_COMPRESSOR_H_
+#define _NODE_MGR_CHUNK_COMPRESSOR_H_
+
+#include "bthread/bthread.h"
+#include "bthread/condition_variable.h"
+#include "bthread/mutex.h"
+#include "butil/iobuf.h"
+#include "flow_control.h"
+#include "traffic_governor.h"
+#include "zettalib/errorcup.h"
+#include <deque>
+#include <zlib.h>
+
+namespace kunlun {
+
+enum FileCompressType {
+  // the file is sent as it is on disk
+  kFileCompressNone = 0,
+  // one gzip member for the whole response, `Content-Encoding: gzip`
+  kFileCompressGzip,
+
+  kFileCompressTypeMax
+};
+
+FileCompressType GetFileCompressTypeByStr(const char *);
+
+/*
+  Deflates the chunks pushed by the sending bthread on a bthread of its
+  own, so reading the next chunk from disk overlaps with compressing the
+  previous one. The compressed stream goes out through `writer` and the
+  bandwidth it takes is charged to `lease`.
+*/
+class ChunkCompressor : public ErrorCup {
+public:
+  ChunkCompressor(FlowControlledWriter *writer, TrafficLease *lease);
+  virtual ~ChunkCompressor();
+
+  bool Start();
+  // Queue `chunk`, taking its content. Blocks while the queue is full.
+  // Return false once compressing or sending failed
+  bool Push(butil::IOBuf *chunk);
+  // Compress what is queued, end the stream and wait for it to be sent
+  bool Finish();
+
+private:
+  static void *Run(void *arg);
+  void run();
+  bool deflateChunk(const butil::IOBuf &chunk);
+  bool deflateData(const char *data, size_t length, int flush);
+  bool emitBlock();
+
+  // forbid copy
+  ChunkCompressor(const ChunkCompressor &rht) = delete;
+  ChunkCompressor &operator=(const ChunkCompressor &rht) = delete;
+
+private:
+  FlowControlledWriter *writer_;
+  TrafficLease *lease_;
+  z_stream zs_;
+  bool zs_inited_;
+  // tracked block being filled by deflate()
+  char *out_block_;
+  size_t out_used_;
+
+  bthread::Mutex mutex_;
+  bthread::ConditionVariable cond_;
+  std::deque<butil::IOBuf> queue_;
+  bool closed_;
+  bool failed_;
+  bthread_t tid_;
+  bool started_;
+};
+
+} // namespace kunlun
+
+#endif /*_NODE_MGR_CHUNK_COMPRESSOR_H_*/
@@ -0,0 +1,193 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#include "control_service.h"
+#include "brpc/server.h"
+#include "instance_info.h"
+#include "request_dealer/job_table.h"
+#include "request_dealer/request_dealer.h"
+#include "util_func/job_executor.h"
+#include "zettalib/op_log.h"
+#include <atomic>
+
+using namespace kunlunrpc;
+
+static void SetResult(ControlResult *result, bool success,
+                      const std::string &error_info) {
+  result->set_status(success ? "success" : "failed");
+  if (!success) {
+    result->set_error_info(error_info);
+  }
+}
+
+static void FillPaths(const std::vector<Tpye_Path_Used_Free> &paths,
+                      google::protobuf::RepeatedPtrField<PathSpace> *out) {
+  for (const auto &path_used_free : paths) {
+    PathSpace *space = out->Add();
+    space->set_path(std::get<0>(path_used_free));
+    space->set_used(std::get<1>(path_used_free));
+    space->set_free(std::get<2>(path_used_free));
+  }
+}
+
+void ControlServiceImpl::Ping(google::protobuf::RpcController *cntl_base,
+                              const PingRequest *request,
+                              PingResponse *response,
+                              google::protobuf::Closure *done) {
+  brpc::ClosureGuard done_guard(done);
+  SetResult(response->mutable_result(), true, "");
+}
+
+void ControlServiceImpl::PathsSpace(google::protobuf::RpcController *cntl_base,
+                                    const PathsSpaceRequest *request,
+                                    PathsSpaceResponse *response,
+                                    google::protobuf::Closure *done) {
+  // du of the instance dirs may take a while, keep it off the brpc worker
+  kunlun::JobExecutor::get_instance()->SubmitExpress(
+      "get_paths_space", [request, response, done] {
+        brpc::ClosureGuard done_guard(done);
+        std::vector<std::string> paths;
+        paths.emplace_back(request->path0());
+        paths.emplace_back(request->path1());
+        paths.emplace_back(request->path2());
+        paths.emplace_back(request->path3());
+        std::vector<std::vector<Tpye_Path_Used_Free>> space;
+        std::string failed;
+        bool ret = Instance_info::get_instance()->get_path_space(paths, space,
+                                                                 failed);
+        SetResult(response->mutable_result(), ret, failed);
+        if (!ret) {
+          return;
+        }
+        FillPaths(space[0], response->mutable_path0());
+        FillPaths(space[1], response->mutable_path1());
+        FillPaths(space[2], response->mutable_path2());
+        FillPaths(space[3], response->mutable_path3());
+      });
+}
+
+void ControlServiceImpl::CheckPortIdle(
+    google::protobuf::RpcController *cntl_base,
+    const CheckPortIdleRequest *request, CheckPortIdleResponse *response,
+    google::protobuf::Closure *done) {
+  // one netstat per port probed
+  kunlun::JobExecutor::get_instance()->SubmitExpress(
+      "check_port_idle", [request, response, done] {
+        brpc::ClosureGuard done_guard(done);
+        int port = request->port();
+        bool ret =
+            Instance_info::get_instance()->check_port_idle(port, request->step());
+        SetResult(response->mutable_result(), ret, "check port idle failed");
+        if (ret) {
+          response->set_port(port);
+        }
+      });
+}
+
+namespace {
+// The job may end, a repeated one even inside Submit, before Submit
+// returned its id. Whichever of the two comes last answers
+struct ControlInstanceCall {
+  ControlInstanceResponse *response;
+  google::protobuf::Closure *done;
+  std::string job_id;
+  std::string job_response;
+  std::atomic<int> pending;
+};
+} // namespace
+
+static void FinishControlInstance(ControlInstanceCall *call) {
+  if (--call->pending > 0) {
+    return;
+  }
+  brpc::ClosureGuard done_guard(call->done);
+  ControlInstanceResponse *response = call->response;
+  response->set_job_id(call->job_id);
+
+  Json::Reader reader;
+  Json::Value root;
+  if (!reader.parse(call->job_response, root)) {
+    SetResult(response->mutable_result(), false, call->job_response);
+    delete call;
+    return;
+  }
+  std::string info;
+  if (root["info"].isString()) {
+    info = root["info"].asString();
+  } else {
+    Json::FastWriter writer;
+    writer.omitEndingLineFeed();
+    info = writer.write(root["info"]);
+  }
+  response->set_info(info);
+  SetResult(response->mutable_result(),
+            root["status"].asString() == "success", info);
+  delete call;
+}
+
+void ControlServiceImpl::ControlInstance(
+    google::protobuf::RpcController *cntl_base,
+    const ControlInstanceRequest *request, ControlInstanceResponse *response,
+    google::protobuf::Closure *done) {
+  brpc::ClosureGuard done_guard(done);
+
+  // the same request the json path builds its dealer from
+  Json::Value root;
+  root["cluster_mgr_request_id"] = request->header().cluster_mgr_request_id();
+  root["task_spec_info"] = request->header().task_spec_info();
+  root["job_type"] = "control_instance";
+  Json::Value &paras = root["paras"];
+  paras["type"] = request->type();
+  paras["control"] = request->control();
+  paras["ip"] = request->ip();
+  paras["port"] = request->port();
+  KLOG_INFO("get control_instance request from cluster_mgr: {} {} {}:{}",
+            request->control(), request->type(), request->ip(),
+            request->port());
+
+  RequestDealer *dealer = new RequestDealer(root);
+  if (!dealer->ParseRequest()) {
+    KLOG_ERROR("Parse control_instance request failed: {}",
+               dealer->getErr());
+    SetResult(response->mutable_result(), false, dealer->getErr());
+    delete dealer;
+    return;
+  }
+
+  ControlInstanceCall *call = new ControlInstanceCall;
+  call->response = response;
+  call->done = done_guard.release();
+  call->pending = 2;
+  call->job_id = JobTable::get_instance()->Submit(
+      dealer, [call](const std::string &job_response) {
+        call->job_response = job_response;
+        FinishControlInstance(call);
+      });
+  FinishControlInstance(call);
+}
+
+void ControlServiceImpl::JobStatus(google::protobuf::RpcController *cntl_base,
+                                   const JobStatusRequest *request,
+                                   JobStatusResponse *response,
+                                   google::protobuf::Closure *done) {
+  brpc::ClosureGuard done_guard(done);
+  Json::Value status;
+  bool ret = JobTable::get_instance()->GetStatus(request->job_id(), status);
+  if (!ret) {
+    SetResult(response->mutable_result(), false, status.asString());
+    return;
+  }
+  SetResult(response->mutable_result(), true, "");
+  response->set_job_id(status["job_id"].asString());
+  response->set_cluster_mgr_request_id(
+      status["cluster_mgr_request_id"].asString());
+  response->set_job_type(status["job_type"].asString());
+  response->set_state(status["state"].asString());
+  response->set_submit_ms(status["submit_ms"].asInt64());
+  response->set_start_ms(status["start_ms"].asInt64());
+  response->set_end_ms(status["end_ms"].asInt64());
+}
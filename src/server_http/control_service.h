@@ -0,0 +1,51 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#ifndef _NODE_MGR_CONTROL_SERVICE_H_
+#define _NODE_MGR_CONTROL_SERVICE_H_
+
+#include "proto/control.pb.h"
+#include "zettalib/errorcup.h"
+
+/*
+  Typed counterparts of the requests cluster_mgr sends most often, served
+  over baidu_std on the port of the http server. The fields are encoded
+  as protobuf instead of the json of HttpService.Emit, which stays for the
+  other requests and the clients still speaking it.
+
+  Ping and JobStatus are answered on the brpc worker. PathsSpace and
+  CheckPortIdle run commands and run in the express lane of the
+  JobExecutor under their job_type. ControlInstance is submitted to the JobTable like the json
+  control_instance, so it is deduplicated and journaled the same.
+*/
+class ControlServiceImpl : public kunlunrpc::ControlService,
+                           public kunlun::ErrorCup {
+public:
+  ControlServiceImpl() {}
+  virtual ~ControlServiceImpl() {}
+
+  void Ping(google::protobuf::RpcController *,
+            const kunlunrpc::PingRequest *, kunlunrpc::PingResponse *,
+            google::protobuf::Closure *);
+  void PathsSpace(google::protobuf::RpcController *,
+                  const kunlunrpc::PathsSpaceRequest *,
+                  kunlunrpc::PathsSpaceResponse *,
+                  google::protobuf::Closure *);
+  void CheckPortIdle(google::protobuf::RpcController *,
+                     const kunlunrpc::CheckPortIdleRequest *,
+                     kunlunrpc::CheckPortIdleResponse *,
+                     google::protobuf::Closure *);
+  void ControlInstance(google::protobuf::RpcController *,
+                       const kunlunrpc::ControlInstanceRequest *,
+                       kunlunrpc::ControlInstanceResponse *,
+                       google::protobuf::Closure *);
+  void JobStatus(google::protobuf::RpcController *,
+                 const kunlunrpc::JobStatusRequest *,
+                 kunlunrpc::JobStatusResponse *, google::protobuf::Closure *);
+};
+
+#endif /*_NODE_MGR_CONTROL_SERVICE_H_*/
@@ -0,0 +1,479 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#include "delta_format.h"
+#include "butil/crc32c.h"
+#include "butil/md5.h"
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace kunlun {
+
+#define DELTA_SIGNATURES_HEADER_SIZE 12
+#define DELTA_SIGNATURE_SIZE (4 + DELTA_STRONG_SIZE)
+// bytes read from the file at once
+#define DELTA_READ_SIZE (4 * 1024 * 1024)
+
+static void PutUint(uint64_t value, int bytes, std::string *out) {
+  for (int i = bytes - 1; i >= 0; i--) {
+    out->push_back(static_cast<char>((value >> (i * 8)) & 0xff));
+  }
+}
+
+static uint64_t GetUint(const char *in, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++) {
+    value = (value << 8) | static_cast<unsigned char>(in[i]);
+  }
+  return value;
+}
+
+static void Strong(const char *data, size_t length, char *out) {
+  butil::MD5Digest digest;
+  butil::MD5Sum(data, length, &digest);
+  memcpy(out, digest.a, DELTA_STRONG_SIZE);
+}
+
+// pread() until `length` bytes or EOF, return the bytes read or -1
+static ssize_t ReadFull(int fd, char *data, size_t length, int64_t offset) {
+  size_t done = 0;
+  while (done < length) {
+    ssize_t ret = pread(fd, data + done, length - done, offset + done);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (ret == 0) {
+      break;
+    }
+    done += ret;
+  }
+  return done;
+}
+
+uint32_t DeltaBlockSize(int64_t size) {
+  int64_t block = (size + DELTA_MAX_BLOCKS - 1) / DELTA_MAX_BLOCKS;
+  // a power of two keeps reads aligned
+  int64_t aligned = DELTA_MIN_BLOCK_SIZE;
+  while (aligned < block && aligned < DELTA_MAX_BLOCK_SIZE) {
+    aligned <<= 1;
+  }
+  return aligned;
+}
+
+uint32_t DeltaWeakSum(const char *data, size_t length) {
+  uint32_t a = 0;
+  uint32_t b = 0;
+  for (size_t i = 0; i < length; i++) {
+    a += static_cast<unsigned char>(data[i]);
+    b += (length - i) * static_cast<unsigned char>(data[i]);
+  }
+  return (a & 0xffff) | ((b & 0xffff) << 16);
+}
+
+void DeltaSignatures::add(const char *data, size_t length) {
+  weak_.push_back(DeltaWeakSum(data, length));
+  char strong[DELTA_STRONG_SIZE];
+  Strong(data, length, strong);
+  strong_.append(strong, DELTA_STRONG_SIZE);
+}
+
+void DeltaSignatures::index() {
+  by_weak_.clear();
+  by_weak_.reserve(weak_.size());
+  for (size_t i = 0; i < weak_.size(); i++) {
+    by_weak_.insert(std::make_pair(weak_[i], (uint32_t)i));
+  }
+}
+
+bool DeltaSignatures::Build(int fd, int64_t size, std::string *err) {
+  block_size_ = DeltaBlockSize(size);
+  basis_size_ = size;
+  weak_.clear();
+  strong_.clear();
+  std::vector<char> buff(block_size_);
+  for (int64_t offset = 0; offset < size; offset += block_size_) {
+    size_t want = std::min((int64_t)block_size_, size - offset);
+    ssize_t ret = ReadFull(fd, buff.data(), want, offset);
+    if (ret != (ssize_t)want) {
+      *err = ret < 0 ? std::string("Read basis failed: ") + strerror(errno)
+                     : "Basis file shrank while computing signatures";
+      return false;
+    }
+    add(buff.data(), want);
+  }
+  index();
+  return true;
+}
+
+std::string DeltaSignatures::Serialize() const {
+  std::string out;
+  out.reserve(DELTA_SIGNATURES_HEADER_SIZE +
+              weak_.size() * DELTA_SIGNATURE_SIZE);
+  PutUint(block_size_, 4, &out);
+  PutUint(basis_size_, 8, &out);
+  for (size_t i = 0; i < weak_.size(); i++) {
+    PutUint(weak_[i], 4, &out);
+    out.append(strong_, i * DELTA_STRONG_SIZE, DELTA_STRONG_SIZE);
+  }
+  return out;
+}
+
+bool DeltaSignatures::Parse(const std::string &data, std::string *err) {
+  if (data.size() < DELTA_SIGNATURES_HEADER_SIZE) {
+    *err = "Delta signatures are truncated";
+    return false;
+  }
+  block_size_ = GetUint(data.data(), 4);
+  basis_size_ = GetUint(data.data() + 4, 8);
+  if (block_size_ < DELTA_MIN_BLOCK_SIZE || block_size_ > DELTA_MAX_BLOCK_SIZE ||
+      basis_size_ < 0) {
+    *err = "Delta signatures have a bad block size";
+    return false;
+  }
+  int64_t blocks = (basis_size_ + block_size_ - 1) / block_size_;
+  if ((int64_t)data.size() !=
+      DELTA_SIGNATURES_HEADER_SIZE + blocks * DELTA_SIGNATURE_SIZE) {
+    *err = "Delta signatures do not match the basis size";
+    return false;
+  }
+  weak_.resize(blocks);
+  strong_.clear();
+  strong_.reserve(blocks * DELTA_STRONG_SIZE);
+  const char *pos = data.data() + DELTA_SIGNATURES_HEADER_SIZE;
+  for (int64_t i = 0; i < blocks; i++) {
+    weak_[i] = GetUint(pos, 4);
+    strong_.append(pos + 4, DELTA_STRONG_SIZE);
+    pos += DELTA_SIGNATURE_SIZE;
+  }
+  index();
+  return true;
+}
+
+uint32_t DeltaSignatures::block_length(size_t index) const {
+  int64_t offset = (int64_t)index * block_size_;
+  return std::min((int64_t)block_size_, basis_size_ - offset);
+}
+
+int64_t DeltaSignatures::Find(uint32_t weak, const char *data, size_t length,
+                              int64_t prefer) const {
+  auto range = by_weak_.equal_range(weak);
+  if (range.first == range.second) {
+    return -1;
+  }
+  // the strong sum is only computed once a weak one matched
+  char strong[DELTA_STRONG_SIZE];
+  Strong(data, length, strong);
+  auto matches = [&](uint32_t index) {
+    return block_length(index) == length &&
+           memcmp(strong_.data() + (size_t)index * DELTA_STRONG_SIZE, strong,
+                  DELTA_STRONG_SIZE) == 0;
+  };
+  if (prefer >= 0 && (size_t)prefer < weak_.size() && weak_[prefer] == weak &&
+      matches(prefer)) {
+    return prefer;
+  }
+  for (auto iter = range.first; iter != range.second; ++iter) {
+    if (matches(iter->second)) {
+      return iter->second;
+    }
+  }
+  return -1;
+}
+
+bool DeltaEncoder::flushRun(const Emit &emit) {
+  if (run_count_ == 0) {
+    return true;
+  }
+  std::string record("C");
+  PutUint(run_start_, 8, &record);
+  PutUint(run_count_, 8, &record);
+  run_start_ = -1;
+  run_count_ = 0;
+  butil::IOBuf buf;
+  buf.append(record);
+  return emit(&buf);
+}
+
+bool DeltaEncoder::copy(int64_t block, const Emit &emit) {
+  copied_bytes_ += signatures_.block_length(block);
+  if (run_count_ > 0 && run_start_ + run_count_ == block) {
+    run_count_++;
+    return true;
+  }
+  if (!flushRun(emit)) {
+    return false;
+  }
+  run_start_ = block;
+  run_count_ = 1;
+  return true;
+}
+
+bool DeltaEncoder::literal(const char *data, size_t length, const Emit &emit) {
+  if (length == 0) {
+    return true;
+  }
+  if (!flushRun(emit)) {
+    return false;
+  }
+  literal_bytes_ += length;
+  std::string header("D");
+  PutUint(length, 8, &header);
+  butil::IOBuf buf;
+  buf.append(header);
+  buf.append(data, length);
+  return emit(&buf);
+}
+
+butil::Status DeltaEncoder::Run(int fd, const Emit &emit) {
+  butil::Status status;
+  const size_t block = signatures_.block_size();
+  std::vector<char> buf(DELTA_LITERAL_SIZE + block + DELTA_READ_SIZE);
+  // buf holds the file from buf_offset on: [begin, pos) is literal not
+  // sent yet, [pos, pos + block) the window and [pos, end) is valid
+  int64_t buf_offset = 0;
+  size_t begin = 0;
+  size_t pos = 0;
+  size_t end = 0;
+  bool eof = false;
+  bool have_sum = false;
+  uint32_t a = 0;
+  uint32_t b = 0;
+  uint32_t crc = 0;
+
+  for (;;) {
+    // rolling needs the byte after the window too
+    if (!eof && end - pos <= block) {
+      if (pos - begin >= DELTA_LITERAL_SIZE &&
+          !literal(buf.data() + begin, pos - begin, emit)) {
+        status.set_error(ECANCELED, "Delta stream stopped");
+        return status;
+      }
+      if (pos - begin >= DELTA_LITERAL_SIZE) {
+        begin = pos;
+      }
+      memmove(buf.data(), buf.data() + begin, end - begin);
+      buf_offset += begin;
+      pos -= begin;
+      end -= begin;
+      begin = 0;
+      ssize_t ret =
+          ReadFull(fd, buf.data() + end, buf.size() - end, buf_offset + end);
+      if (ret < 0) {
+        status.set_error(errno, "Read failed: %s", strerror(errno));
+        return status;
+      }
+      crc = butil::crc32c::Extend(crc, buf.data() + end, ret);
+      end += ret;
+      eof = ret == 0 || end < buf.size();
+      continue;
+    }
+
+    size_t window = std::min(block, end - pos);
+    if (window == 0) {
+      break;
+    }
+    int64_t prefer = run_count_ > 0 ? run_start_ + run_count_ : -1;
+    if (window < block) {
+      // only the short last block of the basis can match the tail
+      int64_t match = signatures_.Find(DeltaWeakSum(buf.data() + pos, window),
+                                       buf.data() + pos, window, prefer);
+      if (match >= 0) {
+        if (!literal(buf.data() + begin, pos - begin, emit) ||
+            !copy(match, emit)) {
+          status.set_error(ECANCELED, "Delta stream stopped");
+          return status;
+        }
+        begin = pos = end;
+      } else {
+        pos = end;
+      }
+      break;
+    }
+
+    if (!have_sum) {
+      uint32_t sum = DeltaWeakSum(buf.data() + pos, block);
+      a = sum & 0xffff;
+      b = sum >> 16;
+      have_sum = true;
+    }
+    int64_t match = signatures_.Find(a | (b << 16), buf.data() + pos, block,
+                                     prefer);
+    if (match >= 0) {
+      if (!literal(buf.data() + begin, pos - begin, emit) ||
+          !copy(match, emit)) {
+        status.set_error(ECANCELED, "Delta stream stopped");
+        return status;
+      }
+      pos += block;
+      begin = pos;
+      have_sum = false;
+      continue;
+    }
+    if (pos + block >= end) {
+      // at EOF, the window shrinks from here on
+      pos++;
+      have_sum = false;
+      continue;
+    }
+    uint32_t out = static_cast<unsigned char>(buf[pos]);
+    uint32_t in = static_cast<unsigned char>(buf[pos + block]);
+    a = (a - out + in) & 0xffff;
+    b = (b - block * out + a) & 0xffff;
+    pos++;
+  }
+
+  if (!literal(buf.data() + begin, end - begin, emit) || !flushRun(emit)) {
+    status.set_error(ECANCELED, "Delta stream stopped");
+    return status;
+  }
+  std::string record("E");
+  PutUint(buf_offset + end, 8, &record);
+  PutUint(crc, 4, &record);
+  butil::IOBuf tail;
+  tail.append(record);
+  if (!emit(&tail)) {
+    status.set_error(ECANCELED, "Delta stream stopped");
+  }
+  return status;
+}
+
+DeltaDecoder::DeltaDecoder(int basis_fd, int out_fd, uint32_t block_size,
+                           int64_t basis_size)
+    : basis_fd_(basis_fd), out_fd_(out_fd), block_size_(block_size),
+      basis_size_(basis_size), literal_left_(0), written_(0), crc_(0),
+      ended_(false) {}
+
+butil::Status DeltaDecoder::write(const char *data, size_t length) {
+  butil::Status status;
+  crc_ = butil::crc32c::Extend(crc_, data, length);
+  while (length > 0) {
+    ssize_t ret = pwrite(out_fd_, data, length, written_);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      status.set_error(errno, "Pwrite() Failed: %s", strerror(errno));
+      return status;
+    }
+    data += ret;
+    length -= ret;
+    written_ += ret;
+  }
+  return status;
+}
+
+butil::Status DeltaDecoder::copyBlocks(int64_t first, int64_t count) {
+  butil::Status status;
+  int64_t offset = first * block_size_;
+  int64_t length = std::min(count * block_size_, basis_size_ - offset);
+  if (first < 0 || count <= 0 || offset >= basis_size_ || length <= 0) {
+    status.set_error(EINVAL, "Delta copies blocks %ld+%ld beyond the basis",
+                     first, count);
+    return status;
+  }
+  std::vector<char> buff(std::min(length, (int64_t)DELTA_READ_SIZE));
+  while (length > 0) {
+    size_t want = std::min(length, (int64_t)buff.size());
+    ssize_t ret = ReadFull(basis_fd_, buff.data(), want, offset);
+    if (ret != (ssize_t)want) {
+      status.set_error(EIO, "Read basis failed: %s",
+                       ret < 0 ? strerror(errno) : "basis shrank");
+      return status;
+    }
+    status = write(buff.data(), want);
+    if (!status.ok()) {
+      return status;
+    }
+    offset += want;
+    length -= want;
+  }
+  return status;
+}
+
+// header_ holds a complete record header
+butil::Status DeltaDecoder::record() {
+  butil::Status status;
+  const char *fields = header_.data() + 1;
+  switch (header_[0]) {
+  case 'C':
+    status = copyBlocks(GetUint(fields, 8), GetUint(fields + 8, 8));
+    break;
+  case 'D':
+    literal_left_ = GetUint(fields, 8);
+    break;
+  case 'E': {
+    int64_t size = GetUint(fields, 8);
+    uint32_t crc = GetUint(fields + 8, 4);
+    if (size != written_ || crc != crc_) {
+      status.set_error(EINVAL,
+                       "Rebuilt file does not match: %ld bytes crc32c %08x, "
+                       "server has %ld bytes crc32c %08x",
+                       written_, crc_, size, crc);
+    } else if (ftruncate(out_fd_, written_) != 0) {
+      status.set_error(errno, "Ftruncate() Failed: %s", strerror(errno));
+    }
+    ended_ = true;
+    break;
+  }
+  default:
+    status.set_error(EINVAL, "Unknown delta record '%c'", header_[0]);
+  }
+  header_.clear();
+  return status;
+}
+
+static size_t RecordHeaderSize(char type) {
+  switch (type) {
+  case 'C':
+    return 17;
+  case 'D':
+    return 9;
+  case 'E':
+    return 13;
+  }
+  return 1;
+}
+
+butil::Status DeltaDecoder::Feed(const char *data, size_t length) {
+  butil::Status status;
+  while (length > 0) {
+    if (ended_) {
+      status.set_error(EINVAL, "Data after the end of the delta");
+      return status;
+    }
+    if (literal_left_ > 0) {
+      size_t n = std::min((int64_t)length, literal_left_);
+      status = write(data, n);
+      if (!status.ok()) {
+        return status;
+      }
+      data += n;
+      length -= n;
+      literal_left_ -= n;
+      continue;
+    }
+    size_t want = header_.empty() ? 1 : RecordHeaderSize(header_[0]);
+    size_t n = std::min(length, want - header_.size());
+    header_.append(data, n);
+    data += n;
+    length -= n;
+    if (header_.size() == RecordHeaderSize(header_[0])) {
+      status = record();
+      if (!status.ok()) {
+        return status;
+      }
+    }
+  }
+  return status;
+}
+
+} // namespace kunlun
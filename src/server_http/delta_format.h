@@ -0,0 +1,140 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#ifndef _NODE_MGR_DELTA_FORMAT_H_
+#define _NODE_MGR_DELTA_FORMAT_H_
+
+#include "butil/iobuf.h"
+#include "butil/status.h"
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Request header carrying the byte count of the signatures appended to
+// the request body after its JSON
+#define DELTA_SIGNATURES_HEADER "X-Delta-Signatures"
+// Response header announcing a delta body, its value is the version
+#define DELTA_HEADER "X-Delta"
+#define DELTA_V1 "v1"
+#define DELTA_MIN_BLOCK_SIZE (8 * 1024)
+#define DELTA_MAX_BLOCK_SIZE (16 * 1024 * 1024)
+// a signature is 20 bytes, keep the request body below a few MB
+#define DELTA_MAX_BLOCKS (256 * 1024)
+// literal bytes gathered before they go out as one record
+#define DELTA_LITERAL_SIZE (1024 * 1024)
+#define DELTA_STRONG_SIZE 16
+
+namespace kunlun {
+
+// Block size used for a basis file of `size` bytes
+uint32_t DeltaBlockSize(int64_t size);
+
+// rsync's rolling checksum: both halves are sums mod 2^16, the window can
+// be moved by one byte in constant time
+uint32_t DeltaWeakSum(const char *data, size_t length);
+
+/*
+  Signatures of the copy the receiver already has: a weak rolling checksum
+  and an MD5 per block. Serialized as block size (4 bytes) and basis size
+  (8 bytes) followed by weak (4 bytes) and strong (16 bytes) of every
+  block, all big endian.
+*/
+class DeltaSignatures {
+public:
+  DeltaSignatures() : block_size_(0), basis_size_(0) {}
+
+  // Read the whole of `fd`, `size` bytes long
+  bool Build(int fd, int64_t size, std::string *err);
+  std::string Serialize() const;
+  bool Parse(const std::string &data, std::string *err);
+
+  uint32_t block_size() const { return block_size_; }
+  int64_t basis_size() const { return basis_size_; }
+  size_t block_num() const { return weak_.size(); }
+  uint32_t block_length(size_t index) const;
+  // Index of the block with these sums, -1 if none. `prefer` is tried
+  // first so runs of blocks stay runs
+  int64_t Find(uint32_t weak, const char *data, size_t length,
+               int64_t prefer) const;
+
+private:
+  void add(const char *data, size_t length);
+  void index();
+
+  uint32_t block_size_;
+  int64_t basis_size_;
+  std::vector<uint32_t> weak_;
+  std::string strong_;
+  std::unordered_multimap<uint32_t, uint32_t> by_weak_;
+};
+
+/*
+  Produces the delta of the file at `fd` against the signatures: runs of
+  blocks the receiver has and literal bytes for everything else. Records
+  are 'C' first block (8 bytes) count (8 bytes), 'D' length (8 bytes)
+  followed by the bytes, and 'E' file size (8 bytes) crc32c of the file
+  (4 bytes) last.
+*/
+class DeltaEncoder {
+public:
+  // Return false to stop the encoder
+  typedef std::function<bool(butil::IOBuf *)> Emit;
+
+  explicit DeltaEncoder(const DeltaSignatures &signatures)
+      : signatures_(signatures), run_start_(-1), run_count_(0),
+        copied_bytes_(0), literal_bytes_(0) {}
+
+  butil::Status Run(int fd, const Emit &emit);
+  int64_t copied_bytes() const { return copied_bytes_; }
+  int64_t literal_bytes() const { return literal_bytes_; }
+
+private:
+  bool copy(int64_t block, const Emit &emit);
+  bool flushRun(const Emit &emit);
+  bool literal(const char *data, size_t length, const Emit &emit);
+
+  const DeltaSignatures &signatures_;
+  int64_t run_start_;
+  int64_t run_count_;
+  int64_t copied_bytes_;
+  int64_t literal_bytes_;
+};
+
+/*
+  Rebuilds the file from a delta and the basis it was made against,
+  writing it front to back into `out_fd`.
+*/
+class DeltaDecoder {
+public:
+  DeltaDecoder(int basis_fd, int out_fd, uint32_t block_size,
+               int64_t basis_size);
+
+  butil::Status Feed(const char *data, size_t length);
+  bool ended() const { return ended_; }
+
+private:
+  butil::Status record();
+  butil::Status write(const char *data, size_t length);
+  butil::Status copyBlocks(int64_t first, int64_t count);
+
+  int basis_fd_;
+  int out_fd_;
+  uint32_t block_size_;
+  int64_t basis_size_;
+  std::string header_;
+  // literal bytes of the current 'D' record still to come
+  int64_t literal_left_;
+  int64_t written_;
+  uint32_t crc_;
+  bool ended_;
+};
+
+} // namespace kunlun
+
+#endif /*_NODE_MGR_DELTA_FORMAT_H_*/
@@ -0,0 +1,370 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#include "file_chunk.h"
+#include "zettalib/op_log.h"
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <mutex>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace kunlun {
+
+// IOBuf user-data deleters only get the data pointer back, so remember
+// where each window was mapped and how long it is
+struct MappedRegion {
+  void *base;
+  size_t length;
+  // the part of the window appended to the IOBuf, charged to `window`
+  size_t data_length;
+  std::shared_ptr<TransferWindow> window;
+};
+static std::mutex g_mapped_mutex;
+static std::unordered_map<void *, MappedRegion> g_mapped_regions;
+
+// Called by brpc once the socket has written the last byte of the window
+static void ReleaseMappedRegion(void *data) {
+  MappedRegion region;
+  {
+    std::lock_guard<std::mutex> guard(g_mapped_mutex);
+    auto iter = g_mapped_regions.find(data);
+    if (iter == g_mapped_regions.end()) {
+      KLOG_ERROR("Release unknown mapped region {}", data);
+      return;
+    }
+    region = iter->second;
+    g_mapped_regions.erase(iter);
+  }
+  munmap(region.base, region.length);
+  if (region.window) {
+    region.window->Release(region.data_length);
+  }
+}
+
+FileSendMode GetFileSendModeByStr(const char *mode_str) {
+  if (mode_str == nullptr || *mode_str == '\0' ||
+      strcasecmp(mode_str, "mmap") == 0) {
+    return kFileSendMmap;
+  }
+  if (strcasecmp(mode_str, "copy") == 0) {
+    return kFileSendCopy;
+  }
+  if (strcasecmp(mode_str, "direct") == 0) {
+    return kFileSendDirect;
+  }
+  if (strcasecmp(mode_str, "auto") == 0) {
+    return kFileSendAuto;
+  }
+  return kFileSendModeMax;
+}
+
+FileSendMode ResolveFileSendMode(FileSendMode mode, int64_t file_size,
+                                 int64_t threshold, bool user_space) {
+  if (mode == kFileSendAuto) {
+    mode = threshold > 0 && file_size >= threshold ? kFileSendDirect
+                                                   : kFileSendMmap;
+  }
+  if (mode == kFileSendMmap && user_space) {
+    return kFileSendPread;
+  }
+  return mode;
+}
+
+FileChunkReader::~FileChunkReader() {
+  // windows still referenced by unsent IOBufs stay mapped after close()
+  if (fd_ >= 0 && !shared_file_) {
+    close(fd_);
+  }
+}
+
+bool FileChunkReader::Open(const std::string &path) {
+  if (mode_ == kFileSendDirect) {
+    fd_ = open(path.c_str(), O_RDONLY | O_DIRECT);
+    direct_io_ = fd_ >= 0;
+    if (fd_ < 0 && errno == EINVAL) {
+      KLOG_INFO("{} does not support O_DIRECT, drop its pages after reading",
+                path);
+    }
+  }
+  if (fd_ < 0) {
+    fd_ = open(path.c_str(), O_RDONLY);
+  }
+  if (fd_ < 0) {
+    setErr("Open() %s failed: %s", path.c_str(), strerror(errno));
+    return false;
+  }
+  if (!refreshFileSize()) {
+    return false;
+  }
+  if (mode_ == kFileSendMmap || mode_ == kFileSendPread ||
+      (mode_ == kFileSendDirect && !direct_io_)) {
+    posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+  return true;
+}
+
+bool FileChunkReader::Open(const std::shared_ptr<SharedFile> &file) {
+  // reads are positional, sharing the fd shares no file offset
+  shared_file_ = file;
+  fd_ = file->fd();
+  if (!refreshFileSize()) {
+    return false;
+  }
+  if (mode_ == kFileSendMmap || mode_ == kFileSendPread ||
+      (mode_ == kFileSendDirect && !direct_io_)) {
+    posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+  return true;
+}
+
+size_t FileChunkReader::chunk_size() const {
+  if (mode_ == kFileSendCopy) {
+    return SEND_BUFFER_SIZE;
+  }
+  return mode_ == kFileSendDirect ? DIRECT_READ_SIZE : FILE_CHUNK_SIZE;
+}
+
+bool FileChunkReader::refreshFileSize() {
+  struct stat st;
+  if (fstat(fd_, &st) != 0) {
+    setErr("Fstat() failed: %s", strerror(errno));
+    return false;
+  }
+  file_size_ = st.st_size;
+  return true;
+}
+
+bool FileChunkReader::NextExtent(off_t from, off_t *data_begin,
+                                 off_t *data_end) {
+  if (!refreshFileSize()) {
+    return false;
+  }
+  if (from >= file_size_) {
+    *data_begin = *data_end = std::max((int64_t)from, file_size_);
+    return true;
+  }
+  // reads are positional, moving the offset of a shared fd is harmless
+  off_t begin = lseek(fd_, from, SEEK_DATA);
+  if (begin < 0) {
+    if (errno == ENXIO) {
+      *data_begin = *data_end = file_size_;
+      return true;
+    }
+    if (errno != EINVAL && errno != EOPNOTSUPP) {
+      setErr("Lseek() SEEK_DATA failed: %s", strerror(errno));
+      return false;
+    }
+    *data_begin = from;
+    *data_end = file_size_;
+    return true;
+  }
+  off_t end = lseek(fd_, begin, SEEK_HOLE);
+  if (end < 0) {
+    setErr("Lseek() SEEK_HOLE failed: %s", strerror(errno));
+    return false;
+  }
+  // the file may have grown since the fstat(), stay within what it was
+  *data_begin = std::min((int64_t)begin, file_size_);
+  *data_end = std::min((int64_t)end, file_size_);
+  return true;
+}
+
+ssize_t FileChunkReader::ReadChunk(off_t offset, size_t length,
+                                   butil::IOBuf *out) {
+  if (length == 0) {
+    return 0;
+  }
+  if (mode_ == kFileSendCopy) {
+    return readCopy(offset, length, out);
+  }
+  if (mode_ == kFileSendDirect) {
+    return readDirect(offset, length, out);
+  }
+  if (mode_ == kFileSendPread) {
+    return readPread(offset, length, out);
+  }
+  return readMapped(offset, length, out);
+}
+
+ssize_t FileChunkReader::readMapped(off_t offset, size_t length,
+                                    butil::IOBuf *out) {
+  // the file may still be growing, look again before reporting EOF
+  if (offset >= file_size_ && !refreshFileSize()) {
+    return -1;
+  }
+  if (offset >= file_size_) {
+    return 0;
+  }
+  if ((int64_t)length > file_size_ - offset) {
+    length = file_size_ - offset;
+  }
+
+  static const off_t page_size = sysconf(_SC_PAGESIZE);
+  off_t map_offset = offset & ~(page_size - 1);
+  size_t map_length = length + (offset - map_offset);
+
+  // MAP_POPULATE faults the window in here, on the sending bthread, instead
+  // of in the brpc thread that writes the socket
+  void *base = mmap(nullptr, map_length, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+                    fd_, map_offset);
+  if (base == MAP_FAILED) {
+    setErr("Mmap() failed: %s", strerror(errno));
+    return -1;
+  }
+  madvise(base, map_length, MADV_SEQUENTIAL);
+
+  char *data = static_cast<char *>(base) + (offset - map_offset);
+  {
+    std::lock_guard<std::mutex> guard(g_mapped_mutex);
+    MappedRegion region = {base, map_length, length, window_};
+    g_mapped_regions[data] = region;
+  }
+  if (window_) {
+    window_->Charge(length);
+  }
+  if (out->append_user_data(data, length, ReleaseMappedRegion) != 0) {
+    ReleaseMappedRegion(data);
+    setErr("Append mapped region to IOBuf failed");
+    return -1;
+  }
+  return length;
+}
+
+ssize_t FileChunkReader::readCopy(off_t offset, size_t length,
+                                  butil::IOBuf *out) {
+  char buff[SEND_BUFFER_SIZE] = {'\0'};
+  size_t total = 0;
+  while (total < length) {
+    size_t want = length - total;
+    if (want > SEND_BUFFER_SIZE) {
+      want = SEND_BUFFER_SIZE;
+    }
+    // with a window the block is read into a tracked buffer, so the
+    // in-flight accounting sees it
+    char *block = buff;
+    if (window_) {
+      block = TrackedBlock::Allocate(want, window_);
+      if (block == nullptr) {
+        setErr("Allocate %lu bytes failed", want);
+        return -1;
+      }
+    }
+    ssize_t ret = pread(fd_, block, want, offset + total);
+    if (ret <= 0) {
+      int saved_errno = errno;
+      if (block != buff) {
+        TrackedBlock::Free(block);
+      }
+      if (ret == 0) {
+        break;
+      }
+      if (saved_errno == EINTR) {
+        continue;
+      }
+      setErr("Read File failed: %s", strerror(saved_errno));
+      return -1;
+    }
+    if (block == buff) {
+      out->append(buff, ret);
+    } else if (TrackedBlock::Append(block, ret, out) != 0) {
+      setErr("Append %ld bytes to IOBuf failed", ret);
+      return -1;
+    }
+    total += ret;
+  }
+  return total;
+}
+
+ssize_t FileChunkReader::readPread(off_t offset, size_t length,
+                                   butil::IOBuf *out) {
+  if (length > FILE_CHUNK_SIZE) {
+    length = FILE_CHUNK_SIZE;
+  }
+  char *block = TrackedBlock::Allocate(length, window_);
+  if (block == nullptr) {
+    setErr("Allocate %lu bytes failed", length);
+    return -1;
+  }
+  // a file truncated meanwhile just reads short, unlike a mapped window
+  size_t total = 0;
+  while (total < length) {
+    ssize_t ret = pread(fd_, block + total, length - total, offset + total);
+    if (ret == 0) {
+      break;
+    }
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      int saved_errno = errno;
+      TrackedBlock::Free(block);
+      setErr("Read File failed: %s", strerror(saved_errno));
+      return -1;
+    }
+    total += ret;
+  }
+  if (total == 0) {
+    TrackedBlock::Free(block);
+    return 0;
+  }
+  if (TrackedBlock::Append(block, total, out) != 0) {
+    setErr("Append %lu bytes to IOBuf failed", total);
+    return -1;
+  }
+  return total;
+}
+
+ssize_t FileChunkReader::readDirect(off_t offset, size_t length,
+                                    butil::IOBuf *out) {
+  // O_DIRECT wants the offset, length and buffer aligned, so read from the
+  // aligned offset below and cut the head off again
+  off_t aligned_offset = offset & ~(off_t)(DIRECT_READ_ALIGN - 1);
+  size_t head = offset - aligned_offset;
+  size_t want = (head + length + DIRECT_READ_ALIGN - 1) &
+                ~(size_t)(DIRECT_READ_ALIGN - 1);
+  char *block = TrackedBlock::Allocate(want, window_, DIRECT_READ_ALIGN);
+  if (block == nullptr) {
+    setErr("Allocate %lu bytes failed", want);
+    return -1;
+  }
+
+  ssize_t ret = 0;
+  do {
+    ret = pread(fd_, block, want, aligned_offset);
+  } while (ret < 0 && errno == EINTR);
+  if (ret < 0) {
+    int saved_errno = errno;
+    TrackedBlock::Free(block);
+    setErr("Read File failed: %s", strerror(saved_errno));
+    return -1;
+  }
+  if ((size_t)ret <= head) {
+    TrackedBlock::Free(block);
+    return 0;
+  }
+  size_t got = std::min((size_t)ret - head, length);
+  if (!direct_io_) {
+    // the bytes are copied out, nothing reads these pages again soon
+    posix_fadvise(fd_, aligned_offset, ret, POSIX_FADV_DONTNEED);
+  }
+
+  butil::IOBuf piece;
+  if (TrackedBlock::Append(block, head + got, &piece) != 0) {
+    setErr("Append %lu bytes to IOBuf failed", head + got);
+    return -1;
+  }
+  piece.pop_front(head);
+  out->append(piece);
+  return got;
+}
+
+} // namespace kunlun
@@ -0,0 +1,109 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#ifndef _NODE_MGR_FILE_CHUNK_H_
+#define _NODE_MGR_FILE_CHUNK_H_
+
+#include "butil/iobuf.h"
+#include "flow_control.h"
+#include "path_index.h"
+#include "zettalib/errorcup.h"
+#include <memory>
+#include <string>
+#include <sys/types.h>
+
+// Read granularity of the copying send path
+#define SEND_BUFFER_SIZE 1024
+// Size of one mmap'd window handed to the socket without copying
+#define FILE_CHUNK_SIZE (4 * 1024 * 1024)
+// Size and alignment of one read bypassing the page cache
+#define DIRECT_READ_SIZE (1024 * 1024)
+#define DIRECT_READ_ALIGN 4096
+
+namespace kunlun {
+
+enum FileSendMode {
+  // mmap the file window by window and append the pages to the IOBuf as user
+  // data, the socket writev()s them straight out of the page cache. Not used
+  // when the payload is checksummed or compressed, see ResolveFileSendMode()
+  kFileSendMmap = 0,
+  // read() SEND_BUFFER_SIZE blocks and memcpy them into the IOBuf
+  kFileSendCopy,
+  // O_DIRECT reads of DIRECT_READ_SIZE into aligned blocks, so a bulk
+  // transfer does not evict the page cache of the database instances.
+  // Where O_DIRECT is not supported the pages just read are dropped with
+  // POSIX_FADV_DONTNEED instead
+  kFileSendDirect,
+  // direct for files of at least the threshold, mmap below it
+  kFileSendAuto,
+  // pread() FILE_CHUNK_SIZE at once into one tracked block, what mmap
+  // turns into when the payload is read in user space. Not configurable
+  kFileSendPread,
+
+  kFileSendModeMax
+};
+
+FileSendMode GetFileSendModeByStr(const char *);
+// The mode a file of `file_size` bytes is read with, `threshold` 0 keeps
+// kFileSendAuto from ever picking kFileSendDirect. With `user_space` the
+// bytes are read by node_mgr itself, checksummed or compressed, and never
+// mmapped: a file truncated meanwhile would raise SIGBUS there rather
+// than fail the writev() of the socket with EFAULT. kFileSendPread takes
+// the place of kFileSendMmap then
+FileSendMode ResolveFileSendMode(FileSendMode mode, int64_t file_size,
+                                 int64_t threshold, bool user_space);
+
+class FileChunkReader : public ErrorCup {
+public:
+  explicit FileChunkReader(FileSendMode mode)
+      : mode_(mode), fd_(-1), direct_io_(false), file_size_(0) {}
+  virtual ~FileChunkReader();
+
+  bool Open(const std::string &path);
+  // Read through an fd shared with other readers of the same file
+  bool Open(const std::shared_ptr<SharedFile> &file);
+  int64_t file_size() const { return file_size_; }
+  size_t chunk_size() const;
+  // Charge every chunk appended from now on to `window`
+  void set_window(const std::shared_ptr<TransferWindow> &window) {
+    window_ = window;
+  }
+
+  // Find the first data extent at or after `from`: [*data_begin, *data_end).
+  // Both are the file size if only a hole follows. A filesystem without
+  // SEEK_DATA reports the whole rest of the file as data
+  bool NextExtent(off_t from, off_t *data_begin, off_t *data_end);
+
+  // Append at most `length` bytes starting at `offset` to `out`.
+  // Return the number of bytes appended, 0 on EOF and -1 on failure
+  ssize_t ReadChunk(off_t offset, size_t length, butil::IOBuf *out);
+
+private:
+  ssize_t readMapped(off_t offset, size_t length, butil::IOBuf *out);
+  ssize_t readCopy(off_t offset, size_t length, butil::IOBuf *out);
+  ssize_t readPread(off_t offset, size_t length, butil::IOBuf *out);
+  ssize_t readDirect(off_t offset, size_t length, butil::IOBuf *out);
+  bool refreshFileSize();
+
+  // forbid copy
+  FileChunkReader(const FileChunkReader &rht) = delete;
+  FileChunkReader &operator=(const FileChunkReader &rht) = delete;
+
+private:
+  FileSendMode mode_;
+  int fd_;
+  // fd_ was opened with O_DIRECT
+  bool direct_io_;
+  // owns fd_ when it is shared
+  std::shared_ptr<SharedFile> shared_file_;
+  int64_t file_size_;
+  std::shared_ptr<TransferWindow> window_;
+};
+
+} // namespace kunlun
+
+#endif /*_NODE_MGR_FILE_CHUNK_H_*/
@@ -0,0 +1,222 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#include "file_relay.h"
+#include "file_upload.h"
+#include "util_func/job_executor.h"
+#include "zettalib/op_log.h"
+#include "zettalib/tool_func.h"
+#include <algorithm>
+#include <set>
+#include <stdlib.h>
+
+namespace kunlun {
+
+bool ParseRelayChain(const std::string &value, const std::string &self,
+                     std::vector<std::string> *chain, std::string *err) {
+  std::set<std::string> seen;
+  std::vector<std::string> hops = StringTokenize(value, ",");
+  for (size_t i = 0; i < hops.size(); i++) {
+    std::string hop = trim(hops[i]);
+    if (hop.empty()) {
+      continue;
+    }
+    if (hop == self || !seen.insert(hop).second) {
+      *err = string_sprintf("Relay chain %s visits %s twice", value.c_str(),
+                            hop.c_str());
+      return false;
+    }
+    chain->push_back(hop);
+  }
+  return true;
+}
+
+RelayForwarder::RelayForwarder(const std::string &name,
+                               const std::vector<std::string> &chain,
+                               bool override_file)
+    : name_(name), chain_(chain), override_file_(override_file),
+      queued_bytes_(0), sending_(false), failed_(false), stop_(false) {}
+
+RelayForwarder::~RelayForwarder() {
+  std::vector<std::pair<Callback, bool>> ready;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stop_ = true;
+    // nothing owning the forwarder is left to wait, tell the rest anyway
+    for (auto &waiter : queued_waiters_) {
+      ready.emplace_back(waiter, false);
+    }
+    for (auto &waiter : drained_waiters_) {
+      ready.emplace_back(waiter, false);
+    }
+    queued_waiters_.clear();
+    drained_waiters_.clear();
+  }
+  cond_.notify_all();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  dispatch(ready);
+}
+
+bool RelayForwarder::Start() {
+  brpc::ChannelOptions options;
+  // the last piece is answered once the rest of the chain has the file
+  options.timeout_ms = 3600000; // 1 hour
+  options.protocol = "http";
+  options.max_retry = 5;
+  if (channel_.Init(next_hop().c_str(), "", &options) != 0) {
+    setErr("Init channel to relay hop %s failed", next_hop().c_str());
+    return false;
+  }
+  thread_ = std::thread(&RelayForwarder::forwardLoop, this);
+  return true;
+}
+
+void RelayForwarder::Push(const butil::IOBuf &piece, int64_t first,
+                          int64_t total, uint32_t crc,
+                          const Callback &on_queued) {
+  std::vector<std::pair<Callback, bool>> ready;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (failed_) {
+      ready.emplace_back(on_queued, false);
+    } else {
+      Piece item;
+      item.data = piece;
+      item.first = first;
+      item.total = total;
+      item.crc = crc;
+      queued_bytes_ += piece.size();
+      queue_.push_back(item);
+      queued_waiters_.push_back(on_queued);
+      takeReady(&ready);
+    }
+  }
+  cond_.notify_all();
+  dispatch(ready);
+}
+
+void RelayForwarder::OnDrained(const Callback &on_drained) {
+  std::vector<std::pair<Callback, bool>> ready;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    drained_waiters_.push_back(on_drained);
+    takeReady(&ready);
+  }
+  dispatch(ready);
+}
+
+void RelayForwarder::takeReady(std::vector<std::pair<Callback, bool>> *ready) {
+  // always let one piece in, whatever its size
+  if (failed_ || queued_bytes_ <= RELAY_QUEUE_SIZE || queue_.size() <= 1) {
+    for (auto &waiter : queued_waiters_) {
+      ready->emplace_back(std::move(waiter), !failed_);
+    }
+    queued_waiters_.clear();
+  }
+  if (failed_ || (queue_.empty() && !sending_)) {
+    for (auto &waiter : drained_waiters_) {
+      ready->emplace_back(std::move(waiter), !failed_);
+    }
+    drained_waiters_.clear();
+  }
+}
+
+// The callbacks may hold the last reference to the forwarder, they run and
+// are destroyed on the executor, never on the forwarding thread
+void RelayForwarder::dispatch(std::vector<std::pair<Callback, bool>> &ready) {
+  for (auto &it : ready) {
+    Callback *callback = new Callback;
+    callback->swap(it.first);
+    bool ok = it.second;
+    JobExecutor::get_instance()->Submit("file_upload", [callback, ok] {
+      (*callback)(ok);
+      delete callback;
+    });
+  }
+  ready.clear();
+}
+
+void RelayForwarder::forwardLoop() {
+  for (;;) {
+    Piece piece;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+      if (stop_) {
+        return;
+      }
+      piece = queue_.front();
+      sending_ = true;
+    }
+
+    bool ok = forward(piece);
+    std::vector<std::pair<Callback, bool>> ready;
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      queue_.pop_front();
+      queued_bytes_ -= piece.data.size();
+      sending_ = false;
+      if (!ok) {
+        failed_ = true;
+        queue_.clear();
+        queued_bytes_ = 0;
+      }
+      takeReady(&ready);
+    }
+    dispatch(ready);
+    if (!ok) {
+      return;
+    }
+  }
+}
+
+bool RelayForwarder::forward(const Piece &piece) {
+  int64_t last = piece.first + (int64_t)piece.data.size() - 1;
+  brpc::Controller cntl;
+  cntl.http_request().uri() =
+      string_sprintf("http://%s/FileService/%s", next_hop().c_str(),
+                     name_.c_str());
+  cntl.http_request().set_method(brpc::HTTP_METHOD_PUT);
+  if (override_file_) {
+    cntl.http_request().uri().SetQuery("override", "true");
+  }
+  cntl.http_request().SetHeader(
+      "Content-Range",
+      string_sprintf("bytes %ld-%ld/%ld", piece.first, last, piece.total));
+  cntl.http_request().SetHeader(PIECE_CRC32C_HEADER,
+                                string_sprintf("%08x", piece.crc));
+  if (chain_.size() > 1) {
+    std::string rest;
+    for (size_t i = 1; i < chain_.size(); i++) {
+      rest += (i > 1 ? "," : "") + chain_[i];
+    }
+    cntl.http_request().SetHeader(RELAY_CHAIN_HEADER, rest);
+  }
+  cntl.request_attachment() = piece.data;
+
+  channel_.CallMethod(NULL, &cntl, NULL, NULL, NULL);
+  // a retried piece the hop already wrote is answered with the offset
+  // after it
+  const std::string *next = cntl.http_response().GetHeader(UPLOAD_OFFSET_HEADER);
+  if (cntl.Failed() &&
+      cntl.http_response().status_code() == brpc::HTTP_STATUS_CONFLICT &&
+      next != nullptr && atoll(next->c_str()) == last + 1) {
+    return true;
+  }
+  if (cntl.Failed()) {
+    setErr("Relay %s bytes %ld-%ld to %s failed: %s %s", name_.c_str(),
+           piece.first, last, next_hop().c_str(), cntl.ErrorText().c_str(),
+           cntl.response_attachment().to_string().c_str());
+    KLOG_ERROR("{}", getErr());
+    return false;
+  }
+  return true;
+}
+
+} // namespace kunlun
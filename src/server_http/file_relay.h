@@ -0,0 +1,106 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#ifndef _NODE_MGR_FILE_RELAY_H_
+#define _NODE_MGR_FILE_RELAY_H_
+
+#include "brpc/channel.h"
+#include "butil/iobuf.h"
+#include "zettalib/errorcup.h"
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// node_mgrs (`ip:port`, comma separated) an upload is passed on to, in
+// order. Each hop forwards to the first one and the rest of the list
+#define RELAY_CHAIN_HEADER "X-Relay-Chain"
+// crc32c of the piece in the body, in hex, checked by every hop
+#define PIECE_CRC32C_HEADER "X-Piece-Crc32c"
+// bytes received but not yet taken by the next hop, beyond this the
+// upstream is answered late
+#define RELAY_QUEUE_SIZE (64 * 1024 * 1024)
+
+namespace kunlun {
+
+// Split a RELAY_CHAIN_HEADER value, false if it names a hop twice or
+// `self`, which would make the chain a loop
+bool ParseRelayChain(const std::string &value, const std::string &self,
+                     std::vector<std::string> *chain, std::string *err);
+
+/*
+  Passes the pieces of an upload on to the next node_mgr of a chain while
+  they are still arriving. Pieces are queued as they are written locally
+  and PUT downstream in order by a thread of their own, carrying the rest
+  of the chain, so each hop only adds the time of one piece to the whole
+  distribution. Nobody waits on the forwarder: it tells through callbacks,
+  run on the JobExecutor, when a piece may be answered and when the chain
+  has the whole file.
+*/
+class RelayForwarder : public ErrorCup {
+public:
+  typedef std::function<void(bool ok)> Callback;
+
+  RelayForwarder(const std::string &name, const std::vector<std::string> &chain,
+                 bool override_file);
+  virtual ~RelayForwarder();
+
+  bool Start();
+  // Queue [first, first + piece.size()) of a `total` bytes file. on_queued
+  // runs once no more than RELAY_QUEUE_SIZE bytes wait, or the piece is
+  // the only one queued, with false if forwarding failed
+  void Push(const butil::IOBuf &piece, int64_t first, int64_t total,
+            uint32_t crc, const Callback &on_queued);
+  // on_drained runs once the chain took every queued piece, with false if
+  // it did not
+  void OnDrained(const Callback &on_drained);
+  const std::string &next_hop() const { return chain_.front(); }
+
+private:
+  struct Piece {
+    butil::IOBuf data;
+    int64_t first;
+    int64_t total;
+    uint32_t crc;
+  };
+
+  // Callbacks whose condition holds now, taken out. Called with mutex_ held
+  void takeReady(std::vector<std::pair<Callback, bool>> *ready);
+  static void dispatch(std::vector<std::pair<Callback, bool>> &ready);
+  void forwardLoop();
+  bool forward(const Piece &piece);
+
+  // forbid copy
+  RelayForwarder(const RelayForwarder &rht) = delete;
+  RelayForwarder &operator=(const RelayForwarder &rht) = delete;
+
+  std::string name_;
+  std::vector<std::string> chain_;
+  bool override_file_;
+  brpc::Channel channel_;
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<Piece> queue_;
+  size_t queued_bytes_;
+  // a piece is on its way downstream
+  bool sending_;
+  std::vector<Callback> queued_waiters_;
+  std::vector<Callback> drained_waiters_;
+  bool failed_;
+  bool stop_;
+  std::thread thread_;
+};
+
+} // namespace kunlun
+
+#endif /*_NODE_MGR_FILE_RELAY_H_*/
@@ -0,0 +1,490 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#include "file_upload.h"
+#include "butil/crc32c.h"
+#include "json/json.h"
+#include "path_index.h"
+#include "util_func/job_executor.h"
+#include "zettalib/op_log.h"
+#include "zettalib/tool_func.h"
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+extern std::string local_ip;
+extern int64_t node_mgr_brpc_http_port;
+
+namespace kunlun {
+
+AlignedFileWriter::AlignedFileWriter()
+    : fd_(-1), buffer_(nullptr), buffered_(0), written_(0), total_size_(0) {}
+
+AlignedFileWriter::~AlignedFileWriter() {
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+  free(buffer_);
+}
+
+bool AlignedFileWriter::Open(const std::string &path, int64_t total_size) {
+  path_ = path;
+  total_size_ = total_size;
+  void *buffer = nullptr;
+  if (posix_memalign(&buffer, UPLOAD_WRITE_ALIGN, UPLOAD_BATCH_SIZE) != 0) {
+    setErr("Allocate %d bytes failed", UPLOAD_BATCH_SIZE);
+    return false;
+  }
+  buffer_ = static_cast<char *>(buffer);
+
+  fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd_ < 0) {
+    setErr("Open() %s failed: %s", path.c_str(), strerror(errno));
+    return false;
+  }
+  // a full disk fails the upload now rather than after most of it was sent
+  if (total_size > 0 && fallocate(fd_, 0, 0, total_size) != 0) {
+    if (errno != EOPNOTSUPP) {
+      setErr("Fallocate() %ld bytes for %s failed: %s", total_size,
+             path.c_str(), strerror(errno));
+      return false;
+    }
+    KLOG_INFO("{} can not be preallocated, written without", path);
+  }
+  return true;
+}
+
+bool AlignedFileWriter::Append(const butil::IOBuf &data) {
+  if (size() + (int64_t)data.size() > total_size_) {
+    setErr("%s would grow beyond its %ld bytes", path_.c_str(), total_size_);
+    return false;
+  }
+  for (size_t i = 0; i < data.backing_block_num(); i++) {
+    butil::StringPiece block = data.backing_block(i);
+    const char *ptr = block.data();
+    size_t left = block.size();
+    while (left > 0) {
+      size_t n = std::min(left, (size_t)UPLOAD_BATCH_SIZE - buffered_);
+      memcpy(buffer_ + buffered_, ptr, n);
+      buffered_ += n;
+      ptr += n;
+      left -= n;
+      if (buffered_ == UPLOAD_BATCH_SIZE && !flush()) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool AlignedFileWriter::flush() {
+  size_t done = 0;
+  while (done < buffered_) {
+    ssize_t ret =
+        pwrite(fd_, buffer_ + done, buffered_ - done, written_ + done);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      setErr("Write %s failed: %s", path_.c_str(), strerror(errno));
+      return false;
+    }
+    done += ret;
+  }
+  written_ += buffered_;
+  buffered_ = 0;
+  return true;
+}
+
+bool AlignedFileWriter::Finish() {
+  if (!flush()) {
+    return false;
+  }
+  if (ftruncate(fd_, total_size_) != 0) {
+    setErr("Ftruncate() %s failed: %s", path_.c_str(), strerror(errno));
+    return false;
+  }
+  if (fsync(fd_) != 0) {
+    setErr("Fsync() %s failed: %s", path_.c_str(), strerror(errno));
+    return false;
+  }
+  close(fd_);
+  fd_ = -1;
+  return true;
+}
+
+FileUploader *FileUploader::m_inst = nullptr;
+
+// Only plain relative names, nothing may land outside the tmp data path
+static bool ValidUploadName(const std::string &name) {
+  if (name.empty() || name.back() == '/') {
+    return false;
+  }
+  size_t suffix_len = strlen(UPLOAD_PARTIAL_SUFFIX);
+  if (name.size() >= suffix_len &&
+      name.compare(name.size() - suffix_len, suffix_len,
+                   UPLOAD_PARTIAL_SUFFIX) == 0) {
+    return false;
+  }
+  size_t start = 0;
+  for (;;) {
+    size_t slash = name.find('/', start);
+    std::string component = name.substr(start, slash - start);
+    if (component.empty() || component == "." || component == "..") {
+      return false;
+    }
+    if (slash == std::string::npos) {
+      return true;
+    }
+    start = slash + 1;
+  }
+}
+
+// `bytes first-last/total`
+static bool ParseContentRange(const std::string &range, int64_t *first,
+                              int64_t *last, int64_t *total) {
+  long long a = 0, b = 0, t = 0;
+  char tail = '\0';
+  if (sscanf(range.c_str(), "bytes %lld-%lld/%lld%c", &a, &b, &t, &tail) != 3) {
+    return false;
+  }
+  if (a < 0 || b < a || t <= b) {
+    return false;
+  }
+  *first = a;
+  *last = b;
+  *total = t;
+  return true;
+}
+
+static void SetUploadResponse(brpc::Controller *cntl, int status_code,
+                              bool success, const std::string &info) {
+  cntl->http_response().set_status_code(status_code);
+  Json::Value root;
+  root["status"] = success ? "success" : "failed";
+  root["info"] = info;
+  Json::FastWriter writer;
+  writer.omitEndingLineFeed();
+  cntl->response_attachment().append(writer.write(root));
+}
+
+static uint32_t PieceCrc32c(const butil::IOBuf &data) {
+  uint32_t crc = 0;
+  for (size_t i = 0; i < data.backing_block_num(); i++) {
+    butil::StringPiece block = data.backing_block(i);
+    crc = butil::crc32c::Extend(crc, block.data(), block.size());
+  }
+  return crc;
+}
+
+// the rename is only durable once the directory is synced too
+static void SyncParentDir(const std::string &path) {
+  std::string dir = path.substr(0, path.rfind('/'));
+  int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  fsync(fd);
+  close(fd);
+}
+
+void FileUploader::Handle(brpc::Controller *cntl, const std::string &name,
+                          google::protobuf::Closure *done) {
+  brpc::ClosureGuard done_guard(done);
+  if (!ValidUploadName(name)) {
+    KLOG_ERROR("FileService refuses upload name {}", name);
+    SetUploadResponse(cntl, brpc::HTTP_STATUS_BAD_REQUEST, false,
+                      "Invalid upload name: " + name);
+    return;
+  }
+  std::string root = PathIndex::get_instance()->root_path(PathIndex::kTmpDataRoot);
+  std::shared_ptr<UploadPiece> piece = std::make_shared<UploadPiece>();
+  piece->cntl = cntl;
+  piece->name = name;
+  piece->path = root + "/" + name;
+  const std::string &path = piece->path;
+
+  const butil::IOBuf &body = cntl->request_attachment();
+  piece->first = 0;
+  int64_t last = (int64_t)body.size() - 1;
+  piece->total = body.size();
+  const std::string *range = cntl->http_request().GetHeader("Content-Range");
+  if (range != nullptr &&
+      (!ParseContentRange(*range, &piece->first, &last, &piece->total) ||
+       last - piece->first + 1 != (int64_t)body.size())) {
+    KLOG_ERROR("FileService upload {} with bad Content-Range {}", path, *range);
+    SetUploadResponse(cntl, brpc::HTTP_STATUS_BAD_REQUEST, false,
+                      "Bad Content-Range: " + *range);
+    return;
+  }
+
+  const std::string *chain_str = cntl->http_request().GetHeader(RELAY_CHAIN_HEADER);
+  std::string err;
+  if (chain_str != nullptr &&
+      !ParseRelayChain(*chain_str,
+                       string_sprintf("%s:%ld", local_ip.c_str(),
+                                      node_mgr_brpc_http_port),
+                       &piece->chain, &err)) {
+    KLOG_ERROR("FileService upload {} refused: {}", path, err);
+    SetUploadResponse(cntl, brpc::HTTP_STATUS_BAD_REQUEST, false, err);
+    return;
+  }
+  if (chain_str != nullptr) {
+    piece->chain_str = *chain_str;
+  }
+
+  const std::string *override_str =
+      cntl->http_request().uri().GetQuery("override");
+  piece->override_file =
+      override_str != nullptr && (*override_str == "true" || *override_str == "1");
+
+  // writes of up to a whole piece, the fsync and the rename would hold the
+  // brpc worker, they run on the executor and answer from there
+  piece->done = done_guard.release();
+  JobExecutor::get_instance()->Submit("file_upload",
+                                      [this, piece] { handlePiece(piece); });
+}
+
+void FileUploader::handlePiece(const std::shared_ptr<UploadPiece> &piece) {
+  brpc::ClosureGuard done_guard(piece->done);
+  brpc::Controller *cntl = piece->cntl;
+  const std::string &name = piece->name;
+  const std::string &path = piece->path;
+  const butil::IOBuf &body = cntl->request_attachment();
+  int64_t first = piece->first;
+  int64_t total = piece->total;
+  const std::vector<std::string> &chain = piece->chain;
+
+  // every hop checks the piece it got, a relay passes the crc on
+  uint32_t crc = PieceCrc32c(body);
+  const std::string *crc_str = cntl->http_request().GetHeader(PIECE_CRC32C_HEADER);
+  if (crc_str != nullptr && strtoul(crc_str->c_str(), nullptr, 16) != crc) {
+    KLOG_ERROR("FileService upload {} piece at {} is corrupted, crc32c {} "
+               "expected {}", path, first, string_sprintf("%08x", crc),
+               *crc_str);
+    SetUploadResponse(cntl, brpc::HTTP_STATUS_BAD_REQUEST, false,
+                      string_sprintf("Piece at %ld fails its crc32c", first));
+    return;
+  }
+
+  if (first == 0 && !piece->override_file && CheckFileExists(path.c_str())) {
+    SetUploadResponse(cntl, brpc::HTTP_STATUS_CONFLICT, false,
+                      "File exists: " + name);
+    return;
+  }
+
+  int status_code = brpc::HTTP_STATUS_OK;
+  std::string err;
+  std::shared_ptr<Session> session =
+      findSession(path, first, total, &status_code, &err);
+  if (!session) {
+    KLOG_ERROR("FileService upload {} failed: {}", path, err);
+    SetUploadResponse(cntl, status_code, false, err);
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(session->mutex);
+  AlignedFileWriter &writer = session->writer;
+  if (session->dropped || session->busy || writer.size() != first ||
+      writer.total_size() != total) {
+    // tell the client where to go on from, a fresh upload starts at 0
+    int64_t offset = session->dropped ? 0 : writer.size();
+    cntl->http_response().SetHeader(UPLOAD_OFFSET_HEADER,
+                                    string_sprintf("%ld", offset));
+    SetUploadResponse(cntl, brpc::HTTP_STATUS_CONFLICT, false,
+                      string_sprintf("Upload of %s continues at %ld",
+                                     name.c_str(), offset));
+    return;
+  }
+  session->last_active = time(nullptr);
+  if (first == 0 && !chain.empty()) {
+    session->relay.reset(
+        new RelayForwarder(name, chain, piece->override_file));
+    if (!session->relay->Start()) {
+      KLOG_ERROR("FileService upload {} failed: {}", path,
+                 session->relay->getErr());
+      SetUploadResponse(cntl, brpc::HTTP_STATUS_INTERNAL_SERVER_ERROR, false,
+                        session->relay->getErr());
+      dropSession(path, session, true);
+      return;
+    }
+  }
+
+  if (!writer.Append(body)) {
+    KLOG_ERROR("FileService upload {} failed: {}", path, writer.getErr());
+    SetUploadResponse(cntl, brpc::HTTP_STATUS_INTERNAL_SERVER_ERROR, false,
+                      writer.getErr());
+    dropSession(path, session, true);
+    return;
+  }
+  if (writer.size() == total) {
+    if (!writer.Finish()) {
+      KLOG_ERROR("FileService upload {} failed: {}", path, writer.getErr());
+      SetUploadResponse(cntl, brpc::HTTP_STATUS_INTERNAL_SERVER_ERROR, false,
+                        writer.getErr());
+      dropSession(path, session, true);
+      return;
+    }
+    if (rename(session->partial_path.c_str(), path.c_str()) != 0) {
+      err = string_sprintf("Rename() %s failed: %s",
+                           session->partial_path.c_str(), strerror(errno));
+      KLOG_ERROR("FileService upload {} failed: {}", path, err);
+      SetUploadResponse(cntl, brpc::HTTP_STATUS_INTERNAL_SERVER_ERROR, false,
+                        err);
+      dropSession(path, session, true);
+      return;
+    }
+    SyncParentDir(path);
+  }
+  if (!session->relay) {
+    answerPiece(piece, session, true);
+    return;
+  }
+
+  // the piece is answered once the relay queue has room for more, the
+  // last one once the whole chain has the file. Other pieces are refused
+  // meanwhile so the queue keeps their order
+  session->busy = true;
+  bool last_piece = writer.size() == total;
+  lock.unlock();
+  done_guard.release();
+  RelayForwarder *relay = session->relay.get();
+  relay->Push(body, first, total, crc,
+              [this, piece, session, relay, last_piece](bool ok) {
+                if (ok && last_piece) {
+                  relay->OnDrained([this, piece, session](bool ok) {
+                    onRelayed(piece, session, ok);
+                  });
+                  return;
+                }
+                onRelayed(piece, session, ok);
+              });
+}
+
+void FileUploader::onRelayed(const std::shared_ptr<UploadPiece> &piece,
+                             const std::shared_ptr<Session> &session,
+                             bool ok) {
+  brpc::ClosureGuard done_guard(piece->done);
+  std::lock_guard<std::mutex> guard(session->mutex);
+  session->busy = false;
+  session->last_active = time(nullptr);
+  if (!ok) {
+    // a broken chain fails the whole upload, the source starts it over.
+    // The local copy stays once complete, whatever the rest of the chain did
+    bool complete = session->writer.size() == session->writer.total_size();
+    SetUploadResponse(piece->cntl, brpc::HTTP_STATUS_BAD_GATEWAY, false,
+                      session->relay->getErr());
+    if (!session->dropped) {
+      dropSession(piece->path, session, !complete);
+    }
+    return;
+  }
+  answerPiece(piece, session, false);
+}
+
+// session->mutex must be held, `done` is run by the caller
+void FileUploader::answerPiece(const std::shared_ptr<UploadPiece> &piece,
+                               const std::shared_ptr<Session> &session,
+                               bool local_only) {
+  brpc::Controller *cntl = piece->cntl;
+  AlignedFileWriter &writer = session->writer;
+  cntl->http_response().SetHeader(UPLOAD_OFFSET_HEADER,
+                                  string_sprintf("%ld", writer.size()));
+  if (writer.size() < writer.total_size()) {
+    SetUploadResponse(cntl, brpc::HTTP_STATUS_OK, true,
+                      string_sprintf("Received %ld of %ld bytes",
+                                     writer.size(), writer.total_size()));
+    return;
+  }
+  dropSession(piece->path, session, false);
+  KLOG_INFO("FileService upload {} finished, {} bytes{}", piece->path,
+            writer.total_size(),
+            local_only ? "" : ", relayed to " + piece->chain_str);
+  SetUploadResponse(cntl, brpc::HTTP_STATUS_OK, true, "success");
+}
+
+std::shared_ptr<FileUploader::Session>
+FileUploader::findSession(const std::string &path, int64_t first,
+                          int64_t total, int *status_code, std::string *err) {
+  dropIdleSessions();
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto iter = sessions_.find(path);
+  if (first != 0) {
+    if (iter != sessions_.end()) {
+      return iter->second;
+    }
+    // the caller answers with offset 0, the upload has to start over
+    std::shared_ptr<Session> gone = std::make_shared<Session>();
+    gone->dropped = true;
+    return gone;
+  }
+
+  // the first piece (re)starts the upload, unless a piece of the running
+  // one is being written. Sessions are locked before the table everywhere
+  // else, so only try here
+  if (iter != sessions_.end()) {
+    std::unique_lock<std::mutex> session_lock(iter->second->mutex,
+                                              std::try_to_lock);
+    if (!session_lock.owns_lock() || iter->second->busy) {
+      *status_code = brpc::HTTP_STATUS_CONFLICT;
+      *err = string_sprintf("A piece of %s is being written", path.c_str());
+      return nullptr;
+    }
+    iter->second->dropped = true;
+    sessions_.erase(iter);
+  }
+  std::shared_ptr<Session> session = std::make_shared<Session>();
+  session->partial_path = path + UPLOAD_PARTIAL_SUFFIX;
+  session->last_active = time(nullptr);
+  if (!session->writer.Open(session->partial_path, total)) {
+    *status_code = brpc::HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    *err = session->writer.getErr();
+    unlink(session->partial_path.c_str());
+    return nullptr;
+  }
+  sessions_[path] = session;
+  return session;
+}
+
+// session->mutex must be held
+void FileUploader::dropSession(const std::string &path,
+                               const std::shared_ptr<Session> &session,
+                               bool remove_file) {
+  session->dropped = true;
+  if (remove_file) {
+    unlink(session->partial_path.c_str());
+  }
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto iter = sessions_.find(path);
+  if (iter != sessions_.end() && iter->second == session) {
+    sessions_.erase(iter);
+  }
+}
+
+void FileUploader::dropIdleSessions() {
+  time_t now = time(nullptr);
+  std::lock_guard<std::mutex> guard(mutex_);
+  for (auto iter = sessions_.begin(); iter != sessions_.end();) {
+    std::shared_ptr<Session> session = iter->second;
+    // a session busy with a piece is not idle
+    std::unique_lock<std::mutex> session_lock(session->mutex, std::try_to_lock);
+    if (!session_lock.owns_lock() || session->busy ||
+        now - session->last_active < UPLOAD_SESSION_TIMEOUT) {
+      ++iter;
+      continue;
+    }
+    KLOG_INFO("FileService drops idle upload {}", iter->first);
+    session->dropped = true;
+    unlink(session->partial_path.c_str());
+    iter = sessions_.erase(iter);
+  }
+}
+
+} // namespace kunlun
@@ -0,0 +1,143 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#ifndef _NODE_MGR_FILE_UPLOAD_H_
+#define _NODE_MGR_FILE_UPLOAD_H_
+
+#include "brpc/server.h"
+#include "butil/iobuf.h"
+#include "file_relay.h"
+#include "zettalib/errorcup.h"
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Size and alignment of one write of an uploaded file
+#define UPLOAD_BATCH_SIZE (4 * 1024 * 1024)
+#define UPLOAD_WRITE_ALIGN 4096
+// An upload lands in <name>.uploading until its last byte is on disk
+#define UPLOAD_PARTIAL_SUFFIX ".uploading"
+// Bytes of the upload the server has, sent back with every piece
+#define UPLOAD_OFFSET_HEADER "X-Upload-Offset"
+// Seconds an unfinished upload may stay idle before it is dropped
+#define UPLOAD_SESSION_TIMEOUT 600
+
+namespace kunlun {
+
+/*
+  Writes a file front to back the way a large upload wants it: the whole
+  size is preallocated at once so the filesystem lays it out in few extents,
+  incoming data is gathered into UPLOAD_BATCH_SIZE aligned buffers which go
+  out with one pwrite() each, and the file is fsync()ed once, at the end.
+*/
+class AlignedFileWriter : public ErrorCup {
+public:
+  AlignedFileWriter();
+  virtual ~AlignedFileWriter();
+
+  bool Open(const std::string &path, int64_t total_size);
+  bool Append(const butil::IOBuf &data);
+  // Write out what is buffered, cut the file to its size and fsync it
+  bool Finish();
+  // bytes taken so far, buffered or written
+  int64_t size() const { return written_ + buffered_; }
+  int64_t total_size() const { return total_size_; }
+
+private:
+  bool flush();
+
+  // forbid copy
+  AlignedFileWriter(const AlignedFileWriter &rht) = delete;
+  AlignedFileWriter &operator=(const AlignedFileWriter &rht) = delete;
+
+private:
+  std::string path_;
+  int fd_;
+  char *buffer_;
+  size_t buffered_;
+  int64_t written_;
+  int64_t total_size_;
+};
+
+/*
+  PUT side of FileService. The request body is stored as
+  node_mgr_tmp_data_path/<name>. Files larger than one request body are
+  pushed as consecutive pieces, each PUT carrying
+  `Content-Range: bytes first-last/total`. Pieces are appended to
+  <name>.uploading, which is renamed to <name> once the last one is on
+  disk. A piece which does not continue the upload is refused with 409 and
+  X-Upload-Offset telling where to go on from. Pieces are written on the
+  JobExecutor, never on a brpc worker. With RELAY_CHAIN_HEADER the
+  upload is passed on down the chain as it arrives, and its last piece is
+  answered once every hop has the whole file.
+*/
+class FileUploader {
+private:
+  static FileUploader *m_inst;
+  FileUploader() {}
+
+public:
+  static FileUploader *get_instance() {
+    if (!m_inst)
+      m_inst = new FileUploader();
+    return m_inst;
+  }
+
+  // Answers the piece through `done`, possibly after returning
+  void Handle(brpc::Controller *cntl, const std::string &name,
+              google::protobuf::Closure *done);
+
+private:
+  // a PUT checked on the brpc worker, written on the JobExecutor
+  struct UploadPiece {
+    brpc::Controller *cntl = nullptr;
+    google::protobuf::Closure *done = nullptr;
+    std::string name;
+    std::string path;
+    int64_t first = 0;
+    int64_t total = 0;
+    std::vector<std::string> chain;
+    std::string chain_str;
+    bool override_file = false;
+  };
+  struct Session {
+    std::mutex mutex;
+    AlignedFileWriter writer;
+    std::string partial_path;
+    time_t last_active = 0;
+    // set once the session left the table, late pieces are refused
+    bool dropped = false;
+    // a piece waits for the relay to answer it
+    bool busy = false;
+    // next hop of a relayed upload
+    std::unique_ptr<RelayForwarder> relay;
+  };
+
+  void handlePiece(const std::shared_ptr<UploadPiece> &piece);
+  void onRelayed(const std::shared_ptr<UploadPiece> &piece,
+                 const std::shared_ptr<Session> &session, bool ok);
+  void answerPiece(const std::shared_ptr<UploadPiece> &piece,
+                   const std::shared_ptr<Session> &session, bool local_only);
+  // nullptr with the status to answer and the reason if the piece can
+  // not be taken
+  std::shared_ptr<Session> findSession(const std::string &path, int64_t first,
+                                       int64_t total, int *status_code,
+                                       std::string *err);
+  void dropSession(const std::string &path,
+                   const std::shared_ptr<Session> &session, bool remove_file);
+  void dropIdleSessions();
+
+  std::mutex mutex_;
+  std::unordered_map<std::string, std::shared_ptr<Session>> sessions_;
+};
+
+} // namespace kunlun
+
+#endif /*_NODE_MGR_FILE_UPLOAD_H_*/
@@ -0,0 +1,188 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#include "flow_control.h"
+#include "brpc/errno.pb.h"
+#include "bthread/bthread.h"
+#include "butil/time.h"
+#include "zettalib/op_log.h"
+#include <algorithm>
+#include <atomic>
+#include <errno.h>
+#include <mutex>
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+
+// first and longest sleep on an overcrowded socket
+#define OVERCROWDED_BACKOFF_MIN_US 100
+#define OVERCROWDED_BACKOFF_MAX_US 100000
+// keeps the payload of a tracked block cache line aligned
+#define TRACKED_BLOCK_HEADER_SIZE 64
+
+namespace kunlun {
+
+static bvar::Adder<int64_t> g_transfer_stall_us("node_mgr_transfer_stall_us");
+static std::atomic<int64_t> g_transfer_id(0);
+
+struct TrackedBlockHeader {
+  std::shared_ptr<TransferWindow> window;
+  size_t length;
+  // start of the allocation, aligned blocks put padding before the header
+  void *base;
+};
+static_assert(sizeof(TrackedBlockHeader) <= TRACKED_BLOCK_HEADER_SIZE,
+              "tracked block header does not fit");
+
+static TrackedBlockHeader *HeaderOf(void *data) {
+  return reinterpret_cast<TrackedBlockHeader *>(static_cast<char *>(data) -
+                                                TRACKED_BLOCK_HEADER_SIZE);
+}
+
+// Called by brpc once the socket has written the last byte of the block
+static void ReleaseTrackedBlock(void *data) {
+  TrackedBlockHeader *header = HeaderOf(data);
+  if (header->window) {
+    header->window->Release(header->length);
+  }
+  void *base = header->base;
+  header->~TrackedBlockHeader();
+  free(base);
+}
+
+int64_t TransferWindow::WaitForRoom(int64_t slack) {
+  std::unique_lock<bthread::Mutex> lock(mutex_);
+  if (inflight_ < max_inflight_ + slack) {
+    return 0;
+  }
+  int64_t begin = butil::monotonic_time_us();
+  while (inflight_ >= max_inflight_ + slack) {
+    cond_.wait(lock);
+  }
+  return butil::monotonic_time_us() - begin;
+}
+
+void TransferWindow::Charge(int64_t bytes) {
+  std::lock_guard<bthread::Mutex> guard(mutex_);
+  inflight_ += bytes;
+}
+
+void TransferWindow::Release(int64_t bytes) {
+  std::lock_guard<bthread::Mutex> guard(mutex_);
+  inflight_ -= bytes;
+  cond_.notify_all();
+}
+
+int64_t TransferWindow::inflight() {
+  std::lock_guard<bthread::Mutex> guard(mutex_);
+  return inflight_;
+}
+
+char *TrackedBlock::Allocate(size_t capacity,
+                             const std::shared_ptr<TransferWindow> &window,
+                             size_t alignment) {
+  void *block = nullptr;
+  size_t data_offset = TRACKED_BLOCK_HEADER_SIZE;
+  if (alignment > TRACKED_BLOCK_HEADER_SIZE) {
+    // the header sits right below the aligned data
+    if (posix_memalign(&block, alignment, alignment + capacity) != 0) {
+      return nullptr;
+    }
+    data_offset = alignment;
+  } else {
+    block = malloc(TRACKED_BLOCK_HEADER_SIZE + capacity);
+    if (block == nullptr) {
+      return nullptr;
+    }
+  }
+  char *data = static_cast<char *>(block) + data_offset;
+  TrackedBlockHeader *header = new (HeaderOf(data)) TrackedBlockHeader;
+  header->window = window;
+  header->length = 0;
+  header->base = block;
+  return data;
+}
+
+int TrackedBlock::Append(char *data, size_t length, butil::IOBuf *out) {
+  TrackedBlockHeader *header = HeaderOf(data);
+  if (length == 0) {
+    Free(data);
+    return 0;
+  }
+  header->length = length;
+  if (header->window) {
+    header->window->Charge(length);
+  }
+  if (out->append_user_data(data, length, ReleaseTrackedBlock) != 0) {
+    ReleaseTrackedBlock(data);
+    return -1;
+  }
+  return 0;
+}
+
+void TrackedBlock::Free(char *data) {
+  TrackedBlockHeader *header = HeaderOf(data);
+  void *base = header->base;
+  header->~TrackedBlockHeader();
+  free(base);
+}
+
+FlowControlledWriter::FlowControlledWriter(
+    butil::intrusive_ptr<brpc::ProgressiveAttachment> pa, int64_t window_size,
+    const std::string &name)
+    : pa_(pa), window_(std::make_shared<TransferWindow>(window_size)),
+      name_(name), broken_(false) {
+  stall_us_.expose("node_mgr_transfer_" + std::to_string(++g_transfer_id) +
+                   "_stall_us");
+}
+
+FlowControlledWriter::~FlowControlledWriter() {
+  int64_t stall = stall_us_.get_value();
+  g_transfer_stall_us << stall;
+  KLOG_INFO("transfer {} stalled {} us on the peer", name_, stall);
+}
+
+void FlowControlledWriter::WaitForRoom(int64_t slack) {
+  stall_us_ << window_->WaitForRoom(slack);
+}
+
+bool FlowControlledWriter::Write(const butil::IOBuf &data) {
+  if (broken_) {
+    return false;
+  }
+  int64_t backoff_us = OVERCROWDED_BACKOFF_MIN_US;
+  while (pa_->Write(data) != 0) {
+    if (errno != brpc::EOVERCROWDED) {
+      KLOG_ERROR("transfer {} write failed: {}", name_, strerror(errno));
+      broken_ = true;
+      return false;
+    }
+    int64_t begin = butil::monotonic_time_us();
+    bthread_usleep(backoff_us);
+    stall_us_ << butil::monotonic_time_us() - begin;
+    backoff_us = std::min(backoff_us * 2, (int64_t)OVERCROWDED_BACKOFF_MAX_US);
+  }
+  return true;
+}
+
+bool FlowControlledWriter::Write(const void *data, size_t n) {
+  WaitForRoom();
+  char *block = TrackedBlock::Allocate(n, window_);
+  if (block == nullptr) {
+    KLOG_ERROR("transfer {} allocate {} bytes failed", name_, n);
+    return false;
+  }
+  memcpy(block, data, n);
+  butil::IOBuf buf;
+  if (TrackedBlock::Append(block, n, &buf) != 0) {
+    KLOG_ERROR("transfer {} append {} bytes to IOBuf failed", name_, n);
+    return false;
+  }
+  return Write(buf);
+}
+
+} // namespace kunlun
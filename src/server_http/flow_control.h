@@ -0,0 +1,108 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#ifndef _NODE_MGR_FLOW_CONTROL_H_
+#define _NODE_MGR_FLOW_CONTROL_H_
+
+#include "brpc/progressive_attachment.h"
+#include "bthread/condition_variable.h"
+#include "bthread/mutex.h"
+#include "butil/iobuf.h"
+#include "bvar/bvar.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace kunlun {
+
+/*
+  Bytes of one transfer which were handed to the socket but not written
+  yet. Blocks appended to the IOBuf through TrackedBlock (or the mmap'd
+  windows of FileChunkReader) charge the window when they are appended and
+  release it from the IOBuf deleter, that is once brpc wrote them out.
+  Deleters may run after the transfer returned, so the window is shared.
+*/
+class TransferWindow {
+public:
+  explicit TransferWindow(int64_t max_inflight)
+      : max_inflight_(max_inflight), inflight_(0) {}
+
+  // Park the calling bthread until less than max_inflight + slack bytes
+  // are in flight. Return the microseconds spent waiting
+  int64_t WaitForRoom(int64_t slack = 0);
+  void Charge(int64_t bytes);
+  void Release(int64_t bytes);
+  int64_t inflight();
+
+private:
+  // forbid copy
+  TransferWindow(const TransferWindow &rht) = delete;
+  TransferWindow &operator=(const TransferWindow &rht) = delete;
+
+  bthread::Mutex mutex_;
+  bthread::ConditionVariable cond_;
+  int64_t max_inflight_;
+  int64_t inflight_;
+};
+
+// Heap block whose release from the last IOBuf is reported to a window
+class TrackedBlock {
+public:
+  // Return a buffer of `capacity` bytes to be filled by the caller,
+  // starting at a multiple of `alignment` if that is a power of two
+  // larger than the block header
+  static char *Allocate(size_t capacity,
+                        const std::shared_ptr<TransferWindow> &window,
+                        size_t alignment = 0);
+  // Hand the first `length` bytes of `data` over to `out`, the block
+  // belongs to the IOBuf afterwards even on failure
+  static int Append(char *data, size_t length, butil::IOBuf *out);
+  // Free a block that never made it into an IOBuf
+  static void Free(char *data);
+};
+
+/*
+  Write side of a progressive attachment which neither spins nor queues
+  without bound: callers wait for room in the transfer window before they
+  produce the next piece, and an overcrowded socket is retried with
+  exponential backoff. Any other write error means the peer is gone.
+  Time spent waiting is exported as the bvar
+  `node_mgr_transfer_<id>_stall_us` while the transfer lives and summed up
+  in `node_mgr_transfer_stall_us` afterwards.
+*/
+class FlowControlledWriter {
+public:
+  FlowControlledWriter(butil::intrusive_ptr<brpc::ProgressiveAttachment> pa,
+                       int64_t window_size, const std::string &name);
+  ~FlowControlledWriter();
+
+  const std::shared_ptr<TransferWindow> &window() const { return window_; }
+  int64_t stall_us() const { return stall_us_.get_value(); }
+
+  // `slack`: bytes charged to the window but still held by the caller,
+  // the socket can not drain them
+  void WaitForRoom(int64_t slack = 0);
+  // Return false once the peer can not be written any more
+  bool Write(const butil::IOBuf &data);
+  // Copy `n` bytes into a tracked block and write it
+  bool Write(const void *data, size_t n);
+
+private:
+  // forbid copy
+  FlowControlledWriter(const FlowControlledWriter &rht) = delete;
+  FlowControlledWriter &operator=(const FlowControlledWriter &rht) = delete;
+
+  butil::intrusive_ptr<brpc::ProgressiveAttachment> pa_;
+  std::shared_ptr<TransferWindow> window_;
+  std::string name_;
+  bvar::Adder<int64_t> stall_us_;
+  bool broken_;
+};
+
+} // namespace kunlun
+
+#endif /*_NODE_MGR_FLOW_CONTROL_H_*/
@@ -1,23 +1,39 @@
 #include "server_http.h"
+#include "body_sender.h"
+#include "bulk_stream.h"
+#include "control_service.h"
+#include "delta_format.h"
+#include "file_chunk.h"
+#include "file_upload.h"
+#include "path_index.h"
+#include "sparse_format.h"
+#include "tar_stream.h"
 #include "backup_task/backup_dealer.h"
 #include "bthread/bthread.h"
 #include "butil/iobuf.h"
+#include "butil/time.h"
 #include "install_task/mysql_install_dealer.h"
 #include "install_task/mysql_uninstall_dealer.h"
 #include "install_task/postgres_install_dealer.h"
 #include "install_task/postgres_uninstall_dealer.h"
 #include "install_task/exporter_install_dealer.h"
 #include "install_task/exporter_uninstall_dealer.h"
+#include "request_dealer/batch_job.h"
+#include "request_dealer/job_table.h"
 #include "request_dealer/request_dealer.h"
 #include "restore_task/restore_mysql_dealer.h"
 #include "restore_task/restore_postgres_dealer.h"
 #include "strings.h"
 #include "sys.h"
-#include "zettalib/biodirectpopen.h"
-#include "zettalib/microsec_interval.h"
+#include "traffic_governor.h"
+#include "util_func/child_process.h"
+#include "util_func/job_executor.h"
 #include "zettalib/op_log.h"
 #include "zettalib/tool_func.h"
+#include <algorithm>
+#include <gflags/gflags.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -25,83 +41,71 @@
 #include <unistd.h>
 
 int64_t node_mgr_brpc_http_port;
+int64_t transfer_window_size = 16 * 1024 * 1024;
+int64_t bulk_read_threshold = 1024LL * 1024 * 1024;
+int64_t bulk_stream_window = 16 * 1024 * 1024;
+int64_t socket_buffer_size = 0;
 extern std::string node_mgr_tmp_data_path;
 extern std::string node_mgr_util_path;
 extern std::string local_ip;
-static RequestDealer *RequestDealerFactory(brpc::Controller *cntl);
+static RequestDealer *ParsedDealer(Json::Value &request);
 #define READ_BUFF_LEN 4096
-#define SEND_BUFFER_SIZE 1024
 
 using namespace kunlun;
 
-struct DoDealArg {
-  brpc::Controller *cntl;
-  RequestDealer *dealer;
-  google::protobuf::Closure *done;
-};
-
-static void *DoDeal(void *para){
-  DoDealArg *args = (DoDealArg *)para;
-  args->dealer->Deal();
-  std::string response_l = args->dealer->FetchResponse();
-  args->cntl->http_response().set_content_type("text/plain");
-  args->cntl->response_attachment().append(response_l);
-  args->done->Run();
-  delete args->dealer;
-  delete args;
-  return nullptr;
-}
-
 struct ShellServiceArg {
   butil::intrusive_ptr<brpc::ProgressiveAttachment> pa;
   brpc::Controller *cntl;
   std::string cmd;
 };
 
+// Every piece of output of the shell command goes out behind a header
+// line `<stdout|stderr> <unix time in us> <length>\n`, a last `exit`
+// frame carries the exit status. A command which could not be run gets
+// an `error` frame with the reason instead
+static void AppendShellFrame(butil::IOBuf *out, const char *stream,
+                             const char *data, size_t length) {
+  out->append(kunlun::string_sprintf("%s %ld %lu\n", stream,
+                                     butil::gettimeofday_us(), length));
+  out->append(data, length);
+}
+
+static bool WriteShellFrame(FlowControlledWriter *writer, const char *stream,
+                            const char *data, size_t length) {
+  butil::IOBuf frame;
+  AppendShellFrame(&frame, stream, data, length);
+  return writer->Write(frame);
+}
+
 static void *DoShellCmd(void *para) {
   std::unique_ptr<ShellServiceArg> arg(static_cast<ShellServiceArg *>(para));
-  std::unique_ptr<kunlun::BiodirectPopen> biopopen(
-      new kunlun::BiodirectPopen(arg->cmd.c_str()));
-  char buffer[SEND_BUFFER_SIZE] = {'\0'};
-  int ret = 0;
-  FILE *stdout_fp = nullptr;
-  FILE *stderr_fp = nullptr;
-
-  ret = biopopen->Launch("r");
-  if (!ret) {
-    // TODO: Wraper need to be modified to encode error info
-    // WrapTheFailedResponse(para, strerror(errno));
-    KLOG_ERROR("Open File to be trasmitted failed: {}", strerror(errno));
+  FlowControlledWriter writer(arg->pa, transfer_window_size, arg->cmd);
+
+  // both pipes are drained as the output arrives, a chatty stderr can not
+  // stall the child while stdout is being sent
+  kunlun::ChildProcess child(arg->cmd);
+  child.set_chunk_sink(
+      [&writer](const char *data, size_t length, bool is_stderr) {
+        return WriteShellFrame(&writer, is_stderr ? "stderr" : "stdout", data,
+                               length);
+      });
+  if (!child.Launch()) {
+    std::string err = child.getErr();
+    KLOG_ERROR("Launch shell command failed: {}", err);
+    WriteShellFrame(&writer, "error", err.data(), err.size());
     return nullptr;
   }
-  stdout_fp = biopopen->getReadStdOutFp();
-  stderr_fp = biopopen->getReadStdErrFp();
-
-  // response stdout and stderr
-  snprintf(buffer, SEND_BUFFER_SIZE, "===STDOUT===\n");
-  while (arg->pa->Write(buffer, SEND_BUFFER_SIZE) < 0) {
-    bthread_usleep(1);
-  }
-  bzero((void *)buffer, SEND_BUFFER_SIZE);
-
-  while (fgets(buffer, SEND_BUFFER_SIZE, stdout_fp)) {
-    while (arg->pa->Write(buffer, SEND_BUFFER_SIZE) < 0) {
-      bthread_usleep(1);
-    }
-    bzero((void *)buffer, SEND_BUFFER_SIZE);
+  // returns once the child exited, a daemon it left behind holding the
+  // pipes does not hold the frames up. Fails only when the peer is gone
+  if (!child.Wait()) {
+    KLOG_ERROR("{}", child.getErr());
+    // the child leads a process group of its own, take what it forked along
+    kill(-child.pid(), SIGKILL);
+    return nullptr;
   }
 
-  snprintf(buffer, SEND_BUFFER_SIZE, "===STDERR===\n");
-  while (arg->pa->Write(buffer, SEND_BUFFER_SIZE) < 0) {
-    bthread_usleep(1);
-  }
-  bzero((void *)buffer, SEND_BUFFER_SIZE);
-  while (fgets(buffer, SEND_BUFFER_SIZE, stderr_fp)) {
-    while (arg->pa->Write(buffer, SEND_BUFFER_SIZE) < 0) {
-      bthread_usleep(1);
-    }
-    bzero((void *)buffer, SEND_BUFFER_SIZE);
-  }
+  std::string status = std::to_string(child.exit_code());
+  WriteShellFrame(&writer, "exit", status.data(), status.size());
   return nullptr;
 }
 
@@ -116,8 +120,12 @@ void HttpServiceImpl::Shell(google::protobuf::RpcController *cntl_base,
   Json::Reader reader;
   Json::Value root;
   bool ret = reader.parse(orig_request, root);
-  if (!ret) {
-    // TODO
+  if (!ret || !root["command"].isString()) {
+    std::string err = ret ? "command is missing"
+                          : reader.getFormattedErrorMessages();
+    KLOG_ERROR("Shell service got a bad request: {}", err);
+    AppendShellFrame(&cntl->response_attachment(), "error", err.data(),
+                     err.size());
     return;
   }
 
@@ -129,8 +137,9 @@ void HttpServiceImpl::Shell(google::protobuf::RpcController *cntl_base,
   para->cmd = root["command"].asString();
   para->cntl = cntl;
 
-  bthread_t th;
-  bthread_start_background(&th, nullptr, DoShellCmd, para.release());
+  // the command blocks till it exits, keep it off the brpc workers
+  ShellServiceArg *arg = para.release();
+  JobExecutor::get_instance()->Submit("shell", [arg] { DoShellCmd(arg); });
 }
 
 void HttpServiceImpl::Emit(google::protobuf::RpcController *cntl_base,
@@ -140,33 +149,83 @@ void HttpServiceImpl::Emit(google::protobuf::RpcController *cntl_base,
   brpc::Controller *cntl = static_cast<brpc::Controller *>(cntl_base);
 
   // Sync Deal request here
-  KLOG_INFO("get original request from cluster_mgr: {}",
-         cntl->request_attachment().to_string());
+  const std::string body = cntl->request_attachment().to_string();
+  KLOG_INFO("get original request from cluster_mgr: {}", body);
 
-  // TODO: make a wrapper to do this json stuff
-  std::string response_l;
-  RequestDealer *dealer = RequestDealerFactory(cntl);
-  if (dealer == nullptr) {
-    dealer = new RequestDealer(cntl->request_attachment().to_string().c_str());
+  // parsed once here, the dealer takes the document over
+  Json::Value root;
+  Json::Reader reader;
+  bool parsed =
+      reader.parse(body.data(), body.data() + body.size(), root, false);
+  RequestDealer *dealer = RequestDealerFactory(root);
+  std::string parse_err;
+  if (!parsed) {
+    parse_err = reader.getFormattedErrorMessages();
+    dealer->MarkAborted(parse_err);
+  } else if (!dealer->ParseRequest()) {
+    parse_err = dealer->getErr();
   }
-  if (!dealer->ParseRequest()) {
-    response_l = dealer->FetchResponse();
-    KLOG_ERROR("Parse Cluster mgr request failed: {}", dealer->getErr());
+  if (!parse_err.empty()) {
+    KLOG_ERROR("Parse Cluster mgr request failed: {}", parse_err);
     cntl->http_response().set_content_type("text/plain");
-    cntl->response_attachment().append(response_l);
+    cntl->response_attachment().append(dealer->FetchResponse());
+    delete dealer;
+    return;
+  }
+  if (JobTable::IsQueryType(dealer->request_type())) {
+    dealer->Deal();
+    cntl->http_response().set_content_type("text/plain");
+    cntl->response_attachment().append(dealer->FetchResponse());
     delete dealer;
     return;
   }
-  //deal the request async
-  done_gurad.release();
 
-  DoDealArg * para = new DoDealArg();
-  para->dealer = dealer;
-  para->cntl = cntl;
-  para->done = done;
+  if (dealer->request_type() == kunlun::kBatchJobsType) {
+    std::shared_ptr<BatchJob> batch(new BatchJob);
+    if (!batch->Prepare(dealer->request_json(), ParsedDealer)) {
+      KLOG_ERROR("batch request invalid: {}", batch->getErr());
+      dealer->MarkAborted(batch->getErr());
+      cntl->http_response().set_content_type("text/plain");
+      cntl->response_attachment().append(dealer->FetchResponse());
+      delete dealer;
+      return;
+    }
+    delete dealer;
+    done_gurad.release();
+    batch->Start([cntl, done](const std::string &response) {
+      cntl->http_response().set_content_type("text/plain");
+      cntl->response_attachment().append(response);
+      done->Run();
+    });
+    return;
+  }
 
-  bthread_t th;
-  bthread_start_background(&th, nullptr, DoDeal, (void *)para);
+  // the job runs in the background, only its id is returned
+  if (dealer->IsAsync()) {
+    Json::Value root;
+    root["cluster_mgr_request_id"] =
+        dealer->request_json()["cluster_mgr_request_id"].asString();
+    bool duplicate = false;
+    root["info"]["job_id"] =
+        JobTable::get_instance()->Submit(dealer, nullptr, &duplicate);
+    root["status"] = "accepted";
+    // a repeated request gets the id of the job it repeats
+    root["info"]["duplicate"] = duplicate;
+    Json::FastWriter writer;
+    writer.omitEndingLineFeed();
+    cntl->http_response().set_content_type("text/plain");
+    cntl->response_attachment().append(writer.write(root));
+    return;
+  }
+
+  //deal the request async
+  done_gurad.release();
+  JobTable::get_instance()->Submit(
+      dealer, [cntl, done](const std::string &response) {
+        cntl->http_response().set_content_type("text/plain");
+        cntl->response_attachment().append(response);
+        done->Run();
+      });
 }
 
 struct Args {
@@ -174,6 +233,24 @@ struct Args {
   brpc::Controller *cntl;
   std::string resolved_file_path;
   int64_t bytes_per_second = 5242880;
+  // share of the host wide bandwidth relative to the other transfers
+  int64_t weight = 1;
+  kunlun::FileSendMode send_mode = kunlun::kFileSendAuto;
+  kunlun::FileCompressType compress = kunlun::kFileCompressNone;
+  // append a crc32c trailer after the body
+  bool checksum = false;
+  // set when the path is a directory, it is sent as a tar archive
+  std::unique_ptr<kunlun::TarStreamer> archive;
+  int read_parallel = TAR_READ_PARALLEL;
+  // byte range requested by the `Range` header, length -1 means till EOF
+  int64_t offset = 0;
+  int64_t length = -1;
+  // size when the request was resolved, picks the send mode
+  int64_t file_size = 0;
+  // send only the data extents of a sparse file
+  bool sparse = false;
+  // signatures of the copy the peer has, the body is the delta against it
+  std::unique_ptr<kunlun::DeltaSignatures> delta;
 };
 
 static void WrapTheFailedResponse(void *para, const char *info) {
@@ -190,87 +267,331 @@ static void WrapTheFailedResponse(void *para, const char *info) {
   args->pa->Write(res.c_str(), res.size());
 }
 
-// return none empty string means successfully
-static std::string ReolveFilename(const std::string &orig_filename) {
-  std::string node_mgr_data_abs_path =
-      kunlun::ConvertToAbsolutePath(node_mgr_tmp_data_path.c_str());
-  std::string file_abs_path = node_mgr_data_abs_path + "/" + orig_filename;
-
-  bool ret = kunlun::CheckFileExists(file_abs_path.c_str());
-  if (!ret) {
-    KLOG_INFO("FileService File Not Found: {}", file_abs_path);
-    return "";
+// entry.exists false means not found, the stat of a found entry is filled
+static PathEntry ReolveFilename(const std::string &orig_filename) {
+  PathEntry entry =
+      PathIndex::get_instance()->Lookup(PathIndex::kTmpDataRoot, orig_filename);
+  if (!entry.exists ||
+      !(S_ISREG(entry.st.st_mode) || S_ISDIR(entry.st.st_mode))) {
+    KLOG_INFO("FileService File Not Found: {}", entry.abs_path);
+    entry.exists = false;
+    return entry;
   }
-  KLOG_INFO( "FileService File Found: {}", file_abs_path);
-  return file_abs_path;
+  KLOG_INFO( "FileService File Found: {}", entry.abs_path);
+  return entry;
 }
 
-static void *SendFile(void *para) {
-  std::unique_ptr<Args> args(static_cast<Args *>(para));
-  std::string resolved = args->resolved_file_path;
-
-  // timeout interval is 100 microsecond
-  int interval_para_microsec = 2;
-  kunlun::MicroSecInterval timer(interval_para_microsec, 0);
-  int64_t bytes_per_sec = args->bytes_per_second;
-  int64_t bytes_send_counter = 0;
-  int inner_check_counter = 0;
-
-  char buff[SEND_BUFFER_SIZE] = {'\0'};
-  size_t ret = 0;
+// Parse a single `bytes=` range against a file of `file_size` bytes into
+// the inclusive [*first, *last]. Return false if it can not be satisfied
+static bool ParseRangeHeader(const std::string &range, int64_t file_size,
+                             int64_t *first, int64_t *last) {
+  const char *prefix = "bytes=";
+  if (range.compare(0, strlen(prefix), prefix) != 0 ||
+      range.find(',') != std::string::npos) {
+    return false;
+  }
+  std::string spec = range.substr(strlen(prefix));
+  size_t dash = spec.find('-');
+  if (dash == std::string::npos || file_size <= 0) {
+    return false;
+  }
+  std::string first_str = spec.substr(0, dash);
+  std::string last_str = spec.substr(dash + 1);
+  char *endptr = nullptr;
+
+  if (first_str.empty()) {
+    // suffix range: the last N bytes
+    int64_t suffix = strtoll(last_str.c_str(), &endptr, 10);
+    if (last_str.empty() || *endptr != '\0' || suffix <= 0) {
+      return false;
+    }
+    *first = suffix >= file_size ? 0 : file_size - suffix;
+    *last = file_size - 1;
+    return true;
+  }
 
-  int fd = open(resolved.c_str(), O_RDONLY);
-  if (fd < 0) {
-    WrapTheFailedResponse(para, strerror(errno));
-    KLOG_ERROR("Open File to be trasmitted failed: {}", strerror(errno));
-    goto end;
+  *first = strtoll(first_str.c_str(), &endptr, 10);
+  if (*endptr != '\0' || *first < 0 || *first >= file_size) {
+    return false;
+  }
+  *last = file_size - 1;
+  if (!last_str.empty()) {
+    int64_t last_pos = strtoll(last_str.c_str(), &endptr, 10);
+    if (*endptr != '\0' || last_pos < *first) {
+      return false;
+    }
+    *last = std::min(last_pos, file_size - 1);
   }
+  return true;
+}
 
+// Send [offset, offset + length) of the file, length -1 means till EOF.
+// `sent`, if given, counts the bytes sent. Return false once the transfer
+// broke off, a read error is reported to the peer too
+static bool SendFileRange(Args *args, BodySender *sender,
+                          kunlun::FileChunkReader *reader, off_t offset,
+                          int64_t length, int64_t *sent) {
+  int64_t remaining = length;
   for (;;) {
-    ret = read(fd, buff, SEND_BUFFER_SIZE);
+    // keep one chunk well below the per-second share, the share changes
+    // whenever a transfer starts or stops
+    size_t want = reader->chunk_size();
+    int64_t rate = sender->rate();
+    if (rate > 0 && want > (size_t)(rate / 8)) {
+      want = std::max((size_t)(rate / 8), (size_t)SEND_BUFFER_SIZE);
+    }
+    if (remaining >= 0 && (int64_t)want > remaining) {
+      want = remaining;
+    }
+    // do not read ahead of a peer which is not keeping up
+    sender->WaitForRoom();
+    butil::IOBuf chunk;
+    ssize_t ret = reader->ReadChunk(offset, want, &chunk);
     if (ret < 0) {
-      WrapTheFailedResponse(para, strerror(errno));
-      KLOG_ERROR( "Read File failed: {}", strerror(errno));
-      break;
+      WrapTheFailedResponse(args, reader->getErr());
+      KLOG_ERROR("Read File failed: {}", reader->getErr());
+      return false;
     } else if (ret == 0) {
-      // syslog(Logger::INFO,"read ret 0");
       break;
-    } else {
-      for (;;) {
-        if (timer.timeout()) {
-          // do check
-          inner_check_counter++;
-          if (inner_check_counter >= (1000000 / interval_para_microsec)) {
-            // traffic control under seconde level
-            inner_check_counter = 0;
-            bytes_send_counter = 0;
-          }
-          if (bytes_send_counter >= bytes_per_sec) {
-            // stop and wait in the rest of the one seconde long
-            // bthread_usleep counter as microseconde
-            bthread_usleep(
-                ((1000000 / interval_para_microsec) - inner_check_counter) *
-                interval_para_microsec);
-            inner_check_counter = 0;
-            bytes_send_counter = 0;
-            continue;
-          }
-        }
-
-        while (args->pa->Write(buff, ret) < 0) {
-          bthread_usleep(1);
-        }
-        bytes_send_counter += ret;
-        break;
-      }
     }
+
+    if (!sender->Send(&chunk)) {
+      KLOG_ERROR("Send {} stopped at offset {}: {}", args->resolved_file_path,
+                 offset, sender->getErr());
+      return false;
+    }
+    offset += ret;
+    if (sent != nullptr) {
+      *sent += ret;
+    }
+    if (remaining >= 0) {
+      remaining -= ret;
+    }
+  }
+  return true;
+}
+
+static bool SendString(BodySender *sender, const std::string &data) {
+  butil::IOBuf buf;
+  buf.append(data);
+  return sender->Send(&buf);
+}
+
+// Send only the data extents of the requested range, each behind its
+// extent header, then an empty extent where the range ends. Holes cost
+// neither reads nor network bytes
+static bool SendExtents(Args *args, BodySender *sender,
+                        kunlun::FileChunkReader *reader) {
+  const std::string &resolved = args->resolved_file_path;
+  off_t offset = args->offset;
+  int64_t end = args->length >= 0 ? args->offset + args->length : -1;
+  for (;;) {
+    off_t data_begin = 0;
+    off_t data_end = 0;
+    if (!reader->NextExtent(offset, &data_begin, &data_end)) {
+      WrapTheFailedResponse(args, reader->getErr());
+      KLOG_ERROR("Map extents of {} failed: {}", resolved, reader->getErr());
+      return false;
+    }
+    if (end >= 0) {
+      data_begin = std::min((int64_t)data_begin, end);
+      data_end = std::min((int64_t)data_end, end);
+    }
+    offset = data_begin;
+    if (data_begin >= data_end) {
+      break;
+    }
+
+    int64_t length = data_end - data_begin;
+    int64_t sent = 0;
+    if (!SendString(sender, kunlun::SparseExtentHeader(data_begin, length))) {
+      KLOG_ERROR("Send {} stopped at offset {}: {}", resolved, data_begin,
+                 sender->getErr());
+      return false;
+    }
+    if (!SendFileRange(args, sender, reader, data_begin, length, &sent)) {
+      return false;
+    }
+    // the header promised `length` bytes, the stream is garbage without them
+    if (sent != length) {
+      KLOG_ERROR("{} shrank while being sent, stopped at offset {}", resolved,
+                 data_begin + sent);
+      return false;
+    }
+    offset = data_end;
+  }
+  if (!SendString(sender, kunlun::SparseExtentHeader(offset, 0))) {
+    KLOG_ERROR("Send {} failed at the end: {}", resolved, sender->getErr());
+    return false;
+  }
+  return true;
+}
+
+// Send the file as the delta against the peer's copy, blocks the peer
+// already has go out as references to them
+static void *SendDelta(void *para) {
+  std::unique_ptr<Args> args(static_cast<Args *>(para));
+  std::string resolved = args->resolved_file_path;
+
+  BodySender sender(args->pa, args->weight, args->bytes_per_second,
+                    args->compress, args->checksum, resolved);
+  std::shared_ptr<SharedFile> file =
+      PathIndex::get_instance()->OpenShared(resolved);
+  if (!file) {
+    std::string err = kunlun::string_sprintf("Open %s failed: %s",
+                                             resolved.c_str(), strerror(errno));
+    WrapTheFailedResponse(para, err.c_str());
+    KLOG_ERROR("{}", err);
+    return nullptr;
+  }
+  if (!sender.Start()) {
+    KLOG_ERROR("{}", sender.getErr());
+    return nullptr;
+  }
+
+  kunlun::DeltaEncoder encoder(*args->delta);
+  butil::Status status = encoder.Run(file->fd(), [&](butil::IOBuf *buf) {
+    sender.WaitForRoom();
+    return sender.Send(buf);
+  });
+  if (!status.ok()) {
+    KLOG_ERROR("Send delta of {} failed: {} {}", resolved, status.error_str(),
+               sender.getErr());
+    return nullptr;
   }
+  KLOG_INFO("Sent delta of {}: {} bytes matched, {} bytes literal", resolved,
+            encoder.copied_bytes(), encoder.literal_bytes());
 
-end:
-  close(fd);
+  if (!sender.Finish()) {
+    KLOG_ERROR("Send {} failed at the end: {}", resolved, sender.getErr());
+  }
+  return nullptr;
+}
+
+static void *SendFile(void *para) {
+  std::unique_ptr<Args> args(static_cast<Args *>(para));
+  std::string resolved = args->resolved_file_path;
+
+  // traffic_limit caps this transfer, the host wide limit is shared by weight
+  BodySender sender(args->pa, args->weight, args->bytes_per_second,
+                    args->compress, args->checksum, resolved);
+
+  kunlun::FileSendMode mode = kunlun::ResolveFileSendMode(
+      args->send_mode, args->file_size, bulk_read_threshold,
+      sender.reads_payload());
+  kunlun::FileChunkReader reader(mode);
+  reader.set_window(sender.window());
+  // concurrent downloads of one file read through the same fd, a direct
+  // read needs an O_DIRECT fd of its own
+  std::shared_ptr<SharedFile> file;
+  if (mode != kunlun::kFileSendDirect) {
+    file = PathIndex::get_instance()->OpenShared(resolved);
+  }
+  bool opened = file ? reader.Open(file) : reader.Open(resolved);
+  if (!opened) {
+    WrapTheFailedResponse(para, reader.getErr());
+    KLOG_ERROR("Open File to be trasmitted failed: {}", reader.getErr());
+    return nullptr;
+  }
+  if (!sender.Start()) {
+    KLOG_ERROR("{}", sender.getErr());
+    return nullptr;
+  }
+
+  bool ok = args->sparse ? SendExtents(args.get(), &sender, &reader)
+                         : SendFileRange(args.get(), &sender, &reader,
+                                         args->offset, args->length, nullptr);
+  if (!ok) {
+    return nullptr;
+  }
+
+  if (!sender.Finish()) {
+    KLOG_ERROR("Send {} failed at the end: {}", resolved, sender.getErr());
+  }
+  return nullptr;
+}
+
+static void *SendDirectory(void *para) {
+  std::unique_ptr<Args> args(static_cast<Args *>(para));
+  std::string resolved = args->resolved_file_path;
+
+  BodySender sender(args->pa, args->weight, args->bytes_per_second,
+                    args->compress, args->checksum, resolved);
+  if (!sender.Start()) {
+    KLOG_ERROR("{}", sender.getErr());
+    return nullptr;
+  }
+  // an archive cut short ends without the checksum trailer
+  if (!args->archive->Run(&sender, args->send_mode, args->read_parallel)) {
+    KLOG_ERROR("Send directory {} failed: {}", resolved,
+               args->archive->getErr());
+    return nullptr;
+  }
+  if (!sender.Finish()) {
+    KLOG_ERROR("Send {} failed at the end: {}", resolved, sender.getErr());
+  }
   return nullptr;
 }
 
+// A baidu_std call of FileService which brings a stream: the range named
+// in the request goes out over the stream, paced by its window
+static void AcceptBulkStream(brpc::Controller *cntl) {
+  Json::Value root;
+  Json::Reader reader;
+  if (!reader.parse(cntl->request_attachment().to_string(), root) ||
+      !root.isMember("file")) {
+    cntl->SetFailed(EINVAL, "Bulk stream request without a file");
+    return;
+  }
+  PathEntry resolved = ReolveFilename(root["file"].asString());
+  if (!resolved.exists || !S_ISREG(resolved.st.st_mode)) {
+    cntl->SetFailed(ENOENT, "File Not Found: %s",
+                    root["file"].asString().c_str());
+    return;
+  }
+
+  std::unique_ptr<kunlun::BulkStreamTask> task(new kunlun::BulkStreamTask);
+  task->path = resolved.abs_path;
+  task->file_size = resolved.st.st_size;
+  task->offset = ::atoll(root.get("offset", "0").asString().c_str());
+  task->length = ::atoll(root.get("length", "-1").asString().c_str());
+  task->bytes_per_second =
+      ::atoll(root.get("traffic_limit", "5242880").asString().c_str());
+  task->weight = ::atoll(root.get("weight", "1").asString().c_str());
+  task->send_mode = kunlun::GetFileSendModeByStr(
+      root.get("send_mode", "auto").asString().c_str());
+  if (task->send_mode == kunlun::kFileSendModeMax) {
+    task->send_mode = kunlun::kFileSendAuto;
+  }
+  if (task->offset < 0 || task->offset > task->file_size ||
+      (task->length >= 0 && task->offset + task->length > task->file_size)) {
+    cntl->SetFailed(EINVAL, "Range %ld+%ld is beyond the %ld bytes of %s",
+                    task->offset, task->length, task->file_size,
+                    task->path.c_str());
+    return;
+  }
+
+  brpc::StreamOptions options;
+  // the window: bytes the receiver has not consumed yet
+  options.max_buf_size = bulk_stream_window;
+  if (brpc::StreamAccept(&task->stream, *cntl, &options) != 0) {
+    cntl->SetFailed("Accept bulk stream failed");
+    return;
+  }
+  Json::Value result;
+  result["status"] = "success";
+  result["size"] = std::to_string(task->file_size);
+  Json::FastWriter writer;
+  writer.omitEndingLineFeed();
+  cntl->response_attachment().append(writer.write(result));
+  KLOG_INFO("FileService streams {} from {} to {}", task->path, task->offset,
+            butil::endpoint2str(cntl->remote_side()).c_str());
+
+  bthread_t th;
+  bthread_start_background(&th, nullptr, kunlun::BulkStreamSender::Start,
+                           task.release());
+}
+
 void FileServiceImpl::default_method(google::protobuf::RpcController *cntl_base,
                                      const HttpRequest *request,
                                      HttpResponse *response,
@@ -278,9 +599,19 @@ void FileServiceImpl::default_method(google::protobuf::RpcController *cntl_base,
 
   brpc::ClosureGuard done_guard(done);
   brpc::Controller *cntl = static_cast<brpc::Controller *>(cntl_base);
+  if (cntl->has_remote_stream()) {
+    AcceptBulkStream(cntl);
+    return;
+  }
   const std::string &filename = cntl->http_request().unresolved_path();
-  resolved_file_path_ = ReolveFilename(filename);
-  if (resolved_file_path_.empty()) {
+  // GET/POST download the file, PUT uploads it
+  if (cntl->http_request().method() == brpc::HTTP_METHOD_PUT) {
+    kunlun::FileUploader::get_instance()->Handle(cntl, filename,
+                                                 done_guard.release());
+    return;
+  }
+  PathEntry resolved = ReolveFilename(filename);
+  if (!resolved.exists) {
     cntl->http_response().set_status_code(
         brpc::HTTP_STATUS_INTERNAL_SERVER_ERROR);
     char buff[4096] = {'\0'};
@@ -295,26 +626,181 @@ void FileServiceImpl::default_method(google::protobuf::RpcController *cntl_base,
     return;
   }
 
+  // a directory goes out as a tar archive, walked before the headers so
+  // errors still get a status code
+  std::unique_ptr<kunlun::TarStreamer> archive;
+  if (S_ISDIR(resolved.st.st_mode)) {
+    archive.reset(new kunlun::TarStreamer(resolved.abs_path));
+    if (!archive->Prepare()) {
+      KLOG_ERROR("FileService walk directory failed: {}", archive->getErr());
+      cntl->http_response().set_status_code(
+          brpc::HTTP_STATUS_INTERNAL_SERVER_ERROR);
+      Json::Value root;
+      root["status"] = "failed";
+      root["info"] = archive->getErr();
+      Json::FastWriter writer;
+      writer.omitEndingLineFeed();
+      cntl->response_attachment().append(writer.write(root));
+      return;
+    }
+    cntl->http_response().set_content_type(TAR_CONTENT_TYPE);
+  } else {
+    cntl->http_response().SetHeader("Accept-Ranges", "bytes");
+    cntl->http_response().SetHeader(BULK_STREAM_HEADER, BULK_STREAM_V1);
+  }
+
+  int64_t range_first = 0;
+  int64_t range_last = -1;
+  // byte ranges of an archive are not supported, it is sent whole
+  const std::string *range =
+      archive ? nullptr : cntl->http_request().GetHeader("Range");
+  if (range != nullptr) {
+    int64_t file_size = resolved.st.st_size;
+    if (!ParseRangeHeader(*range, file_size, &range_first, &range_last)) {
+      KLOG_ERROR("FileService unsatisfiable range {} of {}", *range,
+                 resolved.abs_path);
+      cntl->http_response().set_status_code(
+          brpc::HTTP_STATUS_REQUEST_RANGE_NOT_SATISFIABLE);
+      cntl->http_response().SetHeader(
+          "Content-Range", kunlun::string_sprintf("bytes */%ld", file_size));
+      return;
+    }
+    cntl->http_response().set_status_code(brpc::HTTP_STATUS_PARTIAL_CONTENT);
+    cntl->http_response().SetHeader(
+        "Content-Range", kunlun::string_sprintf("bytes %ld-%ld/%ld", range_first,
+                                                range_last, file_size));
+  }
+
   std::unique_ptr<Args> para(new Args);
   para->pa = cntl->CreateProgressiveAttachment();
   para->cntl = cntl;
-  para->resolved_file_path = resolved_file_path_;
+  para->resolved_file_path = resolved.abs_path;
+  para->file_size = resolved.st.st_size;
+  para->archive.swap(archive);
+  if (range != nullptr) {
+    para->offset = range_first;
+    para->length = range_last - range_first + 1;
+  }
 
   std::string request_attachment = cntl->request_attachment().to_string();
+  // delta signatures follow the JSON, the header tells how many bytes
+  const std::string *delta_size =
+      cntl->http_request().GetHeader(DELTA_SIGNATURES_HEADER);
+  if (delta_size != nullptr) {
+    size_t size = strtoull(delta_size->c_str(), nullptr, 10);
+    std::unique_ptr<kunlun::DeltaSignatures> signatures(
+        new kunlun::DeltaSignatures);
+    std::string err = "Delta signatures are truncated";
+    if (size <= request_attachment.size() &&
+        signatures->Parse(request_attachment.substr(
+                              request_attachment.size() - size),
+                          &err)) {
+      // a range or an archive is sent as it is, the signatures cover a file
+      if (para->archive == nullptr && range == nullptr) {
+        para->delta.swap(signatures);
+      }
+    } else {
+      KLOG_ERROR("FileService ignores delta signatures of {}: {}",
+                 resolved.abs_path, err);
+    }
+    request_attachment.resize(request_attachment.size() -
+                              std::min(size, request_attachment.size()));
+  }
   Json::Value root;
   Json::Reader reader;
   reader.parse(request_attachment,root);
   if(root.isMember("traffic_limit")){
     para->bytes_per_second = ::atoll(root["traffic_limit"].asCString()); 
   }
+  if (root.isMember("weight")) {
+    para->weight = ::atoll(root["weight"].asString().c_str());
+  }
+  if (root.isMember("send_mode")) {
+    para->send_mode =
+        kunlun::GetFileSendModeByStr(root["send_mode"].asString().c_str());
+    if (para->send_mode == kunlun::kFileSendModeMax) {
+      KLOG_ERROR("Unrecongnized send_mode {}, fall back to auto",
+                 root["send_mode"].asString());
+      para->send_mode = kunlun::kFileSendAuto;
+    }
+  }
+  if (root.isMember("compress")) {
+    para->compress =
+        kunlun::GetFileCompressTypeByStr(root["compress"].asString().c_str());
+    if (para->compress == kunlun::kFileCompressTypeMax) {
+      KLOG_ERROR("Unrecongnized compress {}, send uncompressed",
+                 root["compress"].asString());
+      para->compress = kunlun::kFileCompressNone;
+    }
+  }
+  if (root.isMember("read_parallel")) {
+    para->read_parallel = ::atoi(root["read_parallel"].asString().c_str());
+  }
+  if (root.isMember("checksum")) {
+    std::string checksum = root["checksum"].asString();
+    if (checksum == CHECKSUM_TRAILER_CRC32C) {
+      para->checksum = true;
+    } else if (!checksum.empty() && checksum != "none") {
+      KLOG_ERROR("Unrecongnized checksum {}, send without trailer", checksum);
+    }
+  }
+  if (root.isMember("sparse") && root["sparse"].asString() == "true") {
+    // an archive lists its files, their holes are not mapped
+    para->sparse = para->archive == nullptr;
+  }
+  if (para->delta) {
+    // holes of a delta are literal zeros, matched blocks cost nothing anyway
+    para->sparse = false;
+    cntl->http_response().SetHeader(DELTA_HEADER, DELTA_V1);
+  }
+  if (para->sparse) {
+    cntl->http_response().SetHeader(SPARSE_EXTENTS_HEADER, SPARSE_EXTENTS_V1);
+  }
+  if (para->checksum) {
+    cntl->http_response().SetHeader(CHECKSUM_TRAILER_HEADER,
+                                    CHECKSUM_TRAILER_CRC32C);
+  }
+  if (para->compress == kunlun::kFileCompressGzip) {
+    // Content-Range still counts bytes of the file, not of the gzip stream
+    cntl->http_response().SetHeader("Content-Encoding", "gzip");
+  }
 
   bthread_t th;
-  bthread_start_background(&th, nullptr, SendFile, para.release());
+  void *(*send)(void *) = SendFile;
+  if (para->archive != nullptr) {
+    send = SendDirectory;
+  } else if (para->delta) {
+    send = SendDelta;
+  }
+  bthread_start_background(&th, nullptr, send, para.release());
+}
+
+// Parsed dealer of a request out of the journal or a batch, nullptr if the
+// request is not valid
+static RequestDealer *ParsedDealer(Json::Value &request) {
+  RequestDealer *dealer = RequestDealerFactory(request);
+  if (!dealer->ParseRequest()) {
+    KLOG_ERROR("parse request failed: {}", dealer->getErr());
+    delete dealer;
+    return nullptr;
+  }
+  return dealer;
 }
 
 brpc::Server *NewHttpServer() {
   HttpServiceImpl *http_service = new HttpServiceImpl();
   FileServiceImpl *file_service = new FileServiceImpl();
+  ControlServiceImpl *control_service = new ControlServiceImpl();
+  // created before the server runs, get_instance() is not thread safe
+  kunlun::FileUploader::get_instance();
+  // jobs a restart interrupted go on before new requests come in
+  JobTable::get_instance()->Recover(ParsedDealer);
+  // bulk streams over long links need more than the default socket buffers
+  if (socket_buffer_size > 0) {
+    std::string size = std::to_string(socket_buffer_size);
+    google::SetCommandLineOption("socket_send_buffer_size", size.c_str());
+    google::SetCommandLineOption("socket_recv_buffer_size", size.c_str());
+  }
   brpc::Server *server = new brpc::Server();
   if (server->AddService(http_service, brpc::SERVER_DOESNT_OWN_SERVICE) != 0) {
     KLOG_ERROR( "Add http service to brpc::Server failed,");
@@ -324,6 +810,12 @@ brpc::Server *NewHttpServer() {
     KLOG_ERROR("Add file service to brpc::Server failed,");
     return nullptr;
   }
+  // typed requests, baidu_std on the same port
+  if (server->AddService(control_service, brpc::SERVER_DOESNT_OWN_SERVICE) !=
+      0) {
+    KLOG_ERROR("Add control service to brpc::Server failed,");
+    return nullptr;
+  }
   
   brpc::ServerOptions *options = new brpc::ServerOptions();
   options->idle_timeout_sec = -1;
@@ -335,64 +827,43 @@ brpc::Server *NewHttpServer() {
          node_mgr_brpc_http_port);
   return server;
 }
-static RequestDealer *RequestDealerFactory(brpc::Controller *cntl) {
-  Json::Reader reader;
-  Json::Value root;
-  bool ret = reader.parse(cntl->request_attachment().to_string().c_str(), root);
-  if (!ret) {
-    // TODO: log error info
-    KLOG_ERROR("RequestDealFactory failed: {}",
-               reader.getFormattedErrorMessages());
-    return nullptr;
+// Takes over request, the dealer of an unknown job_type reports it
+RequestDealer *RequestDealerFactory(Json::Value &request) {
+  if (!request.isObject()) {
+    return new RequestDealer(request);
   }
-  if (!root.isMember("job_type")) {
-    KLOG_ERROR("RequestDealFactory failed: Missing `job_type` filed");
-    return nullptr;
-  }
-  std::string type_str = root["job_type"].asString();
+  std::string type_str = request["job_type"].asString();
   auto request_type = kunlun::GetReqTypeEnumByStr(type_str.c_str());
   switch (request_type) {
   case kunlun::kInstallMySQLType: {
-    return new kunlun::MySQLInstallDealer(
-        cntl->request_attachment().to_string().c_str());
+    return new kunlun::MySQLInstallDealer(request);
   }
   case kunlun::kUninstallMySQLType: {
-    return new kunlun::MySQLUninstallDealer(
-        cntl->request_attachment().to_string().c_str());
+    return new kunlun::MySQLUninstallDealer(request);
   }
   case kunlun::kInstallPostgresType: {
-    return new kunlun::PostgresInstallDealer(
-        cntl->request_attachment().to_string().c_str());
+    return new kunlun::PostgresInstallDealer(request);
   }
   case kunlun::kUninstallPostgresType: {
-    return new kunlun::PostgresUninstallDealer(
-        cntl->request_attachment().to_string().c_str());
+    return new kunlun::PostgresUninstallDealer(request);
   }
   case kunlun::kRestoreMySQLType: {
-    return new kunlun::MySQLRestoreDealer(
-        cntl->request_attachment().to_string().c_str());
+    return new kunlun::MySQLRestoreDealer(request);
   }
   case kunlun::kRestorePostGresType: {
-    return new kunlun::PostGresRestoreDealer(
-        cntl->request_attachment().to_string().c_str());
+    return new kunlun::PostGresRestoreDealer(request);
   }
   case kunlun::kBackupShardType:
   case kunlun::kBackupComputeType: {
-    return new kunlun::BackUpDealer(
-        cntl->request_attachment().to_string().c_str());
+    return new kunlun::BackUpDealer(request);
   }
   case kunlun::kInstallNodeExporterType:
-    return new kunlun::NodeExporterInstallDealer(
-      cntl->request_attachment().to_string().c_str()
-    );
+    return new kunlun::NodeExporterInstallDealer(request);
   case kunlun::kUninstallNodeExporterType:
-    return new kunlun::NodeExporterUninstallDealer(
-      cntl->request_attachment().to_string().c_str()
-    );
+    return new kunlun::NodeExporterUninstallDealer(request);
 
   default:
     break;
   }
-  KLOG_DEBUG("Unrecongnized job_type {}", type_str);
-  return nullptr;
+  return new RequestDealer(request);
 }
@@ -11,6 +11,7 @@
 #include "rapidjson/writer.h"
 #include "zettalib/errorcup.h"
 #include "zettalib/biodirectpopen.h"
+#include "json/json.h"
 #include <brpc/stream.h>
 
 
@@ -36,11 +37,13 @@ public:
   virtual ~FileServiceImpl(){};
   void default_method(google::protobuf::RpcController *, const HttpRequest *,
                       HttpResponse *, google::protobuf::Closure *);
-private:
-  std::string resolved_file_path_;
 };
 
 extern brpc::Server *
 NewHttpServer();
 
+class RequestDealer;
+// Takes over request, the dealer of an unknown job_type reports it
+extern RequestDealer *RequestDealerFactory(Json::Value &request);
+
 #endif /*_NODE_MGR_HTTP_SERVER_H_*/
@@ -0,0 +1,87 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#include "sparse_format.h"
+#include <algorithm>
+#include <errno.h>
+
+namespace kunlun {
+
+static void PutUint64(uint64_t value, char *out) {
+  for (int i = 7; i >= 0; i--) {
+    out[i] = static_cast<char>(value & 0xff);
+    value >>= 8;
+  }
+}
+
+static uint64_t GetUint64(const char *in) {
+  uint64_t value = 0;
+  for (int i = 0; i < 8; i++) {
+    value = (value << 8) | static_cast<unsigned char>(in[i]);
+  }
+  return value;
+}
+
+std::string SparseExtentHeader(int64_t offset, int64_t length) {
+  char buff[SPARSE_EXTENT_HEADER_SIZE];
+  PutUint64(offset, buff);
+  PutUint64(length, buff + 8);
+  return std::string(buff, sizeof(buff));
+}
+
+butil::Status SparseDecoder::Feed(const char *data, size_t length,
+                                  const Sink &sink) {
+  butil::Status status;
+  while (length > 0) {
+    if (ended_) {
+      status.set_error(EINVAL, "Data after the last extent");
+      return status;
+    }
+    if (in_data_) {
+      size_t n = std::min((int64_t)length, left_);
+      status = sink(offset_, data, n);
+      if (!status.ok()) {
+        return status;
+      }
+      offset_ += n;
+      left_ -= n;
+      data += n;
+      length -= n;
+      in_data_ = left_ > 0;
+      continue;
+    }
+
+    size_t n = std::min(length, SPARSE_EXTENT_HEADER_SIZE - header_.size());
+    header_.append(data, n);
+    data += n;
+    length -= n;
+    if (header_.size() < SPARSE_EXTENT_HEADER_SIZE) {
+      break;
+    }
+    int64_t offset = GetUint64(header_.data());
+    int64_t extent_length = GetUint64(header_.data() + 8);
+    header_.clear();
+    if (offset < offset_ || extent_length < 0) {
+      status.set_error(EINVAL, "Extent %ld+%ld out of order, expected >= %ld",
+                       offset, extent_length, offset_);
+      return status;
+    }
+    offset_ = offset;
+    left_ = extent_length;
+    if (extent_length == 0) {
+      ended_ = true;
+      status = sink(offset_, nullptr, 0);
+      if (!status.ok()) {
+        return status;
+      }
+    }
+    in_data_ = left_ > 0;
+  }
+  return status;
+}
+
+} // namespace kunlun
@@ -0,0 +1,55 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#ifndef _NODE_MGR_SPARSE_FORMAT_H_
+#define _NODE_MGR_SPARSE_FORMAT_H_
+
+#include "butil/status.h"
+#include <cstdint>
+#include <functional>
+#include <string>
+
+// Response header announcing a body of extents, its value is the version
+#define SPARSE_EXTENTS_HEADER "X-Sparse-Extents"
+#define SPARSE_EXTENTS_V1 "v1"
+// offset and length, both 8 bytes big endian
+#define SPARSE_EXTENT_HEADER_SIZE 16
+
+namespace kunlun {
+
+// Header of the extent of `length` data bytes at `offset` of the file.
+// An extent of length 0 ends the body, its offset is where the file ends
+std::string SparseExtentHeader(int64_t offset, int64_t length);
+
+/*
+  Splits a body of extents sent by FileService for a sparse file back into
+  the data extents, which are written at their offsets, and the holes,
+  which are simply skipped. Extents come in ascending order and do not
+  overlap.
+*/
+class SparseDecoder {
+public:
+  // (offset, data, length), (end of file, nullptr, 0) comes last
+  typedef std::function<butil::Status(int64_t, const char *, size_t)> Sink;
+
+  SparseDecoder() : offset_(0), left_(0), in_data_(false), ended_(false) {}
+
+  butil::Status Feed(const char *data, size_t length, const Sink &sink);
+  bool ended() const { return ended_; }
+
+private:
+  std::string header_;
+  // file offset of the next data byte and data bytes left in the extent
+  int64_t offset_;
+  int64_t left_;
+  bool in_data_;
+  bool ended_;
+};
+
+} // namespace kunlun
+
+#endif /*_NODE_MGR_SPARSE_FORMAT_H_*/
@@ -0,0 +1,77 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#include "stream_checksum.h"
+#include "butil/crc32c.h"
+#include <algorithm>
+#include <inttypes.h>
+#include <stdio.h>
+
+namespace kunlun {
+
+void StreamChecksum::Update(const void *data, size_t length) {
+  // SSE4.2 crc32 instruction when the CPU has it
+  crc_ = butil::crc32c::Extend(crc_, static_cast<const char *>(data), length);
+  bytes_ += length;
+}
+
+void StreamChecksum::Update(const butil::IOBuf &data) {
+  for (size_t i = 0; i < data.backing_block_num(); i++) {
+    butil::StringPiece block = data.backing_block(i);
+    Update(block.data(), block.size());
+  }
+}
+
+std::string StreamChecksum::Trailer() const {
+  char buff[CHECKSUM_TRAILER_LENGTH + 1] = {'\0'};
+  snprintf(buff, sizeof(buff), "%s %08" PRIx32 " %016" PRIx64 "\n",
+           CHECKSUM_TRAILER_CRC32C, crc_, (uint64_t)bytes_);
+  return std::string(buff, CHECKSUM_TRAILER_LENGTH);
+}
+
+bool StreamChecksum::ParseTrailer(const std::string &trailer, uint32_t *crc,
+                                  int64_t *bytes) {
+  if (trailer.size() != CHECKSUM_TRAILER_LENGTH ||
+      trailer[CHECKSUM_TRAILER_LENGTH - 1] != '\n') {
+    return false;
+  }
+  uint64_t parsed_bytes = 0;
+  if (sscanf(trailer.c_str(), CHECKSUM_TRAILER_CRC32C " %8" SCNx32 " %16" SCNx64,
+             crc, &parsed_bytes) != 2) {
+    return false;
+  }
+  *bytes = parsed_bytes;
+  return true;
+}
+
+butil::Status TrailerSplitter::Feed(const void *data, size_t length,
+                                    const Sink &sink) {
+  butil::Status status;
+  const char *pos = static_cast<const char *>(data);
+  size_t total = held_.size() + length;
+  if (total <= CHECKSUM_TRAILER_LENGTH) {
+    held_.append(pos, length);
+    return status;
+  }
+  size_t body_length = total - CHECKSUM_TRAILER_LENGTH;
+  size_t from_held = std::min(body_length, held_.size());
+  if (from_held > 0) {
+    status = sink(held_.data(), from_held);
+    held_.erase(0, from_held);
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  size_t from_data = body_length - from_held;
+  if (from_data > 0) {
+    status = sink(pos, from_data);
+  }
+  held_.append(pos + from_data, length - from_data);
+  return status;
+}
+
+} // namespace kunlun
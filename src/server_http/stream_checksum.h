@@ -0,0 +1,70 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#ifndef _NODE_MGR_STREAM_CHECKSUM_H_
+#define _NODE_MGR_STREAM_CHECKSUM_H_
+
+#include "butil/iobuf.h"
+#include "butil/status.h"
+#include <cstdint>
+#include <functional>
+#include <string>
+
+// Response header announcing the trailer, its value names the algorithm
+#define CHECKSUM_TRAILER_HEADER "X-Checksum-Trailer"
+#define CHECKSUM_TRAILER_CRC32C "crc32c"
+// "crc32c <checksum, 8 hex> <bytes, 16 hex>\n", fixed so the receiver
+// knows how many bytes to hold back before the body ends
+#define CHECKSUM_TRAILER_LENGTH 33
+
+namespace kunlun {
+
+/*
+  CRC32C of the body of a FileService response before compression, that
+  is the file bytes, or the extents of a sparse file.
+  The sender appends Trailer() after the last byte of the body and the
+  receiver compares it with what it computed over the bytes it wrote.
+*/
+class StreamChecksum {
+public:
+  StreamChecksum() : crc_(0), bytes_(0) {}
+
+  void Update(const void *data, size_t length);
+  void Update(const butil::IOBuf &data);
+  uint32_t value() const { return crc_; }
+  int64_t bytes() const { return bytes_; }
+
+  std::string Trailer() const;
+  // Return false if `trailer` is not a well formed crc32c trailer
+  static bool ParseTrailer(const std::string &trailer, uint32_t *crc,
+                           int64_t *bytes);
+
+private:
+  uint32_t crc_;
+  int64_t bytes_;
+};
+
+/*
+  Hands everything but the last CHECKSUM_TRAILER_LENGTH bytes of a body
+  on, so the trailer never reaches the inflater or the output file.
+*/
+class TrailerSplitter {
+public:
+  typedef std::function<butil::Status(const char *, size_t)> Sink;
+
+  // `sink` gets the part of `data` known not to be trailer, the bytes
+  // which may still be the trailer are copied aside
+  butil::Status Feed(const void *data, size_t length, const Sink &sink);
+  const std::string &trailer() const { return held_; }
+
+private:
+  std::string held_;
+};
+
+} // namespace kunlun
+
+#endif /*_NODE_MGR_STREAM_CHECKSUM_H_*/
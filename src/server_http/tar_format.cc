@@ -0,0 +1,450 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#include "tar_format.h"
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// offsets of the ustar header fields
+#define TAR_NAME_OFFSET 0
+#define TAR_NAME_LENGTH 100
+#define TAR_MODE_OFFSET 100
+#define TAR_UID_OFFSET 108
+#define TAR_GID_OFFSET 116
+#define TAR_ID_LENGTH 8
+#define TAR_SIZE_OFFSET 124
+#define TAR_MTIME_OFFSET 136
+#define TAR_NUMBER_LENGTH 12
+#define TAR_CHKSUM_OFFSET 148
+#define TAR_CHKSUM_LENGTH 8
+#define TAR_TYPE_OFFSET 156
+#define TAR_LINK_OFFSET 157
+#define TAR_MAGIC_OFFSET 257
+#define TAR_VERSION_OFFSET 263
+
+#define TAR_TYPE_REGULAR '0'
+#define TAR_TYPE_OLD_REGULAR '\0'
+#define TAR_TYPE_SYMLINK '2'
+#define TAR_TYPE_DIRECTORY '5'
+#define TAR_TYPE_CONTIGUOUS '7'
+#define TAR_TYPE_LONG_NAME 'L'
+#define TAR_TYPE_LONG_LINK 'K'
+#define TAR_LONG_LINK_NAME "././@LongLink"
+
+namespace kunlun {
+
+// Octal with a terminating NUL, base-256 when that does not fit
+static void PutNumber(char *field, size_t length, uint64_t value) {
+  if (value < (1ULL << (3 * (length - 1)))) {
+    snprintf(field, length, "%0*" PRIo64, (int)length - 1, value);
+    return;
+  }
+  memset(field, 0, length);
+  field[0] = (char)0x80;
+  for (size_t i = length - 1; i > 0 && value != 0; i--) {
+    field[i] = (char)(value & 0xff);
+    value >>= 8;
+  }
+}
+
+static uint64_t ParseNumber(const char *field, size_t length) {
+  uint64_t value = 0;
+  if ((unsigned char)field[0] & 0x80) {
+    for (size_t i = 1; i < length; i++) {
+      value = (value << 8) | (unsigned char)field[i];
+    }
+    return value;
+  }
+  for (size_t i = 0; i < length; i++) {
+    if (field[i] >= '0' && field[i] <= '7') {
+      value = (value << 3) | (field[i] - '0');
+    } else if (field[i] != ' ' || value != 0) {
+      break;
+    }
+  }
+  return value;
+}
+
+static unsigned HeaderChecksum(const char *block) {
+  unsigned sum = 0;
+  for (int i = 0; i < TAR_BLOCK_SIZE; i++) {
+    // the checksum field itself counts as spaces
+    bool in_chksum =
+        i >= TAR_CHKSUM_OFFSET && i < TAR_CHKSUM_OFFSET + TAR_CHKSUM_LENGTH;
+    sum += in_chksum ? ' ' : (unsigned char)block[i];
+  }
+  return sum;
+}
+
+static std::string HeaderBlock(const std::string &name, char type,
+                               const struct stat &st, int64_t size,
+                               const std::string &link_target) {
+  char block[TAR_BLOCK_SIZE];
+  memset(block, 0, sizeof(block));
+  memcpy(block + TAR_NAME_OFFSET, name.data(),
+         std::min(name.size(), (size_t)TAR_NAME_LENGTH));
+  PutNumber(block + TAR_MODE_OFFSET, TAR_ID_LENGTH, st.st_mode & 07777);
+  PutNumber(block + TAR_UID_OFFSET, TAR_ID_LENGTH, st.st_uid);
+  PutNumber(block + TAR_GID_OFFSET, TAR_ID_LENGTH, st.st_gid);
+  PutNumber(block + TAR_SIZE_OFFSET, TAR_NUMBER_LENGTH, size);
+  PutNumber(block + TAR_MTIME_OFFSET, TAR_NUMBER_LENGTH, st.st_mtime);
+  block[TAR_TYPE_OFFSET] = type;
+  memcpy(block + TAR_LINK_OFFSET, link_target.data(),
+         std::min(link_target.size(), (size_t)TAR_NAME_LENGTH));
+  memcpy(block + TAR_MAGIC_OFFSET, "ustar", 6);
+  memcpy(block + TAR_VERSION_OFFSET, "00", 2);
+  snprintf(block + TAR_CHKSUM_OFFSET, TAR_CHKSUM_LENGTH, "%06o",
+           HeaderChecksum(block));
+  block[TAR_CHKSUM_OFFSET + TAR_CHKSUM_LENGTH - 1] = ' ';
+  return std::string(block, TAR_BLOCK_SIZE);
+}
+
+// GNU entry carrying a name or link target longer than 100 bytes
+static std::string LongValueEntry(char type, const std::string &value) {
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  st.st_mode = 0644;
+  std::string entry =
+      HeaderBlock(TAR_LONG_LINK_NAME, type, st, value.size() + 1, "");
+  entry += value;
+  entry.append(1 + TarPadding(value.size() + 1), '\0');
+  return entry;
+}
+
+std::string TarHeader(const TarEntry &entry) {
+  std::string header;
+  if (entry.name.size() > TAR_NAME_LENGTH) {
+    header += LongValueEntry(TAR_TYPE_LONG_NAME, entry.name);
+  }
+  if (entry.link_target.size() > TAR_NAME_LENGTH) {
+    header += LongValueEntry(TAR_TYPE_LONG_LINK, entry.link_target);
+  }
+  char type = TAR_TYPE_REGULAR;
+  int64_t size = 0;
+  if (S_ISDIR(entry.st.st_mode)) {
+    type = TAR_TYPE_DIRECTORY;
+  } else if (S_ISLNK(entry.st.st_mode)) {
+    type = TAR_TYPE_SYMLINK;
+  } else {
+    size = entry.st.st_size;
+  }
+  header += HeaderBlock(entry.name, type, entry.st, size, entry.link_target);
+  return header;
+}
+
+size_t TarPadding(int64_t size) {
+  return (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+}
+
+std::string TarEnd() { return std::string(2 * TAR_BLOCK_SIZE, '\0'); }
+
+// Refuse names which would land outside the extract directory
+static bool IsSafeName(const std::string &name) {
+  if (name.empty() || name[0] == '/') {
+    return false;
+  }
+  size_t begin = 0;
+  while (begin <= name.size()) {
+    size_t end = name.find('/', begin);
+    if (end == std::string::npos) {
+      end = name.size();
+    }
+    if (name.compare(begin, end - begin, "..") == 0) {
+      return false;
+    }
+    begin = end + 1;
+  }
+  return true;
+}
+
+// An earlier entry may have put a symbolic link where `name` needs a
+// directory, extracting through it would write wherever it points
+static bool ThroughSymlink(const std::string &dir, const std::string &name) {
+  for (size_t pos = name.find('/'); pos != std::string::npos;
+       pos = name.find('/', pos + 1)) {
+    std::string parent = dir + "/" + name.substr(0, pos);
+    struct stat st;
+    if (lstat(parent.c_str(), &st) == 0 && !S_ISDIR(st.st_mode)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool MakeDirs(const std::string &path) {
+  for (size_t pos = path.find('/', 1); pos != std::string::npos;
+       pos = path.find('/', pos + 1)) {
+    std::string parent = path.substr(0, pos);
+    if (mkdir(parent.c_str(), 0755) != 0 && errno != EEXIST) {
+      return false;
+    }
+  }
+  return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+}
+
+TarExtractor::TarExtractor(const std::string &dir)
+    : dir_(dir), state_(kHeader), type_(0), mode_(0), mtime_(0), size_(0),
+      left_(0), padding_left_(0), fd_(-1), long_value_(nullptr), files_(0) {}
+
+TarExtractor::~TarExtractor() {
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+butil::Status TarExtractor::Init() {
+  butil::Status status;
+  if (!MakeDirs(dir_)) {
+    status.set_error(errno, "Mkdir() %s Failed: %s", dir_.c_str(),
+                     strerror(errno));
+  }
+  return status;
+}
+
+butil::Status TarExtractor::Feed(const char *data, size_t length) {
+  butil::Status status;
+  while (length > 0 && status.ok()) {
+    size_t used = 0;
+    switch (state_) {
+    case kHeader:
+      used = std::min(length, TAR_BLOCK_SIZE - header_.size());
+      header_.append(data, used);
+      if (header_.size() == TAR_BLOCK_SIZE) {
+        status = parseHeader();
+        header_.clear();
+      }
+      break;
+    case kData:
+      used = std::min((int64_t)length, left_);
+      status = consumeData(data, used);
+      left_ -= used;
+      if (status.ok() && left_ == 0) {
+        status = endEntry();
+      }
+      break;
+    case kPadding:
+      used = std::min(length, padding_left_);
+      padding_left_ -= used;
+      if (padding_left_ == 0) {
+        state_ = kHeader;
+      }
+      break;
+    case kEnd:
+      // the zero blocks after the end marker
+      used = length;
+      break;
+    }
+    data += used;
+    length -= used;
+  }
+  return status;
+}
+
+butil::Status TarExtractor::Finish() {
+  butil::Status status;
+  if (state_ != kEnd) {
+    status.set_error(EINVAL, "Archive is truncated");
+    return status;
+  }
+  // entries inside a directory changed its mtime, restore it last, the
+  // deepest directories first
+  for (auto it = dirs_.rbegin(); it != dirs_.rend(); ++it) {
+    struct stat st;
+    if (lstat(it->path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+      continue;
+    }
+    struct timespec times[2];
+    times[0].tv_sec = times[1].tv_sec = it->mtime;
+    times[0].tv_nsec = times[1].tv_nsec = 0;
+    if (chmod(it->path.c_str(), it->mode & 07777) != 0 ||
+        utimensat(AT_FDCWD, it->path.c_str(), times, AT_SYMLINK_NOFOLLOW) !=
+            0) {
+      status.set_error(errno, "Restore attributes of %s Failed: %s",
+                       it->path.c_str(), strerror(errno));
+      return status;
+    }
+  }
+  return status;
+}
+
+butil::Status TarExtractor::parseHeader() {
+  butil::Status status;
+  const char *block = header_.data();
+  if (std::all_of(header_.begin(), header_.end(),
+                  [](char c) { return c == '\0'; })) {
+    state_ = kEnd;
+    return status;
+  }
+  unsigned checksum = ParseNumber(block + TAR_CHKSUM_OFFSET, TAR_CHKSUM_LENGTH);
+  if (checksum != HeaderChecksum(block)) {
+    status.set_error(EINVAL, "Tar header checksum mismatch");
+    return status;
+  }
+
+  type_ = block[TAR_TYPE_OFFSET];
+  mode_ = ParseNumber(block + TAR_MODE_OFFSET, TAR_ID_LENGTH);
+  size_ = ParseNumber(block + TAR_SIZE_OFFSET, TAR_NUMBER_LENGTH);
+  mtime_ = ParseNumber(block + TAR_MTIME_OFFSET, TAR_NUMBER_LENGTH);
+  left_ = size_;
+  padding_left_ = TarPadding(size_);
+
+  if (type_ == TAR_TYPE_LONG_NAME || type_ == TAR_TYPE_LONG_LINK) {
+    long_value_ = type_ == TAR_TYPE_LONG_NAME ? &long_name_ : &long_link_;
+    long_value_->clear();
+  } else {
+    long_value_ = nullptr;
+    name_ = long_name_.empty()
+                ? std::string(block + TAR_NAME_OFFSET,
+                              strnlen(block + TAR_NAME_OFFSET, TAR_NAME_LENGTH))
+                : long_name_;
+    link_target_ =
+        long_link_.empty()
+            ? std::string(block + TAR_LINK_OFFSET,
+                          strnlen(block + TAR_LINK_OFFSET, TAR_NAME_LENGTH))
+            : long_link_;
+    long_name_.clear();
+    long_link_.clear();
+    status = beginEntry();
+    if (!status.ok()) {
+      return status;
+    }
+  }
+
+  if (left_ > 0) {
+    state_ = kData;
+    return status;
+  }
+  return endEntry();
+}
+
+butil::Status TarExtractor::beginEntry() {
+  butil::Status status;
+  if (!IsSafeName(name_)) {
+    status.set_error(EINVAL, "Refuse to extract %s", name_.c_str());
+    return status;
+  }
+  std::string name = name_;
+  while (!name.empty() && name.back() == '/') {
+    name.pop_back();
+  }
+  if (ThroughSymlink(dir_, name)) {
+    status.set_error(EINVAL, "Refuse to extract %s through a symbolic link",
+                     name_.c_str());
+    return status;
+  }
+  std::string path = dir_ + "/" + name;
+  std::string parent = path.substr(0, path.rfind('/'));
+  if (!MakeDirs(parent)) {
+    status.set_error(errno, "Mkdir() %s Failed: %s", parent.c_str(),
+                     strerror(errno));
+    return status;
+  }
+  // the entry replaces what is there, a symbolic link is never followed
+  struct stat st;
+  bool exists = lstat(path.c_str(), &st) == 0;
+  if (exists && S_ISLNK(st.st_mode)) {
+    unlink(path.c_str());
+    exists = false;
+  }
+
+  switch (type_) {
+  case TAR_TYPE_DIRECTORY:
+    if (exists && !S_ISDIR(st.st_mode) && unlink(path.c_str()) != 0) {
+      status.set_error(errno, "Unlink() %s Failed: %s", path.c_str(),
+                       strerror(errno));
+      break;
+    }
+    // keep the directory writable for the entries inside it, its own
+    // mode and mtime are restored once the archive ended
+    if ((mkdir(path.c_str(), 0700) != 0 && errno != EEXIST) ||
+        chmod(path.c_str(), (mode_ & 07777) | S_IRWXU) != 0) {
+      status.set_error(errno, "Mkdir() %s Failed: %s", path.c_str(),
+                       strerror(errno));
+      break;
+    }
+    dirs_.push_back(DirAttr{path, mode_, mtime_});
+    break;
+  case TAR_TYPE_SYMLINK:
+    if (exists) {
+      unlink(path.c_str());
+    }
+    if (symlink(link_target_.c_str(), path.c_str()) != 0) {
+      status.set_error(errno, "Symlink() %s Failed: %s", path.c_str(),
+                       strerror(errno));
+    }
+    break;
+  case TAR_TYPE_REGULAR:
+  case TAR_TYPE_OLD_REGULAR:
+  case TAR_TYPE_CONTIGUOUS:
+    fd_ = open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_NOFOLLOW,
+               S_IRUSR | S_IWUSR);
+    if (fd_ < 0) {
+      status.set_error(errno, "Open() %s Failed: %s", path.c_str(),
+                       strerror(errno));
+      break;
+    }
+    files_++;
+    break;
+  default:
+    // devices, fifos, hard links: the data, if any, is skipped
+    break;
+  }
+  return status;
+}
+
+butil::Status TarExtractor::consumeData(const char *data, size_t length) {
+  butil::Status status;
+  if (long_value_ != nullptr) {
+    long_value_->append(data, length);
+    return status;
+  }
+  while (fd_ >= 0 && length > 0) {
+    ssize_t ret = write(fd_, data, length);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      status.set_error(errno, "Write() %s Failed: %s", name_.c_str(),
+                       strerror(errno));
+      return status;
+    }
+    data += ret;
+    length -= ret;
+  }
+  return status;
+}
+
+butil::Status TarExtractor::endEntry() {
+  butil::Status status;
+  state_ = padding_left_ > 0 ? kPadding : kHeader;
+  if (long_value_ != nullptr) {
+    // the value is NUL terminated inside the entry
+    long_value_->resize(strnlen(long_value_->c_str(), long_value_->size()));
+    return status;
+  }
+  if (fd_ < 0) {
+    return status;
+  }
+  struct timespec times[2];
+  times[0].tv_sec = times[1].tv_sec = mtime_;
+  times[0].tv_nsec = times[1].tv_nsec = 0;
+  if (fchmod(fd_, mode_ & 07777) != 0 || futimens(fd_, times) != 0) {
+    status.set_error(errno, "Restore attributes of %s Failed: %s",
+                     name_.c_str(), strerror(errno));
+  }
+  close(fd_);
+  fd_ = -1;
+  return status;
+}
+
+} // namespace kunlun
@@ -0,0 +1,98 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#ifndef _NODE_MGR_TAR_FORMAT_H_
+#define _NODE_MGR_TAR_FORMAT_H_
+
+#include "butil/status.h"
+#include <cstdint>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+// Content-Type of a directory streamed by FileService
+#define TAR_CONTENT_TYPE "application/x-tar"
+#define TAR_BLOCK_SIZE 512
+
+namespace kunlun {
+
+struct TarEntry {
+  // where the entry is on disk
+  std::string path;
+  // relative path inside the archive, directories end with '/'
+  std::string name;
+  struct stat st;
+  // target of a symbolic link
+  std::string link_target;
+};
+
+// ustar header blocks of `entry`, preceded by GNU long name and long link
+// entries when the name or link target does not fit in 100 bytes.
+// Sizes beyond the 11 octal digits are written base-256 like GNU tar does
+std::string TarHeader(const TarEntry &entry);
+// Zero bytes completing a member of `size` bytes to a whole block
+size_t TarPadding(int64_t size);
+// Two zero blocks end the archive
+std::string TarEnd();
+
+/*
+  Unpacks a tar stream handed in piece by piece under `dir`. Regular files,
+  directories and symbolic links are restored with their mode and mtime,
+  other entries are skipped. Names which are absolute, climb out of `dir`
+  with ".." or lead through a symbolic link an earlier entry made are
+  refused. Directories get their mode and mtime back in Finish().
+*/
+class TarExtractor {
+public:
+  explicit TarExtractor(const std::string &dir);
+  ~TarExtractor();
+
+  butil::Status Init();
+  butil::Status Feed(const char *data, size_t length);
+  // The stream ended, it must have ended with the archive
+  butil::Status Finish();
+  int64_t files() const { return files_; }
+
+private:
+  butil::Status parseHeader();
+  butil::Status beginEntry();
+  butil::Status consumeData(const char *data, size_t length);
+  butil::Status endEntry();
+
+  enum State { kHeader, kData, kPadding, kEnd };
+
+  struct DirAttr {
+    std::string path;
+    mode_t mode;
+    int64_t mtime;
+  };
+
+  std::string dir_;
+  State state_;
+  std::string header_;
+  // current entry
+  char type_;
+  std::string name_;
+  std::string link_target_;
+  mode_t mode_;
+  int64_t mtime_;
+  int64_t size_;
+  int64_t left_;
+  size_t padding_left_;
+  int fd_;
+  // GNU long name / long link data of the next entry
+  std::string long_name_;
+  std::string long_link_;
+  std::string *long_value_;
+  int64_t files_;
+  // directories extracted, in archive order
+  std::vector<DirAttr> dirs_;
+};
+
+} // namespace kunlun
+
+#endif /*_NODE_MGR_TAR_FORMAT_H_*/
@@ -0,0 +1,251 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#include "tar_stream.h"
+#include "zettalib/op_log.h"
+#include "zettalib/tool_func.h"
+#include <algorithm>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <mutex>
+#include <string.h>
+#include <unistd.h>
+
+extern int64_t bulk_read_threshold;
+
+namespace kunlun {
+
+TarStreamer::TarStreamer(const std::string &root)
+    : root_(root), mode_(kFileSendAuto), parallel_(TAR_READ_PARALLEL),
+      sender_(nullptr), next_read_(0), sending_(0), prefetched_(0),
+      stopped_(false) {}
+
+TarStreamer::~TarStreamer() { stopReaders(); }
+
+bool TarStreamer::Prepare() { return walk(root_, ""); }
+
+bool TarStreamer::Run(BodySender *sender, FileSendMode mode, int parallel) {
+  sender_ = sender;
+  mode_ = mode;
+  parallel_ = parallel > 0 ? parallel : 1;
+  slots_.resize(entries_.size());
+  size_t readers = std::min((size_t)parallel_, entries_.size());
+  for (size_t i = 0; i < readers; i++) {
+    bthread_t tid;
+    if (bthread_start_background(&tid, nullptr, ReadFiles, this) != 0) {
+      setErr("Start tar reader bthread failed");
+      stopReaders();
+      return false;
+    }
+    readers_.push_back(tid);
+  }
+
+  bool ok = true;
+  for (size_t i = 0; i < entries_.size() && ok; i++) {
+    {
+      std::lock_guard<bthread::Mutex> guard(mutex_);
+      sending_ = i;
+      cond_.notify_all();
+    }
+    ok = sendString(TarHeader(entries_[i])) && sendFile(i);
+  }
+  stopReaders();
+  if (ok) {
+    ok = sendString(TarEnd());
+  }
+  KLOG_INFO("Tar stream of {} with {} entries {}", root_, entries_.size(),
+            ok ? "finished" : "failed");
+  return ok;
+}
+
+bool TarStreamer::walk(const std::string &dir, const std::string &prefix) {
+  DIR *dp = opendir(dir.c_str());
+  if (dp == nullptr) {
+    setErr("Opendir() %s failed: %s", dir.c_str(), strerror(errno));
+    return false;
+  }
+  std::vector<std::string> names;
+  struct dirent *entry = nullptr;
+  while ((entry = readdir(dp)) != nullptr) {
+    if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+      names.push_back(entry->d_name);
+    }
+  }
+  closedir(dp);
+  std::sort(names.begin(), names.end());
+
+  for (auto &name : names) {
+    TarEntry item;
+    item.path = dir + "/" + name;
+    item.name = prefix + name;
+    if (lstat(item.path.c_str(), &item.st) != 0) {
+      setErr("Lstat() %s failed: %s", item.path.c_str(), strerror(errno));
+      return false;
+    }
+    if (S_ISDIR(item.st.st_mode)) {
+      item.name += "/";
+      entries_.push_back(item);
+      if (!walk(item.path, item.name)) {
+        return false;
+      }
+    } else if (S_ISLNK(item.st.st_mode)) {
+      char target[PATH_MAX] = {'\0'};
+      ssize_t ret = readlink(item.path.c_str(), target, sizeof(target));
+      if (ret < 0) {
+        setErr("Readlink() %s failed: %s", item.path.c_str(), strerror(errno));
+        return false;
+      }
+      item.link_target.assign(target, ret);
+      entries_.push_back(item);
+    } else if (S_ISREG(item.st.st_mode)) {
+      entries_.push_back(item);
+    } else {
+      KLOG_INFO("Tar stream skips special file {}", item.path);
+    }
+  }
+  return true;
+}
+
+void *TarStreamer::ReadFiles(void *arg) {
+  static_cast<TarStreamer *>(arg)->readFiles();
+  return nullptr;
+}
+
+void TarStreamer::readFiles() {
+  for (;;) {
+    size_t index = 0;
+    {
+      std::unique_lock<bthread::Mutex> lock(mutex_);
+      while (!stopped_ && next_read_ < entries_.size() &&
+             next_read_ >= sending_ + parallel_) {
+        cond_.wait(lock);
+      }
+      if (stopped_ || next_read_ >= entries_.size()) {
+        return;
+      }
+      index = next_read_++;
+    }
+
+    std::string error;
+    bool ok = readFile(index, &error);
+    std::lock_guard<bthread::Mutex> guard(mutex_);
+    slots_[index].done = true;
+    if (!ok) {
+      slots_[index].error = error.empty() ? "reading stopped" : error;
+    }
+    cond_.notify_all();
+  }
+}
+
+bool TarStreamer::readFile(size_t index, std::string *error) {
+  const TarEntry &entry = entries_[index];
+  if (!S_ISREG(entry.st.st_mode)) {
+    return true;
+  }
+  FileChunkReader reader(ResolveFileSendMode(
+      mode_, entry.st.st_size, bulk_read_threshold, sender_->reads_payload()));
+  reader.set_window(sender_->window());
+  if (!reader.Open(entry.path)) {
+    *error = reader.getErr();
+    return false;
+  }
+
+  // the header already promised st_size bytes, exactly those are sent
+  int64_t size = entry.st.st_size;
+  off_t offset = 0;
+  while (offset < size) {
+    butil::IOBuf chunk;
+    size_t want = std::min((int64_t)reader.chunk_size(), size - offset);
+    ssize_t ret = reader.ReadChunk(offset, want, &chunk);
+    if (ret < 0) {
+      *error = reader.getErr();
+      return false;
+    } else if (ret == 0) {
+      *error = kunlun::string_sprintf("%s shrank while being sent",
+                                      entry.path.c_str());
+      return false;
+    }
+    offset += ret;
+
+    std::unique_lock<bthread::Mutex> lock(mutex_);
+    FileSlot &slot = slots_[index];
+    while (slot.chunks.size() >= TAR_SLOT_CHUNKS && !stopped_) {
+      cond_.wait(lock);
+    }
+    if (stopped_) {
+      return false;
+    }
+    prefetched_ += chunk.size();
+    slot.chunks.emplace_back();
+    slot.chunks.back().swap(chunk);
+    cond_.notify_all();
+  }
+  return true;
+}
+
+bool TarStreamer::sendFile(size_t index) {
+  if (!S_ISREG(entries_[index].st.st_mode)) {
+    return true;
+  }
+  FileSlot &slot = slots_[index];
+  for (;;) {
+    butil::IOBuf chunk;
+    int64_t slack = 0;
+    {
+      std::unique_lock<bthread::Mutex> lock(mutex_);
+      while (slot.chunks.empty() && !slot.done) {
+        cond_.wait(lock);
+      }
+      if (slot.chunks.empty()) {
+        if (!slot.error.empty()) {
+          setErr("%s", slot.error.c_str());
+          return false;
+        }
+        break;
+      }
+      chunk.swap(slot.chunks.front());
+      slot.chunks.pop_front();
+      prefetched_ -= chunk.size();
+      cond_.notify_all();
+      // chunks read ahead count against the window too, the socket can
+      // only drain what was sent
+      slack = prefetched_ + chunk.size();
+    }
+    sender_->WaitForRoom(slack);
+    if (!sender_->Send(&chunk)) {
+      setErr("%s", sender_->getErr());
+      return false;
+    }
+  }
+  size_t padding = TarPadding(entries_[index].st.st_size);
+  return padding == 0 || sendString(std::string(padding, '\0'));
+}
+
+bool TarStreamer::sendString(const std::string &data) {
+  butil::IOBuf buf;
+  buf.append(data);
+  if (!sender_->Send(&buf)) {
+    setErr("%s", sender_->getErr());
+    return false;
+  }
+  return true;
+}
+
+void TarStreamer::stopReaders() {
+  {
+    std::lock_guard<bthread::Mutex> guard(mutex_);
+    stopped_ = true;
+    cond_.notify_all();
+  }
+  for (auto tid : readers_) {
+    bthread_join(tid, nullptr);
+  }
+  readers_.clear();
+}
+
+} // namespace kunlun
@@ -0,0 +1,88 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#ifndef _NODE_MGR_TAR_STREAM_H_
+#define _NODE_MGR_TAR_STREAM_H_
+
+#include "body_sender.h"
+#include "bthread/bthread.h"
+#include "bthread/condition_variable.h"
+#include "bthread/mutex.h"
+#include "butil/iobuf.h"
+#include "file_chunk.h"
+#include "tar_format.h"
+#include "zettalib/errorcup.h"
+#include <deque>
+#include <string>
+#include <vector>
+
+// files read ahead of the one being sent
+#define TAR_READ_PARALLEL 4
+// chunks one file may have read ahead
+#define TAR_SLOT_CHUNKS 2
+
+namespace kunlun {
+
+/*
+  Streams the tree under a directory as a tar archive, without staging it
+  on disk. Up to `parallel` bthreads read the next files ahead into slots
+  of their own while the sending bthread drains the slots strictly in
+  archive order, so a slow file does not hold the others back and the
+  archive still comes out in one piece.
+*/
+class TarStreamer : public ErrorCup {
+public:
+  explicit TarStreamer(const std::string &root);
+  virtual ~TarStreamer();
+
+  // Walk the tree, before the response headers go out
+  bool Prepare();
+  size_t entry_num() const { return entries_.size(); }
+  // Send the archive, return false if it is incomplete
+  bool Run(BodySender *sender, FileSendMode mode, int parallel);
+
+private:
+  struct FileSlot {
+    std::deque<butil::IOBuf> chunks;
+    bool done = false;
+    std::string error;
+  };
+
+  bool walk(const std::string &dir, const std::string &prefix);
+  static void *ReadFiles(void *arg);
+  void readFiles();
+  bool readFile(size_t index, std::string *error);
+  bool sendFile(size_t index);
+  bool sendString(const std::string &data);
+  void stopReaders();
+
+  // forbid copy
+  TarStreamer(const TarStreamer &rht) = delete;
+  TarStreamer &operator=(const TarStreamer &rht) = delete;
+
+private:
+  std::string root_;
+  FileSendMode mode_;
+  int parallel_;
+  BodySender *sender_;
+  std::vector<TarEntry> entries_;
+  std::vector<FileSlot> slots_;
+
+  bthread::Mutex mutex_;
+  bthread::ConditionVariable cond_;
+  // next entry a reader picks up and the entry being sent
+  size_t next_read_;
+  size_t sending_;
+  // bytes read ahead and not handed to the sender yet
+  int64_t prefetched_;
+  bool stopped_;
+  std::vector<bthread_t> readers_;
+};
+
+} // namespace kunlun
+
+#endif /*_NODE_MGR_TAR_STREAM_H_*/
@@ -12,9 +12,11 @@
 #include "instance_info.h"
 #include "job.h"
 //#include "log.h"
+#include "path_index.h"
 #include "zettalib/op_log.h"
 #include "sys_config.h"
 #include "thread_manager.h"
+#include "traffic_governor.h"
 #include "zettalib/tool_func.h"
 #include <utility>
 
@@ -77,6 +79,10 @@ int System::create_instance(const std::string &cfg_path)
     goto end;
   if ((ret = (Job::get_instance() == NULL)) != 0)
     goto end;
+  if ((ret = (TrafficGovernor::get_instance() == NULL)) != 0)
+    goto end;
+  // lookups still work uncached if inotify is unavailable
+  PathIndex::get_instance()->Init();
   if ((ret = connet_to_meta_master()) == false){
     KLOG_ERROR("connect to metadata error");
     goto end;
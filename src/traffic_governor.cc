@@ -0,0 +1,152 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#include "traffic_governor.h"
+#include "bthread/bthread.h"
+#include "butil/time.h"
+#include "zettalib/op_log.h"
+#include <algorithm>
+#include <vector>
+
+int64_t transfer_bandwidth_limit = 0;
+
+TrafficGovernor *TrafficGovernor::m_inst = NULL;
+
+// a lease which sat idle may burst for this long at its rate
+#define TRAFFIC_BURST_US 125000
+
+TrafficLease::TrafficLease(int64_t weight, int64_t limit,
+                           const std::string &name)
+    : weight_(weight > 0 ? weight : 1), limit_(limit), name_(name), rate_(0),
+      tokens_(0), last_refill_us_(butil::monotonic_time_us()),
+      acquired_bytes_(0) {
+  TrafficGovernor::get_instance()->attach(this);
+}
+
+TrafficLease::~TrafficLease() { TrafficGovernor::get_instance()->detach(this); }
+
+void TrafficLease::Acquire(int64_t bytes) {
+  int64_t wait_us = TrafficGovernor::get_instance()->acquire(this, bytes);
+  if (wait_us > 0) {
+    // works from pthreads too, it falls back to usleep() there
+    bthread_usleep(wait_us);
+  }
+}
+
+int64_t TrafficLease::rate() {
+  std::lock_guard<std::mutex> guard(TrafficGovernor::get_instance()->mtx_);
+  return rate_;
+}
+
+TrafficGovernor::TrafficGovernor()
+    : bandwidth_limit_(transfer_bandwidth_limit) {}
+
+void TrafficGovernor::set_bandwidth_limit(int64_t bytes_per_second) {
+  std::lock_guard<std::mutex> guard(mtx_);
+  KLOG_INFO("transfer bandwidth limit changed from {} to {}", bandwidth_limit_,
+            bytes_per_second);
+  bandwidth_limit_ = bytes_per_second;
+  transfer_bandwidth_limit = bytes_per_second;
+  rebalance();
+}
+
+int64_t TrafficGovernor::get_bandwidth_limit() {
+  std::lock_guard<std::mutex> guard(mtx_);
+  return bandwidth_limit_;
+}
+
+void TrafficGovernor::get_status(Json::Value &status) {
+  std::lock_guard<std::mutex> guard(mtx_);
+  status["bandwidth_limit"] = Json::Int64(bandwidth_limit_);
+  Json::Value transfers(Json::arrayValue);
+  for (auto lease : leases_) {
+    Json::Value item;
+    item["name"] = lease->name_;
+    item["weight"] = Json::Int64(lease->weight_);
+    item["limit"] = Json::Int64(lease->limit_);
+    item["rate"] = Json::Int64(lease->rate_);
+    item["sent_bytes"] = Json::Int64(lease->acquired_bytes_);
+    transfers.append(item);
+  }
+  status["transfers"] = transfers;
+}
+
+void TrafficGovernor::attach(TrafficLease *lease) {
+  std::lock_guard<std::mutex> guard(mtx_);
+  leases_.insert(lease);
+  rebalance();
+}
+
+void TrafficGovernor::detach(TrafficLease *lease) {
+  std::lock_guard<std::mutex> guard(mtx_);
+  leases_.erase(lease);
+  rebalance();
+}
+
+/*
+  Take `bytes` out of the bucket of the lease, going into debt if needed.
+  Return the microseconds the caller has to sleep to pay the debt back.
+*/
+int64_t TrafficGovernor::acquire(TrafficLease *lease, int64_t bytes) {
+  std::lock_guard<std::mutex> guard(mtx_);
+  lease->acquired_bytes_ += bytes;
+  if (lease->rate_ <= 0) {
+    return 0;
+  }
+
+  int64_t now = butil::monotonic_time_us();
+  double burst = (double)lease->rate_ * TRAFFIC_BURST_US / 1000000;
+  lease->tokens_ +=
+      (double)(now - lease->last_refill_us_) * lease->rate_ / 1000000;
+  lease->tokens_ = std::min(lease->tokens_, burst);
+  lease->last_refill_us_ = now;
+
+  lease->tokens_ -= bytes;
+  if (lease->tokens_ >= 0) {
+    return 0;
+  }
+  return (int64_t)(-lease->tokens_ * 1000000 / lease->rate_);
+}
+
+/*
+  Water-filling: hand out the host limit by weight, leases whose own limit
+  is below their fair share are pinned to it and the rest is split again
+  among the others. Caller holds mtx_.
+*/
+void TrafficGovernor::rebalance() {
+  if (bandwidth_limit_ <= 0) {
+    for (auto lease : leases_) {
+      lease->rate_ = lease->limit_ > 0 ? lease->limit_ : 0;
+    }
+    return;
+  }
+
+  std::vector<TrafficLease *> sorted(leases_.begin(), leases_.end());
+  std::sort(sorted.begin(), sorted.end(),
+            [](const TrafficLease *a, const TrafficLease *b) {
+              // leases without a limit of their own go last
+              if (a->limit_ <= 0 || b->limit_ <= 0) {
+                return a->limit_ > 0 && b->limit_ <= 0;
+              }
+              return (double)a->limit_ / a->weight_ <
+                     (double)b->limit_ / b->weight_;
+            });
+
+  double remain = bandwidth_limit_;
+  int64_t weight_sum = 0;
+  for (auto lease : sorted) {
+    weight_sum += lease->weight_;
+  }
+  for (auto lease : sorted) {
+    double fair = remain * lease->weight_ / weight_sum;
+    double rate = (lease->limit_ > 0 && lease->limit_ < fair) ? lease->limit_
+                                                               : fair;
+    lease->rate_ = std::max((int64_t)rate, (int64_t)1);
+    remain -= rate;
+    weight_sum -= lease->weight_;
+  }
+}
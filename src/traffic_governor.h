@@ -0,0 +1,79 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#ifndef _NODE_MGR_TRAFFIC_GOVERNOR_H_
+#define _NODE_MGR_TRAFFIC_GOVERNOR_H_
+
+#include "json/json.h"
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <string>
+
+/*
+  Every bulk transfer of the host holds a TrafficLease for its lifetime.
+  TrafficGovernor splits `transfer_bandwidth_limit` among the live leases
+  by weight (a lease never gets more than its own limit, what it can not
+  use goes to the others) and each lease spends its share through a token
+  bucket, sleeping exactly as long as it takes to refill its debt.
+*/
+class TrafficLease {
+public:
+  // limit <= 0 means the transfer has no limit of its own
+  TrafficLease(int64_t weight, int64_t limit, const std::string &name);
+  ~TrafficLease();
+
+  // Block the calling bthread or pthread until `bytes` may be sent
+  void Acquire(int64_t bytes);
+  // Current share in bytes per second, 0 means unlimited
+  int64_t rate();
+
+private:
+  friend class TrafficGovernor;
+  // forbid copy
+  TrafficLease(const TrafficLease &rht) = delete;
+  TrafficLease &operator=(const TrafficLease &rht) = delete;
+
+  int64_t weight_;
+  int64_t limit_;
+  std::string name_;
+  int64_t rate_;
+  double tokens_;
+  int64_t last_refill_us_;
+  int64_t acquired_bytes_;
+};
+
+class TrafficGovernor {
+private:
+  static TrafficGovernor *m_inst;
+  TrafficGovernor();
+
+public:
+  static TrafficGovernor *get_instance() {
+    if (!m_inst)
+      m_inst = new TrafficGovernor();
+    return m_inst;
+  }
+
+  // 0 turns the host wide limit off
+  void set_bandwidth_limit(int64_t bytes_per_second);
+  int64_t get_bandwidth_limit();
+  void get_status(Json::Value &status);
+
+private:
+  friend class TrafficLease;
+  void attach(TrafficLease *lease);
+  void detach(TrafficLease *lease);
+  int64_t acquire(TrafficLease *lease, int64_t bytes);
+  void rebalance();
+
+  std::mutex mtx_;
+  int64_t bandwidth_limit_;
+  std::set<TrafficLease *> leases_;
+};
+
+#endif /*_NODE_MGR_TRAFFIC_GOVERNOR_H_*/
@@ -5,18 +5,33 @@
   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
 */
 
+#include <algorithm>
 #include <brpc/channel.h>
 #include <brpc/progressive_reader.h>
+#include <brpc/stream.h>
 #include <butil/logging.h>
 #include <gflags/gflags.h>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <sys/fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <thread>
 #include <unistd.h>
+#include <vector>
 #include <zettalib/errorcup.h>
 #include <zettalib/tool_func.h>
 #include <json/json.h>
+#include <zlib.h>
+#include "server_http/bulk_stream.h"
+#include "server_http/delta_format.h"
+#include "server_http/proto/nodemng.pb.h"
+#include "server_http/sparse_format.h"
+#include "server_http/stream_checksum.h"
+#include "server_http/tar_format.h"
 
 DEFINE_string(url, "", "URL of the request reource");
 DEFINE_string(out_prefix, "", "Downloaded File path prefix");
@@ -25,48 +40,438 @@ DEFINE_int64(traffic_limit, 5242880, "Download traffic limit, default is 5242880
 DEFINE_bool(
     output_override, false,
     "Whether override the output file if destination has the same name or not");
+DEFINE_bool(resume, false,
+            "Continue a broken download, append to the existing output file "
+            "from its current size");
+DEFINE_string(compress, "",
+              "Ask the server to compress the stream: gzip. The output is "
+              "decompressed on the fly");
+DEFINE_string(checksum, "crc32c",
+              "Ask the server for a checksum trailer and verify the output "
+              "against it: crc32c or none");
+DEFINE_bool(extract, false,
+            "The url names a directory, unpack the tar stream the server "
+            "sends into the directory out_prefix/out_filename");
+DEFINE_bool(sparse, false,
+            "Ask the server to send only the data extents of a sparse file, "
+            "the holes stay holes in the output");
+DEFINE_bool(delta, false,
+            "Re-sync an existing output file: send the server signatures of "
+            "its blocks and fetch only what changed, over a single connection");
+DEFINE_int32(streams, 1,
+             "Connections to download over in parallel, each one fetches "
+             "its own byte range. -resume always uses a single connection");
+DEFINE_string(transport, "auto",
+              "http: progressive HTTP bodies. stream: brpc streams with a "
+              "window of their own, one per connection. auto: streams if "
+              "the server offers them and the download is a plain file. "
+              "Socket buffers are set with -socket_recv_buffer_size");
+
+// the file rebuilt from a delta, renamed over the output once complete
+#define DELTA_PARTIAL_SUFFIX ".delta"
+
+// ranges smaller than this are not worth a connection of their own
+#define MIN_RANGE_SIZE (8 * 1024 * 1024)
+// attempts to fetch what is left of a range after a broken connection
+#define RANGE_MAX_ATTEMPTS 3
+
+// Absolute path of the output file. An existing one is kept when
+// `keep_existing`, removed on -output_override and an error otherwise
+static bool ResolveOutputPath(bool keep_existing, std::string *path,
+                              std::string *err) {
+  std::string path_prefix = "./";
+  std::string file_name = "outfile";
+  if (!FLAGS_out_prefix.empty()) {
+    path_prefix = FLAGS_out_prefix;
+  }
+  if (!FLAGS_out_filename.empty()) {
+    file_name = FLAGS_out_filename;
+  }
+  *path = kunlun::ConvertToAbsolutePath(path_prefix.c_str());
+  if (path->empty()) {
+    *err = kunlun::string_sprintf("out_prefix %s is not exists",
+                                  path_prefix.c_str());
+    return false;
+  }
+  *path += "/";
+  *path += file_name;
+
+  if (kunlun::CheckFileExists(path->c_str()) && !keep_existing) {
+    if (!FLAGS_output_override) {
+      *err = kunlun::string_sprintf("%s already exists!", path->c_str());
+      return false;
+    }
+    unlink(path->c_str());
+  }
+  return true;
+}
+
+static std::string RequestBody(int64_t traffic_limit) {
+  char buff[1024] = {'\0'};
+  sprintf(buff, "%ld", traffic_limit);
+  Json::Value root;
+  root["traffic_limit"] = buff;
+  if (!FLAGS_compress.empty()) {
+    root["compress"] = FLAGS_compress;
+  }
+  if (!FLAGS_checksum.empty()) {
+    root["checksum"] = FLAGS_checksum;
+  }
+  if (FLAGS_sparse) {
+    root["sparse"] = "true";
+  }
+  Json::FastWriter writer;
+  writer.omitEndingLineFeed();
+  return writer.write(root);
+}
+
+// pwrite() all of `data` at `offset` of `fd`
+static butil::Status PwriteAll(int fd, const char *data, size_t length,
+                               int64_t offset) {
+  butil::Status status;
+  while (length > 0) {
+    ssize_t ret = pwrite(fd, data, length, offset);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      status.set_error(errno, "Pwrite() Failed: %s", strerror(errno));
+      return status;
+    }
+    data += ret;
+    length -= ret;
+    offset += ret;
+  }
+  return status;
+}
+
+// The server compressed the body, see FileService `compress`
+static bool IsGzipEncoded(brpc::Controller &cntl) {
+  const std::string *encoding =
+      cntl.http_response().GetHeader("Content-Encoding");
+  return encoding != nullptr && *encoding == "gzip";
+}
+
+// Inflates a gzip body piece by piece as it arrives
+class GzipInflater {
+public:
+  typedef std::function<butil::Status(const char *, size_t)> Sink;
+
+  GzipInflater() : inited_(false), ended_(false), out_(256 * 1024) {
+    memset(&zs_, 0, sizeof(zs_));
+  }
+  ~GzipInflater() {
+    if (inited_) {
+      inflateEnd(&zs_);
+    }
+  }
+  bool Init() {
+    // windowBits above 15 expect a gzip header
+    inited_ = inflateInit2(&zs_, MAX_WBITS + 16) == Z_OK;
+    return inited_;
+  }
+  // Inflate `length` compressed bytes, `sink` gets every inflated piece
+  butil::Status Feed(const void *data, size_t length, const Sink &sink) {
+    butil::Status status;
+    zs_.next_in = reinterpret_cast<Bytef *>(const_cast<void *>(data));
+    zs_.avail_in = length;
+    while (zs_.avail_in > 0) {
+      if (ended_) {
+        status.set_error(EINVAL, "Data after the end of the gzip stream");
+        return status;
+      }
+      zs_.next_out = reinterpret_cast<Bytef *>(out_.data());
+      zs_.avail_out = out_.size();
+      int ret = inflate(&zs_, Z_NO_FLUSH);
+      if (ret != Z_OK && ret != Z_STREAM_END) {
+        status.set_error(EINVAL, "Inflate() Failed: %s",
+                         zs_.msg ? zs_.msg : "corrupted stream");
+        return status;
+      }
+      ended_ = ret == Z_STREAM_END;
+      size_t produced = out_.size() - zs_.avail_out;
+      if (produced > 0) {
+        status = sink(out_.data(), produced);
+        if (!status.ok()) {
+          return status;
+        }
+      }
+    }
+    return status;
+  }
+  bool ended() { return ended_; }
+
+private:
+  z_stream zs_;
+  bool inited_;
+  bool ended_;
+  std::vector<char> out_;
+};
+
+/*
+  Undoes what FileService did to the body on its way out: strips the
+  checksum trailer, inflates and checks the crc32c of the bytes which
+  come out against the trailer once the body ended. The extents of a
+  sparse file go to `extent_sink`, everything else to `sink`.
+*/
+class BodyDecoder {
+public:
+  typedef std::function<butil::Status(const char *, size_t)> Sink;
+
+  BodyDecoder(const Sink &sink, const kunlun::SparseDecoder::Sink &extent_sink)
+      : sink_(sink), extent_sink_(extent_sink), has_trailer_(false) {}
+  // Set up from the response headers
+  bool Init(brpc::Controller &cntl, std::string *err) {
+    if (IsGzipEncoded(cntl)) {
+      inflater_.reset(new GzipInflater());
+      if (!inflater_->Init()) {
+        *err = "InflateInit2() Failed";
+        return false;
+      }
+    }
+    const std::string *trailer =
+        cntl.http_response().GetHeader(CHECKSUM_TRAILER_HEADER);
+    has_trailer_ = trailer != nullptr && *trailer == CHECKSUM_TRAILER_CRC32C;
+    const std::string *extents =
+        cntl.http_response().GetHeader(SPARSE_EXTENTS_HEADER);
+    if (extents != nullptr) {
+      if (*extents != SPARSE_EXTENTS_V1) {
+        *err = "Unknown sparse extents version " + *extents;
+        return false;
+      }
+      sparse_.reset(new kunlun::SparseDecoder());
+    }
+    return true;
+  }
+  butil::Status Feed(const void *data, size_t length) {
+    if (has_trailer_) {
+      return splitter_.Feed(data, length,
+                            [this](const char *body, size_t body_length) {
+                              return decode(body, body_length);
+                            });
+    }
+    return decode(static_cast<const char *>(data), length);
+  }
+  // The body ended without a transport error, check it is complete
+  butil::Status Finish() {
+    butil::Status status;
+    if (inflater_ && !inflater_->ended()) {
+      status.set_error(EINVAL, "Compressed stream is truncated");
+      return status;
+    }
+    if (sparse_ && !sparse_->ended()) {
+      status.set_error(EINVAL, "Extent stream is truncated");
+      return status;
+    }
+    if (!has_trailer_) {
+      return status;
+    }
+    uint32_t crc = 0;
+    int64_t bytes = 0;
+    if (!kunlun::StreamChecksum::ParseTrailer(splitter_.trailer(), &crc,
+                                              &bytes)) {
+      status.set_error(EINVAL, "Stream is truncated, no checksum trailer");
+    } else if (bytes != checksum_.bytes() || crc != checksum_.value()) {
+      status.set_error(EINVAL,
+                       "Checksum mismatch: got %ld bytes crc32c %08x, "
+                       "server sent %ld bytes crc32c %08x",
+                       checksum_.bytes(), checksum_.value(), bytes, crc);
+    }
+    return status;
+  }
+
+private:
+  butil::Status decode(const char *data, size_t length) {
+    if (inflater_) {
+      return inflater_->Feed(data, length,
+                             [this](const char *out, size_t out_length) {
+                               return output(out, out_length);
+                             });
+    }
+    return output(data, length);
+  }
+  butil::Status output(const char *data, size_t length) {
+    checksum_.Update(data, length);
+    if (sparse_) {
+      return sparse_->Feed(data, length, extent_sink_);
+    }
+    return sink_(data, length);
+  }
+
+  Sink sink_;
+  kunlun::SparseDecoder::Sink extent_sink_;
+  bool has_trailer_;
+  kunlun::TrailerSplitter splitter_;
+  kunlun::StreamChecksum checksum_;
+  std::unique_ptr<GzipInflater> inflater_;
+  std::unique_ptr<kunlun::SparseDecoder> sparse_;
+};
 
 class MyProgressiveReader : public brpc::ProgressiveReader,
                             public kunlun::ErrorCup {
 public:
   MyProgressiveReader()
-      : fd_(-1), finished_(false), file_name_("outfile"), path_prefix_("./"),
-        success_(true){};
+      : fd_(-1), basis_fd_(-1), finished_(false), success_(true),
+        resume_offset_(0),
+        decoder_(
+            [this](const char *out, size_t out_length) {
+              return writeOut(out, out_length);
+            },
+            [this](int64_t offset, const char *out, size_t out_length) {
+              return writeExtent(offset, out, out_length);
+            }){};
   ~MyProgressiveReader(){};
   bool Init() {
-    if(!FLAGS_out_prefix.empty()){
-      path_prefix_ = FLAGS_out_prefix;
-    }
-    if(!FLAGS_out_filename.empty()){
-      file_name_ = FLAGS_out_filename;
-    }
-    std::string path = kunlun::ConvertToAbsolutePath(path_prefix_.c_str());
-    if (path.empty()) {
-      setErr("out_prefix %s is not exists", path_prefix_.c_str());
+    std::string path;
+    std::string err;
+    if (!ResolveOutputPath(FLAGS_resume || FLAGS_delta, &path, &err)) {
+      setErr("%s", err.c_str());
       return false;
     }
-    path += "/";
-    path += file_name_;
-
-    if (kunlun::CheckFileExists(path.c_str())) {
-      // remove firs
-      if (!FLAGS_output_override) {
-        setErr("%s already exists!", path.c_str());
+    if (FLAGS_delta) {
+      return initDelta(path);
+    }
+    if (FLAGS_extract) {
+      extractor_.reset(new kunlun::TarExtractor(path));
+      butil::Status status = extractor_->Init();
+      if (!status.ok()) {
+        setErr("%s", status.error_cstr());
         return false;
       }
-      // unlink file
-      unlink(path.c_str());
+      return true;
     }
-    fd_ = open(path.c_str(), O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR | S_IXUSR);
+    // O_APPEND would make pwrite() of an extent append too
+    int flags = FLAGS_sparse ? O_CREAT | O_WRONLY : O_CREAT | O_WRONLY | O_APPEND;
+    fd_ = open(path.c_str(), flags, S_IRUSR | S_IWUSR | S_IXUSR);
     if (fd_ < 0) {
       setErr("Open() Failed: %s", strerror(errno));
       return false;
     }
+    if (lseek(fd_, 0, SEEK_END) < 0) {
+      setErr("Lseek() Failed: %s", strerror(errno));
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd_, &st) != 0) {
+      setErr("Fstat() Failed: %s", strerror(errno));
+      return false;
+    }
+    resume_offset_ = st.st_size;
+    return true;
+  }
+  // The server ignored the `Range` header and sends the whole file
+  bool Restart() {
+    if (ftruncate(fd_, 0) != 0 || lseek(fd_, 0, SEEK_SET) < 0) {
+      setErr("Ftruncate() Failed: %s", strerror(errno));
+      return false;
+    }
+    resume_offset_ = 0;
+    return true;
+  }
+  void Close() {
+    if (fd_ >= 0) {
+      close(fd_);
+      fd_ = -1;
+    }
+    if (basis_fd_ >= 0) {
+      close(basis_fd_);
+      basis_fd_ = -1;
+    }
+  }
+  // Signatures of the existing output to send along, empty if none
+  const std::string &signatures() const { return signatures_; }
+  bool InitDecoder(brpc::Controller &cntl) {
+    if (extractor_ && cntl.http_response().content_type() != TAR_CONTENT_TYPE) {
+      setErr("Server did not send a directory archive");
+      return false;
+    }
+    std::string err;
+    if (!decoder_.Init(cntl, &err)) {
+      setErr("%s", err.c_str());
+      return false;
+    }
+    // without the header the server sent the whole file
+    const std::string *delta = cntl.http_response().GetHeader(DELTA_HEADER);
+    if (delta != nullptr) {
+      if (*delta != DELTA_V1 || basis_fd_ < 0) {
+        setErr("Unexpected delta %s", delta->c_str());
+        return false;
+      }
+      delta_.reset(new kunlun::DeltaDecoder(basis_fd_, fd_, block_size_,
+                                            basis_size_));
+    }
     return true;
   }
   virtual butil::Status OnReadOnePart(const void *data,
                                       size_t length) override {
+    return decoder_.Feed(data, length);
+  }
+  virtual void OnEndOfMessage(const butil::Status &status) override {
+    butil::Status result = status.ok() ? decoder_.Finish() : status;
+    if (result.ok() && extractor_) {
+      result = extractor_->Finish();
+    }
+    if (result.ok() && delta_ && !delta_->ended()) {
+      result.set_error(EINVAL, "Delta stream is truncated");
+    }
+    if (result.ok() && !partial_path_.empty() &&
+        rename(partial_path_.c_str(), output_path_.c_str()) != 0) {
+      result.set_error(errno, "Rename() Failed: %s", strerror(errno));
+    }
+    if (!result.ok()) {
+      setErr("%s", result.error_cstr());
+      success_ = false;
+    }
+    Close();
+    finished_ = true;
+  }
+
+  bool Finish() { return finished_; }
+  bool Ok() { return success_; }
+  int64_t resume_offset() { return resume_offset_; }
+
+private:
+  // The output is rebuilt in <path>.delta from the existing file and what
+  // the server sends, then replaces it
+  bool initDelta(const std::string &path) {
+    output_path_ = path;
+    partial_path_ = path + DELTA_PARTIAL_SUFFIX;
+    fd_ = open(partial_path_.c_str(), O_CREAT | O_WRONLY | O_TRUNC,
+               S_IRUSR | S_IWUSR | S_IXUSR);
+    if (fd_ < 0) {
+      setErr("Open() %s Failed: %s", partial_path_.c_str(), strerror(errno));
+      return false;
+    }
+    basis_fd_ = open(path.c_str(), O_RDONLY);
+    if (basis_fd_ < 0) {
+      // nothing to re-sync against, a plain download
+      return true;
+    }
+    struct stat st;
+    if (fstat(basis_fd_, &st) != 0) {
+      setErr("Fstat() Failed: %s", strerror(errno));
+      return false;
+    }
+    posix_fadvise(basis_fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+    kunlun::DeltaSignatures signatures;
+    std::string err;
+    if (!signatures.Build(basis_fd_, st.st_size, &err)) {
+      setErr("%s", err.c_str());
+      return false;
+    }
+    signatures_ = signatures.Serialize();
+    block_size_ = signatures.block_size();
+    basis_size_ = signatures.basis_size();
+    return true;
+  }
+  butil::Status writeOut(const void *data, size_t length) {
     butil::Status status;
+    if (extractor_) {
+      return extractor_->Feed(static_cast<const char *>(data), length);
+    }
+    if (delta_) {
+      return delta_->Feed(static_cast<const char *>(data), length);
+    }
 
     int ret = write(fd_, data, length);
     if (ret < 0) {
@@ -76,31 +481,483 @@ public:
   end:
     return status;
   }
+  butil::Status writeExtent(int64_t offset, const char *data, size_t length) {
+    butil::Status status;
+    if (data != nullptr) {
+      return PwriteAll(fd_, data, length, offset);
+    }
+    // the end of the file, a hole at the end needs the size set
+    if (ftruncate(fd_, offset) != 0) {
+      status.set_error(errno, "Ftruncate() Failed: %s", strerror(errno));
+    }
+    return status;
+  }
+
+  int fd_;
+  // the existing output a delta is applied to
+  int basis_fd_;
+  bool finished_;
+  bool success_;
+  int64_t resume_offset_;
+  BodyDecoder decoder_;
+  std::unique_ptr<kunlun::TarExtractor> extractor_;
+  std::string output_path_;
+  std::string partial_path_;
+  std::string signatures_;
+  uint32_t block_size_ = 0;
+  int64_t basis_size_ = 0;
+  std::unique_ptr<kunlun::DeltaDecoder> delta_;
+};
+
+// Total size out of `Content-Range: bytes first-last/total`, -1 if absent
+static int64_t ContentRangeTotal(brpc::Controller &cntl) {
+  const std::string *content_range =
+      cntl.http_response().GetHeader("Content-Range");
+  if (content_range == nullptr) {
+    return -1;
+  }
+  size_t slash = content_range->rfind('/');
+  if (slash == std::string::npos) {
+    return -1;
+  }
+  return ::atoll(content_range->c_str() + slash + 1);
+}
+
+// Writes the bytes of one range at their place in the preallocated output
+class RangeReader : public brpc::ProgressiveReader {
+public:
+  RangeReader(int fd, int64_t offset, int64_t length)
+      : fd_(fd), offset_(offset), length_(length), received_(0),
+        finished_(false),
+        decoder_(
+            [this](const char *out, size_t out_length) {
+              return writeOut(out, out_length);
+            },
+            [this](int64_t offset, const char *out, size_t out_length) {
+              return writeExtent(offset, out, out_length);
+            }) {}
+  bool InitDecoder(brpc::Controller &cntl, std::string *err) {
+    return decoder_.Init(cntl, err);
+  }
+  virtual butil::Status OnReadOnePart(const void *data,
+                                      size_t length) override {
+    return decoder_.Feed(data, length);
+  }
   virtual void OnEndOfMessage(const butil::Status &status) override {
-    finished_ = true;
-    if (!status.ok()) {
-      setErr("%s", status.error_cstr());
-      success_ = false;
+    butil::Status result = status.ok() ? decoder_.Finish() : status;
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (!result.ok()) {
+      error_ = result.error_cstr();
     }
-    close(fd_);
+    finished_ = true;
+    cond_.notify_all();
   }
 
-  bool Finish() { return finished_; }
-  bool Ok() { return success_; }
+  // Block till the range is over, return false if it broke off
+  bool Wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this] { return finished_; });
+    return error_.empty();
+  }
+  int64_t received() { return received_; }
+  const std::string &error() { return error_; }
 
 private:
+  butil::Status writeOut(const void *data, size_t length) {
+    butil::Status status;
+    if (received_ + (int64_t)length > length_) {
+      status.set_error(EINVAL, "Server sent more than the requested range");
+      return status;
+    }
+    status = PwriteAll(fd_, static_cast<const char *>(data), length,
+                       offset_ + received_);
+    if (status.ok()) {
+      received_ += length;
+    }
+    return status;
+  }
+  // holes are already holes of the output, they count as received
+  butil::Status writeExtent(int64_t offset, const char *data, size_t length) {
+    butil::Status status;
+    if (offset < offset_ + received_ ||
+        offset + (int64_t)length > offset_ + length_) {
+      status.set_error(EINVAL, "Server sent an extent outside the range");
+      return status;
+    }
+    if (data != nullptr) {
+      status = PwriteAll(fd_, data, length, offset);
+    }
+    if (status.ok()) {
+      received_ = offset + length - offset_;
+    }
+    return status;
+  }
+
   int fd_;
+  int64_t offset_;
+  int64_t length_;
+  int64_t received_;
   bool finished_;
-  std::string file_name_;
-  std::string path_prefix_;
-  bool success_;
+  std::string error_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  BodyDecoder decoder_;
+};
+
+struct ByteRange {
+  int64_t first;
+  int64_t last;
+  int64_t received;
+  std::string error;
+};
+
+// Body of the size probe: the one byte asked for. A server ignoring the
+// Range header answers with the whole file, the connection is dropped
+// after its first part instead of taking it all in
+class ProbeReader : public brpc::ProgressiveReader {
+public:
+  ProbeReader() : received_(0) {}
+  virtual butil::Status OnReadOnePart(const void *data,
+                                      size_t length) override {
+    received_ += length;
+    if (received_ > 1) {
+      return butil::Status(ECANCELED, "Probe got more than the byte asked");
+    }
+    return butil::Status::OK();
+  }
+  virtual void OnEndOfMessage(const butil::Status &status) override {
+    delete this;
+  }
+
+private:
+  size_t received_;
 };
+
+// Size of the remote file, -1 if the server does not serve byte ranges.
+// `bulk_stream` tells whether the file can be fetched over streams
+static int64_t RemoteFileSize(brpc::Channel &channel, bool *bulk_stream) {
+  brpc::Controller cntl;
+  cntl.http_request().uri() = FLAGS_url;
+  cntl.http_request().set_method(brpc::HTTP_METHOD_POST);
+  cntl.http_request().SetHeader("Range", "bytes=0-0");
+  cntl.request_attachment().append(RequestBody(FLAGS_traffic_limit));
+  // only the headers are wanted
+  cntl.response_will_be_read_progressively();
+  channel.CallMethod(NULL, &cntl, NULL, NULL, NULL);
+  if (!cntl.Failed()) {
+    cntl.ReadProgressiveAttachmentBy(new ProbeReader());
+  }
+  if (cntl.Failed() && cntl.http_response().status_code() !=
+                           brpc::HTTP_STATUS_REQUEST_RANGE_NOT_SATISFIABLE) {
+    return -1;
+  }
+  if (!cntl.Failed() &&
+      cntl.http_response().status_code() != brpc::HTTP_STATUS_PARTIAL_CONTENT) {
+    return -1;
+  }
+  const std::string *stream =
+      cntl.http_response().GetHeader(BULK_STREAM_HEADER);
+  *bulk_stream = stream != nullptr && *stream == BULK_STREAM_V1;
+  return ContentRangeTotal(cntl);
+}
+
+// Fetch `range` over a connection of its own, picking up where a broken
+// connection left off
+static void FetchRange(int fd, int64_t traffic_limit, ByteRange *range) {
+  brpc::Channel channel;
+  brpc::ChannelOptions options;
+  options.timeout_ms = 3600000; // 1 hour
+  options.protocol = "http";
+  options.max_retry = 5;
+  options.connection_type = "pooled";
+  if (channel.Init(FLAGS_url.c_str(), "", &options) != 0) {
+    range->error = "Fail to initialize channel";
+    return;
+  }
+
+  int64_t length = range->last - range->first + 1;
+  for (int attempt = 0; attempt < RANGE_MAX_ATTEMPTS && range->received < length;
+       attempt++) {
+    int64_t first = range->first + range->received;
+    brpc::Controller cntl;
+    cntl.http_request().uri() = FLAGS_url;
+    cntl.http_request().set_method(brpc::HTTP_METHOD_POST);
+    cntl.http_request().SetHeader(
+        "Range", kunlun::string_sprintf("bytes=%ld-%ld", first, range->last));
+    cntl.request_attachment().append(RequestBody(traffic_limit));
+    cntl.response_will_be_read_progressively();
+    channel.CallMethod(NULL, &cntl, NULL, NULL, NULL);
+    if (cntl.Failed()) {
+      range->error = cntl.ErrorText();
+      continue;
+    }
+    if (cntl.http_response().status_code() !=
+        brpc::HTTP_STATUS_PARTIAL_CONTENT) {
+      range->error = "Server ignored the Range header";
+      return;
+    }
+
+    RangeReader reader(fd, first, range->last - first + 1);
+    if (!reader.InitDecoder(cntl, &range->error)) {
+      return;
+    }
+    cntl.ReadProgressiveAttachmentBy(&reader);
+    bool ok = reader.Wait();
+    range->received += reader.received();
+    range->error = ok ? "" : reader.error();
+  }
+}
+
+// Server address and file name out of
+// http://address:port/FileService/FilePath
+static bool SplitFileUrl(std::string *server, std::string *file) {
+  std::string url = FLAGS_url;
+  size_t scheme = url.find("://");
+  if (scheme != std::string::npos) {
+    url = url.substr(scheme + 3);
+  }
+  const std::string service = "/FileService/";
+  size_t slash = url.find('/');
+  if (slash == std::string::npos ||
+      url.compare(slash, service.size(), service) != 0) {
+    return false;
+  }
+  *server = url.substr(0, slash);
+  *file = url.substr(slash + service.size());
+  return !file->empty();
+}
+
+/*
+  Receiving end of a bulk stream: data is written where it belongs in the
+  output as it arrives, the end message is checked against the crc32c of
+  the data.
+*/
+class StreamRangeReceiver : public brpc::StreamInputHandler {
+public:
+  StreamRangeReceiver(int fd, int64_t offset, int64_t length)
+      : fd_(fd), offset_(offset), length_(length), received_(0),
+        ended_(false), closed_(false) {}
+
+  virtual int on_received_messages(brpc::StreamId id,
+                                   butil::IOBuf *const messages[],
+                                   size_t size) override {
+    for (size_t i = 0; i < size; i++) {
+      std::string err = receive(messages[i]);
+      if (!err.empty()) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        if (error_.empty()) {
+          error_ = err;
+        }
+      }
+    }
+    return 0;
+  }
+  virtual void on_idle_timeout(brpc::StreamId id) override {}
+  virtual void on_closed(brpc::StreamId id) override {
+    std::lock_guard<std::mutex> guard(mutex_);
+    closed_ = true;
+    cond_.notify_all();
+  }
+
+  // Block till the stream is closed, return false if the range broke off
+  bool Wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this] { return closed_; });
+    if (error_.empty() && !ended_) {
+      error_ = "Stream closed before the end of the range";
+    }
+    return error_.empty();
+  }
+  int64_t received() { return received_; }
+  const std::string &error() { return error_; }
+
+private:
+  std::string receive(butil::IOBuf *message) {
+    char type = '\0';
+    if (!error_.empty() || message->cutn(&type, 1) != 1) {
+      return "";
+    }
+    if (type == BULK_MSG_ERROR) {
+      return "Server failed: " + message->to_string();
+    }
+    if (type == BULK_MSG_END) {
+      uint32_t crc = 0;
+      int64_t bytes = 0;
+      if (!kunlun::StreamChecksum::ParseTrailer(message->to_string(), &crc,
+                                                &bytes) ||
+          bytes != checksum_.bytes() || crc != checksum_.value()) {
+        return kunlun::string_sprintf(
+            "Checksum mismatch: got %ld bytes crc32c %08x", checksum_.bytes(),
+            checksum_.value());
+      }
+      std::lock_guard<std::mutex> guard(mutex_);
+      ended_ = true;
+      return "";
+    }
+    if (type != BULK_MSG_DATA ||
+        received_ + (int64_t)message->size() > length_) {
+      return "Server sent more than the requested range";
+    }
+    checksum_.Update(*message);
+    while (!message->empty()) {
+      ssize_t ret =
+          message->pcut_into_file_descriptor(fd_, offset_ + received_);
+      if (ret < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return kunlun::string_sprintf("Pwrite() Failed: %s", strerror(errno));
+      }
+      received_ += ret;
+    }
+    return "";
+  }
+
+  int fd_;
+  int64_t offset_;
+  int64_t length_;
+  int64_t received_;
+  bool ended_;
+  bool closed_;
+  std::string error_;
+  kunlun::StreamChecksum checksum_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+};
+
+static std::string StreamRequestBody(const std::string &file, int64_t offset,
+                                     int64_t length, int64_t traffic_limit) {
+  Json::Value root;
+  root["file"] = file;
+  root["offset"] = std::to_string(offset);
+  root["length"] = std::to_string(length);
+  root["traffic_limit"] = std::to_string(traffic_limit);
+  Json::FastWriter writer;
+  writer.omitEndingLineFeed();
+  return writer.write(root);
+}
+
+// Fetch `range` over a bulk stream on a connection of its own, picking up
+// where a broken stream left off
+static void FetchRangeByStream(int fd, int64_t traffic_limit,
+                               ByteRange *range) {
+  std::string server;
+  std::string file;
+  if (!SplitFileUrl(&server, &file)) {
+    range->error = "Url does not name a FileService file";
+    return;
+  }
+  brpc::Channel channel;
+  brpc::ChannelOptions options;
+  options.timeout_ms = 60000;
+  options.protocol = "baidu_std";
+  options.max_retry = 5;
+  // streams ride single connections, a group of its own keeps every range
+  // on a socket of its own
+  options.connection_type = "single";
+  options.connection_group = kunlun::string_sprintf("bulk-%ld", range->first);
+  if (channel.Init(server.c_str(), "", &options) != 0) {
+    range->error = "Fail to initialize channel";
+    return;
+  }
+  kunlunrpc::FileService_Stub stub(&channel);
+
+  int64_t length = range->last - range->first + 1;
+  for (int attempt = 0; attempt < RANGE_MAX_ATTEMPTS && range->received < length;
+       attempt++) {
+    int64_t first = range->first + range->received;
+    StreamRangeReceiver receiver(fd, first, range->last - first + 1);
+    brpc::Controller cntl;
+    brpc::StreamId stream;
+    brpc::StreamOptions stream_options;
+    stream_options.handler = &receiver;
+    if (brpc::StreamCreate(&stream, cntl, &stream_options) != 0) {
+      range->error = "Fail to create stream";
+      return;
+    }
+    cntl.request_attachment().append(StreamRequestBody(
+        file, first, range->last - first + 1, traffic_limit));
+    kunlunrpc::HttpRequest request;
+    kunlunrpc::HttpResponse response;
+    stub.default_method(&cntl, &request, &response, NULL);
+    if (cntl.Failed()) {
+      brpc::StreamClose(stream);
+    }
+    // the receiver is in use till the stream is closed
+    bool ok = receiver.Wait();
+    brpc::StreamClose(stream);
+    range->received += receiver.received();
+    range->error = cntl.Failed() ? cntl.ErrorText() : ok ? "" : receiver.error();
+  }
+}
+
+// Split the file into `streams` ranges fetched concurrently by `fetch` into
+// a preallocated output, then make sure every byte arrived
+static bool ParallelDownload(int64_t total, int streams,
+                             void (*fetch)(int, int64_t, ByteRange *)) {
+  std::string path;
+  std::string err;
+  if (!ResolveOutputPath(false, &path, &err)) {
+    fprintf(stderr, "%s", err.c_str());
+    return false;
+  }
+  int fd = open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC,
+                S_IRUSR | S_IWUSR | S_IXUSR);
+  if (fd < 0) {
+    fprintf(stderr, "Open() Failed: %s", strerror(errno));
+    return false;
+  }
+  // a sparse output only gets the size, the ranges leave the holes alone
+  int ret = FLAGS_sparse ? (ftruncate(fd, total) == 0 ? 0 : errno)
+                         : posix_fallocate(fd, 0, total);
+  if (ret != 0) {
+    fprintf(stderr, "Fallocate() %ld bytes Failed: %s", total, strerror(ret));
+    close(fd);
+    return false;
+  }
+
+  std::vector<ByteRange> ranges(streams);
+  int64_t range_size = (total + streams - 1) / streams;
+  for (int i = 0; i < streams; i++) {
+    ranges[i].first = i * range_size;
+    ranges[i].last = std::min(total, (i + 1) * range_size) - 1;
+    ranges[i].received = 0;
+  }
+  // every connection gets its share of the limit of the whole download
+  int64_t traffic_limit = std::max(FLAGS_traffic_limit / streams, (int64_t)1);
+  std::vector<std::thread> fetchers;
+  for (int i = 0; i < streams; i++) {
+    fetchers.emplace_back(fetch, fd, traffic_limit, &ranges[i]);
+  }
+  for (auto &fetcher : fetchers) {
+    fetcher.join();
+  }
+
+  bool success = true;
+  for (auto &range : ranges) {
+    int64_t length = range.last - range.first + 1;
+    if (range.received != length) {
+      fprintf(stderr, "Range %ld-%ld got %ld of %ld bytes: %s\n", range.first,
+              range.last, range.received, length, range.error.c_str());
+      success = false;
+    }
+  }
+  struct stat st;
+  if (success && (fstat(fd, &st) != 0 || st.st_size != total)) {
+    fprintf(stderr, "Output size %ld does not match the remote size %ld",
+            (int64_t)st.st_size, total);
+    success = false;
+  }
+  close(fd);
+  return success;
+}
+
 int main(int argc, char *argv[]) {
   google::ParseCommandLineFlags(&argc, &argv, false);
 
   char usage[2048] = {'\0'};
   if(argc < 2){
-    sprintf(usage,"./download_files -url=\"http://address:port/FileService/FilePath\" -out_prefix=\"prefix\" -out_filename=\"filename\" -output_override=false");
+    sprintf(usage,"./download_files -url=\"http://address:port/FileService/FilePath\" -out_prefix=\"prefix\" -out_filename=\"filename\" -output_override=false -resume=false -streams=1 -compress=\"gzip\" -checksum=\"crc32c\" -extract=false -sparse=false -delta=false -transport=auto");
     fprintf(stderr,"Usage: %s\n",usage);
     exit(-1);
   }
@@ -116,32 +973,96 @@ int main(int argc, char *argv[]) {
     exit(-1);
   }
 
+  if (FLAGS_extract && FLAGS_resume) {
+    fprintf(stderr, "-extract can not be resumed");
+    exit(-1);
+  }
+  if (FLAGS_delta && (FLAGS_resume || FLAGS_extract || FLAGS_sparse)) {
+    fprintf(stderr, "-delta can not be combined with -resume, -extract or "
+                    "-sparse");
+    exit(-1);
+  }
+  // streams carry the bytes of a plain file, nothing else
+  bool plain = !FLAGS_resume && !FLAGS_extract && !FLAGS_delta &&
+               !FLAGS_sparse && FLAGS_compress.empty();
+  if (FLAGS_transport == "stream" && !plain) {
+    fprintf(stderr, "-transport=stream can not be combined with -resume, "
+                    "-extract, -delta, -sparse or -compress");
+    exit(-1);
+  }
+  if ((FLAGS_streams > 1 || FLAGS_transport != "http") && !FLAGS_resume &&
+      !FLAGS_extract && !FLAGS_delta) {
+    bool bulk_stream = false;
+    int64_t total = RemoteFileSize(channel, &bulk_stream);
+    int streams = std::max(
+        std::min((int64_t)FLAGS_streams, total / MIN_RANGE_SIZE), (int64_t)1);
+    if (plain && FLAGS_transport != "http" && total > 0 &&
+        (bulk_stream || FLAGS_transport == "stream")) {
+      exit(ParallelDownload(total, streams, FetchRangeByStream) ? 0 : -1);
+    }
+    if (streams > 1) {
+      exit(ParallelDownload(total, streams, FetchRange) ? 0 : -1);
+    }
+  }
+
+  auto reader = new MyProgressiveReader();
+  // -resume needs the offset of the output and -delta its signatures for
+  // the request. Otherwise the output is only touched once the server
+  // answered, an error leaves no empty file and -output_override does not
+  // remove the old one for nothing
+  bool open_first = FLAGS_resume || FLAGS_delta;
+  if (open_first && !reader->Init()) {
+    fprintf(stderr, "%s", reader->getErr());
+    exit(-1);
+  }
+
   brpc::Controller cntl;
   cntl.http_request().uri() = FLAGS_url;
   cntl.http_request().set_method(brpc::HTTP_METHOD_POST);
+  if (reader->resume_offset() > 0) {
+    cntl.http_request().SetHeader(
+        "Range", kunlun::string_sprintf("bytes=%ld-", reader->resume_offset()));
+  }
 
-  char buff[1024] = {'\0'};
-  sprintf(buff,"%ld",FLAGS_traffic_limit);
-  Json::Value root;
-  root["traffic_limit"] = buff; 
-  Json::FastWriter writer;
-  writer.omitEndingLineFeed();
-  cntl.request_attachment().append(writer.write(root));
+  cntl.request_attachment().append(RequestBody(FLAGS_traffic_limit));
+  if (!reader->signatures().empty()) {
+    cntl.http_request().SetHeader(
+        DELTA_SIGNATURES_HEADER,
+        kunlun::string_sprintf("%lu", reader->signatures().size()));
+    cntl.request_attachment().append(reader->signatures());
+  }
 
   cntl.response_will_be_read_progressively();
   channel.CallMethod(NULL, &cntl, NULL, NULL, NULL);
   if (cntl.Failed()) {
+    if (reader->resume_offset() > 0 &&
+        cntl.http_response().status_code() ==
+            brpc::HTTP_STATUS_REQUEST_RANGE_NOT_SATISFIABLE &&
+        ContentRangeTotal(cntl) == reader->resume_offset()) {
+      // nothing left, the previous run got the whole file
+      reader->Close();
+      exit(0);
+    }
     fprintf(stderr, "%s", cntl.ErrorText().c_str());
     exit(-1);
   }
 
-  auto reader = new MyProgressiveReader();
-  bool ret = reader->Init();
-  if (!ret) {
+  if (!open_first && !reader->Init()) {
     fprintf(stderr, "%s", reader->getErr());
     exit(-1);
   }
+  if (reader->resume_offset() > 0 &&
+      cntl.http_response().status_code() != brpc::HTTP_STATUS_PARTIAL_CONTENT) {
+    if (!reader->Restart()) {
+      fprintf(stderr, "%s", reader->getErr());
+      exit(-1);
+    }
+  }
 
+  if (!reader->InitDecoder(cntl)) {
+    fprintf(stderr, "%s", reader->getErr());
+    exit(-1);
+  }
   cntl.ReadProgressiveAttachmentBy(reader);
 
   while (!reader->Finish()) {
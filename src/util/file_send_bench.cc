@@ -0,0 +1,177 @@
+/*
+  Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+  This source code is licensed under Apache 2.0 License,
+  combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+// Measure the CPU FileService spends per GB for every send mode.
+// The file is chunked exactly like SendFile() does and every chunk is
+// written into a unix socket drained by another thread, so the numbers
+// include the copy into the socket buffer just like a real transfer.
+// With -checksum every chunk also goes the way of BodySender::Send() with
+// the default -checksum=crc32c of download_file: crc32c in user space,
+// charged to a transfer window, and the mode resolved the way a
+// checksummed body resolves it (mmap reads by pread then).
+
+#include "server_http/file_chunk.h"
+#include "server_http/flow_control.h"
+#include "server_http/stream_checksum.h"
+#include <butil/iobuf.h>
+#include <errno.h>
+#include <gflags/gflags.h>
+#include <memory>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+DEFINE_string(file, "", "File to be sent, better larger than 1GB");
+DEFINE_string(mode, "all", "Send mode to measure: mmap, copy, direct or all");
+DEFINE_int32(repeat, 3, "Times to send the file for every mode");
+DEFINE_string(checksum, "both",
+              "Measure without checksum (off), with crc32c (on) or both");
+
+static double TimevalToSec(const struct timeval &tv) {
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static double ThreadCpuSec() {
+  struct rusage usage;
+  getrusage(RUSAGE_THREAD, &usage);
+  return TimevalToSec(usage.ru_utime) + TimevalToSec(usage.ru_stime);
+}
+
+static double WallSec() {
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  return TimevalToSec(tv);
+}
+
+static void DrainSocket(int fd) {
+  std::vector<char> buff(1024 * 1024);
+  while (read(fd, buff.data(), buff.size()) > 0) {
+  }
+}
+
+// Return the bytes sent, -1 on failure
+static int64_t SendOnce(kunlun::FileSendMode mode, bool checksum,
+                        int sock_fd) {
+  kunlun::FileChunkReader reader(mode);
+  if (!reader.Open(FLAGS_file)) {
+    fprintf(stderr, "%s\n", reader.getErr());
+    return -1;
+  }
+  // nothing waits for room, the window only costs what it costs SendFile()
+  std::shared_ptr<kunlun::TransferWindow> window;
+  kunlun::StreamChecksum crc;
+  if (checksum) {
+    window = std::make_shared<kunlun::TransferWindow>(INT64_MAX);
+    reader.set_window(window);
+  }
+
+  // brpc batches queued chunks into one writev(), do the same here
+  butil::IOBuf pending;
+  int64_t sent = 0;
+  for (;;) {
+    butil::IOBuf chunk;
+    ssize_t ret = reader.ReadChunk(sent, reader.chunk_size(), &chunk);
+    if (ret < 0) {
+      fprintf(stderr, "%s\n", reader.getErr());
+      return -1;
+    }
+    if (checksum) {
+      crc.Update(chunk);
+    }
+    pending.append(chunk);
+    sent += ret;
+    if (ret != 0 && pending.size() < FILE_CHUNK_SIZE) {
+      continue;
+    }
+    while (!pending.empty()) {
+      if (pending.cut_into_file_descriptor(sock_fd) < 0) {
+        fprintf(stderr, "write socket failed: %s\n", strerror(errno));
+        return -1;
+      }
+    }
+    if (ret == 0) {
+      break;
+    }
+  }
+  return sent;
+}
+
+static bool Bench(kunlun::FileSendMode mode, const char *mode_name,
+                  bool checksum) {
+  // threshold 0, the mode stays what was asked for
+  mode = kunlun::ResolveFileSendMode(mode, 0, 0, checksum);
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+    fprintf(stderr, "socketpair failed: %s\n", strerror(errno));
+    return false;
+  }
+  std::thread drainer(DrainSocket, fds[1]);
+
+  int64_t total = 0;
+  double cpu_begin = ThreadCpuSec();
+  double wall_begin = WallSec();
+  for (int i = 0; i < FLAGS_repeat; i++) {
+    int64_t sent = SendOnce(mode, checksum, fds[0]);
+    if (sent < 0) {
+      break;
+    }
+    total += sent;
+  }
+  double cpu = ThreadCpuSec() - cpu_begin;
+  double wall = WallSec() - wall_begin;
+
+  close(fds[0]);
+  drainer.join();
+  close(fds[1]);
+
+  if (total == 0) {
+    return false;
+  }
+  double gb = total / (1024.0 * 1024 * 1024);
+  fprintf(stdout,
+          "%-6s %-6s sent %.2f GB in %.2f s (%.1f MB/s), sender cpu %.2f s, "
+          "%.3f cpu-sec/GB\n",
+          mode_name, checksum ? "crc32c" : "", gb, wall,
+          total / wall / (1024 * 1024), cpu, cpu / gb);
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  google::ParseCommandLineFlags(&argc, &argv, false);
+  if (FLAGS_file.empty()) {
+    fprintf(stderr, "Usage: ./file_send_bench -file=\"path\" "
+                    "-mode=\"all|mmap|copy|direct\" -checksum=\"both|on|off\" "
+                    "-repeat=3\n");
+    exit(-1);
+  }
+
+  bool ret = true;
+  for (int checksum = 0; checksum <= 1; checksum++) {
+    const char *wanted = checksum ? "on" : "off";
+    if (FLAGS_checksum != "both" && FLAGS_checksum != wanted) {
+      continue;
+    }
+    if (FLAGS_mode == "all" || FLAGS_mode == "copy") {
+      ret = Bench(kunlun::kFileSendCopy, "copy", checksum) && ret;
+    }
+    if (FLAGS_mode == "all" || FLAGS_mode == "mmap") {
+      ret = Bench(kunlun::kFileSendMmap, checksum ? "pread" : "mmap",
+                  checksum) &&
+            ret;
+    }
+    if (FLAGS_mode == "all" || FLAGS_mode == "direct") {
+      ret = Bench(kunlun::kFileSendDirect, "direct", checksum) && ret;
+    }
+  }
+  exit(ret ? 0 : -1);
+}
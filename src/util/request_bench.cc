@@ -0,0 +1,138 @@
+/*
+  Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+  This source code is licensed under Apache 2.0 License,
+  combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+// Measure the CPU Emit spends on a request outside of the job itself. The
+// attachment goes the way Emit takes it: copied out and parsed once,
+// RequestDealerFactory(), ParseRequest() and FetchResponse() of the real
+// dealers. An install_mysql request stands for the jobs, whose response
+// is fetched without running them, and list_jobs for the queries Emit
+// deals with inline.
+
+#include "request_dealer/job_table.h"
+#include "request_dealer/request_dealer.h"
+#include "server_http/server_http.h"
+#include "json/json.h"
+#include <butil/iobuf.h>
+#include <gflags/gflags.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+DEFINE_int32(requests, 200000, "Requests to run through every pipeline");
+DEFINE_int32(hosts, 8, "Instances listed in the paras of the request, "
+                       "makes the request larger");
+
+// defined by main.cc of node_mgr, which is not linked in
+std::string tcp_server_file;
+int64_t node_mgr_tcp_port;
+
+static double TimevalToSec(const struct timeval &tv) {
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static double ThreadCpuSec() {
+  struct rusage usage;
+  getrusage(RUSAGE_THREAD, &usage);
+  return TimevalToSec(usage.ru_utime) + TimevalToSec(usage.ru_stime);
+}
+
+static std::string ToString(const Json::Value &root) {
+  Json::FastWriter writer;
+  writer.omitEndingLineFeed();
+  return writer.write(root);
+}
+
+// An install_mysql request the size of a shard setup
+static std::string MakeInstallRequest() {
+  Json::Value root;
+  root["cluster_mgr_request_id"] = "1024";
+  root["task_spec_info"] = "install_mysql_192.168.0.135_57001";
+  root["job_type"] = "install_mysql";
+  Json::Value &paras = root["paras"];
+  paras["command_name"] = "install-mysql.py";
+  paras["cluster_name"] = "cluster_1657247309_000006";
+  paras["shard_name"] = "shard_2";
+  for (int i = 0; i < FLAGS_hosts; i++) {
+    Json::Value host;
+    host["ip"] = "192.168.0.135";
+    host["port"] = 57001 + i * 3;
+    host["is_primary"] = i == 0;
+    host["innodb_buffer_pool_size"] = "1024MB";
+    host["data_dir_path"] = "/home/kunlun/data/" + std::to_string(57001 + i);
+    host["log_dir_path"] = "/home/kunlun/log/" + std::to_string(57001 + i);
+    paras["install_ids"].append(host);
+  }
+  return ToString(root);
+}
+
+static std::string MakeListJobsRequest() {
+  Json::Value root;
+  root["cluster_mgr_request_id"] = "1025";
+  root["task_spec_info"] = "list_jobs";
+  root["job_type"] = "list_jobs";
+  root["paras"]["with_finished"] = true;
+  return ToString(root);
+}
+
+// What Emit does with the attachment but for starting the job, return the
+// response bytes or -1 if the request was refused
+static ssize_t EmitOnce(const butil::IOBuf &attachment) {
+  const std::string body = attachment.to_string();
+  Json::Value root;
+  Json::Reader reader;
+  if (!reader.parse(body.data(), body.data() + body.size(), root, false)) {
+    return -1;
+  }
+  RequestDealer *dealer = RequestDealerFactory(root);
+  if (!dealer->ParseRequest()) {
+    fprintf(stderr, "%s\n", dealer->getErr());
+    delete dealer;
+    return -1;
+  }
+  if (JobTable::IsQueryType(dealer->request_type())) {
+    dealer->Deal();
+  }
+  ssize_t bytes = dealer->FetchResponse().size();
+  delete dealer;
+  return bytes;
+}
+
+static bool Bench(const char *name, const std::string &request) {
+  butil::IOBuf attachment;
+  attachment.append(request);
+  size_t bytes = 0;
+  double begin = ThreadCpuSec();
+  for (int i = 0; i < FLAGS_requests; i++) {
+    ssize_t ret = EmitOnce(attachment);
+    if (ret < 0) {
+      fprintf(stderr, "%s request refused\n", name);
+      return false;
+    }
+    bytes += ret;
+  }
+  double cpu = ThreadCpuSec() - begin;
+  fprintf(stdout, "%-13s %d requests of %lu bytes, cpu %.3f s, "
+                  "%.2f us/request (%lu response bytes)\n",
+          name, FLAGS_requests, (unsigned long)request.size(), cpu,
+          cpu * 1000000 / FLAGS_requests, (unsigned long)bytes);
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  google::ParseCommandLineFlags(&argc, &argv, false);
+  if (FLAGS_requests <= 0) {
+    fprintf(stderr, "Usage: ./request_bench -requests=200000 -hosts=8\n");
+    exit(-1);
+  }
+
+  bool ret = Bench("install_mysql", MakeInstallRequest());
+  ret = Bench("list_jobs", MakeListJobsRequest()) && ret;
+  exit(ret ? 0 : -1);
+}
@@ -0,0 +1,161 @@
+/*
+  Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+  This source code is licensed under Apache 2.0 License,
+  combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+
+#include <algorithm>
+#include <brpc/channel.h>
+#include <butil/crc32c.h>
+#include <butil/iobuf.h>
+#include <gflags/gflags.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#include <zettalib/tool_func.h>
+#include "server_http/file_upload.h"
+
+DEFINE_string(url, "", "URL the file is uploaded to: "
+                       "http://address:port/FileService/FilePath");
+DEFINE_string(file, "", "Local file to upload");
+DEFINE_int64(piece_size, 32 * 1024 * 1024,
+             "Bytes sent per request, below the server's max_body_size");
+DEFINE_bool(output_override, false,
+            "Whether override the file on the server if it exists or not");
+DEFINE_string(chain, "",
+              "node_mgrs (ip:port, comma separated) the server passes the file "
+              "on to, one after another, while it arrives");
+
+// attempts to send one piece before giving up
+#define PIECE_MAX_ATTEMPTS 3
+
+// Read [offset, offset + length) of `fd` into `out`
+static bool ReadPiece(int fd, int64_t offset, int64_t length,
+                      butil::IOBuf *out, uint32_t *crc) {
+  std::vector<char> buff(length);
+  int64_t done = 0;
+  while (done < length) {
+    ssize_t ret = pread(fd, buff.data() + done, length - done, offset + done);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      fprintf(stderr, "Read %s failed: %s\n", FLAGS_file.c_str(),
+              ret == 0 ? "unexpected EOF" : strerror(errno));
+      return false;
+    }
+    done += ret;
+  }
+  out->append(buff.data(), length);
+  *crc = butil::crc32c::Value(buff.data(), length);
+  return true;
+}
+
+// Send [offset, offset + length) of the file. Return the offset the server
+// wants next, -1 on failure
+static int64_t SendPiece(brpc::Channel &channel, int fd, int64_t offset,
+                         int64_t length, int64_t total) {
+  brpc::Controller cntl;
+  cntl.http_request().uri() = FLAGS_url;
+  cntl.http_request().set_method(brpc::HTTP_METHOD_PUT);
+  if (FLAGS_output_override) {
+    cntl.http_request().uri().SetQuery("override", "true");
+  }
+  if (total > 0) {
+    cntl.http_request().SetHeader(
+        "Content-Range", kunlun::string_sprintf("bytes %ld-%ld/%ld", offset,
+                                                offset + length - 1, total));
+  }
+  if (!FLAGS_chain.empty()) {
+    cntl.http_request().SetHeader(RELAY_CHAIN_HEADER, FLAGS_chain);
+  }
+  uint32_t crc = 0;
+  if (!ReadPiece(fd, offset, length, &cntl.request_attachment(), &crc)) {
+    return -1;
+  }
+  // checked by the server and by every hop of the chain
+  cntl.http_request().SetHeader(PIECE_CRC32C_HEADER,
+                                kunlun::string_sprintf("%08x", crc));
+
+  channel.CallMethod(NULL, &cntl, NULL, NULL, NULL);
+  const std::string *next =
+      cntl.http_response().GetHeader(UPLOAD_OFFSET_HEADER);
+  if (cntl.Failed()) {
+    // the server has a different idea of the offset, go on from there
+    if (cntl.http_response().status_code() == brpc::HTTP_STATUS_CONFLICT &&
+        next != nullptr) {
+      return atoll(next->c_str());
+    }
+    fprintf(stderr, "Upload %ld bytes at %ld failed: %s %s\n", length, offset,
+            cntl.ErrorText().c_str(),
+            cntl.response_attachment().to_string().c_str());
+    return -1;
+  }
+  return offset + length;
+}
+
+int main(int argc, char *argv[]) {
+  google::ParseCommandLineFlags(&argc, &argv, false);
+
+  if (FLAGS_url.empty() || FLAGS_file.empty() || FLAGS_piece_size <= 0) {
+    fprintf(stderr, "Usage: ./upload_file -url=\"http://address:port/"
+                    "FileService/FilePath\" -file=\"path\" "
+                    "-piece_size=33554432 -output_override=false "
+                    "-chain=\"ip:port,ip:port\"\n");
+    exit(-1);
+  }
+
+  int fd = open(FLAGS_file.c_str(), O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Open %s failed: %s\n", FLAGS_file.c_str(),
+            strerror(errno));
+    exit(-1);
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    fprintf(stderr, "Stat %s failed: %s\n", FLAGS_file.c_str(),
+            strerror(errno));
+    exit(-1);
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  brpc::Channel channel;
+  brpc::ChannelOptions options;
+  options.timeout_ms = 3600000; // 1 hour
+  options.protocol = "http";
+  // a retried PUT is answered with the offset to go on from
+  options.max_retry = 5;
+  if (channel.Init(FLAGS_url.c_str(), "", &options) != 0) {
+    fprintf(stderr, "Fail to initialize channel");
+    exit(-1);
+  }
+
+  int64_t total = st.st_size;
+  int64_t offset = 0;
+  int failures = 0;
+  for (;;) {
+    int64_t length = std::min((int64_t)FLAGS_piece_size, total - offset);
+    int64_t next = SendPiece(channel, fd, offset, length, total);
+    // an empty file is done by its single request
+    if (next < 0 || (next == offset && total > 0)) {
+      if (++failures >= PIECE_MAX_ATTEMPTS) {
+        close(fd);
+        exit(-1);
+      }
+      continue;
+    }
+    failures = 0;
+    offset = next;
+    if (offset >= total) {
+      break;
+    }
+  }
+  close(fd);
+  exit(0);
+}
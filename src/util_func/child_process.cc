@@ -0,0 +1,393 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+#include "child_process.h"
+#include "job_cgroup.h"
+#include "job_control.h"
+#include "zettalib/op_log.h"
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+// Without a pidfd the child is looked after this often
+#define CHILD_POLL_INTERVAL_MS 20
+
+extern char **environ;
+
+namespace kunlun {
+
+// Anything the shell would interpret, and the builtins which only mean
+// something to it
+static bool NeedsShell(const std::string &command) {
+  if (command.find_first_of("|&;<>()$`\\\"'*?[]{}~#=%!\n") !=
+      std::string::npos) {
+    return true;
+  }
+  size_t begin = command.find_first_not_of(" \t");
+  if (begin == std::string::npos) {
+    return true;
+  }
+  std::string first = command.substr(begin, command.find_first_of(" \t", begin) - begin);
+  return first == "cd" || first == "export" || first == "source" ||
+         first == "." || first == "ulimit" || first == "exec";
+}
+
+static std::vector<std::string> SplitArgs(const std::string &command) {
+  std::vector<std::string> args;
+  size_t pos = 0;
+  for (;;) {
+    size_t begin = command.find_first_not_of(" \t", pos);
+    if (begin == std::string::npos) {
+      return args;
+    }
+    size_t end = command.find_first_of(" \t", begin);
+    args.push_back(command.substr(begin, end - begin));
+    if (end == std::string::npos) {
+      return args;
+    }
+    pos = end;
+  }
+}
+
+static int64_t NowMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+ChildProcess::ChildProcess(const std::string &command)
+    : command_(command), pid_(-1), pidfd_(-1), used_shell_(false),
+      exited_(false), exit_code_(-1), sink_failed_(false), job_(nullptr) {
+  pipes_[0] = pipes_[1] = -1;
+}
+
+ChildProcess::~ChildProcess() {
+  // never leave a zombie behind
+  if (pid_ > 0 && !exited_) {
+    reap(true);
+  }
+  closePipe(0);
+  closePipe(1);
+  if (pidfd_ >= 0) {
+    close(pidfd_);
+  }
+}
+
+bool ChildProcess::Launch() {
+  JobControl *job = JobControl::current();
+  if (job != nullptr && job->cancelled()) {
+    setErr("The job is cancelled, %s is not run", command_.c_str());
+    return false;
+  }
+  int out[2] = {-1, -1};
+  int err[2] = {-1, -1};
+  if (pipe2(out, O_CLOEXEC) != 0 || pipe2(err, O_CLOEXEC) != 0) {
+    setErr("pipe2() failed: %s", strerror(errno));
+    for (int fd : {out[0], out[1], err[0], err[1]}) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+    return false;
+  }
+
+  used_shell_ = NeedsShell(command_);
+  std::vector<std::string> args;
+  if (used_shell_) {
+    args = {"sh", "-c", command_};
+  } else {
+    args = SplitArgs(command_);
+  }
+  // the child puts itself into the job's cgroup before it execs the
+  // command, nothing it forks can escape the limits. That takes a shell
+  // even for a command which needs none, it execs the command right away.
+  // CLONE_INTO_CGROUP of clone3() would spare it, but posix_spawn() has no
+  // way to pass it
+  std::string procs = JobCgroup::CurrentProcsPath();
+  if (!procs.empty() && !args.empty()) {
+    args.insert(args.begin(),
+                {"sh", "-c", "echo $$ > \"$0\" && exec \"$@\"", procs});
+    used_shell_ = true;
+  }
+  std::vector<char *> argv;
+  for (auto &arg : args) {
+    argv.push_back(const_cast<char *>(arg.c_str()));
+  }
+  argv.push_back(nullptr);
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+  // dup2() clears O_CLOEXEC of the copies, the originals close on exec
+  posix_spawn_file_actions_adddup2(&actions, out[1], 1);
+  posix_spawn_file_actions_adddup2(&actions, err[1], 2);
+
+  // the child starts with no signal blocked and default SIGCHLD handling.
+  // SIGPIPE keeps the disposition of node_mgr, ignored since brpc set it
+  // up, as children of popen() had it: a daemon the command leaves
+  // behind, mysqld of startmysql.sh say, still holds the write ends of the
+  // pipes Wait() closes once the command exited, and must get EPIPE
+  // rather than be killed on its next write to stdout or stderr
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  sigset_t mask;
+  sigemptyset(&mask);
+  posix_spawnattr_setsigmask(&attr, &mask);
+  sigset_t defaults;
+  sigemptyset(&defaults);
+  sigaddset(&defaults, SIGCHLD);
+  posix_spawnattr_setsigdefault(&attr, &defaults);
+  // in a group of its own, cancelling the job kills what the child forked
+  posix_spawnattr_setpgroup(&attr, 0);
+  short flags =
+      POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP;
+#ifdef POSIX_SPAWN_USEVFORK
+  flags |= POSIX_SPAWN_USEVFORK;
+#endif
+  posix_spawnattr_setflags(&attr, flags);
+
+  const char *path = used_shell_ ? "/bin/sh" : argv[0];
+  int ret = argv[0] == nullptr
+                ? EINVAL
+                : used_shell_ ? posix_spawn(&pid_, path, &actions, &attr,
+                                            argv.data(), environ)
+                              : posix_spawnp(&pid_, path, &actions, &attr,
+                                             argv.data(), environ);
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  close(out[1]);
+  close(err[1]);
+  if (ret != 0) {
+    close(out[0]);
+    close(err[0]);
+    pid_ = -1;
+    setErr("Spawn %s failed: %s", command_.c_str(), strerror(ret));
+    return false;
+  }
+
+  pipes_[0] = out[0];
+  pipes_[1] = err[0];
+  fcntl(pipes_[0], F_SETFL, O_NONBLOCK);
+  fcntl(pipes_[1], F_SETFL, O_NONBLOCK);
+  // kernels before 5.3 have no pidfd, the child is polled then
+  pidfd_ = syscall(SYS_pidfd_open, pid_, 0);
+  // cancelled meanwhile the child is killed right away, Wait() reaps it
+  if (job != nullptr && job->AddChild(pid_)) {
+    job_ = job;
+  }
+  return true;
+}
+
+bool ChildProcess::reap(bool block) {
+  int status = 0;
+  pid_t ret;
+  do {
+    ret = waitpid(pid_, &status, block ? 0 : WNOHANG);
+  } while (ret < 0 && errno == EINTR);
+  if (ret == 0) {
+    return false;
+  }
+  exited_ = true;
+  if (job_ != nullptr) {
+    job_->RemoveChild(pid_);
+  }
+  if (ret < 0) {
+    exit_code_ = -1 * errno;
+  } else if (WIFEXITED(status)) {
+    exit_code_ = WEXITSTATUS(status);
+  } else if (WIFSIGNALED(status)) {
+    exit_code_ = WTERMSIG(status);
+  } else {
+    exit_code_ = status;
+  }
+  return true;
+}
+
+void ChildProcess::closePipe(int index) {
+  if (pipes_[index] >= 0) {
+    close(pipes_[index]);
+    pipes_[index] = -1;
+  }
+}
+
+void ChildProcess::emitLines(int index, bool flush) {
+  std::string &partial = partial_[index];
+  size_t begin = 0;
+  for (;;) {
+    size_t end = partial.find('\n', begin);
+    if (end == std::string::npos) {
+      break;
+    }
+    if (line_sink_) {
+      line_sink_(partial.substr(begin, end - begin), index == 1);
+    }
+    begin = end + 1;
+  }
+  partial.erase(0, begin);
+  if (flush && !partial.empty()) {
+    if (line_sink_) {
+      line_sink_(partial, index == 1);
+    }
+    partial.clear();
+  }
+}
+
+bool ChildProcess::readPipe(int index) {
+  char buffer[65536];
+  for (;;) {
+    ssize_t n = read(pipes_[index], buffer, sizeof(buffer));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && errno == EAGAIN) {
+      return true;
+    }
+    if (n <= 0) {
+      emitLines(index, true);
+      closePipe(index);
+      return false;
+    }
+    if (chunk_sink_) {
+      if (!sink_failed_ && !chunk_sink_(buffer, n, index == 1)) {
+        sink_failed_ = true;
+      }
+      if (sink_failed_) {
+        return true;
+      }
+      continue;
+    }
+    std::string &output = output_[index];
+    if (output.size() < CHILD_OUTPUT_LIMIT) {
+      output.append(buffer,
+                    std::min((size_t)n, CHILD_OUTPUT_LIMIT - output.size()));
+    }
+    partial_[index].append(buffer, n);
+    emitLines(index, false);
+  }
+}
+
+bool ChildProcess::Wait(int64_t timeout_ms) {
+  if (pid_ <= 0) {
+    setErr("%s was not launched", command_.c_str());
+    return false;
+  }
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0) {
+    setErr("epoll_create1() failed: %s", strerror(errno));
+    return false;
+  }
+  // the data of an event is 0 and 1 for the pipes, 2 for the pidfd
+  for (int i = 0; i < 2; i++) {
+    if (pipes_[i] >= 0) {
+      struct epoll_event event;
+      event.events = EPOLLIN;
+      event.data.u32 = i;
+      epoll_ctl(epfd, EPOLL_CTL_ADD, pipes_[i], &event);
+    }
+  }
+  if (pidfd_ >= 0) {
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u32 = 2;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, pidfd_, &event);
+  }
+
+  int64_t deadline = timeout_ms < 0 ? -1 : NowMs() + timeout_ms;
+  bool ok = true;
+  while (!exited_) {
+    int wait_ms = -1;
+    if (deadline >= 0) {
+      wait_ms = std::max(deadline - NowMs(), (int64_t)0);
+    }
+    if (pidfd_ < 0 && (wait_ms < 0 || wait_ms > CHILD_POLL_INTERVAL_MS)) {
+      wait_ms = CHILD_POLL_INTERVAL_MS;
+    }
+    struct epoll_event events[3];
+    int n = epoll_wait(epfd, events, 3, wait_ms);
+    if (n < 0 && errno != EINTR) {
+      setErr("epoll_wait() failed: %s", strerror(errno));
+      ok = false;
+      break;
+    }
+    for (int i = 0; i < n; i++) {
+      int index = events[i].data.u32;
+      if (index < 2 && pipes_[index] >= 0 && !readPipe(index)) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, pipes_[index], nullptr);
+      }
+    }
+    if (sink_failed_) {
+      break;
+    }
+    // a pidfd gets readable once the child exited, without one look anyway
+    reap(false);
+    if (!exited_ && deadline >= 0 && NowMs() >= deadline) {
+      setErr("%s is still running after %ld ms", command_.c_str(),
+             timeout_ms);
+      ok = false;
+      break;
+    }
+  }
+  close(epfd);
+  if (exited_ && !sink_failed_) {
+    for (int i = 0; i < 2; i++) {
+      if (pipes_[i] >= 0 && readPipe(i)) {
+        emitLines(i, true);
+        closePipe(i);
+      }
+    }
+  }
+  if (sink_failed_) {
+    setErr("Output of %s could not be passed on", command_.c_str());
+    ok = false;
+  }
+  return ok;
+}
+
+bool ChildProcess::Kill(int sig) {
+  if (pid_ <= 0 || exited_) {
+    return false;
+  }
+  if (kill(pid_, sig) != 0) {
+    setErr("Kill %d failed: %s", pid_, strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+int RunCommand(const std::string &command, std::string *output,
+               std::string *error_output, bool log_output) {
+  ChildProcess child(command);
+  if (log_output) {
+    child.set_line_sink([](const std::string &line, bool is_stderr) {
+      KLOG_INFO("{}{}", is_stderr ? "stderr: " : "", line);
+    });
+  }
+  if (!child.Launch() || !child.Wait()) {
+    KLOG_ERROR("{}", child.getErr());
+    return -1;
+  }
+  if (output != nullptr) {
+    *output = child.stdout_str();
+  }
+  if (error_output != nullptr) {
+    *error_output = child.stderr_str();
+  }
+  return child.exit_code();
+}
+
+} // namespace kunlun
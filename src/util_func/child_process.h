@@ -0,0 +1,101 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+#ifndef _KUNLUN_CHILD_PROCESS_UTIL_FUNC_H_
+#define _KUNLUN_CHILD_PROCESS_UTIL_FUNC_H_
+#include "zettalib/errorcup.h"
+#include <functional>
+#include <signal.h>
+#include <string>
+#include <sys/types.h>
+
+// Bytes of each output stream of a child kept for the caller
+#define CHILD_OUTPUT_LIMIT (1024 * 1024)
+
+namespace kunlun {
+
+class JobControl;
+
+/*
+  One way for node_mgr to run a command. The child is started with
+  posix_spawn(), which vfork()s instead of copying the address space of
+  node_mgr, and through /bin/sh only if the command line uses shell syntax.
+  Wait() sleeps in epoll on a pidfd of the child and both its output pipes,
+  so completion is seen at once and neither pipe can fill up and stall the
+  child. Output is collected up to CHILD_OUTPUT_LIMIT per stream and
+  handed line by line to the line sink as it arrives, or, with a chunk
+  sink, passed on as read and neither collected nor split into lines. Inside a
+  JobCgroup::Scope the child joins the job's cgroup before it execs, inside
+  a JobControl::Scope cancelling the job kills the child's process group.
+
+  Once the child has exited, what its pipes hold is read and they are
+  closed: a daemon it left behind keeping them open does not hold up
+  Wait().
+*/
+class ChildProcess : public ErrorCup {
+public:
+  typedef std::function<void(const std::string &line, bool is_stderr)>
+      LineSink;
+  // false stops Wait(), the child is left running
+  typedef std::function<bool(const char *data, size_t length,
+                             bool is_stderr)>
+      ChunkSink;
+
+  explicit ChildProcess(const std::string &command);
+  virtual ~ChildProcess();
+
+  void set_line_sink(const LineSink &sink) { line_sink_ = sink; }
+  void set_chunk_sink(const ChunkSink &sink) { chunk_sink_ = sink; }
+  bool Launch();
+  // Drain the output till the child exits. timeout_ms < 0 waits for ever,
+  // false on timeout or failure, the child is left running on timeout
+  bool Wait(int64_t timeout_ms = -1);
+  bool Kill(int sig = SIGKILL);
+
+  pid_t pid() const { return pid_; }
+  bool used_shell() const { return used_shell_; }
+  // Exit code, or the number of the signal which killed the child, as
+  // CheckPidStatus() reports it. -1 while it runs
+  int exit_code() const { return exit_code_; }
+  const std::string &stdout_str() const { return output_[0]; }
+  const std::string &stderr_str() const { return output_[1]; }
+
+private:
+  bool reap(bool block);
+  // false once the pipe is at EOF and closed
+  bool readPipe(int index);
+  void closePipe(int index);
+  void emitLines(int index, bool flush);
+
+  // forbid copy
+  ChildProcess(const ChildProcess &rht) = delete;
+  ChildProcess &operator=(const ChildProcess &rht) = delete;
+
+  std::string command_;
+  pid_t pid_;
+  int pidfd_;
+  // read ends of stdout and stderr
+  int pipes_[2];
+  bool used_shell_;
+  bool exited_;
+  int exit_code_;
+  std::string output_[2];
+  std::string partial_[2];
+  LineSink line_sink_;
+  ChunkSink chunk_sink_;
+  bool sink_failed_;
+  // job the child is registered with until it is reaped
+  JobControl *job_;
+};
+
+// Run `command` to completion, return its exit code or -1 if it could not
+// be started. Every line of its output is logged when `log_output`
+int RunCommand(const std::string &command, std::string *output = nullptr,
+               std::string *error_output = nullptr, bool log_output = true);
+
+} // namespace kunlun
+
+#endif /*_KUNLUN_CHILD_PROCESS_UTIL_FUNC_H_*/
@@ -0,0 +1,331 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+#include "job_cgroup.h"
+#include "bthread/bthread.h"
+#include "zettalib/op_log.h"
+#include <algorithm>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string.h>
+#include <linux/magic.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+bool job_cgroup_enabled;
+std::string job_cgroup_root;
+std::string job_cgroup_backup;
+std::string job_cgroup_restore;
+std::string job_cgroup_rebuild;
+std::string job_cgroup_command;
+
+// cgroup the processes a job leaves running are moved to
+#define DETACHED_CGROUP "detached"
+// Passes over cgroup.procs when moving the leftovers, each may find
+// children forked meanwhile
+#define DETACH_ROUNDS 5
+
+namespace kunlun {
+
+// The interface files a job's limits may be written to
+static const char *kLimitFiles[] = {"cpu.weight", "cpu.max",     "io.weight",
+                                    "io.max",     "memory.high", "memory.max"};
+
+static bthread_key_t cgroup_key;
+static std::once_flag key_once;
+static std::once_flag root_once;
+static bool root_ready = false;
+
+static bool IsLimitFile(const std::string &file) {
+  for (const char *name : kLimitFiles) {
+    if (file == name) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool WriteCgroupFile(const std::string &path, const std::string &value) {
+  int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  ssize_t ret = write(fd, value.c_str(), value.size());
+  close(fd);
+  return ret == (ssize_t)value.size();
+}
+
+static std::string ReadCgroupFile(const std::string &path) {
+  std::ifstream in(path);
+  std::stringstream content;
+  content << in.rdbuf();
+  return content.str();
+}
+
+// "cpu.weight=50;io.max=8:0,wbps=1048576", the value is what follows the
+// first '=' with ',' for space as a config value ends at a space
+static void ParseLimits(const std::string &spec,
+                        std::map<std::string, std::string> &limits) {
+  std::stringstream in(spec);
+  std::string item;
+  while (std::getline(in, item, ';')) {
+    size_t eq = item.find('=');
+    if (eq == std::string::npos) {
+      continue;
+    }
+    std::string file = item.substr(0, eq);
+    file.erase(0, file.find_first_not_of(" \t"));
+    file.erase(file.find_last_not_of(" \t") + 1);
+    std::string value = item.substr(eq + 1);
+    std::replace(value.begin(), value.end(), ',', ' ');
+    if (!IsLimitFile(file)) {
+      KLOG_ERROR("job cgroup limit {} is not supported", file);
+      continue;
+    }
+    limits[file] = value;
+  }
+}
+
+// Move whatever runs in the cgroup at `path` to the detached cgroup
+static void DetachProcs(const std::string &path) {
+  std::string detached = job_cgroup_root + "/" DETACHED_CGROUP "/cgroup.procs";
+  for (int round = 0; round < DETACH_ROUNDS; round++) {
+    std::stringstream procs(ReadCgroupFile(path + "/cgroup.procs"));
+    std::string pid;
+    bool moved = false;
+    while (procs >> pid) {
+      KLOG_INFO("process {} outlives job cgroup {}, detach it", pid, path);
+      if (!WriteCgroupFile(detached, pid)) {
+        KLOG_ERROR("Move process {} to {} failed: {}", pid, detached,
+                   strerror(errno));
+      }
+      moved = true;
+    }
+    if (!moved) {
+      return;
+    }
+  }
+}
+
+// Job cgroups a node_mgr which did not exit cleanly left behind. Their
+// names repeat once a job is resumed or retried
+static void RemoveStaleCgroups() {
+  DIR *dir = opendir(job_cgroup_root.c_str());
+  if (dir == nullptr) {
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != nullptr) {
+    std::string name = entry->d_name;
+    if (entry->d_type != DT_DIR || name == "." || name == ".." ||
+        name == DETACHED_CGROUP) {
+      continue;
+    }
+    std::string path = job_cgroup_root + "/" + name;
+    DetachProcs(path);
+    if (rmdir(path.c_str()) != 0) {
+      KLOG_ERROR("Remove stale job cgroup {} failed: {}", path,
+                 strerror(errno));
+    } else {
+      KLOG_INFO("stale job cgroup {} removed", path);
+    }
+  }
+  closedir(dir);
+}
+
+// Make the job root and its detached cgroup once. The controllers the
+// limits need must be delegated to the parent of the job root by the
+// operator, node_mgr never changes a cgroup it did not create
+static void SetupRoot() {
+  std::string parent = job_cgroup_root.substr(0, job_cgroup_root.rfind('/'));
+  struct statfs fs;
+  if (statfs(parent.c_str(), &fs) != 0 || fs.f_type != CGROUP2_SUPER_MAGIC) {
+    KLOG_ERROR("{} is not in a cgroup v2 hierarchy, jobs run without "
+               "cgroup limits", job_cgroup_root);
+    return;
+  }
+  if (mkdir(job_cgroup_root.c_str(), 0755) != 0 && errno != EEXIST) {
+    KLOG_ERROR("Create {} failed: {}, jobs run without cgroup limits",
+               job_cgroup_root, strerror(errno));
+    return;
+  }
+  for (const char *controller : {"+cpu", "+io", "+memory"}) {
+    if (!WriteCgroupFile(job_cgroup_root + "/cgroup.subtree_control",
+                         controller)) {
+      KLOG_ERROR("Enable {} controller in {} failed: {}, enable it in {}/"
+                 "cgroup.subtree_control",
+                 controller + 1, job_cgroup_root, strerror(errno), parent);
+    }
+  }
+  std::string detached = job_cgroup_root + "/" + DETACHED_CGROUP;
+  if (mkdir(detached.c_str(), 0755) != 0 && errno != EEXIST) {
+    KLOG_ERROR("Create {} failed: {}, jobs run without cgroup limits",
+               detached, strerror(errno));
+    return;
+  }
+  RemoveStaleCgroups();
+  root_ready = true;
+}
+
+JobCgroup::JobCgroup(const std::string &name, const std::string &job_class)
+    : name_(name), job_class_(job_class) {}
+
+JobCgroup::~JobCgroup() {
+  if (path_.empty()) {
+    return;
+  }
+  detachLeftovers();
+  if (rmdir(path_.c_str()) != 0) {
+    KLOG_ERROR("Remove job cgroup {} failed: {}", path_, strerror(errno));
+  }
+}
+
+const char *JobCgroup::JobClassOf(ClusterRequestTypes type) {
+  switch (type) {
+  case kBackupShardType:
+  case kBackupComputeType:
+    return "backup";
+  case kRestoreMySQLType:
+  case kRestorePostGresType:
+    return "restore";
+  case kRebuildNodeType:
+    return "rebuild";
+  case kExecuteCommandType:
+    return "command";
+  default:
+    return nullptr;
+  }
+}
+
+bool JobCgroup::Create(const Json::Value &overrides) {
+  std::call_once(root_once, SetupRoot);
+  if (!root_ready) {
+    setErr("job cgroup root %s is not usable", job_cgroup_root.c_str());
+    return false;
+  }
+
+  const std::string *spec = &job_cgroup_command;
+  if (job_class_ == "backup") {
+    spec = &job_cgroup_backup;
+  } else if (job_class_ == "restore") {
+    spec = &job_cgroup_restore;
+  } else if (job_class_ == "rebuild") {
+    spec = &job_cgroup_rebuild;
+  }
+  ParseLimits(*spec, limits_);
+  for (const auto &file : overrides.getMemberNames()) {
+    if (!IsLimitFile(file)) {
+      setErr("cgroup limit %s is not supported", file.c_str());
+      return false;
+    }
+    limits_[file] = overrides[file].asString();
+  }
+
+  std::string path = job_cgroup_root + "/" + name_;
+  if (mkdir(path.c_str(), 0755) != 0) {
+    setErr("Create %s failed: %s", path.c_str(), strerror(errno));
+    return false;
+  }
+  path_ = path;
+  for (const auto &limit : limits_) {
+    if (!writeFile(limit.first, limit.second)) {
+      return false;
+    }
+  }
+  KLOG_INFO("job cgroup {} created for {} job", path_, job_class_);
+  return true;
+}
+
+bool JobCgroup::writeFile(const std::string &file, const std::string &value) {
+  if (!WriteCgroupFile(path_ + "/" + file, value)) {
+    setErr("Set %s of %s to '%s' failed: %s", file.c_str(), path_.c_str(),
+           value.c_str(), strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+void JobCgroup::detachLeftovers() { DetachProcs(path_); }
+
+void JobCgroup::GetUsage(Json::Value &usage) {
+  usage["cgroup"] = path_;
+  for (const auto &limit : limits_) {
+    usage["limits"][limit.first] = limit.second;
+  }
+
+  std::stringstream cpu(ReadCgroupFile(path_ + "/cpu.stat"));
+  std::string key;
+  int64_t value;
+  while (cpu >> key >> value) {
+    if (key == "usage_usec") {
+      usage["cpu_usage_us"] = (Json::Int64)value;
+    } else if (key == "user_usec") {
+      usage["cpu_user_us"] = (Json::Int64)value;
+    } else if (key == "system_usec") {
+      usage["cpu_system_us"] = (Json::Int64)value;
+    }
+  }
+
+  // memory.peak needs linux 5.19, the current charge is the best guess
+  // before that
+  std::string memory = ReadCgroupFile(path_ + "/memory.peak");
+  if (memory.empty()) {
+    memory = ReadCgroupFile(path_ + "/memory.current");
+  }
+  if (!memory.empty()) {
+    usage["memory_peak_bytes"] = (Json::Int64)atoll(memory.c_str());
+  }
+
+  // one line per device: "8:0 rbytes=1 wbytes=2 rios=3 wios=4 ..."
+  int64_t io[4] = {0, 0, 0, 0};
+  const char *io_keys[4] = {"rbytes", "wbytes", "rios", "wios"};
+  std::stringstream io_stat(ReadCgroupFile(path_ + "/io.stat"));
+  std::string field;
+  while (io_stat >> field) {
+    size_t eq = field.find('=');
+    if (eq == std::string::npos) {
+      continue;
+    }
+    for (int i = 0; i < 4; i++) {
+      if (field.compare(0, eq, io_keys[i]) == 0) {
+        io[i] += atoll(field.c_str() + eq + 1);
+      }
+    }
+  }
+  usage["io_read_bytes"] = (Json::Int64)io[0];
+  usage["io_write_bytes"] = (Json::Int64)io[1];
+  usage["io_read_ops"] = (Json::Int64)io[2];
+  usage["io_write_ops"] = (Json::Int64)io[3];
+}
+
+static void CreateCgroupKey() { bthread_key_create(&cgroup_key, nullptr); }
+
+std::string JobCgroup::CurrentProcsPath() {
+  std::call_once(key_once, CreateCgroupKey);
+  JobCgroup *cgroup = static_cast<JobCgroup *>(bthread_getspecific(cgroup_key));
+  if (cgroup == nullptr || cgroup->path_.empty()) {
+    return "";
+  }
+  return cgroup->path_ + "/cgroup.procs";
+}
+
+// bthread local rather than thread_local: a job's bthread may be resumed
+// by another worker pthread after any blocking brpc call
+JobCgroup::Scope::Scope(JobCgroup *cgroup) {
+  std::call_once(key_once, CreateCgroupKey);
+  prev_ = bthread_getspecific(cgroup_key);
+  bthread_setspecific(cgroup_key, cgroup);
+}
+
+JobCgroup::Scope::~Scope() { bthread_setspecific(cgroup_key, prev_); }
+
+} // namespace kunlun
@@ -0,0 +1,73 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+#ifndef _KUNLUN_JOB_CGROUP_UTIL_FUNC_H_
+#define _KUNLUN_JOB_CGROUP_UTIL_FUNC_H_
+#include "requestValueDefine.h"
+#include "json/json.h"
+#include "zettalib/errorcup.h"
+#include <map>
+#include <string>
+
+namespace kunlun {
+
+/*
+  A cgroup v2 of its own for the process tree of one job, created below
+  `job_cgroup_root`. The limits come from the job_cgroup_<class> config of
+  the job's class, a `cgroup` object in the request paras overrides them
+  file by file, e.g. {"cpu.weight":"20","io.max":"8:0 wbps=52428800"}.
+
+  While a Scope is alive every ChildProcess launched by the same bthread
+  joins the cgroup before it execs, so the whole tree it forks is
+  accounted and limited. When the job ends, whatever still runs in the
+  cgroup, a mysqld the job started for instance, is moved to the unlimited
+  `detached` cgroup next to it and the job's cgroup is removed. Job
+  cgroups an earlier node_mgr left behind are removed the same way before
+  the first one is created.
+*/
+class JobCgroup : public ErrorCup {
+public:
+  // name is unique among the running jobs
+  JobCgroup(const std::string &name, const std::string &job_class);
+  virtual ~JobCgroup();
+
+  bool Create(const Json::Value &overrides);
+  // CPU, memory and IO the job's processes used so far
+  void GetUsage(Json::Value &usage);
+  const std::string &path() const { return path_; }
+
+  // Job class whose limits a request type runs under, nullptr when its
+  // processes are not sandboxed
+  static const char *JobClassOf(ClusterRequestTypes type);
+  // cgroup.procs of the cgroup of the calling bthread's job, empty if none
+  static std::string CurrentProcsPath();
+
+  class Scope {
+  public:
+    explicit Scope(JobCgroup *cgroup);
+    ~Scope();
+
+  private:
+    void *prev_;
+  };
+
+private:
+  bool writeFile(const std::string &file, const std::string &value);
+  void detachLeftovers();
+
+  // forbid copy
+  JobCgroup(const JobCgroup &rht) = delete;
+  JobCgroup &operator=(const JobCgroup &rht) = delete;
+
+  std::string name_;
+  std::string job_class_;
+  std::string path_;
+  std::map<std::string, std::string> limits_;
+};
+
+} // namespace kunlun
+
+#endif /*_KUNLUN_JOB_CGROUP_UTIL_FUNC_H_*/
@@ -0,0 +1,120 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+#include "job_control.h"
+#include "bthread/bthread.h"
+#include "zettalib/op_log.h"
+#include <signal.h>
+
+namespace kunlun {
+
+static bthread_key_t control_key;
+static std::once_flag key_once;
+
+static void CreateControlKey() { bthread_key_create(&control_key, nullptr); }
+
+void JobControl::Cancel() {
+  std::lock_guard<std::mutex> guard(mux_);
+  cancelled_ = true;
+  for (pid_t pgid : children_) {
+    KLOG_INFO("job cancelled, kill process group {}", pgid);
+    kill(-pgid, SIGKILL);
+  }
+}
+
+bool JobControl::cancelled() {
+  std::lock_guard<std::mutex> guard(mux_);
+  return cancelled_;
+}
+
+bool JobControl::AddChild(pid_t pgid) {
+  std::function<void()> on_change;
+  {
+    std::lock_guard<std::mutex> guard(mux_);
+    if (cancelled_) {
+      kill(-pgid, SIGKILL);
+      return false;
+    }
+    children_.insert(pgid);
+    on_change = on_change_;
+  }
+  if (on_change) {
+    on_change();
+  }
+  return true;
+}
+
+void JobControl::RemoveChild(pid_t pgid) {
+  std::function<void()> on_change;
+  {
+    std::lock_guard<std::mutex> guard(mux_);
+    children_.erase(pgid);
+    on_change = on_change_;
+  }
+  if (on_change) {
+    on_change();
+  }
+}
+
+std::set<pid_t> JobControl::children() {
+  std::lock_guard<std::mutex> guard(mux_);
+  return children_;
+}
+
+bool JobControl::StepFinished(const std::string &step, std::string *payload) {
+  std::lock_guard<std::mutex> guard(mux_);
+  auto it = steps_.find(step);
+  if (it == steps_.end()) {
+    return false;
+  }
+  if (payload) {
+    *payload = it->second;
+  }
+  return true;
+}
+
+void JobControl::FinishStep(const std::string &step,
+                            const std::string &payload) {
+  std::function<void()> on_change;
+  {
+    std::lock_guard<std::mutex> guard(mux_);
+    steps_[step] = payload;
+    on_change = on_change_;
+  }
+  if (on_change) {
+    on_change();
+  }
+}
+
+std::map<std::string, std::string> JobControl::steps() {
+  std::lock_guard<std::mutex> guard(mux_);
+  return steps_;
+}
+
+void JobControl::RestoreSteps(const std::map<std::string, std::string> &steps) {
+  std::lock_guard<std::mutex> guard(mux_);
+  steps_ = steps;
+}
+
+void JobControl::set_on_change(const std::function<void()> &on_change) {
+  std::lock_guard<std::mutex> guard(mux_);
+  on_change_ = on_change;
+}
+
+JobControl *JobControl::current() {
+  std::call_once(key_once, CreateControlKey);
+  return static_cast<JobControl *>(bthread_getspecific(control_key));
+}
+
+JobControl::Scope::Scope(JobControl *control) {
+  std::call_once(key_once, CreateControlKey);
+  prev_ = bthread_getspecific(control_key);
+  bthread_setspecific(control_key, control);
+}
+
+JobControl::Scope::~Scope() { bthread_setspecific(control_key, prev_); }
+
+} // namespace kunlun
@@ -0,0 +1,78 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+#ifndef _KUNLUN_JOB_CONTROL_UTIL_FUNC_H_
+#define _KUNLUN_JOB_CONTROL_UTIL_FUNC_H_
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <sys/types.h>
+
+namespace kunlun {
+
+/*
+  Lets a running job be cancelled. While a Scope is alive every
+  ChildProcess launched by the same bthread registers the process group it
+  leads here. Cancel() kills those groups, so the job's step fails at
+  once, and makes any later launch of the job fail, so the job can not
+  start its next step.
+
+  A job made of steps records each one it finishes, along with whatever
+  the later steps need from it. When the job is resumed after a restart
+  of node_mgr the steps finished before are known and skipped.
+*/
+class JobControl {
+public:
+  JobControl() : cancelled_(false) {}
+
+  void Cancel();
+  bool cancelled();
+
+  // false, and the child is killed, when the job is cancelled already
+  bool AddChild(pid_t pgid);
+  void RemoveChild(pid_t pgid);
+  std::set<pid_t> children();
+
+  // true, and the payload given to FinishStep, if an earlier run of the
+  // job finished step
+  bool StepFinished(const std::string &step, std::string *payload = nullptr);
+  void FinishStep(const std::string &step, const std::string &payload = "");
+  std::map<std::string, std::string> steps();
+  // steps the job finished before node_mgr restarted
+  void RestoreSteps(const std::map<std::string, std::string> &steps);
+
+  // called, by the job's own bthread, after its children or steps changed
+  void set_on_change(const std::function<void()> &on_change);
+
+  // JobControl of the calling bthread's job, nullptr if none
+  static JobControl *current();
+
+  class Scope {
+  public:
+    explicit Scope(JobControl *control);
+    ~Scope();
+
+  private:
+    void *prev_;
+  };
+
+private:
+  // forbid copy
+  JobControl(const JobControl &rht) = delete;
+  JobControl &operator=(const JobControl &rht) = delete;
+
+  std::mutex mux_;
+  bool cancelled_;
+  std::set<pid_t> children_;
+  std::map<std::string, std::string> steps_;
+  std::function<void()> on_change_;
+};
+
+} // namespace kunlun
+
+#endif /*_KUNLUN_JOB_CONTROL_UTIL_FUNC_H_*/
@@ -0,0 +1,153 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+#include "job_executor.h"
+#include "butil/time.h"
+#include "zettalib/op_log.h"
+#include <pthread.h>
+#include <sstream>
+#include <stdlib.h>
+#include <thread>
+
+int64_t job_executor_threads;
+int64_t job_executor_express_threads;
+std::string job_type_concurrency;
+
+namespace kunlun {
+
+JobExecutor *JobExecutor::m_inst = NULL;
+
+// `<job type>=<max running>;...`, e.g. backup_shard=2;rebuild_node=1
+static void ParseConcurrency(const std::string &spec,
+                             std::map<std::string, int64_t> &limits) {
+  std::stringstream in(spec);
+  std::string item;
+  while (std::getline(in, item, ';')) {
+    size_t eq = item.find('=');
+    if (eq == std::string::npos) {
+      continue;
+    }
+    std::string job_type = item.substr(0, eq);
+    int64_t limit = atoll(item.substr(eq + 1).c_str());
+    if (job_type.empty() || limit < 0) {
+      KLOG_ERROR("bad job_type_concurrency item {}", item);
+      continue;
+    }
+    limits[job_type] = limit;
+  }
+}
+
+JobExecutor::JobExecutor()
+    : queue_depth_("node_mgr_job_queue_depth"),
+      running_("node_mgr_job_running"), wait_("node_mgr_job_wait") {
+  ParseConcurrency(job_type_concurrency, limits_);
+  int64_t threads = job_executor_threads > 0 ? job_executor_threads : 1;
+  for (int64_t i = 0; i < threads; i++) {
+    std::thread(workerMain, this, false).detach();
+  }
+  int64_t express_threads =
+      job_executor_express_threads > 0 ? job_executor_express_threads : 1;
+  for (int64_t i = 0; i < express_threads; i++) {
+    std::thread(workerMain, this, true).detach();
+  }
+  KLOG_INFO("job executor started {} threads, {} express", threads,
+            express_threads);
+}
+
+JobExecutor::TypeSlot &JobExecutor::slotOf(const std::string &job_type) {
+  std::unique_ptr<TypeSlot> &slot = slots_[job_type];
+  if (!slot) {
+    slot.reset(new TypeSlot);
+    auto it = limits_.find(job_type);
+    if (it != limits_.end()) {
+      slot->limit = it->second;
+    }
+    std::string prefix = "node_mgr_job_" + job_type;
+    slot->queue_depth.reset(new bvar::Adder<int64_t>(prefix + "_queue_depth"));
+    slot->wait.reset(new bvar::LatencyRecorder(prefix + "_wait"));
+  }
+  return *slot;
+}
+
+void JobExecutor::Submit(const std::string &job_type, const Task &task) {
+  enqueue(job_type, task, false);
+}
+
+void JobExecutor::SubmitExpress(const std::string &job_type,
+                                const Task &task) {
+  enqueue(job_type, task, true);
+}
+
+void JobExecutor::enqueue(const std::string &job_type, const Task &task,
+                          bool express) {
+  QueuedTask queued;
+  queued.job_type = job_type.empty() ? "unknown" : job_type;
+  queued.task = task;
+  queued.submit_us = butil::monotonic_time_us();
+  queued.express = express;
+  {
+    std::lock_guard<std::mutex> guard(mux_);
+    *slotOf(queued.job_type).queue_depth << 1;
+    queue_.push_back(std::move(queued));
+  }
+  queue_depth_ << 1;
+  cond_.notify_one();
+  if (express) {
+    express_cond_.notify_one();
+  }
+}
+
+bool JobExecutor::takeRunnable(QueuedTask &next, bool express) {
+  for (auto it = queue_.begin(); it != queue_.end(); ++it) {
+    if (express && !it->express) {
+      continue;
+    }
+    TypeSlot &slot = slotOf(it->job_type);
+    if (slot.limit > 0 && slot.running >= slot.limit) {
+      continue;
+    }
+    slot.running++;
+    *slot.queue_depth << -1;
+    *slot.wait << butil::monotonic_time_us() - it->submit_us;
+    next = std::move(*it);
+    queue_.erase(it);
+    return true;
+  }
+  return false;
+}
+
+void JobExecutor::workerMain(JobExecutor *executor, bool express) {
+  pthread_setname_np(pthread_self(),
+                     express ? "job_express" : "job_executor");
+  std::condition_variable &cond =
+      express ? executor->express_cond_ : executor->cond_;
+  while (true) {
+    QueuedTask next;
+    {
+      std::unique_lock<std::mutex> lock(executor->mux_);
+      cond.wait(lock, [executor, &next, express] {
+        return executor->takeRunnable(next, express);
+      });
+    }
+    int64_t wait_us = butil::monotonic_time_us() - next.submit_us;
+    executor->queue_depth_ << -1;
+    executor->running_ << 1;
+    executor->wait_ << wait_us;
+
+    next.task();
+
+    executor->running_ << -1;
+    {
+      std::lock_guard<std::mutex> guard(executor->mux_);
+      executor->slotOf(next.job_type).running--;
+    }
+    // a task held back by the limit of this type may start now
+    executor->cond_.notify_all();
+    executor->express_cond_.notify_all();
+  }
+}
+
+} // namespace kunlun
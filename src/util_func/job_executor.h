@@ -0,0 +1,104 @@
+/*
+   Copyright (c) 2019-2022 ZettaDB inc. All rights reserved.
+
+   This source code is licensed under Apache 2.0 License,
+   combined with Common Clause Condition 1.0, as detailed in the NOTICE file.
+*/
+#ifndef _KUNLUN_JOB_EXECUTOR_UTIL_FUNC_H_
+#define _KUNLUN_JOB_EXECUTOR_UTIL_FUNC_H_
+#include "bvar/bvar.h"
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace kunlun {
+
+/*
+  Pool of `job_executor_threads` plain pthreads the blocking work of the
+  jobs runs on, so that a job waiting on its child processes, on disk or
+  in a sleep never holds a brpc worker and the RPCs, pings included, keep
+  being served however many jobs run.
+
+  Tasks start in the order they were submitted, except that a task waits
+  while as many tasks of its job type run as `job_type_concurrency` allows
+  and the ones behind it get their turn meanwhile.
+
+  Short read-only requests are submitted as express tasks. Besides the
+  pool, `job_executor_express_threads` threads take only those, so they
+  never wait behind the hours long jobs filling the pool.
+
+  Exposed bvars:
+    node_mgr_job_queue_depth            tasks waiting for a thread
+    node_mgr_job_running                tasks running
+    node_mgr_job_wait                   us from submit to start
+    node_mgr_job_<type>_queue_depth     the same per job type
+    node_mgr_job_<type>_wait
+*/
+class JobExecutor {
+private:
+  static JobExecutor *m_inst;
+  JobExecutor();
+
+public:
+  static JobExecutor *get_instance() {
+    if (!m_inst)
+      m_inst = new JobExecutor();
+    return m_inst;
+  }
+
+  typedef std::function<void()> Task;
+
+  void Submit(const std::string &job_type, const Task &task);
+  void SubmitExpress(const std::string &job_type, const Task &task);
+
+private:
+  struct QueuedTask {
+    std::string job_type;
+    Task task;
+    int64_t submit_us;
+    bool express;
+  };
+
+  // per job type bookkeeping, created on the type's first task
+  struct TypeSlot {
+    int running = 0;
+    // 0 means only the pool size bounds it
+    int64_t limit = 0;
+    std::unique_ptr<bvar::Adder<int64_t>> queue_depth;
+    std::unique_ptr<bvar::LatencyRecorder> wait;
+  };
+
+  static void workerMain(JobExecutor *executor, bool express);
+  void enqueue(const std::string &job_type, const Task &task, bool express);
+  // Takes the first queued task whose type is below its limit, only an
+  // express one for an express worker, false if there is none. Called with
+  // mux_ held
+  bool takeRunnable(QueuedTask &next, bool express);
+  TypeSlot &slotOf(const std::string &job_type);
+
+  // forbid copy
+  JobExecutor(const JobExecutor &rht) = delete;
+  JobExecutor &operator=(const JobExecutor &rht) = delete;
+
+  std::mutex mux_;
+  std::condition_variable cond_;
+  // express workers wait on this one
+  std::condition_variable express_cond_;
+  std::deque<QueuedTask> queue_;
+  std::map<std::string, std::unique_ptr<TypeSlot>> slots_;
+  // parsed job_type_concurrency
+  std::map<std::string, int64_t> limits_;
+
+  bvar::Adder<int64_t> queue_depth_;
+  bvar::Adder<int64_t> running_;
+  bvar::LatencyRecorder wait_;
+};
+
+} // namespace kunlun
+
+#endif /*_KUNLUN_JOB_EXECUTOR_UTIL_FUNC_H_*/
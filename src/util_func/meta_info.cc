@@ -109,6 +109,25 @@ ClusterRequestTypes GetReqTypeEnumByStr(const char *type_str) {
   case "kill_mysql"_hash:
     type_enum = kKillMysqlType;
     break;
+  case "set_transfer_limit"_hash:
+    type_enum = kSetTransferLimitType;
+    break;
+
+  case "get_job_status"_hash:
+    type_enum = kGetJobStatusType;
+    break;
+  case "get_job_result"_hash:
+    type_enum = kGetJobResultType;
+    break;
+  case "cancel_job"_hash:
+    type_enum = kCancelJobType;
+    break;
+  case "list_jobs"_hash:
+    type_enum = kListJobsType;
+    break;
+  case "batch_jobs"_hash:
+    type_enum = kBatchJobsType;
+    break;
     
 #ifndef NDEBUG
   case "node_debug"_hash:
@@ -48,6 +48,13 @@ enum ClusterRequestTypes {
   kRebuildNodeType,
 
   kKillMysqlType,
+  kSetTransferLimitType,
+
+  kGetJobStatusType,
+  kGetJobResultType,
+  kCancelJobType,
+  kListJobsType,
+  kBatchJobsType,
   
 #ifndef NDEBUG
   kNodeDebugType,
@@ -0,0 +1,77 @@
+#!/usr/bin/python3
+
+import sys
+import json
+import time
+import requests
+
+# every case of batch_jobs.json is posted to Emit and its response checked,
+# the request ids get a suffix of the run so a run does not repeat the last
+
+def http_post_json( url, request ):
+	r = requests.post(url, data=json.dumps(request))
+	if r.status_code != requests.codes.ok:
+		raise RuntimeError("http return code " + str(r.status_code))
+	return json.loads(r.content)
+
+def job_status( url, job_id ):
+	request = {"cluster_mgr_request_id":"batch_jobs_status", "job_type":"get_job_status", "paras":{"job_id":job_id}}
+	return http_post_json(url, request)["info"]
+
+def check_case( url, case, suffix, job_ids ):
+	request = case["request"]
+	request["cluster_mgr_request_id"] = request["cluster_mgr_request_id"] + suffix
+	response = http_post_json(url, request)
+
+	if response["status"] != case["status"]:
+		return "status is " + response["status"]
+	if "info" in case:
+		if case["info"] not in json.dumps(response["info"]):
+			return "info is " + json.dumps(response["info"])
+		return None
+
+	jobs = response["info"]["jobs"]
+	for name in case["jobs"]:
+		if jobs[name]["status"] != case["jobs"][name]:
+			return "job " + name + " is " + jobs[name]["status"]
+	job_ids[case["name"]] = {name:jobs[name]["job_id"] for name in jobs}
+
+	if "same_job_ids_as" in case:
+		if job_ids[case["name"]] != job_ids[case["same_job_ids_as"]]:
+			return "job ids differ from the ones of " + case["same_job_ids_as"]
+		return None
+
+	# a job starts only after every job it depends on ended
+	for job in request["paras"]["jobs"]:
+		if job["name"] not in jobs or jobs[job["name"]]["status"] == "skipped":
+			continue
+		start = job_status(url, jobs[job["name"]]["job_id"])["start_ms"]
+		for dep in job.get("depends_on", []):
+			end = job_status(url, jobs[dep]["job_id"])["end_ms"]
+			if start < end:
+				return "job " + job["name"] + " started before " + dep + " ended"
+	return None
+
+
+if __name__ == "__main__":
+
+	if len(sys.argv) != 2:
+		raise RuntimeError("Usage: batch_jobs.py batch_jobs.json")
+
+	print("Batch jobs, start work")
+	config_file = sys.argv[1]
+	json_data = json.load(open(config_file))
+	url = json_data["url"]
+	suffix = "_" + str(int(time.time()))
+
+	failed = 0
+	job_ids = {}
+	for case in json_data["cases"]:
+		err = check_case(url, case, suffix, job_ids)
+		if err is None:
+			print("batch_jobs " + case["name"] + ": ok")
+		else:
+			failed = failed + 1
+			print("batch_jobs " + case["name"] + ": " + err)
+
+	sys.exit(1 if failed else 0)